@@ -1,462 +1,1420 @@
 #include "mbed.h"
+#include "pinmap.h"
 #include "dali.hpp"
+#include "dali_manchester.hpp"
 #include "EventQueue.h"
 
-Dali::Dali(PinName rxPin, PinName txPin) : dali_rx(rxPin), dali_tx(txPin) {
+/* query_slot_t.state */
+enum {
+	SLOT_FREE = 0,
+	SLOT_PENDING,
+	SLOT_DONE
+};
+
+/*
+	The LPC1768 timers.  Each bus needs one to itself, its ISR finds the Dali
+	instance through handlers[].  An Rx pin that is one of the timer's
+	capture inputs is timestamped in hardware, any other pin by GPIO edge
+	interrupts reading TC.
+*/
+typedef struct {
+	LPC_TIM_TypeDef *tim;
+	IRQn_Type irq;
+	uint8_t  pconp;         // power control bit
+	uint8_t  pclksel;       // PCLKSEL0 or PCLKSEL1
+	uint8_t  pclk_shift;    // field within it
+	PinName  cap[2];        // DIP pins with the CAPn.0 and CAPn.1 function
+	void   (*isr)(void);
+} dali_timer_t;
+
+static const dali_timer_t dali_timers[DALI_TIMERS] = {
+	{ LPC_TIM0, TIMER0_IRQn,  1, 0,  2, { NC,  NC  }, &Dali::irq<0> },   // CAP0 is on P1.26/27, not brought out
+	{ LPC_TIM1, TIMER1_IRQn,  2, 0,  4, { NC,  NC  }, &Dali::irq<1> },   // CAP1 is on P1.18/19, LED1 and LED2
+	{ LPC_TIM2, TIMER2_IRQn, 22, 1, 12, { p30, p29 }, &Dali::irq<2> },
+	{ LPC_TIM3, TIMER3_IRQn, 23, 1, 14, { p15, p16 }, &Dali::irq<3> },
+};
+
+Dali *Dali::handlers[DALI_TIMERS] = {0};
+
+/* Shortest idle time before sending after another device's frame, by
+   priority, IEC 62386-101 */
+static const uint16_t dali_settle[5] = { 13500, 14900, 16300, 17900, 19500 };
+
+/* Share of the bus, percent, and deadline, ms, of each traffic class until
+   set_budget() */
+static const uint8_t  dali_class_share[DALI_CLASSES]    = { 60, 30, 10 };
+static const uint16_t dali_class_deadline[DALI_CLASSES] = { 0, 1000, 0 };
+
+
+Dali::Dali(PinName rxPin, PinName txPin, uint8_t timer) : dali_rx(rxPin), dali_tx(txPin) {
+	MBED_ASSERT(timer < DALI_TIMERS && timer != DALI_TIMER_RESERVED && !handlers[timer]);
+	
+	timer_idx  = timer;
+	tim        = dali_timers[timer].tim;
+	rx_channel = -1;
+	for (int ch = 0; ch < 2; ch++) {
+		if (dali_timers[timer].cap[ch] == rxPin)
+			rx_channel = ch;
+	}
+	rx_invert  = 1;
+	tx_invert  = 0;
 	init();
 }
 
 
+/* Stops the bus and gives the timer back. */
+Dali::~Dali() {
+	NVIC_DisableIRQ(dali_timers[timer_idx].irq);
+	tim->TCR = 2;
+	rx_disable();
+	handlers[timer_idx] = 0;
+}
+
+
 void Dali::attach_uart(Serial *uart) {
 	_uart = uart;
 }
 
 
-void Dali::init() {
-	handler        = this;
-	dali_tx        = 1;
-	
-	init_timer();
-    NVIC_SetVector(TIMER2_IRQn,(uint32_t)&irq);
-    NVIC_SetPriority(TIMER2_IRQn,1);
-    NVIC_EnableIRQ(TIMER2_IRQn);
-}
-
-
-void Dali::server_sigio(TCPSocket *socket) {
-	
-    static enum {
-        LISTENING,
-        ACCEPT,
-        CLOSE
-    } next_state = LISTENING;
-
-	nsapi_error_t err;
-	
-	_uart->printf("Dali::server_sigio: state=%d\n\r", next_state);
-	
-	switch (next_state) {
-        case LISTENING:
-			this->client = socket->accept(&err);
-			_uart->printf("socket->accept error is %d\n\r", err);
-			switch(err) {
-                case NSAPI_ERROR_WOULD_BLOCK:
-                    // Continue to listen
-					break;
-				case NSAPI_ERROR_OK: {
-					// Accepted connection
-					_uart->printf("Pop\n\r");
-					eventFlags.set(FLAG_CLIENT_CONNECT);
-					this->client->set_blocking(false);
-					_uart->printf("About to callback\n\r");
-					//this->client->sigio(this->client_handler);
-					_uart->printf("Called back\n\r");
-					next_state = ACCEPT;
-					//flgs->set(FLAG_SOCKET_ACCEPT);
-					break;
-				}
-                default:
-                    // Error in connection phase
-					_uart->printf("Dali::server_sigio: err = %d\n\r", err);	
-					next_state = CLOSE;
-					break;
-            }
-			break;
-        case ACCEPT:
-			//if (err == NSAPI_ERROR_WOULD_BLOCK)
-              //  break;
-			// REVISIT: print debug info
-            //next_state = CLOSE;
-			_uart->printf("Dali::server_sigio: about to accept to test socket\n\r");
-			socket->accept(&err);
-			_uart->printf("Dali::server_sigio: event flags = 0x%0x\n\r", eventFlags.get());
-			_uart->printf("Dali::server_sigio: err=%d\n\r", err);
-			break;
-		case CLOSE:
-			_uart->printf("Dali::server_sigio: CLOSE state\n\r");
-			socket->close();
-			//flgs->set(FLAG_SOCKET_CLOSED);
-			next_state = LISTENING;
-            break;
-    }
+void Dali::set_polarity(bool rx_inverted, bool tx_inverted) {
+	rx_invert = rx_inverted;
+	tx_invert = tx_inverted;
+	dali_tx   = !tx_invert;
+}
+
+
+void Dali::set_adaptive(bool on) {
+	rx_decoder.adaptive = on;
 }
 
 
 /*
-	Callback for client socket connections.
-	Receives 4 bytes and constructs a dali_payload_t.
+	Function    : listen()
+	Description : starts or stops receiving while the bus is idle.  When a
+	              transfer is running the end of transfer in timer_isr()
+	              leaves the timer and capture set up accordingly.
 */
-void Dali::client_sigio(TCPSocket *socket) {
+void Dali::listen(dali_event_cb_t cb) {
+	core_util_critical_section_enter();
+	event    = cb;
+	f_listen = cb ? 1 : 0;
+	if (!f_busy && !f_rx_idle && !f_backoff && !f_collision)
+		idle();
+	core_util_critical_section_exit();
+}
+
+
+void Dali::monitor(dali_monitor_cb_t cb) {
+	core_util_critical_section_enter();
+	mon       = cb;
+	f_monitor = cb ? 1 : 0;
+	if (!f_busy && !f_rx_idle && !f_backoff && !f_collision)
+		idle();
+	core_util_critical_section_exit();
+}
+
+
+void Dali::set_arbitration(bool on, uint8_t prio) {
+	core_util_critical_section_enter();
+	f_arbitrate = on;
+	priority    = (prio >= 1 && prio <= 5) ? prio : DALI_PRIORITY;
+	if (!f_busy && !f_rx_idle && !f_backoff && !f_collision)
+		idle();
+	core_util_critical_section_exit();
+}
+
+
+/* Timer and capture with nothing sent or heard: running with capture on
+   if anything needs to hear the bus, else stopped.  ISR context or a
+   critical section. */
+void Dali::idle(void) {
+	if (f_listen || f_arbitrate || f_monitor) {
+		tim->MCR = 0;
+		tim->TCR = 1;           // free running, for the capture timestamps
+		tc_epoch = us_ticker_read() - tim->TC;
+		rx_enable();
+	} else {
+		tim->TCR = 2;
+		rx_disable();
+	}
+}
+
+
+/* Waits the settling time from from, TC, before the next frame.  The
+   random part comes from a generator stirred by TC, which counts from
+   each master's own last start bit, so two running the same firmware
+   still draw apart.  ISR context. */
+void Dali::backoff(uint32_t from) {
+	rand_state = rand_state * 1664525 + 1013904223 + tim->TC;
+	f_backoff  = 1;
+	tim->MCR   = MR1_INT;
+	tim->MR1   = from + dali_settle[priority - 1] + (rand_state >> 8) % DALI_SETTLE_SPREAD;
+}
+
+
+void Dali::init() {
+	handlers[timer_idx] = this;
+	dali_tx        = !tx_invert;     // bus released
+	f_busy         = 0;
+	f_repeat       = 0;
+	tx_repeat_query = DALI_NO_QUERY;
+	f_dalirx       = 0;
+	answer         = 0;
+	err            = 0;
+	rx_overrun     = 0;
+	rx_lost        = 0;
+	lost_queries   = 0;
+	f_tx_lost_full = 0;
+	tx_query       = DALI_NO_QUERY;
+	queue          = 0;
+	coalesce       = true;
+	stage_n        = 0;
+	stage_held     = 0;
+	staged_addrs   = 0;
+	f_flush_posted = 0;
+	f_flushing     = 0;
+	last_frame     = DALI_NO_FRAME;
+	stage_commands = 0;
+	stage_frames   = 0;
+	f_rx_first     = 0;
+	f_rx_idle      = 0;
+	f_listen       = 0;
+	f_arbitrate    = 0;
+	priority       = DALI_PRIORITY;
+	tx_bits        = DALI_FRAME_16;
+	tx_level       = 1;
+	tx_tries       = 0;
+	f_collision    = 0;
+	f_backoff      = 0;
+	f_retry        = 0;
+	rand_state     = 0x2545F491 * (timer_idx + 1);
+	f_monitor      = 0;
+	f_mon_sent     = 0;
+	tc_epoch       = 0;
+	f_backlog      = 0;
+	frame_end      = 0;
+	tx_class       = DALI_CLASS_SCHEDULED;
+	tx_earned      = 0;
+	tx_hold        = DALI_CLASSES;
+	for (int i = 0; i < DALI_CLASSES; i++) {
+		tx_share[i]    = dali_class_share[i];
+		tx_deadline[i] = dali_class_deadline[i] * 1000;
+		tx_credit[i]   = 0;
+	}
 	
-	static enum {
-		RECEIVE,
-		CLOSE
-	} next_state = RECEIVE;
+	memset(&stats, 0, sizeof(stats));
+	stats.rate_ms = (uint32_t)Kernel::get_ms_count();
+	stats.frame_us = DALI_FRAME_US;
 	
-	static char buf[4];
-	static char *buf_p = buf;
-	static uint32_t remaining = 4;
+	/* The cycle counter times the ISRs */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 	
-	nsapi_size_or_error_t szerr;
+	for (int i = 0; i < DALI_QUERY_SLOTS; i++) {
+		queries[i].state = SLOT_FREE;
+		queries[i].gen   = 0;
+	}
 	
-	_uart->printf("Dali::client_sigio: state=%d\n\r", next_state);
+	init_timer();
+	set_arbitration(true);
 	
-	switch(next_state) {
-		case CLOSE:
-			socket->close();
-			eventFlags.clear(FLAG_CLIENT_CONNECT);
-			next_state = RECEIVE;
-			break;
-			
-		case RECEIVE:
-			szerr = socket->recv(buf_p, remaining);
-			if(szerr > 0) {
-				buf_p += szerr;
-				remaining -= szerr;
-				if(0 == remaining) {
-					// Send transaction
-					_uart->printf("Received transaction: buf[3]=0x%0x buf[2]=0x%0x buf[1]=0x%0x buf[0]=0x%0x ", 
-						buf[3], buf[2], buf[1], buf[0]);
-				}
-				break;
-			} else {
-				if(NSAPI_ERROR_WOULD_BLOCK == szerr) {
-					break;
-				} else if(NSAPI_ERROR_NO_SOCKET == szerr) {
-					next_state = CLOSE;
-					// now fall through to default
-				} else {
-					_uart->printf("Dali::client_sigio:  unhandled error on socket->recv(): %d\n\r", szerr);
-				}
-			}
-			
-		default:
-			// something went wrong so reset the buffer
-			buf_p = buf;
-			remaining = 4;
-	}
+	IRQn_Type irq = dali_timers[timer_idx].irq;
+    NVIC_SetVector(irq,(uintptr_t)dali_timers[timer_idx].isr);
+    NVIC_SetPriority(irq,1);
+    NVIC_EnableIRQ(irq);
 	
+	/* Software capture: the edge handlers must not preempt the timer ISR.
+		This sets the priority of every GPIO interrupt. */
+	if (rx_channel < 0)
+		NVIC_SetPriority(EINT3_IRQn,1);
 }
 
 
-
 /*
-	The Timer is used for both send and receive functionality.  This initialisation
-	function sets up the defaults for receiving.  When sending a frame, we must disable
-	the receive interrupts.
+	The Timer is used for both send and receive functionality.  TC runs freely
+	for the whole of a transfer, so capture values are absolute timestamps and
+	the next deadline is always programmed relative to the last one.
 
 	SEND:
 		- uses Match Register 1, MR1
 			+ used to time each half cycle of a Manchester encoded bit.
 
 	RECEIVE: 
-		- uses Match Regsiter 0, MR0
-			+ used to capture the end of the frame by firing after two stop bits
-		- uses Capture Register 0, CR0
-			+ used to capture the cycle count on both rising and falling edges of the Rx pin
+		- uses Capture Register 0 or 1, CR0/CR1, when the Rx pin is a
+		  capture input of the timer, else GPIO edge interrupts reading TC
+			+ used to capture the time of both rising and falling edges of the Rx pin
+		- uses Match Register 1, MR1
+			+ as the answer watchdog, then to find the end of the backward frame
+			  two stop bits after its last edge
+
+	LISTEN:
+		- while idle with listen() or arbitration on, TC keeps running with
+		  capture enabled and the MR1 interrupt off.  The first edge turns
+		  MR1 on to find the end of the frame heard, two stop bits after its
+		  last edge.
+
+	ARBITRATE:
+		- capture stays on from dali_start() to the start bit, an edge then
+		  holds the frame back.  Each MR1 while sending reads the Rx pin
+		  back before driving the next half bit.
+		- MR1 then times the break after a collision and the settling time
+		  before the frame goes again, or before any frame after one heard.
 */
 void Dali::init_timer() {
+	const dali_timer_t &t = dali_timers[timer_idx];
+	
 	// PCLK = CCLK
-	LPC_SC->PCLKSEL1 |= (1<<12); 
+	if (t.pclksel)
+		LPC_SC->PCLKSEL1 |= (1<<t.pclk_shift);
+	else
+		LPC_SC->PCLKSEL0 |= (1<<t.pclk_shift);
 	
-	// Enable TIM2 in Power Control
-	LPC_SC->PCONP |= 1 << 22;  
+	// Enable the timer in Power Control
+	LPC_SC->PCONP |= 1 << t.pconp;  
 	 
 	// Set the prescaler for 1MHz operation (uS timing resolution)
-	LPC_TIM2->PR = 96;
-	
-	// Set up CR0 to capture and interrupt on rising/falling edges
-	LPC_TIM2->CCR = 0x7;
+	tim->PR = 96;
 	
-	// Set up the MR0 to interrupt and reset when we get to two stop bits
-	LPC_TIM2->MR0 = STP_2TE;
-	LPC_TIM2->MCR = 3;
+	// Capture is only enabled while waiting for an answer
+	tim->CCR = 0;
+	if (rx_channel >= 0)
+		pin_function(t.cap[rx_channel], 3);   // CAPn.ch instead of GPIO
 	
-	// Set up MR1 to interrupt and reset on each half cycle
-	LPC_TIM2->MR1 = TE;
+	// MR1 interrupts without resetting TC, dali_start() arms it
+	tim->MCR = MR1_INT;
+	tim->MR1 = TE;
 
 }
 
+
+/* Open and close the answer window. */
+void Dali::rx_enable(void) {
+	if (rx_channel >= 0) {
+		tim->CCR = 7 << (3*rx_channel);   // capture on both edges, interrupt
+	} else {
+		dali_rx.rise(callback(this, &Dali::rx_rise));
+		dali_rx.fall(callback(this, &Dali::rx_fall));
+	}
+}
+
+void Dali::rx_disable(void) {
+	if (rx_channel >= 0) {
+		tim->CCR = 0;
+	} else {
+		dali_rx.rise(Callback<void()>());
+		dali_rx.fall(Callback<void()>());
+	}
+}
+
 /*
 	Function    : timer_isr()
-	Description : This interrupt routine handles the TIMER2 capture and match IRQs. We
-                  get an IRQ on either edge of the Dali RX pin and also when we have seen
-                  two stop bits.
-                  
-                    - on entry we always reset the char to zero.
-                    - if the match interrupt has fired we know we're at the end of a frame
-                    - if the capture interrupt has fired, we need to check if it was a pos/negedge.
+	Description : This interrupt routine handles the timer capture and match IRQs.
+	
+                    - MR1 shifts out the precomputed half bits of the forward
+                      frame, opens the answer window and ends the transfer.
+                    - CR0 only timestamps the edge into rx_edges.  The frame
+                      is decoded later by process(), outside the ISR.
                    
                   NOTE: this code is adapted from an NXP example but the polarity of the Dali
                   Manchester coding is reversed on the NXP I/OH board due to the optocoupler.
-	              
-	              REVISIT: enable mixed polarity
+                  Both pins are turned to bus levels here, see set_polarity().
 */
 void Dali::timer_isr(void) {
-	/* 	Writing 0 resets the timer and we do this on each entry to the ISR
-		in order to start counting straight after an edge or timer interrupt fires.	*/
-	LPC_TIM2->TC = 0; 
+	uint32_t start = DWT->CYCCNT;
 	
-	if (LPC_TIM2->IR & MR1_IRQ) { // match 1 interrupt for DALI send
+	if (tim->IR & MR1_IRQ) { // match 1 interrupt for DALI send
 		
-		/**/
-		if (frame_bit_pol) {
-			dali_tx = 1; // DALI output pin high
-		} else {
-			dali_tx = 0; // DALI output pin low
-		}
+		tim->IR = MR1_IRQ; // Clear MR1 interrupt flag
 		
-		/* DALI Frame : 0TE second half of start bit = 1 */
-		if (frame_bit_idx == 0) {
-			frame_bit_pol = 1;
+		/* Listening : two stop bits after the last edge of a frame another
+			device sent while the bus was idle. */
+		if (f_rx_idle) {
+			f_rx_idle = 0;
+			rx_close(DALI_EDGE_IDLE, DALI_NO_QUERY);
+			if (f_arbitrate)
+				backoff(tim->MR1 - STP_2TE);    // from its last edge
+			else
+				tim->MCR = 0;
+			
+		/* Collision : the break is over.  Release the bus and send the frame
+			again after the settling time, unless it has collided too often,
+			its query then fails. */
+		} else if (f_collision) {
+			f_collision = 0;
+			dali_tx     = !tx_invert;
+			rx_enable();
+			if (++tx_tries > DALI_TX_RETRIES) {
+				stats.collisions[2]++;
+				if (tx_bits == DALI_FRAME_16 && !tx_lost.push((uint16_t)forward_frame))
+					f_tx_lost_full = 1;
+				uint8_t sent = 0;
+				if (f_monitor) {
+					dali_mon_t m = { tc_epoch + TE, forward_frame, 0, tx_bits,
+					                 DALI_MON_INFO(DALI_MON_SENT, 0, DALI_RX_COLLISION) };
+					sent = mon_sent.push(m) ? DALI_EDGE_SENT : 0;
+				}
+				rx_close(DALI_EDGE_COLLISION | sent, f_repeat ? tx_repeat_query : tx_query);
+				f_repeat = 0;       // the pair is given up whole
+			} else {
+				f_retry = 1;
+			}
+			backoff(tim->TC);
 			
-		/* DALI Frame : 1TE - 32TE, so address + command */
-		} else if (frame_bit_idx < te_stop) {
-			frame_bit_pol = (forward_frame >> (((te_stop-1) - frame_bit_idx)/2)) & 1;
+		/* Settling time over, the bus is ours. */
+		} else if (f_backoff) {
+			f_backoff = 0;
+			idle();
 			
-			if (frame_bit_idx & 1)
-				frame_bit_pol = !frame_bit_pol; // invert if first half of data bit
+		/* Start bit due but the bus is already low: another device got in
+			between the last edge heard and now.  Hear its frame out. */
+		} else if (f_busy && !frame_bit_idx && f_arbitrate && !(dali_rx.read() ^ rx_invert)) {
+			f_busy    = 0;
+			f_retry   = 1;
+			f_rx_idle = 1;
+			tim->MR1  = tim->TC + STP_2TE;
+			stats.collisions[1]++;
 			
-		/* DALI Frame : 33TE start of stop bit (4TE) and start of min settling time (7TE)  */
-		} else if (frame_bit_idx == te_stop) {
-			frame_bit_pol = 1;
+		/* Read back : the bus is low where we released it, so someone else
+			is sending too.  Stop and hold it low, every transmitter then
+			sees the collision. */
+		} else if (f_arbitrate && frame_bit_idx && frame_bit_idx <= te_stop + 5
+		           && tx_level && !(dali_rx.read() ^ rx_invert)) {
+			f_collision = 1;
+			f_busy      = 0;
+			tx_level    = 1;
+			dali_tx     = tx_invert;
+			tim->MR1   += DALI_BREAK;
+			stats.collisions[0]++;
+			
+		/* DALI Frame : 0TE - 43TE, start bit, address and command then the
+			stop bits and settling time.  The half bits were expanded by
+			dali_start() so we just shift them out, the bitmap fills with 1s
+			after the frame.  Wider frames take 2TE more for each bit. */
+		} else if (frame_bit_idx < (te_stop+11)) {
+			if (!frame_bit_idx)
+				rx_disable();       // our own edges from here on
+			tx_level  = (uint32_t)tx_halves & 1;
+			dali_tx   = tx_level ^ tx_invert;
+			tx_halves = (tx_halves >> 1) | ((uint64_t)1 << 63);
+			tim->MR1 += TE;
 			
 		/* DALI Frame : 44TE, end stop bits + settling time 
 			If the forward frame requires an answer, it must come within 9.174mS
 			so we set up the match register as a watchdog and enable CR0 to receive
-			the response. */
+			the response.  Each edge moves the deadline to two stop bits later. */
 		} else if (frame_bit_idx == (te_stop+11)) { 
-			LPC_TIM2->MR1 = 9174;  // timeout of 22TE = 9,174 msec
-			LPC_TIM2->CCR = 7;     // enable rx, capture on both edges
+			tim->MR1 += 9174;      // timeout of 22TE = 9,174 msec
+			f_rx_first = 1;
+			rx_enable();           // capture both edges
+			
+			/* The frame just sent, its last edge is the rising one in or
+				after the last bit */
+			if (f_monitor) {
+				dali_mon_t m = { tc_epoch + TE, forward_frame,
+				                 (uint16_t)((te_stop + !(forward_frame & 1)) * TE), tx_bits,
+				                 DALI_MON_INFO(DALI_MON_SENT, 0, DALI_RX_OK) };
+				f_mon_sent = mon_sent.push(m) ? DALI_EDGE_SENT : 0;
+			}
 			
 		/* DALI Frame :  End of transfer. */
-		} else if (frame_bit_idx == (te_stop+12)) {
-			LPC_TIM2->TCR = 2;      // stop and reset timer
-			LPC_TIM2->MCR = (3<<3); // re-enable receive monitoring after sending
-			LPC_TIM2->MR1 = TE;     // set the half period
+		} else {
+			idle();                // capture off until the next answer window, or heard from now
+			rx_close(f_mon_sent, tx_query);
+			f_mon_sent = 0;
+			f_rx_first = 0;
+			stats.frames++;
 			
-			if (backward_frame & 0x100) {         // backward frame (answer) completed ?
-				answer = (uint8_t)backward_frame; // OK ! save answer
-				f_dalirx = 1;                     // and set flag to signal application
-				print = true;
+			/* The first of a pair sent twice: the same frame goes again
+				now, ahead of the queues, with its query if it has one */
+			if (f_repeat) {
+				f_repeat = 0;
+				f_retry  = 1;
+				tx_tries = 0;
+				tx_query = tx_repeat_query;
 			}
 			
-			backward_frame = 0;     // reset receive frame
-			f_busy = 0;             // end of transmission
+			/* Frames back to back: the gap between their ends is what one
+				costs the bus, settling and other transmitters included */
+			uint32_t end = tc_epoch + tim->TC;
+			if (f_backlog)
+				stats.frame_us += ((int32_t)(end - frame_end) - (int32_t)stats.frame_us) / 8;
+			frame_end = end;
+			f_backlog = f_retry || tx_waiting() != 0;
 			
-			if (f_repeat)     // repeat forward frame ?
-				f_dalitx = 1; // yes, set flag to signal application
+			f_busy = 0;             // end of transmission
 		}
 		
 		frame_bit_idx++;        // Increment half bit index
-		LPC_TIM2->IR = MR1_IRQ; // Clear MR1 interrupt flag
+		
+		if (!f_busy)
+			dali_start();       // next queued frame, if any
+		
+		isr_time(DALI_ISR_MATCH, start);
 		
 	} else {
 
-		/* MR0 IRQ - seen two stop bits */	
-		if(LPC_TIM2->IR & MR0_IRQ) {  
-			if(backward_frame) {
-				print = true;
-			}
-			LPC_TIM2->IR = MR0_IRQ;   // Clear the IRQ
-			
-		/* CR0 IRQ - rising or falling edge */
-		} else {                      
-			if(!dali_rx.read()) {
-				// Rising Edge 
-				if(backward_frame != 0) {
-					low_time = LPC_TIM2->CR0;
-					dali_decode();
-				} else {
-					previous = 1;
-					dali_shift_bit(1);
-				}
-			} else {  
-				// Falling edge
-				high_time = LPC_TIM2->CR0;       
-			}
-			LPC_TIM2->IR = CR0_IRQ;  // Clear the IRQ
-		} 
+		/* CR0/CR1 IRQ - rising or falling edge */
+		uint32_t time = rx_channel ? tim->CR1 : tim->CR0;
+		rx_edge(time, dali_rx.read() ^ rx_invert);
+		tim->IR = CR0_IRQ << rx_channel;  // Clear the IRQ
+		isr_time(DALI_ISR_EDGE, start);
 	}
+}
+
+
+/* GPIO edge interrupts when the Rx pin is not a capture input.  An inverted
+   Rx pin rises when the bus falls. */
+void Dali::rx_rise(void) {
+	uint32_t start = DWT->CYCCNT;
+	rx_edge(tim->TC, rx_invert ? DALI_EDGE_FALL : DALI_EDGE_RISE);
+	isr_time(DALI_ISR_EDGE, start);
+}
+
+void Dali::rx_fall(void) {
+	uint32_t start = DWT->CYCCNT;
+	rx_edge(tim->TC, rx_invert ? DALI_EDGE_RISE : DALI_EDGE_FALL);
+	isr_time(DALI_ISR_EDGE, start);
+}
+
+
+/* Counts an ISR entry and keeps the longest, ISR context only. */
+void Dali::isr_time(uint8_t kind, uint32_t start) {
+	uint32_t cycles = DWT->CYCCNT - start;
+	stats.isr_count[kind]++;
+	if (cycles > stats.isr_worst[kind])
+		stats.isr_worst[kind] = cycles;
+}
+
+
+/* Timestamps an edge into rx_edges, keeping the last slot for the end of
+   window marker, and moves the end of frame deadline two stop bits on.
+   An edge while the bus is idle opens a frame heard from another device.
+   The first edge of an answer window is the backward frame's start bit,
+   its delay after the forward frame's last half bit goes in the latency
+   histogram. */
+void Dali::rx_edge(uint32_t time, uint8_t level) {
+	dali_edge_t e = { time, level, 0 };
+	if (rx_edges.count() >= DALI_RX_EDGE_LEN - 1 || !rx_edges.push(e))
+		rx_overrun = DALI_EDGE_OVERRUN;
+	tim->MR1 = time + STP_2TE;
 	
-	if(print) {
-		// _cb(backward_frame);
-		// _cb(answer);
+	if (f_busy && !frame_bit_idx) {
+		f_busy  = 0;            // the bus went busy before our start bit
+		f_retry = 1;
+		stats.collisions[1]++;
+	}
+	if (!f_busy && !f_rx_idle) {
+		f_rx_idle = 1;          // another device is sending
+		tim->MCR  = MR1_INT;
+	}
+	
+	if (rx_edges.count() > stats.rx_edges_max)
+		stats.rx_edges_max = rx_edges.count();
+	
+	if (f_rx_first) {
+		f_rx_first = 0;
+		uint32_t te = (time - (TE) * (te_stop + 2)) / (TE);
+		stats.latency[te < DALI_LAT_BUCKETS ? te : DALI_LAT_BUCKETS - 1]++;
 	}
 }
 
 
+/* Ends an answer window or a frame heard with its marker and posts
+   process() to decode it.  ISR context only. */
+void Dali::rx_close(uint8_t kind, uint8_t tag) {
+	dali_edge_t end = { tc_epoch, (uint8_t)(DALI_EDGE_END | kind | rx_overrun), tag };
+	if (!rx_edges.push(end)) {
+		rx_lost++;
+		if (tag != DALI_NO_QUERY)
+			lost_queries |= 1 << tag;
+	}
+	rx_overrun = 0;
+	
+	if (queue)
+		queue->call(this, &Dali::process);
+}
+
 
 /*
-   Function    : dali_decode()
-   Description : when receiving a Dali frame, the interrupt handler calls 
-                 dali_decode() on the rising edge of the RX pin.
-				 
-				 We have previously stored the value of the Capture 
-				 register in either the low_time or the high_time
-				 variables depending on whether we saw a falling or 
-				 rising edge.  These are then used to decode the
-				 series of Manchester encoded bits received.
-
-
-				 As an example, consider the bit pattern "10" in the following
-				 Manchester encoded waveform.  A rising edge in the middle of
-				 bit-period represents a "1" and a falling edge a "0".
-
-				 Considering that the timer is reset on each edge, it should
-				 be clear that the rising edge of bit-1 was preceded by a 
-				 short low_time that is equal to TE, the Manchester coded
-				 half period.  In contrast, the falling edge of bit-0 was
-				 preceded by a long high_time.
-
-
-				   . bit-1 . bit-0 .
-				   .       .       .
-				 --+   +---+---+   .
-				   |   |   .   |   .
-				   +---+   .   +---+--
-				   .       .       .      
-                   .  "1"  .  "0"  .   
-
- 				 These timings give rise to the truth table shown below.
-				    
-   
-                Previous                                          New     
-                Half Bit  | Low Time | High Time |   Action   | Half Bit
-             -------------+----------+-----------+------------+-------------
-                   0      |    0     |     0     |  Shift 0   |   0
-                   0      |    0     |     1     |  -ERROR-   |   *
-                   0      |    1     |     0     |  Shift 0,1 |   1
-                   0      |    1     |     1     |  -ERROR-   |   *
-                   1      |    0     |     0     |  Shift 1   |   1
-                   1      |    0     |     1     |  Shift 0   |   0
-                   1      |    1     |     0     |  -ERROR-   |   *
-                   1      |    1     |     1     |  Shift 0,1 |   1
-             
+	Function    : process()
+	Description : decodes the edges captured in timer_isr() since the last call.
+	              Each answer window ends with a DALI_EDGE_END marker and its
+	              edges are run through the decoder in one pass.  A complete 8
+	              bit backward frame sets answer and f_dalirx, and the query
+	              waiting on the window, if any, is completed.  Frames heard
+	              while idle go to heard() instead.  In monitor mode each
+	              frame also goes to mon.
+	              
+	              Runs in thread context: posted to queue at the end of each
+	              transfer when one is attached, and called by get_answer()
+	              and query_result().  Ends by calling tx_ready, if set, for
+	              anything waiting on room in the transmit queue.
 */
-void Dali::dali_decode() {
-    
-	uint8_t action = previous << 2;
-
-
-    if ((high_time > MIN_2TE) && (high_time < MAX_2TE)) {
-        action = action | 1; // high_time = long
-    
-	} else if (!((high_time > MIN_TE) && (high_time < MAX_TE))) {
-        backward_frame = 0; // DALI ERROR
-        err = 1;
-        return;
-    }
-
-
-    if ((low_time > MIN_2TE) && (low_time < MAX_2TE)) {	
-        action = action | 2; // low_time = long
-    
-	} else if (!((low_time > MIN_TE) && (low_time < MAX_TE))) {
-        backward_frame = 0; // DALI ERROR    
-        err = 2;
-        return;
-    }
-
-
-    switch (action) {
-        case 0: dali_shift_bit(0); // short low, short high, shift 0
-                break;
-        case 1: backward_frame = 0; // short low, long high, ERROR
-                break;
-        case 2: dali_shift_bit(0); // long low, short high, shift 0,1
-                dali_shift_bit(1);
-                previous = 1; // new half bit is 1
-                break;
-        case 3: backward_frame = 0; // long low, long high, ERROR
-                break;
-        case 4: dali_shift_bit(1); // short low, short high, shift 1
-                break;
-        case 5: dali_shift_bit(0); // short low, long high, shift 0
-                previous = 0; // new half bit is 0
-                break;
-        case 6: backward_frame = 0; // long low, short high, ERROR
-                break;
-        case 7: dali_shift_bit(0); // long low, long high, shift 0,1
-                dali_shift_bit(1);
-        default: break; // invalid
-    }
-}
-
-
-void Dali::dali_shift_bit(uint8_t val) {
-    backward_frame = (backward_frame << 1) | val;
+void Dali::process(void) {
+	dali_edge_t e;
+	uint32_t data = 0;
+	uint8_t bits = 0;
+	
+	while (rx_edges.pop(e)) {
+		if (!(e.level & DALI_EDGE_END)) {
+			rx_decoder.edge(e.time, e.level);
+			continue;
+		}
+		
+		uint32_t first = rx_decoder.first_edge();
+		uint32_t last  = rx_decoder.last_edge();
+		uint8_t status;
+		if (e.level & DALI_EDGE_OVERRUN) {
+			rx_decoder.reset();
+			status = DALI_RX_OVERRUN;
+		} else if (e.level & DALI_EDGE_COLLISION) {
+			rx_decoder.reset();
+			status = DALI_RX_COLLISION;
+		} else {
+			status = rx_decoder.finish(&data, &bits);
+		}
+		if (f_monitor) {
+			dali_mon_t m;
+			if ((e.level & DALI_EDGE_SENT) && mon_sent.pop(m) && mon)
+				mon(m);
+			if (status == DALI_RX_EMPTY && e.tag != DALI_NO_QUERY)
+				monitor_frame(DALI_MON_ANSWER, status, e.time + TE, 0, 0, 0);
+			else if (status != DALI_RX_EMPTY && status != DALI_RX_COLLISION)
+				monitor_frame((e.level & DALI_EDGE_IDLE) ? DALI_MON_HEARD : DALI_MON_ANSWER,
+				              status, e.time + first, last - first, data, bits);
+		}
+		if (e.level & DALI_EDGE_IDLE) {
+			heard(status, data, bits);
+			continue;
+		}
+		stats.rx_status[status]++;
+		
+		uint8_t result;
+		if (status == DALI_RX_OK && bits == 8) {
+			answer   = (uint8_t)data; // OK ! save answer
+			f_dalirx = 1;             // and set flag to signal application
+			result   = DALI_ANSWER;
+		} else if (status == DALI_RX_EMPTY) {
+			result   = DALI_NO_ANSWER;
+		} else {
+			err      = status;
+			result   = DALI_ANSWER_ERROR;
+		}
+		
+		if (e.tag != DALI_NO_QUERY)
+			query_done(e.tag, result, (uint8_t)data);
+	}
+	
+	/* Queries whose window never made it into rx_edges */
+	if (lost_queries) {
+		core_util_critical_section_enter();
+		uint32_t lost = lost_queries;
+		lost_queries = 0;
+		core_util_critical_section_exit();
+		
+		for (uint8_t i = 0; i < DALI_QUERY_SLOTS; i++) {
+			if (lost & (1 << i))
+				query_done(i, DALI_ANSWER_ERROR, 0);
+		}
+	}
+	
+	/* Frames given up: the shadow followed them as they were queued */
+	uint16_t given_up;
+	while (tx_lost.pop(given_up))
+		shadow.lost(given_up);
+	if (f_tx_lost_full) {
+		f_tx_lost_full = 0;
+		shadow.clear();
+	}
+	
+	stats_rate();
+	
+	/* Work held back for lack of room may fit now */
+	if (tx_ready)
+		tx_ready();
+}
+
+
+/* A received frame to mon, the capture times made absolute. */
+void Dali::monitor_frame(uint8_t kind, uint8_t status, uint32_t time, uint32_t length,
+                         uint32_t data, uint8_t bits) {
+	if (!mon)
+		return;
+	dali_mon_t m;
+	m.time   = time;
+	m.length = (uint16_t)(length > 0xFFFF ? 0xFFFF : length);
+	m.data   = (status == DALI_RX_OK) ? data : 0;
+	m.bits   = (status == DALI_RX_OK) ? bits : 0;
+	m.info   = DALI_MON_INFO(kind, 0, status);
+	mon(m);
+}
+
+
+/* A frame another device sent while the bus was idle.  Only event
+   messages are passed on, anything else is counted. */
+void Dali::heard(uint8_t status, uint32_t data, uint8_t bits) {
+	if (status != DALI_RX_OK || bits != DALI_FRAME_24) {
+		stats.heard[1]++;
+		return;
+	}
+	stats.heard[0]++;
+	if (event)
+		event(data);
+}
+
+
+/* Works out frame_rate once at least a second has passed. */
+void Dali::stats_rate(void) {
+	uint32_t now = (uint32_t)Kernel::get_ms_count();
+	uint32_t ms  = now - stats.rate_ms;
+	
+	if (ms < 1000)
+		return;
+	uint32_t frames = stats.frames;
+	stats.frame_rate  = (uint32_t)((uint64_t)(frames - stats.rate_frames) * 1000 / ms);
+	stats.rate_ms     = now;
+	stats.rate_frames = frames;
+}
+
+
+/*
+	Function    : stat()
+	Description : reads one counter, as listed in dali_stats.hpp.  Runs in
+	              thread context, the ISR may move a counter on while it is
+	              read but never tears one.
+*/
+bool Dali::stat(uint8_t item, uint8_t index, uint32_t *value) {
+	switch (item) {
+		case DALI_STAT_ISR_COUNT:
+		case DALI_STAT_ISR_WORST:
+			if (index >= DALI_ISR_KINDS)
+				return false;
+			*value = (item == DALI_STAT_ISR_COUNT) ? stats.isr_count[index] : stats.isr_worst[index];
+			return true;
+		case DALI_STAT_FRAMES:
+			*value = stats.frames;
+			return index == 0;
+		case DALI_STAT_FRAME_RATE:
+			stats_rate();
+			*value = index ? stats.frame_us : stats.frame_rate;
+			return index < 2;
+		case DALI_STAT_LATENCY:
+			if (index >= DALI_LAT_BUCKETS)
+				return false;
+			*value = stats.latency[index];
+			return true;
+		case DALI_STAT_RX_STATUS:
+			if (index >= DALI_RX_STATUS_COUNT)
+				return false;
+			*value = stats.rx_status[index];
+			return true;
+		case DALI_STAT_TX_QUEUE:
+			*value = (index == 2) ? stats.tx_refused : index ? stats.tx_queue_max : tx_waiting();
+			return index < 3;
+		case DALI_STAT_RX_EDGES:
+			*value = index ? rx_lost : stats.rx_edges_max;
+			return index < 2;
+		case DALI_STAT_HEARD:
+			if (index >= 2)
+				return false;
+			*value = stats.heard[index];
+			return true;
+		case DALI_STAT_COLLISIONS:
+			if (index >= 3)
+				return false;
+			*value = stats.collisions[index];
+			return true;
+		case DALI_STAT_CLASS:
+			if (index >= 2 * DALI_CLASSES)
+				return false;
+			*value = (index < DALI_CLASSES) ? stats.class_frames[index]
+			                                : stats.class_wait[index - DALI_CLASSES];
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/*
+	Function    : query()
+	Description : claims a query slot and queues the frame tagged with it.
+	              The handle carries the slot's generation so that a handle
+	              kept after its result was collected is rejected.
+*/
+int Dali::query(uint16_t frame, dali_answer_cb_t cb) {
+	return query(frame, DALI_FRAME_16, cb);
+}
+
+int Dali::query(uint16_t frame) {
+	return query(frame, dali_answer_cb_t());
 }
 
+int Dali::query(dali_cmd_t cmd, dali_answer_cb_t cb) {
+	if (refused(cmd))
+		return -1;
+	return query_send(cmd.frame, DALI_FRAME_16, cmd.flags & DALI_FLAG_TWICE, cb);
+}
+
+int Dali::query(uint32_t frame, uint8_t bits, dali_answer_cb_t cb) {
+	return query_send(frame, bits, 0, cb);
+}
+
+int Dali::query_send(uint32_t frame, uint8_t bits, uint8_t twice, dali_answer_cb_t cb) {
+	int slot = -1;
+	
+	core_util_critical_section_enter();
+	for (int i = 0; i < DALI_QUERY_SLOTS; i++) {
+		if (queries[i].state == SLOT_FREE) {
+			queries[i].state = SLOT_PENDING;
+			slot = i;
+			break;
+		}
+	}
+	core_util_critical_section_exit();
+	
+	if (slot < 0)
+		return -1;
+	
+	queries[slot].cb    = cb;
+	queries[slot].frame = frame;
+	queries[slot].bits  = bits;
+	queries[slot].gen++;
+	dali_send(frame, slot, bits, twice);
+	return (queries[slot].gen << 8) | slot;
+}
+
+
+bool Dali::query_slot_free(void) {
+	for (int i = 0; i < DALI_QUERY_SLOTS; i++) {
+		if (queries[i].state == SLOT_FREE)
+			return true;
+	}
+	return false;
+}
+
+
+/*
+	Function    : query_result()
+	Description : returns DALI_PENDING until the query's answer window has
+	              closed, then its outcome, freeing the slot.  Returns -1 for
+	              a handle that is not, or no longer, valid.
+*/
+int Dali::query_result(int handle, uint8_t *ans) {
+	uint8_t slot = handle & 0xFF;
+	
+	process();
+	
+	if (handle < 0 || slot >= DALI_QUERY_SLOTS || queries[slot].gen != (uint8_t)(handle >> 8))
+		return -1;
+	
+	query_slot_t &q = queries[slot];
+	if (q.state == SLOT_PENDING)
+		return DALI_PENDING;
+	if (q.state != SLOT_DONE)
+		return -1;
+	
+	int status = q.status;
+	*ans = q.answer;
+	q.state = SLOT_FREE;
+	return status;
+}
+
+
+/* The slot is freed before the callback runs so it can queue another query. */
+void Dali::query_done(uint8_t slot, uint8_t status, uint8_t ans) {
+	query_slot_t &q = queries[slot];
+	
+	if (q.bits == DALI_FRAME_16)
+		shadow.answered(q.frame, status, ans);
+	
+	if (q.cb) {
+		dali_answer_cb_t cb = q.cb;
+		q.cb = dali_answer_cb_t();
+		q.state = SLOT_FREE;
+		cb(status, ans);
+	} else {
+		q.status = status;
+		q.answer = ans;
+		q.state = SLOT_DONE;
+	}
+}
+
+
+/* Frames gear only act on when the same frame arrives twice within 100 ms:
+   configuration commands, INITIALISE and RANDOMISE.  For frames that come
+   raw, off the socket say, commands built with dali_cmd.hpp carry it. */
+static bool dali_twice(uint16_t frame) {
+	return dali_frame_flags(frame) & DALI_FLAG_TWICE;
+}
+
+
+/* The same for 24 bit control device frames, IEC 62386-103: INITIALISE
+   and RANDOMISE, and the device and instance configuration instructions,
+   opcodes 0x00-0x2F and 0x61-0x6F to an address or instance. */
+static bool dali_twice_24(uint32_t frame) {
+	uint8_t a  = frame >> 16;
+	uint8_t op = frame & 0xFF;
+	
+	if (a == 0xC1)
+		return ((frame >> 8) & 0xFF) == 0x01 || ((frame >> 8) & 0xFF) == 0x02;
+	if (!(a & 1) || (a >= 0xC1 && a < 0xFD))
+		return false;           // event message or other special command
+	return op <= 0x2F || (op >= 0x61 && op <= 0x6F);
+}
+
+
+/* Sends a frame, twice in a row if the standard needs it. */
+void Dali::send(uint16_t frame) {
+	dali_send(frame, DALI_NO_QUERY, DALI_FRAME_16, dali_twice(frame));
+}
+
+void Dali::send(dali_cmd_t cmd) {
+	if (refused(cmd))
+		return;
+	dali_send(cmd.frame, DALI_NO_QUERY, DALI_FRAME_16, cmd.flags & DALI_FLAG_TWICE);
+}
+
+void Dali::send(uint32_t frame, uint8_t bits) {
+	if (bits == DALI_FRAME_16) {
+		send((uint16_t)frame);
+		return;
+	}
+	if (bits != DALI_FRAME_24 && bits != DALI_FRAME_25)
+		return;
+	dali_send(frame, DALI_NO_QUERY, bits, bits == DALI_FRAME_24 && dali_twice_24(frame));
+}
 
 
 /* 
 	Function    : dali_send()
-	Description : called once the forward_frame has been set up.  The address
-	 			  and data .  
+	Description : queues a forward frame for transmission, after anything
+	              held for coalescing so the bus sees commands in the order
+	              they were given.  The group table and the shadow follow
+	              what a 16 bit frame will do, gear only act on
+	              configuration sent twice, and a frame of another width in
+	              between breaks the pair.  One the ISR gives up after
+	              collisions goes back to the shadow as lost from
+	              process().  With twice set the ISR sends
+	              the frame a second time itself, a frame given twice in a
+	              row counts as a pair too.
 */
-void Dali::dali_send() {
+void Dali::dali_send(uint32_t frame, uint8_t query, uint8_t bits, uint8_t twice) {
+	flush();
+	
+	if (bits != DALI_FRAME_16) {
+		last_frame = DALI_NO_FRAME;
+	} else {
+		bool pair = twice || frame == last_frame;
+		if (pair)
+			groups.observe(frame);
+		shadow.command(frame, pair);
+		last_frame = frame;
+	}
+	
+	dali_queue(frame, query, bits, twice);
+}
+
+
+/* 
+	Function    : dali_queue()
+	Description : puts a frame on the transmit queue.  If the port is idle
+	              the frame goes straight out, otherwise timer_isr() starts
+	              it at the end of the current transfer.  Callers only wait
+	              if the queue is full, and query callbacks may run from here
+	              while they do.  The frame goes in the queue of the
+	              current class, or of a later one tx_after() picks.
+*/
+void Dali::dali_queue(uint32_t frame, uint8_t query, uint8_t bits, uint8_t twice) {
 
-	// if (f_repeat) { // repeat last command ?
-	// 	f_repeat = 0;
-	//
-	// } else if ((forward & 0xE100) == 0xA100 || (forward & 0xE100) == 0xC100) {
-	// 	if ((forward & 0xFF00) == INITIALISE || forward == RANDOMISE)
-	// 		f_repeat = 1; // special command repeat < 100 ms
-	//
-	// } else if ((forward & 0x1FF) >= 0x120 && (forward & 0x1FF) <= 0x180) {
-	// 	f_repeat = 1; // config. command repeat < 100 ms
-	// }
+	dali_tx_t tx = { frame, bits, query, twice, us_ticker_read() };
+	uint8_t cls = (bits == DALI_FRAME_16) ? tx_after(tx_class, frame) : tx_class;
 	
-	while (f_busy) ; // Wait until dali port is idle
+	/* Queue full, wait for the ISR to take one.  Keep decoding meanwhile,
+		on every bus, so no rx_edges can overflow while the caller is stuck
+		here. */
+	while (!tx_queue[cls].push(tx)) {
+		__WFI();
+		for (int i = 0; i < DALI_TIMERS; i++) {
+			if (handlers[i])
+				handlers[i]->process();
+		}
+	}
+	uint32_t waiting = tx_waiting();
+	if (waiting > stats.tx_queue_max)
+		stats.tx_queue_max = waiting;
 	
-	answer         = 0;
-	backward_frame = 0;
-	frame_bit_pol  = 0; // first half of start bit = 0
+	/* The ISR starts frames too, and dali_start() writes its stats and
+		the class credits: hold it off meanwhile */
+	core_util_critical_section_enter();
+	if (!f_busy)
+		dali_start();
+	core_util_critical_section_exit();
+}
+
+
+/*
+	Function    : dali_stage()
+	Description : holds a command for one short address until flush().  Only
+	              DAPC and the arc power commands 0x00-0x1F are held, they
+	              need neither an answer nor a repeat.  A second command for
+	              an address already held flushes the first, so every device
+	              still sees its commands in order.  Returns false if the
+	              frame has to be sent as it is.
+*/
+bool Dali::dali_stage(uint16_t frame) {
+	uint8_t a = frame >> 8;
+	
+	if (!coalesce || !queue || (a & 0x80))
+		return false;           // group, broadcast or special command
+	if ((a & 1) && (frame & 0xFF) > 0x1F)
+		return false;
+	
+	uint64_t addr = DALI_ADDR((a >> 1) & 0x3F);
+	uint16_t op   = frame & 0x1FF;
+	
+	if (staged_addrs & addr)
+		flush();
+	
+	uint8_t i;
+	for (i = 0; i < stage_n; i++) {
+		if (stage[i].op == op && stage[i].cls == tx_class)
+			break;
+	}
+	if (i == stage_n) {
+		if (stage_n == DALI_STAGE_OPS) {
+			flush();
+			i = 0;
+		}
+		stage[i].op    = op;
+		stage[i].addrs = 0;
+		stage[i].cls   = tx_class;
+		stage_n        = i + 1;
+	}
+	stage[i].addrs |= addr;
+	staged_addrs   |= addr;
+	stage_held++;
+	stage_commands++;
+	shadow.command(frame, false);   // as if it had gone out already
+	
+	if (!f_flush_posted) {
+		f_flush_posted = 1;
+		queue->call(this, &Dali::flush);
+	}
+	return true;
+}
+
+
+/*
+	Function    : flush()
+	Description : sends what dali_stage() held, each command to the groups
+	              groups.plan() picks, in the class it was given in.  Runs
+	              from the event queue after the caller that staged the
+	              commands returns, and before any other frame is sent.
+*/
+void Dali::flush(void) {
+	uint16_t frames[DALI_ADDRESSES + 1];
+	stage_t held[DALI_STAGE_OPS];
+	uint8_t n = stage_n;
+	
+	f_flush_posted = 0;
+	if (!n)
+		return;
+	
+	memcpy(held, stage, n * sizeof(stage_t));
+	stage_n      = 0;
+	stage_held   = 0;
+	staged_addrs = 0;
+	
+	f_flushing = 1;
+	uint8_t cls = tx_class;
+	for (uint8_t i = 0; i < n; i++) {
+		uint32_t count = groups.plan(held[i].addrs, held[i].op, frames, DALI_ADDRESSES + 1);
+		stage_frames += count;
+		tx_class = held[i].cls;
+		for (uint32_t j = 0; j < count; j++)
+			dali_queue(frames[j]);
+		if (count)
+			last_frame = frames[count - 1];
+	}
+	tx_class   = cls;
+	f_flushing = 0;
+}
+
+
+void Dali::coalesce_stats(uint32_t *commands, uint32_t *frames) {
+	*commands = stage_commands;
+	*frames   = stage_frames;
+}
+
+
+/*
+	Function    : learn_groups()
+	Description : asks every short address for QUERY GROUPS 0-7 and 8-15,
+	              one query at a time, and fills in groups from the answers.
+	              Addresses that do not answer are taken as absent.  A
+	              garbled answer is asked again, DALI_LEARN_TRIES times in
+	              all.  If it stays garbled, two devices sharing an address
+	              say, nothing learnt is trusted: a group the master only
+	              half knows would reach devices it did not mean to.
+*/
+void Dali::learn_groups(Callback<void()> done) {
+	groups.clear();
+	learn_addr    = 0;
+	learn_half    = 0;
+	learn_tries   = 0;
+	learn_ok      = 1;
+	learn_present = 0;
+	learn_done    = done;
+	learn_next();
+}
+
+
+void Dali::learn_next(void) {
+	if (learn_addr < DALI_ADDRESSES) {
+		dali_cmd_t cmd = dali_command(dali_short(learn_addr), DALI_QUERY_GROUPS_0_7 + learn_half);
+		uint8_t cls = set_class(DALI_CLASS_BACKGROUND);
+		int handle  = query(cmd, callback(this, &Dali::learn_answer));
+		set_class(cls);
+		if (handle >= 0)
+			return;
+		learn_ok = 0;           // no query slot, give up
+	}
+	
+	if (learn_ok)
+		groups.set_present(learn_present);
+	else
+		groups.clear();
+	if (learn_done)
+		learn_done();
+}
+
+
+void Dali::learn_answer(int status, uint8_t ans) {
+	if (status == DALI_ANSWER_ERROR) {
+		if (++learn_tries < DALI_LEARN_TRIES) {
+			learn_next();
+			return;
+		}
+		learn_ok = 0;
+	}
+	learn_tries = 0;
+	
+	if (status == DALI_ANSWER && !learn_half) {
+		learn_lo   = ans;
+		learn_half = 1;
+	} else {
+		if (status == DALI_ANSWER) {
+			learn_present |= DALI_ADDR(learn_addr);
+			groups.set_groups(learn_addr, learn_lo | (ans << 8));
+		}
+		learn_half = 0;
+		learn_addr++;
+	}
+	learn_next();
+}
+
+
+/* 
+	Function    : dali_start()
+	Description : takes the next frame off the transmit queue and starts the
+	              timer.  Only called with the port idle, from the end of
+	              transfer in timer_isr() or from dali_queue() inside a
+	              critical section, so it never runs in both at once and
+	              the stats and credits it updates need no lock.  Not while a
+	              frame from another device is being heard or the settling
+	              time after it runs, or during a collision: the end of
+	              those calls it again.  A frame held back by arbitration
+	              goes before the queues, otherwise tx_pick() says which
+	              class goes next.
+*/
+bool Dali::dali_start() {
+
+	dali_tx_t tx;
+	
+	if (f_rx_idle || f_backoff || f_collision)
+		return false;
+	if (!f_retry) {
+		uint32_t now = us_ticker_read();
+		int cls = tx_pick(now);
+		if (cls < 0 || !tx_queue[cls].pop(tx))
+			return false;
+		
+		stats.class_frames[cls]++;
+		if (now - tx.time > stats.class_wait[cls])
+			stats.class_wait[cls] = now - tx.time;
+		
+		/* What follows a DTR or ENABLE DEVICE TYPE comes from the same
+			class */
+		uint8_t a = tx.frame >> 8;
+		tx_hold = (tx.bits == DALI_FRAME_16 && (a == DALI_DTR0 || a == DALI_DTR1 || a == DALI_DTR2
+				|| a == DALI_ENABLE_DEVICE_TYPE)) ? cls : DALI_CLASSES;
+		
+		/* A pair goes out whole, the query waits for the second frame */
+		forward_frame   = tx.frame;
+		tx_bits         = tx.bits;
+		tx_tries        = 0;
+		f_repeat        = tx.twice;
+		tx_repeat_query = tx.query;
+		tx_query        = tx.twice ? DALI_NO_QUERY : tx.query;
+	}
+	f_retry        = 0;
+	tx_halves      = (tx_bits == DALI_FRAME_16) ? dali_manchester_frame((uint16_t)forward_frame)
+	                                            : dali_manchester_frame(forward_frame, tx_bits);
+	te_stop        = 2 * tx_bits + 1;
 	frame_bit_idx  = 0;
+	tx_level       = 1;
 	f_busy         = 1; // set transfer activate flag
 	
-	LPC_TIM2->CCR = 0x0000; // disable capture interrupt
-	LPC_TIM2->MCR = (3<<3); // only enable MR1 during send
-	LPC_TIM2->TCR = 2;      // reset timer
-	LPC_TIM2->TCR = 1;      // enable timer
+	if (f_arbitrate)
+		rx_enable();        // the bus may still go busy before the start bit
+	else
+		rx_disable();       // disable capture interrupt
+	tim->TCR = 2;           // reset timer
+	tim->MCR = MR1_INT;
+	tim->MR1 = TE;          // first half bit
+	tim->TCR = 1;           // enable timer
+	tc_epoch = us_ticker_read() - tim->TC;
+	return true;
 }
 
 
 /*
-	Function    : dali_put()
-	Description : 
+	Function    : tx_pick()
+	Description : the class the next frame comes from, or -1 if nothing
+	              waits.  Only from dali_start(), in the ISR or with it
+	              held off, so the credits are never updated twice at
+	              once.  Every class first earns its share of the time
+	              since the last pick, up to DALI_CLASS_BURST frames'
+	              worth, and the class picked pays one frame, a pair sent
+	              twice two.  The rest of a sequence goes first, then a
+	              frame past its deadline, a class with credit and any
+	              class at all; one picked without credit runs into debt,
+	              as far as the same burst.
 */
-void Dali::put(dali_payload_t dali_cmd) {
-	if(dali_cmd.control.is_req) {
+int Dali::tx_pick(uint32_t now) {
+	dali_tx_t tx;
+	int32_t frame = stats.frame_us;
+	int32_t burst = DALI_CLASS_BURST * frame;
+	uint32_t elapsed = now - tx_earned;
+	tx_earned = now;
+	if (elapsed > (uint32_t)burst)
+		elapsed = burst;
+	
+	int held = -1, late = -1, funded = -1, first = -1;
+	for (int c = 0; c < DALI_CLASSES; c++) {
+		tx_credit[c] += elapsed * tx_share[c] / 100;
+		if (tx_credit[c] > burst)
+			tx_credit[c] = burst;
+		if (!tx_queue[c].peek(tx))
+			continue;
+		if (c == tx_hold)
+			held = c;
+		if (first < 0)
+			first = c;
+		if (late < 0 && tx_deadline[c] && now - tx.time > tx_deadline[c])
+			late = c;
+		if (funded < 0 && tx_credit[c] > 0)
+			funded = c;
 	}
+	
+	int c = (held >= 0) ? held : (late >= 0) ? late : (funded >= 0) ? funded : first;
+	if (c >= 0) {
+		tx_credit[c] -= (tx_queue[c].peek(tx) && tx.twice) ? 2 * frame : frame;
+		if (tx_credit[c] < -burst)
+			tx_credit[c] = -burst;
+	}
+	return c;
+}
+
+
+/* Short addresses a 16 bit forward frame reaches: a group as far as the
+   groups are known, every gear for the DTRs and ENABLE DEVICE TYPE, whose
+   effect the next command depends on, and none for other special
+   commands. */
+uint64_t Dali::tx_reach(uint16_t frame) {
+	uint8_t a = frame >> 8;
+	
+	if (a < 0x80)
+		return DALI_ADDR(a >> 1);
+	if (a < 0xA0)
+		return groups.known ? groups.members[(a >> 1) & 0x0F] : ~(uint64_t)0;
+	if (a >= 0xFC || a == DALI_DTR0 || a == DALI_DTR1 || a == DALI_DTR2 || a == DALI_ENABLE_DEVICE_TYPE)
+		return ~(uint64_t)0;
+	return 0;
 }
 
+
+/* Frames that change what gear do or answer: all but the queries, save
+   READ MEMORY LOCATION which moves DTR1 on. */
+static bool dali_changes(uint16_t frame) {
+	return !(dali_frame_flags(frame) & DALI_FLAG_ANSWER)
+		|| ((frame >> 8) < 0xA0 && (frame & 0xFF) == DALI_READ_MEMORY_LOCATION);
+}
+
+
+/*
+	Function    : tx_after()
+	Description : the class a 16 bit frame given in class cls is queued in:
+	              cls, unless a later class still holds a frame that
+	              changes any of the same gear, then the last such class,
+	              so the frame cannot overtake it.  Queries waiting behind
+	              are overtaken, their answer is only the newer.  Thread
+	              only, the queues are read from the producer side.
+*/
+uint8_t Dali::tx_after(uint8_t cls, uint16_t frame) {
+	uint64_t reach = tx_reach(frame);
+	dali_tx_t tx;
+	
+	if (!reach)
+		return cls;
+	for (uint8_t c = DALI_CLASSES - 1; c > cls; c--) {
+		for (uint32_t i = 0; tx_queue[c].at(i, tx); i++) {
+			if (tx.bits == DALI_FRAME_16 && (tx_reach(tx.frame) & reach) && dali_changes(tx.frame))
+				return c;
+		}
+	}
+	return cls;
+}
+
+
+/* Frames waiting in every class */
+uint32_t Dali::tx_waiting(void) {
+	uint32_t n = 0;
+	for (int c = 0; c < DALI_CLASSES; c++)
+		n += tx_queue[c].count();
+	return n;
+}
+
+
+/* Room for frames of the current class, whichever queue they end up in */
+uint32_t Dali::tx_room(void) {
+	uint32_t room = DALI_TX_QUEUE_LEN;
+	for (int c = tx_class; c < DALI_CLASSES; c++) {
+		if (tx_queue[c].size() - tx_queue[c].count() < room)
+			room = tx_queue[c].size() - tx_queue[c].count();
+	}
+	return room;
+}
+
+
+uint8_t Dali::set_class(uint8_t cls) {
+	uint8_t was = tx_class;
+	if (cls < DALI_CLASSES)
+		tx_class = cls;
+	return was;
+}
+
+
+void Dali::set_budget(uint8_t cls, uint8_t share, uint32_t deadline_ms) {
+	if (cls >= DALI_CLASSES)
+		return;
+	tx_share[cls]    = share > 100 ? 100 : share;
+	tx_deadline[cls] = deadline_ms * 1000;
+}
+
+
+bool Dali::is_busy(void) {
+	return stage_n || f_busy || f_retry || f_collision || tx_waiting();
+}
+
+
+/*
+	Function    : get_answer()
+	Description : returns true and the backward frame if one was received
+	              since the last call, decoding any pending edges first.
+*/
+bool Dali::get_answer(uint8_t *ans) {
+	process();
+	if (!f_dalirx)
+		return false;
+	*ans = answer;
+	f_dalirx = 0;
+	return true;
+}
+
+
+/*
+	Function    : put()
+	Description : queues the forward frame (address, command) of a request
+	              record, twice if repeat is set or the command needs it.
+	              With status DALI_NET_FRAME_24 the frame is the 24 bit
+	              (address, command, response).  With response_req the last
+	              frame is sent as a query answered through cb.  Everything
+	              is checked before anything is queued so a refused record
+	              can simply be offered again.  A plain arc power command for
+	              one short address is held for coalescing, the transmit
+	              queue must have room for it and for everything already held.
+*/
+bool Dali::put(dali_payload_t dali_cmd, dali_answer_cb_t cb) {
+	if (!dali_cmd.control.is_req)
+		return true;            // not a request, nothing to do
+	if (f_flushing)
+		return false;           // flush() is waiting for room itself
+	
+	uint8_t bits = DALI_FRAME_16;
+	uint32_t frame = (dali_cmd.address << 8) | dali_cmd.command;
+	bool twice;
+	if (dali_cmd.control.status == DALI_NET_FRAME_24) {
+		bits  = DALI_FRAME_24;
+		frame = (frame << 8) | dali_cmd.response;
+		twice = dali_cmd.control.repeat || dali_twice_24(frame);
+	} else {
+		twice = dali_cmd.control.repeat || dali_twice(frame);
+	}
+	
+	if (tx_room() < 1u + stage_held)
+		return false;
+	if (dali_cmd.control.response_req && !query_slot_free())
+		return false;
+	
+	if (bits == DALI_FRAME_16 && !twice && !dali_cmd.control.response_req && dali_stage(frame))
+		return true;
+	
+	if (dali_cmd.control.response_req)
+		query_send(frame, bits, twice, cb);
+	else
+		dali_send(frame, DALI_NO_QUERY, bits, twice);
+	return true;
+}
+
+
 void Dali::broadcast(uint8_t command) {
-	forward_frame = (0xFF << 8) | command;
-	dali_send();
+	send(dali_command(DALI_BROADCAST, command));
 }
 
 void Dali::query_device_type(uint8_t addr) {
-	forward_frame = (addr << 9) | 0x199;
-	dali_send();
+	send(dali_command(dali_short(addr), DALI_QUERY_DEVICE_TYPE));
 }
 
 void Dali::query_short_address(void) {
-	forward_frame = 0xBB00;
-	dali_send();
+	dali_send(dali_special(DALI_QUERY_SHORT_ADDRESS, 0).frame);
 }
 
 void Dali::turn_on(uint8_t addr) {
-	forward_frame = 0x7E00 & (addr << 9);
-	forward_frame |= 0x105;
-	//printf("turn_on: 0x%0x\n\r", forward_frame);
-	dali_send();
+	dali_cmd_t cmd = dali_command(dali_short(addr), DALI_RECALL_MAX);
+	if (!refused(cmd) && !dali_stage(cmd.frame))
+		dali_send(cmd.frame);
 }
 
 void Dali::turn_off(uint8_t addr) {
-	forward_frame = 0x7E00 & (addr << 9);
-	forward_frame |= 0x100;
-	//printf("turn_off: 0x%0x\n\r", forward_frame);
-	dali_send();	
+	dali_cmd_t cmd = dali_command(dali_short(addr), DALI_OFF);
+	if (!refused(cmd) && !dali_stage(cmd.frame))
+		dali_send(cmd.frame);
+}
+
+void Dali::dapc(uint8_t addr, uint8_t level) {
+	dali_cmd_t cmd = dali_dapc(dali_short(addr), level);
+	if (!refused(cmd) && !dali_stage(cmd.frame))
+		dali_send(cmd.frame);
+}
+
+
+/* A command built from an address, scene or group out of range is not
+   sent masked into range, it is counted and dropped. */
+bool Dali::refused(dali_cmd_t cmd) {
+	if (!(cmd.flags & DALI_FLAG_BAD))
+		return false;
+	stats.tx_refused++;
+	return true;
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
 #ifndef MBED_DALI_H
 #define MBED_DALI_H
 
+#include "dali_ring.hpp"
+#include "dali_decoder.hpp"
+#include "dali_groups.hpp"
+#include "dali_shadow.hpp"
+#include "dali_stats.hpp"
+#include "dali_cmd.hpp"
+
 // Dali Defines
 #define TE 834/2      // half bit time = 417 usec
 #define MIN_TE 350    // minimum half bit time (352)
@@ -9,6 +16,36 @@
 #define MAX_2TE 900   // maximum full bit time (899)
 #define STP_2TE 1800  // maximum time for two stop bits
 
+#define DALI_TX_QUEUE_LEN 32  // pending forward frames per class, must be a power of two
+#define DALI_RX_EDGE_LEN  64  // captured edges awaiting decode, must be a power of two
+#define DALI_TX_LOST_LEN  4   // 16 bit frames given up and not yet in process(), a power of two
+#define DALI_QUERY_SLOTS  16  // queries that can be waiting for an answer at once
+#define DALI_NO_QUERY     0xFF
+#define DALI_NO_FRAME     0xFFFFFFFF
+#define DALI_STAGE_OPS    8   // distinct commands waiting to be coalesced
+#define DALI_LEARN_TRIES  3   // times learn_groups() asks a garbled answer
+#define DALI_FRAME_US     28000 // usec a 16 bit frame and its answer window take, until measured
+#define DALI_CLASS_BURST  4   // frames of unused share a class may save up
+
+/* Sharing the bus with other transmitters, IEC 62386-101 multi-master timing */
+#define DALI_PRIORITY        2     // default priority, 1 (first) to 5 (last)
+#define DALI_SETTLE_SPREAD   1200  // usec, random part of the settling time
+#define DALI_BREAK           1300  // usec the bus is held low after a collision, 1.2-1.4 ms
+#define DALI_TX_RETRIES      8     // times a frame that collided is sent again
+
+#define DALI_TIMERS          4  // TIMER0..3, one per bus
+#define DALI_TIMER_RESERVED  3  // mbed's us_ticker runs on TIMER3
+
+#define DALI_NET_RECORD   4   // bytes per dali_payload_t on the wire
+
+/* Frame widths, in data bits */
+#define DALI_FRAME_BACKWARD  8
+#define DALI_FRAME_16        16   // control gear, IEC 62386-102
+#define DALI_FRAME_24        24   // control devices and their events, IEC 62386-103
+#define DALI_FRAME_25        25
+
+#define DALI_NET_FRAME_24    1    // request status: address, command, response are a 24 bit frame
+
 #define MR0_IRQ 1<<0
 #define MR1_IRQ 1<<1
 #define MR2_IRQ 1<<2
@@ -16,23 +53,97 @@
 #define CR0_IRQ 1<<4
 #define CR1_IRQ 1<<5
 
-#define ALL_OFF 0x06
-#define ALL_ON  0x05
+#define MR1_INT (1<<3)        // MCR: interrupt on MR1 match
+
 
-#define FLAG_SOCKET_ACCEPT  (1<<0)
-#define FLAG_SOCKET_CLOSED  (1<<1)
-#define FLAG_CLIENT_CONNECT (1<<2)
+/*
+	Control byte of a network record, bit 0 first.  bus picks the Dali bus
+	through DaliRouter.  A request with response_req set gets one response
+	record back, in the order the requests were sent on that bus, with
+	is_rsp set, status holding DALI_ANSWER, DALI_NO_ANSWER or
+	DALI_ANSWER_ERROR and response the backward frame.
 
+	A record with response_req set but not is_req reads a counter of the
+	bus instead, see dali_stats.hpp: address is the item, command the index,
+	with bit 7 set for bits 31-24 of the value.  The response, in order with
+	the bus's other responses, carries bits 23-0 of the value in address
+	(high), command and response (low), or status DALI_ANSWER_ERROR if
+	there is no such counter.
 
+	A request with status DALI_NET_FRAME_24 sends the 24 bit frame held in
+	address, command and response, first byte first.  Event messages
+	heard from input devices come back unasked, with none of repeat,
+	response_req, is_rsp and is_req set and the event in address,
+	command and response the same way.
+*/
 typedef struct {
 	uint8_t repeat       : 1;
 	uint8_t response_req : 1;
 	uint8_t is_rsp       : 1;
 	uint8_t is_req       : 1;
-	uint8_t              : 4;
+	uint8_t status       : 2;
+	uint8_t bus          : 2;
 } dali_ctrl_t;
 
 
+/* Outcome of a query, passed to its callback or returned by query_result() */
+enum {
+	DALI_ANSWER = 0,      // answer holds the backward frame
+	DALI_NO_ANSWER,       // nothing came back in the answer window
+	DALI_ANSWER_ERROR,    // a reply that did not decode, e.g. several devices at once
+	DALI_PENDING          // query_result() only: still waiting
+};
+
+typedef Callback<void(int status, uint8_t answer)> dali_answer_cb_t;
+
+
+/* An entry in the transmit queue */
+typedef struct {
+	uint32_t frame;
+	uint8_t  bits;        // DALI_FRAME_16, _24 or _25
+	uint8_t  query;       // slot waiting for the answer, or DALI_NO_QUERY
+	uint8_t  twice;       // the ISR sends it again straight after
+	uint32_t time;        // us_ticker when it was queued
+} dali_tx_t;
+
+typedef Callback<void(uint32_t event)> dali_event_cb_t;
+
+
+/*
+	A frame seen on the bus, as DaliMonitor streams it.  time is the
+	us_ticker at the start bit's falling edge and length runs from there to
+	the frame's last edge.  A frame that did not decode keeps its DALI_RX_*
+	status, with bits and data 0.  A forward frame given up after
+	collisions is SENT with DALI_RX_COLLISION and no length, and a query
+	nothing answered an ANSWER with DALI_RX_EMPTY, timed at the query.  A
+	DALI_MON_DROPPED record stands for data records lost before it and has
+	no length.
+*/
+#define DALI_MON_RECORD   12    // bytes per dali_mon_t on the wire
+#define DALI_MON_SENT_LEN 8     // forward frames sent and not yet in process(), a power of two
+
+enum {
+	DALI_MON_SENT = 0,      // forward frame this master sent
+	DALI_MON_ANSWER,        // backward frame in one of its answer windows
+	DALI_MON_HEARD,         // any frame another device sent while the bus was idle
+	DALI_MON_DROPPED
+};
+
+typedef struct {
+	uint32_t time;
+	uint32_t data;
+	uint16_t length;      // usec
+	uint8_t  bits;
+	uint8_t  info;        // kind, bits 0-1; bus, 2-3; status, 4-7
+} dali_mon_t;
+
+#define DALI_MON_INFO(kind, bus, status)  (uint8_t)((kind) | ((bus) << 2) | ((status) << 4))
+
+static_assert(sizeof(dali_mon_t) == DALI_MON_RECORD, "dali_mon_t is the wire format");
+
+typedef Callback<void(const dali_mon_t &frame)> dali_monitor_cb_t;
+
+
 typedef struct {
 	dali_ctrl_t control;
 	uint8_t     address;
@@ -40,80 +151,285 @@ typedef struct {
 	uint8_t     response;
 } dali_payload_t;
 
+static_assert(sizeof(dali_payload_t) == DALI_NET_RECORD, "dali_payload_t is the wire format");
+
 
 class Dali {
 
 public:
-	/** Receives a pair of PinName variables
+	/** Receives a pair of PinName variables and the timer to use
 	* @param rxPin mbed pin to which the Dali Rx signal is connected
 	* @param txPin mbed pin to which the Dali Tx signal is connected	
+	* @param timer TIMERn dedicated to this bus, 0..2
 	*/
-	Dali(PinName rxPin, PinName txPin);
+	Dali(PinName rxPin, PinName txPin, uint8_t timer = 2);
+	~Dali();
 	
-	/* Pointer to the class instance so we can register the ISR */
-	static Dali* handler;
+	/* The instance driving each timer so we can register the ISRs */
+	static Dali* handlers[DALI_TIMERS];
 	
-	/* Called durint init() to bind the interrupt handler. */
+	/* Bound to TIMERn during init(). */
+	template <int N>
 	static void irq() {
-		handler->timer_isr();
+		handlers[N]->timer_isr();
 	}
 	
-	void server_sigio(TCPSocket *socket);
-	void client_sigio(TCPSocket *socket);
+	/* Main Dali function: queue one request record, with response_req the
+	   answer goes to cb.  Returns false, without sending anything, if the
+	   transmit path has no room for it yet. */
+	bool put(dali_payload_t dali_cmd, dali_answer_cb_t cb);
+	
+	/* Transfer status and the last backward frame received. */
+	bool is_busy(void);
+	bool get_answer(uint8_t *ans);
 	
-	/* Main Dali function */
-	void put(dali_payload_t dali_cmd);
+	/* Decode captured edges, run from the event queue or thread context. */
+	void process(void);
+	
+	/* Asynchronous queries.  Both return a handle, or -1 if all
+	   DALI_QUERY_SLOTS are in use.  With a callback it runs from process()
+	   once the answer window closes; without one poll query_result(), which
+	   returns DALI_PENDING until the outcome is known. */
+	int query(uint16_t frame, dali_answer_cb_t cb);
+	int query(uint16_t frame);
+	int query_result(int handle, uint8_t *answer);
+	
+	/* The same for a command built with dali_cmd.hpp.  One gear only act
+	   on sent twice goes out twice, as send() sends it, the answer window
+	   only follows the second.  One built from a value out of range,
+	   DALI_FLAG_BAD, is refused with -1. */
+	int query(dali_cmd_t cmd, dali_answer_cb_t cb);
 	
 	/* Function to pass pointer to Serial instance. */
 	void attach_uart(Serial *uart);
 	
-	/* Low level Dali commands */
+	/* Polarity of the pins against the bus, true where the pin is low while
+	   the bus is high.  The default is the NXP I/OH board: the Rx
+	   optocoupler inverts, Tx does not.  Change it only while idle. */
+	void set_polarity(bool rx_inverted, bool tx_inverted);
+	
+	/* Answers are decoded with windows around the half bit time measured
+	   on their start bit, false goes back to the fixed windows. */
+	void set_adaptive(bool on);
+	
+	/* Low level Dali commands.  send() takes any forward frame and sends
+	   configuration commands, INITIALISE and RANDOMISE twice.  Given a
+	   dali_cmd_t it goes by the command's flags instead, and refuses one
+	   with DALI_FLAG_BAD, as the per address calls below do for an
+	   address over 63.  A pair is one
+	   entry in the transmit queue: the ISR sends the second frame as soon
+	   as the first one's transfer ends, about 10 ms after it, with nothing
+	   of this master's in between, however late the thread runs.  A
+	   collision on either goes again as any frame does. */
+	void send(uint16_t frame);
+	void send(dali_cmd_t cmd);
 	void broadcast(uint8_t command);
 	void query_device_type(uint8_t addr);
 	void query_short_address(void);
 	void turn_on(uint8_t addr);
 	void turn_off(uint8_t addr);
-	void dali_cmd_16(uint8_t addr, uint16_t data);
+	void dapc(uint8_t addr, uint8_t level);	// direct arc power, coalesced like turn_on()
+	
+	/* Traffic classes.  Frames queued from now on are of class cls,
+	   DALI_CLASS_*, DALI_CLASS_SCHEDULED until changed; the class before
+	   is returned so a caller can put it back.  Each class waits in a
+	   queue of its own and the ISR picks the next frame between them: a
+	   frame past its class's deadline first, then the first class with
+	   share left, then the first with anything waiting, so the bus never
+	   idles for a budget.  A class earns share percent of the bus time,
+	   DALI_CLASS_BURST frames at most, and spends a frame's worth per
+	   frame.  Sequences stay together, the command after DTR0, DTR1, DTR2
+	   or ENABLE DEVICE TYPE comes from the same class next.  A frame for gear a later class still has
+	   a frame waiting for joins that class instead, so each device sees
+	   its commands in the order they were given.  A deadline of 0 is
+	   none.  By default interactive has 60% and no deadline, scheduled
+	   30% and 1000 ms and background 10% and no deadline. */
+	uint8_t set_class(uint8_t cls);
+	void set_budget(uint8_t cls, uint8_t share, uint32_t deadline_ms);
+	
+	/* Frames of other widths: 24 bit commands to control devices, sent
+	   twice where IEC 62386-103 needs it, and 25 bit frames.  Answers are
+	   8 bit backward frames as for control gear. */
+	void send(uint32_t frame, uint8_t bits);
+	int query(uint32_t frame, uint8_t bits, dali_answer_cb_t cb);
+	
+	/* Listens while the bus is idle for frames sent by other devices.  24
+	   bit event messages from input devices go to cb, from process().  An
+	   empty cb stops listening.  A frame being heard holds back the next
+	   forward frame until it ends. */
+	void listen(dali_event_cb_t cb);
+	
+	/* Arbitration with other transmitters, on by default.  The bus is
+	   heard while idle, and after another device's frame the next one
+	   waits the settling time of priority, 1..5, plus a random part.
+	   While sending, each half bit the bus should be high in is read back:
+	   finding it low the frame stops, the bus is held low for DALI_BREAK
+	   so the other side sees the collision too, and the frame goes again
+	   after the settling time, DALI_TX_RETRIES times at most.  A frame the
+	   bus took first is simply held back.  Off, frames go out regardless. */
+	void set_arbitration(bool on, uint8_t priority = DALI_PRIORITY);
+	
+	/* Monitor mode: every frame on the bus goes to cb from process(), the
+	   forward frames sent, the answers to them and frames other devices
+	   sent, decoded or not.  The bus is heard while idle meanwhile.  An
+	   empty cb stops it. */
+	void monitor(dali_monitor_cb_t cb);
+	
+	/* Group coalescing.  Arc power commands for single short addresses are
+	   held until the event queue next runs, then sent to as few groups or
+	   broadcasts as reach exactly those addresses.  Needs queue, and groups
+	   filled in by learn_groups() or by hand.  done runs once the answers
+	   are in. */
+	void learn_groups(Callback<void()> done);
+	void flush(void);
+	void coalesce_stats(uint32_t *commands, uint32_t *frames);
+	
+	DaliGroups groups;
+	bool coalesce;                      // false sends every command as given
+	
+	/* What each short address would answer, kept from the frames sent and
+	   the answers decoded.  DaliRouter answers queries from it. */
+	DaliShadow shadow;
 
-	TCPSocket *client;
+	/* Always on counters, see dali_stats.hpp.  stat() reads one item,
+	   false if there is no such item or index. */
+	dali_stats_t stats;
+	bool stat(uint8_t item, uint8_t index, uint32_t *value);
+	
 	EventQueue *queue;
 	
+	/* Called at the end of process(), the transmit queue may have room. */
+	Callback<void()> tx_ready;
+	
 	
 private:
 
 	InterruptIn dali_rx;
 	DigitalOut dali_tx;
-	SocketAddress clientAddress;
-	EventFlags eventFlags;
 	Serial *_uart;
 	
-	uint32_t low_time;        			// captured puls low time
-	uint32_t high_time;       			// captured puls high time
-	uint32_t counter;        			// 
-	volatile uint8_t frame_bit_pol;		// used for dali send bit
+	LPC_TIM_TypeDef *tim;				// this bus's timer
+	uint8_t timer_idx;
+	int8_t  rx_channel;					// capture channel, -1 for GPIO edge interrupts
+	
+	uint64_t tx_halves;					// half bit levels still to send, LSB next
 	volatile uint8_t frame_bit_idx;		// keeps track of sending bit frame_bit_idx
-	volatile uint8_t previous;			// previous received bit
-	uint16_t forward_frame;   			// holds the forward frame to be transmitted
-	uint16_t backward_frame;			// holds received slave backward frame
+	uint32_t forward_frame;   			// forward frame being transmitted
+	uint8_t  tx_query;					// query slot of the frame being transmitted
+	DaliRing<dali_tx_t, DALI_TX_QUEUE_LEN> tx_queue[DALI_CLASSES];	// frames waiting for the bus
+	uint8_t  tx_class;					// class of the frames queued now
+	uint8_t  tx_share[DALI_CLASSES];	// percent of the bus each class earns
+	uint32_t tx_deadline[DALI_CLASSES];	// usec, 0 for none
+	int32_t  tx_credit[DALI_CLASSES];	// usec of bus time each has to spend
+	uint32_t tx_earned;					// us_ticker when credit was last added
+	uint8_t  tx_hold;					// class the next frame comes from, or DALI_CLASSES
+	DaliRing<dali_edge_t, DALI_RX_EDGE_LEN> rx_edges;	// captured edges, decoded by process()
+	DaliDecoder rx_decoder;
+	volatile uint8_t rx_overrun;		// edges dropped in the current answer window
+	uint32_t rx_lost;					// answer windows dropped because rx_edges was full
+	volatile uint32_t lost_queries;		// slots whose answer window was dropped
+	DaliRing<uint16_t, DALI_TX_LOST_LEN> tx_lost;	// frames given up, for the shadow
+	volatile uint8_t f_tx_lost_full;	// one did not fit in tx_lost
+	volatile uint8_t f_rx_first;		// no edge yet in this answer window
+	volatile uint8_t f_rx_idle;			// hearing a frame another device sent
+	uint8_t  f_listen;					// receiving while the bus is idle
+	dali_event_cb_t event;
+	uint8_t  rx_invert;					// Rx pin low while the bus is high
+	uint8_t  tx_invert;					// Tx pin low to release the bus
+	
+	uint8_t  f_arbitrate;				// set_arbitration() on
+	uint8_t  priority;
+	uint8_t  tx_bits;					// width of forward_frame
+	uint8_t  tx_level;					// bus level driven in the last half bit
+	uint8_t  tx_tries;					// collisions of forward_frame so far
+	volatile uint8_t f_collision;		// holding the bus low after a collision
+	volatile uint8_t f_backoff;			// waiting out the settling time
+	volatile uint8_t f_retry;			// forward_frame goes out again next
+	uint32_t rand_state;
+	
+	uint8_t  f_monitor;					// monitor() on
+	volatile uint8_t f_mon_sent;		// DALI_EDGE_SENT for this window's marker, or 0
+	dali_monitor_cb_t mon;
+	DaliRing<dali_mon_t, DALI_MON_SENT_LEN> mon_sent;	// forward frames sent, for process()
+	uint32_t tc_epoch;					// us_ticker when TC was 0
+	uint8_t  f_backlog;					// a frame was waiting as the last one ended
+	uint32_t frame_end;					// when it ended, us_ticker
+	
+	typedef struct {
+		dali_answer_cb_t cb;
+		uint32_t frame;
+		uint8_t bits;
+		volatile uint8_t state;
+		uint8_t gen;            // makes stale handles detectable
+		uint8_t status;
+		uint8_t answer;
+	} query_slot_t;
+	query_slot_t queries[DALI_QUERY_SLOTS];
 	volatile uint8_t answer;           	// holds answer from slave
-	volatile uint8_t f_repeat;         	// flag command shall be repeated
+	volatile uint8_t f_repeat;         	// forward_frame goes out once more after this transfer
+	uint8_t tx_repeat_query;			// and its query, waiting meanwhile
 	volatile uint8_t f_busy;           	// flag DALI transfer busy
-	uint8_t f_dalitx;
 	uint8_t f_dalirx;
-	uint32_t err;
-	volatile uint32_t leds;
-	bool print;
-	uint32_t te_stop = 33;              // number of half cycles to the stop bit (changes for data width)
-
+	uint32_t err;						// last decode status, DALI_RX_*
+	uint32_t te_stop = 33;              // number of half cycles to the stop bit, 2 * bits + 1
+	
+	typedef struct {
+		uint16_t op;            // selector bit and data, as plan() takes it
+		uint64_t addrs;
+		uint8_t  cls;           // traffic class it was given in
+	} stage_t;
+	stage_t  stage[DALI_STAGE_OPS];		// commands waiting for flush()
+	uint8_t  stage_n;
+	uint8_t  stage_held;				// addresses held, at most one command each
+	uint64_t staged_addrs;
+	uint8_t  f_flush_posted;			// flush() already queued
+	uint8_t  f_flushing;
+	uint32_t last_frame;				// to spot configuration sent twice, DALI_NO_FRAME after other widths
+	uint32_t stage_commands;			// per address commands staged
+	uint32_t stage_frames;				// frames flush() sent for them
 	
-	Callback<void(TCPSocket *sock)> _client_handler;
+	uint8_t  learn_addr;				// learn_groups() progress
+	uint8_t  learn_lo;
+	uint8_t  learn_half;
+	uint8_t  learn_tries;
+	uint8_t  learn_ok;
+	uint64_t learn_present;
+	Callback<void()> learn_done;
 
+	
 	void init();
 	void init_timer();
 	void timer_isr();
-	void dali_decode();
-	void dali_shift_bit(uint8_t val);
-	void dali_send();
+	void rx_enable(void);
+	void rx_disable(void);
+	void rx_rise(void);
+	void rx_fall(void);
+	void rx_edge(uint32_t time, uint8_t level);
+	void rx_close(uint8_t kind, uint8_t tag);
+	void idle(void);
+	void backoff(uint32_t from);
+	void heard(uint8_t status, uint32_t data, uint8_t bits);
+	void monitor_frame(uint8_t kind, uint8_t status, uint32_t time, uint32_t length,
+	                   uint32_t data, uint8_t bits);
+	void isr_time(uint8_t kind, uint32_t start);
+	void stats_rate(void);
+	void dali_send(uint32_t frame, uint8_t query = DALI_NO_QUERY, uint8_t bits = DALI_FRAME_16,
+	               uint8_t twice = 0);
+	void dali_queue(uint32_t frame, uint8_t query = DALI_NO_QUERY, uint8_t bits = DALI_FRAME_16,
+	                uint8_t twice = 0);
+	int  query_send(uint32_t frame, uint8_t bits, uint8_t twice, dali_answer_cb_t cb);
+	bool dali_start();
+	int  tx_pick(uint32_t now);
+	uint8_t tx_after(uint8_t cls, uint16_t frame);
+	uint64_t tx_reach(uint16_t frame);
+	uint32_t tx_waiting(void);
+	uint32_t tx_room(void);
+	void query_done(uint8_t slot, uint8_t status, uint8_t answer);
+	bool query_slot_free(void);
+	bool dali_stage(uint16_t frame);
+	bool refused(dali_cmd_t cmd);
+	void learn_next(void);
+	void learn_answer(int status, uint8_t answer);
 	
 };
 
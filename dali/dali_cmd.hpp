@@ -0,0 +1,283 @@
+#ifndef MBED_DALI_CMD_H
+#define MBED_DALI_CMD_H
+
+/*
+	Forward frames for control gear, IEC 62386-102, built from names.
+
+	A dali_cmd_t is the 16 bit frame together with what the standard says
+	about it: whether gear only act on it when it arrives twice within
+	100 ms, and whether it asks for a backward frame.  Dali::send() and
+	Dali::query() take one and act on the flags as they are, nothing is
+	looked up on the way to the bus.
+
+	Addresses are typed.  dali_short() makes a dali_short_t, dali_group() a
+	dali_group_t and DALI_BROADCAST is a dali_broadcast_t; a number is none
+	of them.  The command builders take any of the three, so
+	dali_command(5, DALI_OFF) does not compile, and PROGRAM SHORT ADDRESS
+	only takes a short address.
+
+	Every builder is constexpr.  Where the compiler has to evaluate one,
+	in a static_assert, a constexpr variable, a case label or a template
+	argument, an address, scene or group out of range does not compile.
+	Evaluated at run time it is not masked into range: the command gets
+	DALI_FLAG_BAD, Dali::send() and Dali::query() refuse it and count it
+	in DALI_STAT_TX_QUEUE.  Tables of frames are best declared constexpr
+	so they are checked.
+
+	Address byte: YAAAAAAS for short address A, 100GGGGS for group G,
+	1111111S for broadcast and 1111110S for the unaddressed (edition 2).
+	S is the selector, clear for direct arc power and set for commands.
+	Special commands use address bytes 101CCCC1 and 110CCCC1 and carry
+	their data in the second byte.  Application extended commands, 0xE0
+	to 0xFE, mean what ENABLE DEVICE TYPE made them and carry no flags:
+	the caller picks send() or query().
+*/
+
+#include <type_traits>
+
+#define DALI_FLAG_TWICE    0x01    // gear only act on it sent twice
+#define DALI_FLAG_ANSWER   0x02    // a backward frame is expected
+#define DALI_FLAG_BAD      0x80    // built from a value out of range, never sent
+
+typedef struct {
+	uint16_t frame;
+	uint8_t  flags;
+} dali_cmd_t;
+
+/* Commands, the second byte with the selector set */
+enum {
+	DALI_OFF                   = 0x00,
+	DALI_UP                    = 0x01,
+	DALI_DOWN                  = 0x02,
+	DALI_STEP_UP               = 0x03,
+	DALI_STEP_DOWN             = 0x04,
+	DALI_RECALL_MAX            = 0x05,
+	DALI_RECALL_MIN            = 0x06,
+	DALI_STEP_DOWN_AND_OFF     = 0x07,
+	DALI_ON_AND_STEP_UP        = 0x08,
+	DALI_ENABLE_DAPC_SEQUENCE  = 0x09,
+	DALI_GO_TO_LAST_LEVEL      = 0x0A,
+	DALI_GO_TO_SCENE           = 0x10,    // + scene
+
+	DALI_RESET                 = 0x20,    // configuration, sent twice
+	DALI_STORE_ACTUAL_LEVEL    = 0x21,
+	DALI_SAVE_PERSISTENT       = 0x22,
+	DALI_SET_OPERATING_MODE    = 0x23,
+	DALI_RESET_MEMORY_BANK     = 0x24,
+	DALI_IDENTIFY_DEVICE       = 0x25,
+	DALI_SET_MAX_LEVEL         = 0x2A,    // DTR0 AS MAX LEVEL
+	DALI_SET_MIN_LEVEL         = 0x2B,
+	DALI_SET_FAIL_LEVEL        = 0x2C,
+	DALI_SET_POWER_ON_LEVEL    = 0x2D,
+	DALI_SET_FADE_TIME         = 0x2E,
+	DALI_SET_FADE_RATE         = 0x2F,
+	DALI_SET_EXT_FADE_TIME     = 0x30,
+	DALI_SET_SCENE             = 0x40,    // + scene, DTR0 AS SCENE
+	DALI_REMOVE_FROM_SCENE     = 0x50,    // + scene
+	DALI_ADD_TO_GROUP          = 0x60,    // + group
+	DALI_REMOVE_FROM_GROUP     = 0x70,    // + group
+	DALI_SET_SHORT_ADDRESS     = 0x80,    // DTR0 AS SHORT ADDRESS
+	DALI_ENABLE_WRITE_MEMORY   = 0x81,
+
+	DALI_QUERY_STATUS          = 0x90,    // queries, answered
+	DALI_QUERY_CONTROL_GEAR    = 0x91,
+	DALI_QUERY_LAMP_FAILURE    = 0x92,
+	DALI_QUERY_LAMP_POWER_ON   = 0x93,
+	DALI_QUERY_LIMIT_ERROR     = 0x94,
+	DALI_QUERY_RESET_STATE     = 0x95,
+	DALI_QUERY_MISSING_SHORT_ADDRESS = 0x96,
+	DALI_QUERY_VERSION         = 0x97,
+	DALI_QUERY_CONTENT_DTR0    = 0x98,
+	DALI_QUERY_DEVICE_TYPE     = 0x99,
+	DALI_QUERY_PHYSICAL_MIN    = 0x9A,
+	DALI_QUERY_POWER_FAILURE   = 0x9B,
+	DALI_QUERY_CONTENT_DTR1    = 0x9C,
+	DALI_QUERY_CONTENT_DTR2    = 0x9D,
+	DALI_QUERY_OPERATING_MODE  = 0x9E,
+	DALI_QUERY_LIGHT_SOURCE_TYPE = 0x9F,
+	DALI_QUERY_ACTUAL_LEVEL    = 0xA0,
+	DALI_QUERY_MAX_LEVEL       = 0xA1,
+	DALI_QUERY_MIN_LEVEL       = 0xA2,
+	DALI_QUERY_POWER_ON_LEVEL  = 0xA3,
+	DALI_QUERY_FAIL_LEVEL      = 0xA4,
+	DALI_QUERY_FADE            = 0xA5,    // fade time and rate
+	DALI_QUERY_MANUFACTURER_MODE = 0xA6,
+	DALI_QUERY_NEXT_DEVICE_TYPE = 0xA7,
+	DALI_QUERY_EXT_FADE_TIME   = 0xA8,
+	DALI_QUERY_GEAR_FAILURE    = 0xAA,
+	DALI_QUERY_SCENE_LEVEL     = 0xB0,    // + scene
+	DALI_QUERY_GROUPS_0_7      = 0xC0,
+	DALI_QUERY_GROUPS_8_15     = 0xC1,
+	DALI_QUERY_RANDOM_H        = 0xC2,
+	DALI_QUERY_RANDOM_M        = 0xC3,
+	DALI_QUERY_RANDOM_L        = 0xC4,
+	DALI_READ_MEMORY_LOCATION  = 0xC5,
+	DALI_QUERY_EXTENDED_VERSION = 0xFF    // after ENABLE DEVICE TYPE
+};
+
+/* Special commands, the address byte */
+enum {
+	DALI_TERMINATE             = 0xA1,
+	DALI_DTR0                  = 0xA3,
+	DALI_INITIALISE            = 0xA5,    // sent twice; data 0x00 all, 0xFF the unaddressed, AAAAAA1 one
+	DALI_RANDOMISE             = 0xA7,    // sent twice
+	DALI_COMPARE               = 0xA9,    // answered
+	DALI_WITHDRAW              = 0xAB,
+	DALI_PING                  = 0xAD,
+	DALI_SEARCHADDRH           = 0xB1,
+	DALI_SEARCHADDRM           = 0xB3,
+	DALI_SEARCHADDRL           = 0xB5,
+	DALI_PROGRAM_SHORT_ADDRESS = 0xB7,    // data AAAAAA1, or 0xFF to delete
+	DALI_VERIFY_SHORT_ADDRESS  = 0xB9,    // answered
+	DALI_QUERY_SHORT_ADDRESS   = 0xBB,    // answered
+	DALI_ENABLE_DEVICE_TYPE    = 0xC1,
+	DALI_DTR1                  = 0xC3,
+	DALI_DTR2                  = 0xC5,
+	DALI_WRITE_MEMORY_LOCATION = 0xC7,    // answered
+	DALI_WRITE_MEMORY_LOCATION_NO_REPLY = 0xC9
+};
+
+
+/* Addresses, by kind.  Only the builders below make them. */
+class dali_short_t {
+public:
+	uint8_t byte;           // address byte, selector clear
+	uint8_t bad;            // built from a number out of range
+private:
+	constexpr dali_short_t(uint8_t b, uint8_t x) : byte(b), bad(x) {}
+	friend constexpr dali_short_t dali_short(uint8_t addr);
+	friend dali_short_t dali_short_out_of_range(uint8_t addr);
+};
+
+class dali_group_t {
+public:
+	uint8_t byte;
+	uint8_t bad;
+private:
+	constexpr dali_group_t(uint8_t b, uint8_t x) : byte(b), bad(x) {}
+	friend constexpr dali_group_t dali_group(uint8_t group);
+	friend dali_group_t dali_group_out_of_range(uint8_t group);
+};
+
+class dali_broadcast_t {
+public:
+	explicit constexpr dali_broadcast_t(bool unaddressed) : byte(unaddressed ? 0xFC : 0xFE) {}
+	uint8_t byte;
+};
+
+constexpr dali_broadcast_t DALI_BROADCAST(false);
+constexpr dali_broadcast_t DALI_UNADDRESSED(true);
+
+/* Any of them, what the command builders take */
+class dali_addr_t {
+public:
+	constexpr dali_addr_t(dali_short_t a) : byte(a.byte), bad(a.bad) {}
+	constexpr dali_addr_t(dali_group_t a) : byte(a.byte), bad(a.bad) {}
+	constexpr dali_addr_t(dali_broadcast_t a) : byte(a.byte), bad(0) {}
+	uint8_t byte;
+	uint8_t bad;
+};
+
+/* A command's second byte, a name or dali_nth() of one */
+class dali_op_t {
+public:
+	constexpr dali_op_t(uint8_t o) : op(o), bad(0) {}
+	constexpr dali_op_t(uint8_t o, uint8_t x) : op(o), bad(x) {}
+	uint8_t op;
+	uint8_t bad;
+};
+
+
+/* Not constexpr: a builder the compiler evaluates that gets here stops
+   it.  Evaluated at run time they return a value marked bad. */
+inline dali_short_t dali_short_out_of_range(uint8_t) {
+	return dali_short_t(0, 1);
+}
+
+inline dali_group_t dali_group_out_of_range(uint8_t) {
+	return dali_group_t(0x80, 1);
+}
+
+inline dali_op_t dali_nth_out_of_range(uint8_t op) {
+	return dali_op_t(op, 1);
+}
+
+constexpr dali_short_t dali_short(uint8_t addr) {
+	return addr < 64 ? dali_short_t(addr << 1, 0) : dali_short_out_of_range(addr);
+}
+
+constexpr dali_group_t dali_group(uint8_t group) {
+	return group < 16 ? dali_group_t(0x80 | group << 1, 0) : dali_group_out_of_range(group);
+}
+
+/* A command's second byte with its scene or group number */
+constexpr dali_op_t dali_nth(uint8_t op, uint8_t n) {
+	return n < 16 ? dali_op_t(op | n) : dali_nth_out_of_range(op);
+}
+
+
+/* An address byte of a special command, not addressed to gear */
+constexpr bool dali_is_special(uint8_t a) {
+	return a >= 0xA0 && a <= 0xCB;
+}
+
+
+/* What the standard says about a frame, from the frame alone. */
+constexpr uint8_t dali_special_flags(uint8_t a) {
+	return (a == DALI_INITIALISE || a == DALI_RANDOMISE) ? DALI_FLAG_TWICE
+		: (a == DALI_COMPARE || a == DALI_VERIFY_SHORT_ADDRESS || a == DALI_QUERY_SHORT_ADDRESS
+			|| a == DALI_WRITE_MEMORY_LOCATION) ? DALI_FLAG_ANSWER : 0;
+}
+
+constexpr uint8_t dali_command_flags(uint8_t op) {
+	return (op >= DALI_RESET && op <= DALI_ENABLE_WRITE_MEMORY) ? DALI_FLAG_TWICE
+		: ((op >= DALI_QUERY_STATUS && op <= DALI_READ_MEMORY_LOCATION)
+			|| op == DALI_QUERY_EXTENDED_VERSION) ? DALI_FLAG_ANSWER : 0;
+}
+
+constexpr uint8_t dali_frame_flags(uint16_t frame) {
+	return dali_is_special(frame >> 8) ? dali_special_flags(frame >> 8)
+		: ((frame >> 8) & 1) ? dali_command_flags(frame & 0xFF) : 0;
+}
+
+
+/* Direct arc power, level 0..254, 255 MASK */
+constexpr dali_cmd_t dali_dapc(dali_addr_t addr, uint8_t level) {
+	return { (uint16_t)(addr.byte << 8 | level), (uint8_t)(addr.bad ? DALI_FLAG_BAD : 0) };
+}
+
+/* A command to an address */
+constexpr dali_cmd_t dali_command(dali_addr_t addr, dali_op_t op) {
+	return { (uint16_t)((addr.byte | 1) << 8 | op.op),
+		(uint8_t)((addr.bad || op.bad) ? DALI_FLAG_BAD : dali_command_flags(op.op)) };
+}
+
+/* A special command and its data */
+constexpr dali_cmd_t dali_special(uint8_t cmd, uint8_t data) {
+	return { (uint16_t)(cmd << 8 | data), dali_special_flags(cmd) };
+}
+
+/* One whose data is a short address, AAAAAA1: PROGRAM SHORT ADDRESS,
+   VERIFY SHORT ADDRESS, INITIALISE one device */
+constexpr dali_cmd_t dali_special(uint8_t cmd, dali_short_t addr) {
+	return { (uint16_t)(cmd << 8 | addr.byte | 1), (uint8_t)(addr.bad ? DALI_FLAG_BAD : dali_special_flags(cmd)) };
+}
+
+
+static_assert(dali_command(dali_short(5), DALI_QUERY_DEVICE_TYPE).frame == 0x0B99, "YAAAAAAS");
+static_assert(dali_command(dali_group(3), DALI_RECALL_MAX).frame == 0x8705, "100GGGGS");
+static_assert(dali_dapc(DALI_BROADCAST, 254).frame == 0xFEFE, "selector clear for DAPC");
+static_assert(dali_command(dali_short(0), dali_nth(DALI_ADD_TO_GROUP, 2)).flags == DALI_FLAG_TWICE,
+	"configuration is sent twice");
+static_assert(dali_command(DALI_BROADCAST, DALI_QUERY_STATUS).flags == DALI_FLAG_ANSWER, "queries are answered");
+static_assert(dali_special(DALI_INITIALISE, 0x00).flags == DALI_FLAG_TWICE, "INITIALISE twice");
+static_assert(dali_special(DALI_DTR0, DALI_RESET).flags == 0, "DTR0 data is not a command");
+static_assert(dali_special(DALI_PROGRAM_SHORT_ADDRESS, dali_short(63)).frame == 0xB77F, "AAAAAA1");
+static_assert(!std::is_convertible<int, dali_addr_t>::value && !std::is_convertible<int, dali_short_t>::value,
+	"a number is not an address");
+static_assert(!std::is_convertible<dali_group_t, dali_short_t>::value
+	&& !std::is_convertible<dali_broadcast_t, dali_short_t>::value, "nor is a group a short address");
+static_assert(dali_frame_flags(0xA500) == DALI_FLAG_TWICE && dali_frame_flags(0x0120) == DALI_FLAG_TWICE
+	&& dali_frame_flags(0x0020) == 0 && dali_frame_flags(0xBB00) == DALI_FLAG_ANSWER, "flags from the frame");
+
+#endif
@@ -0,0 +1,307 @@
+#include "mbed.h"
+#include "dali_commission.hpp"
+#include "EventQueue.h"
+
+/* DaliCommission.state */
+enum {
+	COMMISSION_IDLE = 0,
+	COMMISSION_RANDOMISE,   // waiting for the gear to pick random addresses
+	COMMISSION_PROBE,       // which kept point is the next device below?
+	COMMISSION_TOP,         // is anyone left at all?
+	COMMISSION_SEARCH,      // binary search between lo and hi
+	COMMISSION_VERIFY       // programmed, checking the address took
+};
+
+
+DaliCommission::DaliCommission(Dali *dali) : _dali(dali) {
+	state    = COMMISSION_IDLE;
+	assigned = 0;
+	compares = 0;
+	searches = 0;
+	failed   = 0;
+	shared   = 0;
+}
+
+
+bool DaliCommission::is_busy(void) {
+	return state != COMMISSION_IDLE;
+}
+
+
+/*
+	Function    : start()
+	Description : selects the gear and has them pick random addresses.  The
+	              second RANDOMISE goes out as a query so that its callback
+	              marks the end of the frame, the search starts
+	              DALI_RANDOMISE_MS after it.
+*/
+bool DaliCommission::start(Callback<void(int found)> done, bool all, uint64_t in_use) {
+	if (state != COMMISSION_IDLE || !_dali->queue)
+		return false;
+	
+	_done    = done;
+	taken    = all ? 0 : in_use;
+	assigned = 0;
+	compares = 0;
+	searches = 0;
+	failed   = 0;
+	shared   = 0;
+	shuffles = 0;
+	lo       = 0;
+	points_n = 0;
+	search   = ~0u;
+	_dali->groups.clear();
+	
+	if (all) {
+		send(dali_special(DALI_DTR0, 0xFF));        // everyone is unaddressed
+		send(dali_command(DALI_BROADCAST, DALI_SET_SHORT_ADDRESS));
+	}
+	send(dali_special(DALI_INITIALISE, all ? 0x00 : 0xFF));     // everyone or the unaddressed
+	
+	state = COMMISSION_RANDOMISE;
+	if (!query(dali_special(DALI_RANDOMISE, 0), &DaliCommission::randomised))
+		finish();
+	return true;
+}
+
+
+void DaliCommission::randomised(int, uint8_t) {
+	_dali->queue->call_in(DALI_RANDOMISE_MS, this, &DaliCommission::probe);
+}
+
+
+/*
+	Function    : probe()
+	Description : finds the smallest kept point that still has a device at
+	              or below it.  Devices are spread evenly, so the next one
+	              is usually well above the one just found: the points are
+	              binary searched rather than tried from the smallest up.
+	              If none answers, or none is kept, the top of the range is
+	              tried.
+*/
+void DaliCommission::probe(void) {
+	if (next_free() < 0 || lo > DALI_SEARCH_MAX) {
+		finish();
+		return;
+	}
+	state    = COMMISSION_PROBE;
+	probe_lo = 0;
+	probe_hi = points_n - 1;
+	hi_index = -1;
+	probe_next();
+}
+
+
+void DaliCommission::probe_next(void) {
+	if (probe_lo <= probe_hi) {
+		compare(points[(probe_lo + probe_hi) / 2]);
+	} else if (hi_index >= 0) {
+		points_n = hi_index;        // hi and everything below it are used up
+		state = COMMISSION_SEARCH;
+		search_next();
+	} else {
+		state = COMMISSION_TOP;
+		compare(DALI_SEARCH_MAX);
+	}
+}
+
+
+/*
+	Function    : compared()
+	Description : one step of the search.  Any reply to COMPARE is a yes,
+	              several gear answering at once garble it.  A yes during the
+	              binary search keeps the old upper bound as a point for
+	              later searches.  Whether the yes that set hi was garbled is
+	              kept: no device is left below lo, so if the search closes
+	              in on hi that answer came from several gear at hi.
+*/
+void DaliCommission::compared(int status, uint8_t) {
+	bool yes = (status != DALI_NO_ANSWER);
+	
+	if (yes)
+		f_garbled = (status == DALI_ANSWER_ERROR);
+	
+	switch (state) {
+	case COMMISSION_PROBE: {
+		int8_t k = (probe_lo + probe_hi) / 2;   // points[] is largest first
+		if (yes) {
+			hi       = point;
+			hi_index = k;
+			probe_lo = k + 1;
+		} else {
+			lo       = point + 1;
+			points_n = k;
+			probe_hi = k - 1;
+		}
+		probe_next();
+		return;
+	}
+	case COMMISSION_TOP:
+		if (!yes) {
+			finish();           // nobody left
+			return;
+		}
+		hi = point;
+		state = COMMISSION_SEARCH;
+		break;
+	default:
+		if (yes) {
+			push(hi);
+			hi = point;
+		} else {
+			lo = point + 1;
+		}
+		break;
+	}
+	search_next();
+}
+
+
+/* Halves the range, or programs the device once it is down to one random
+   address that only one device answered at. */
+void DaliCommission::search_next(void) {
+	if (lo < hi) {
+		compare(lo + (hi - lo) / 2);
+		return;
+	}
+	if (f_garbled) {
+		share();
+		return;
+	}
+	tries = 0;
+	program();
+}
+
+
+void DaliCommission::program(void) {
+	addr  = next_free();
+	state = COMMISSION_VERIFY;
+	set_search(hi);
+	send(dali_special(DALI_PROGRAM_SHORT_ADDRESS, dali_short(addr)));
+	if (!query(dali_special(DALI_VERIFY_SHORT_ADDRESS, dali_short(addr)), &DaliCommission::verified))
+		finish();
+}
+
+
+/* The device is withdrawn from the search whether or not it took the
+   address, one that never does would otherwise be found forever.  A
+   garbled answer is several devices that took it, the address goes back. */
+void DaliCommission::verified(int status, uint8_t) {
+	bool yes = (status == DALI_ANSWER);
+	
+	if (status == DALI_ANSWER_ERROR) {
+		send(dali_special(DALI_PROGRAM_SHORT_ADDRESS, 0xFF));     // no short address
+		share();
+		return;
+	}
+	if (!yes && ++tries < DALI_COMMISSION_TRIES) {
+		program();
+		return;
+	}
+	if (yes)
+		assigned |= DALI_ADDR(addr);
+	else
+		failed++;
+	
+	send(dali_special(DALI_WITHDRAW, 0));
+	lo = hi + 1;
+	probe();
+}
+
+
+/*
+	Function    : share()
+	Description : several gear hold the random address hi.  The gear still
+	              in the search pick new random addresses and the search
+	              starts over from 0, the kept points are no longer true.
+	              After DALI_COMMISSION_TRIES rounds the gear at hi are
+	              withdrawn and counted as failed, two of them at least.
+*/
+void DaliCommission::share(void) {
+	shared++;
+	if (++shuffles > DALI_COMMISSION_TRIES) {
+		failed += 2;
+		set_search(hi);
+		send(dali_special(DALI_WITHDRAW, 0));
+		lo = hi + 1;
+		probe();
+		return;
+	}
+	lo       = 0;
+	points_n = 0;
+	state    = COMMISSION_RANDOMISE;
+	if (!query(dali_special(DALI_RANDOMISE, 0), &DaliCommission::randomised))
+		finish();
+}
+
+
+void DaliCommission::finish(void) {
+	send(dali_special(DALI_TERMINATE, 0));
+	state = COMMISSION_IDLE;
+	
+	int found = 0;
+	for (uint64_t a = assigned; a; a &= a - 1)
+		found++;
+	if (_done)
+		_done(found);
+}
+
+
+/* Commissioning is background traffic, anything else on the bus goes first */
+void DaliCommission::send(dali_cmd_t cmd) {
+	uint8_t cls = _dali->set_class(DALI_CLASS_BACKGROUND);
+	_dali->send(cmd);
+	_dali->set_class(cls);
+}
+
+
+bool DaliCommission::query(dali_cmd_t cmd, void (DaliCommission::*fn)(int, uint8_t)) {
+	uint8_t cls = _dali->set_class(DALI_CLASS_BACKGROUND);
+	int handle  = _dali->query(cmd, callback(this, fn));
+	_dali->set_class(cls);
+	return handle >= 0;
+}
+
+
+/* Only the bytes of the search address that changed go on the bus. */
+void DaliCommission::set_search(uint32_t value) {
+	static const uint8_t cmd[3] = { DALI_SEARCHADDRH, DALI_SEARCHADDRM, DALI_SEARCHADDRL };
+	
+	for (int i = 0; i < 3; i++) {
+		int shift = 16 - 8 * i;
+		uint8_t b = value >> shift;
+		if (search > DALI_SEARCH_MAX || (uint8_t)(search >> shift) != b) {
+			send(dali_special(cmd[i], b));
+			searches++;
+		}
+	}
+	search = value;
+}
+
+
+void DaliCommission::compare(uint32_t value) {
+	set_search(value);
+	point = value;
+	compares++;
+	if (!query(dali_special(DALI_COMPARE, 0), &DaliCommission::compared))
+		finish();
+}
+
+
+/* Keeps a yes point, the largest is dropped when there is no room. */
+void DaliCommission::push(uint32_t value) {
+	if (points_n == DALI_COMMISSION_POINTS) {
+		memmove(points, points + 1, (points_n - 1) * sizeof(points[0]));
+		points_n--;
+	}
+	points[points_n++] = value;
+}
+
+
+int DaliCommission::next_free(void) {
+	for (int a = 0; a < DALI_ADDRESSES; a++) {
+		if (!((taken | assigned) & DALI_ADDR(a)))
+			return a;
+	}
+	return -1;
+}
@@ -0,0 +1,94 @@
+#ifndef MBED_DALI_COMMISSION_H
+#define MBED_DALI_COMMISSION_H
+
+#include "dali.hpp"
+
+/*
+	Gives control gear short addresses with the random address search of
+	IEC 62386-102: INITIALISE, RANDOMISE, then find the lowest random
+	address with COMPARE, program it, withdraw it, and repeat.
+
+	Every step is a query whose callback sends the next one, so it runs from
+	the bus's event queue and never blocks.  One engine per bus, buses
+	commission in parallel.  To keep bus time down:
+
+	  - SEARCHADDRH/M/L are only sent for the bytes that changed, the gear
+	    keep the rest.
+	  - Points that answered yes during one search are kept.  The next
+	    device lies above the one just found and at or below one of them,
+	    so the next search starts from the smallest that still answers yes,
+	    found by binary searching the points, instead of from 0xFFFFFF.
+
+	Two gear can draw the same random address.  Both answer COMPARE and
+	VERIFY at once, which garbles the reply, so a garbled answer that pins
+	the search to one address, or a garbled VERIFY, means the address is
+	shared.  Nothing is withdrawn, a short address just given out is taken
+	back, and the gear still in the search are RANDOMISEd and searched
+	again.  After DALI_COMMISSION_TRIES of those the devices are withdrawn
+	and counted in failed.
+*/
+
+#define DALI_RANDOMISE_MS        100   // gear have a new random address this long after RANDOMISE
+#define DALI_COMMISSION_POINTS   24    // yes points kept between searches
+#define DALI_COMMISSION_TRIES    3     // times a device is programmed, or a shared address re-RANDOMISEd, before giving up
+#define DALI_SEARCH_MAX          0xFFFFFF
+
+
+class DaliCommission {
+
+public:
+	DaliCommission(Dali *dali);
+
+	/* Starts commissioning, done gets the number of addresses given out.
+	   With all every device is readdressed from 0, otherwise only gear
+	   without a short address are, and the addresses in in_use are skipped.
+	   The bus's group table is cleared, run learn_groups() afterwards.
+	   Returns false if already running or the bus has no event queue. */
+	bool start(Callback<void(int found)> done, bool all = true, uint64_t in_use = 0);
+	bool is_busy(void);
+
+	uint64_t assigned;          // short addresses given out
+	uint32_t compares;          // COMPARE queries
+	uint32_t searches;          // SEARCHADDRH/M/L frames
+	uint32_t failed;            // devices that would not take an address
+	uint32_t shared;            // random addresses found held by several gear
+
+private:
+	Dali *_dali;
+	Callback<void(int found)> _done;
+	uint8_t  state;
+	uint64_t taken;
+
+	uint32_t lo;                // no device left below lo
+	uint32_t hi;                // some device at or below hi
+	uint32_t point;             // being compared
+	uint32_t search;            // SEARCHADDR the gear hold, > DALI_SEARCH_MAX when unknown
+	uint32_t points[DALI_COMMISSION_POINTS];   // yes points above hi, smallest last
+	uint8_t  points_n;
+	int8_t   probe_lo;          // points[] indices still to probe
+	int8_t   probe_hi;
+	int8_t   hi_index;          // smallest point that answered yes, -1 for none
+	uint8_t  addr;              // short address being programmed
+	uint8_t  tries;
+	uint8_t  shuffles;          // re-RANDOMISEs for shared addresses
+	uint8_t  f_garbled;         // the answer that set hi was garbled
+
+	void send(dali_cmd_t cmd);
+	bool query(dali_cmd_t cmd, void (DaliCommission::*fn)(int, uint8_t));
+	void set_search(uint32_t value);
+	void compare(uint32_t value);
+	void probe(void);
+	void probe_next(void);
+	void search_next(void);
+	void program(void);
+	void share(void);
+	void finish(void);
+	void push(uint32_t value);
+	int  next_free(void);
+
+	void randomised(int status, uint8_t answer);
+	void compared(int status, uint8_t answer);
+	void verified(int status, uint8_t answer);
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_decoder.hpp"
+
+#define NO_EDGE  0xFF      // _last_level before the first edge of a frame
+
+
+/*
+   Class       : DaliDecoder
+   Description : turns the time between consecutive edges into Manchester
+                 half bits and pairs them into data bits.
+
+				 As an example, consider the bit pattern "10" in the following
+				 Manchester encoded waveform.  A rising edge in the middle of
+				 a bit-period represents a "1" and a falling edge a "0".
+
+				   . bit-1 . bit-0 .
+				   .       .       .
+				 --+   +---+---+   .
+				   |   |   .   |   .
+				   +---+   .   +---+--
+				   .       .       .
+                   .  "1"  .  "0"  .
+
+				 The bus holds a level for either one half bit (TE) or two
+				 (2TE), so each interval between edges is classified
+				 against the MIN_TE/MAX_TE and MIN_2TE/MAX_2TE windows and
+				 contributes one or two half bits of the level it held.
+				 Anything outside the windows is a timing error, reported
+				 with the level that was held so that low and high
+				 violations can be told apart.
+
+				 Half bits then pair up: (low, high) is a "1" and
+				 (high, low) a "0", the first pair must be the start bit.
+				 When the frame ends on a "1" its second half runs into
+				 the stop bits without an edge, finish() supplies it.
+
+				 Only the level after the first edge is taken from the
+				 capture, later levels follow by alternation.  Reading the
+				 Rx pin in the ISR can race a following edge, the edge
+				 order cannot.
+
+				 Adaptive windows are the nominal ones scaled to the half
+				 bit time measured on the start bit, so gear running up to
+				 40% slow or fast still fit, and each interval moves the
+				 estimate a quarter of the way to what it measured.  A
+				 jittery edge then costs less of the window than against
+				 the fixed ones, which leave about 70 usec either side.
+*/
+void DaliDecoder::reset() {
+	_first_time = 0;
+	_last_time  = 0;
+	_last_level = NO_EDGE;
+	_status     = DALI_RX_OK;
+	_halves     = 0;
+	_first      = 0;
+	_data       = 0;
+	_te[0]      = 0;
+	_te[1]      = 0;
+}
+
+
+void DaliDecoder::half(uint8_t level) {
+	if (_status != DALI_RX_OK)
+		return;
+
+	if (_halves < 2) {
+		if (level != _halves)              // start bit is low then high
+			_status = DALI_RX_BAD_START;
+	} else if (_halves & 1) {
+		if (level == _first)
+			_status = DALI_RX_BAD_BIT;
+		else if (_halves > 2*32 + 1)
+			_status = DALI_RX_TOO_LONG;
+		else
+			_data = (_data << 1) | level;  // second half carries the value
+	} else {
+		_first = level;
+	}
+	_halves++;
+}
+
+
+void DaliDecoder::edge(uint32_t time, uint8_t level) {
+	if (_status != DALI_RX_OK)
+		return;
+
+	if (_last_level == NO_EDGE) {
+		if (level != DALI_EDGE_FALL)
+			_status = DALI_RX_BAD_START;
+		_last_level = DALI_EDGE_FALL;
+		_first_time = time;
+		_last_time = time;
+		return;
+	}
+
+	uint32_t held = time - _last_time;
+	uint8_t high = _last_level;
+	uint8_t n = adaptive ? classify_adaptive(held, high) : classify(held, high);
+
+	while (n--)
+		half(high);
+
+	_last_time = time;
+	_last_level = !high;
+}
+
+
+/* Half bits in an interval held at one level, by the nominal windows, or
+   0 with the timing error set. */
+uint8_t DaliDecoder::classify(uint32_t held, uint8_t high) {
+	if ((held > MIN_TE) && (held < MAX_TE))
+		return 1;
+	if ((held > MIN_2TE) && (held < MAX_2TE))
+		return 2;
+
+	if (held <= MIN_TE)
+		_status = high ? DALI_RX_SHORT_HIGH : DALI_RX_SHORT_LOW;
+	else if (held < MAX_2TE)
+		_status = high ? DALI_RX_MID_HIGH : DALI_RX_MID_LOW;
+	else
+		_status = high ? DALI_RX_LONG_HIGH : DALI_RX_LONG_LOW;
+	return 0;
+}
+
+
+/* The same, by windows around the half bit time of this frame at each
+   level.  The start bit's low half sets it for low.  Slow rising edges
+   shorten the high halves by as much as they stretch the low ones, so the
+   first high interval is only split into one or two half bits, halfway
+   between, and sets it for high. */
+uint8_t DaliDecoder::classify_adaptive(uint32_t held, uint8_t high) {
+	uint32_t te = _te[high];
+	uint32_t x = held * 16;
+	uint8_t n;
+
+	if (!_te[0]) {
+		if (held <= DALI_ADAPT_START_MIN)
+			_status = DALI_RX_SHORT_LOW;
+		else if (held >= DALI_ADAPT_START_MAX)
+			_status = DALI_RX_LONG_LOW;
+		else
+			_te[0] = held;
+		return _te[0] ? 1 : 0;
+	}
+
+	if (!te) {
+		te = _te[0];
+		if (x <= te * DALI_ADAPT_TE_MIN)
+			_status = DALI_RX_SHORT_HIGH;
+		else if (x >= te * DALI_ADAPT_2TE_MAX)
+			_status = DALI_RX_LONG_HIGH;
+		if (_status != DALI_RX_OK)
+			return 0;
+		n = (x < te * DALI_ADAPT_SPLIT) ? 1 : 2;
+		_te[1] = held / n;
+		return n;
+	}
+
+	if (x > te * DALI_ADAPT_TE_MIN && x < te * DALI_ADAPT_TE_MAX) {
+		n = 1;
+	} else if (x > te * DALI_ADAPT_2TE_MIN && x < te * DALI_ADAPT_2TE_MAX) {
+		n = 2;
+	} else {
+		if (x <= te * DALI_ADAPT_TE_MIN)
+			_status = high ? DALI_RX_SHORT_HIGH : DALI_RX_SHORT_LOW;
+		else if (x < te * DALI_ADAPT_2TE_MAX)
+			_status = high ? DALI_RX_MID_HIGH : DALI_RX_MID_LOW;
+		else
+			_status = high ? DALI_RX_LONG_HIGH : DALI_RX_LONG_LOW;
+		return 0;
+	}
+
+	_te[high] += ((int32_t)(held / n) - (int32_t)te) / 4;
+	return n;
+}
+
+
+uint8_t DaliDecoder::finish(uint32_t *data, uint8_t *bits) {
+	if (_status == DALI_RX_OK) {
+		if (_last_level == NO_EDGE)
+			_status = DALI_RX_EMPTY;
+		else if (_last_level == DALI_EDGE_FALL)
+			_status = DALI_RX_LONG_LOW;    // bus never came back up
+		else if (_halves & 1)
+			half(1);                       // frame ended on a "1"
+	}
+	if (_status == DALI_RX_OK && _halves < 4)
+		_status = DALI_RX_BAD_START;
+
+	uint8_t status = _status;
+	if (status == DALI_RX_OK) {
+		*data = _data;
+		*bits = _halves/2 - 1;
+	}
+	reset();
+	return status;
+}
+
+
+uint8_t DaliDecoder::decode(const dali_edge_t *edges, uint32_t count,
+                            uint32_t *data, uint8_t *bits, bool adaptive) {
+	DaliDecoder dec;
+	dec.adaptive = adaptive;
+	for (uint32_t i = 0; i < count; i++)
+		dec.edge(edges[i].time, edges[i].level);
+	return dec.finish(data, bits);
+}
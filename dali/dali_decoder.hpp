@@ -0,0 +1,102 @@
+#ifndef MBED_DALI_DECODER_H
+#define MBED_DALI_DECODER_H
+
+/*
+	Manchester decoder working on captured edge timestamps.
+
+	The timer ISR only records when each edge happened and which level the
+	bus went to.  A whole frame's edges are fed through DaliDecoder later,
+	outside the ISR, so the same code decodes live captures and recorded
+	traces.
+
+	With adaptive set, the default, the half bit windows follow the gear
+	instead of the nominal MIN_TE..MAX_2TE: the start bit's low half gives
+	the frame's half bit time, and each interval after it refines the
+	estimate, separately for low and high levels since slow rising edges
+	on a long bus make low halves longer than high ones.
+*/
+
+/* Adaptive windows, in 1/16ths of the estimated half bit */
+#define DALI_ADAPT_TE_MIN   10      // one half bit: 0.625 TE
+#define DALI_ADAPT_TE_MAX   22      //               1.375 TE
+#define DALI_ADAPT_2TE_MIN  26      // two:          1.625 TE
+#define DALI_ADAPT_2TE_MAX  38      //               2.375 TE
+#define DALI_ADAPT_SPLIT    19      // first high half: one or two, 1.1875 TE
+#define DALI_ADAPT_START_MIN  250   // usec, shortest start bit half accepted (TE - 40%)
+#define DALI_ADAPT_START_MAX  600   // usec, longest (TE + 44%)
+
+/* Bus level after the edge, or one of the markers the ISR puts in the ring. */
+#define DALI_EDGE_FALL     0x00
+#define DALI_EDGE_RISE     0x01
+#define DALI_EDGE_END      0x80    // end of an answer window
+#define DALI_EDGE_OVERRUN  0x40    // with DALI_EDGE_END: edges were dropped
+#define DALI_EDGE_IDLE     0x20    // with DALI_EDGE_END: a frame heard while idle
+#define DALI_EDGE_COLLISION 0x10   // with DALI_EDGE_END: the frame was given up after collisions
+#define DALI_EDGE_SENT     0x08    // with DALI_EDGE_END: the window's forward frame is in mon_sent
+
+typedef struct {
+	uint32_t time;    // capture register value, usec; with DALI_EDGE_END the us_ticker at TC 0
+	uint8_t  level;
+	uint8_t  tag;     // with DALI_EDGE_END: the query waiting on this window
+} dali_edge_t;
+
+/* Decode status, the timing errors say which level was out of range */
+enum {
+	DALI_RX_OK = 0,
+	DALI_RX_EMPTY,          // no edges at all
+	DALI_RX_SHORT_LOW,      // low time below MIN_TE
+	DALI_RX_SHORT_HIGH,
+	DALI_RX_MID_LOW,        // low time between MAX_TE and MIN_2TE
+	DALI_RX_MID_HIGH,
+	DALI_RX_LONG_LOW,       // low time above MAX_2TE
+	DALI_RX_LONG_HIGH,
+	DALI_RX_BAD_START,      // frame did not open with a start bit
+	DALI_RX_BAD_BIT,        // two equal half bits inside a data bit
+	DALI_RX_TOO_LONG,       // more than 32 data bits
+	DALI_RX_OVERRUN,        // the capture ring overflowed
+	DALI_RX_COLLISION,      // the forward frame kept colliding and was never sent
+	DALI_RX_STATUS_COUNT
+};
+
+
+class DaliDecoder {
+
+public:
+	DaliDecoder() : adaptive(true) { reset(); }
+
+	/* Start a new frame. */
+	void reset();
+
+	/* Feed the next edge of the frame. */
+	void edge(uint32_t time, uint8_t level);
+
+	/* Close the frame (the bus is idle) and return its status.  On
+	   DALI_RX_OK data holds the bits received, MSB first. */
+	uint8_t finish(uint32_t *data, uint8_t *bits);
+
+	/* Decode a complete edge train in one go. */
+	static uint8_t decode(const dali_edge_t *edges, uint32_t count,
+	                      uint32_t *data, uint8_t *bits, bool adaptive = true);
+
+	/* The frame so far: capture times of its first and latest edges. */
+	uint32_t first_edge() const { return _first_time; }
+	uint32_t last_edge() const { return _last_time; }
+
+	bool adaptive;          // track the half bit time, else fixed windows
+
+private:
+	uint32_t _first_time;
+	uint32_t _last_time;
+	uint8_t  _last_level;
+	uint8_t  _status;
+	uint8_t  _halves;       // half bits seen, including the start bit
+	uint8_t  _first;        // first half of the bit being assembled
+	uint32_t _data;
+	uint32_t _te[2];        // estimated half bit held low and high, usec, 0 before the start bit
+
+	void half(uint8_t level);
+	uint8_t classify(uint32_t held, uint8_t high);
+	uint8_t classify_adaptive(uint32_t held, uint8_t high);
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include "mbed.h"
+#include "dali_fade.hpp"
+#include "EventQueue.h"
+
+
+static uint32_t popcount64(uint64_t x) {
+	uint32_t n = 0;
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+
+DaliFade::DaliFade(Dali *bus, EventQueue *queue) {
+	_bus          = bus;
+	_queue        = queue;
+	_active       = 0;
+	_known        = 0;
+	credit        = 0;
+	last_ms       = 0;
+	f_tick_posted = 0;
+	share         = DALI_FADE_SHARE;
+	steps         = 0;
+	commands      = 0;
+	frames        = 0;
+	deferred      = 0;
+}
+
+
+void DaliFade::ramp(uint64_t addrs, uint8_t level, uint32_t ms) {
+	uint32_t now = (uint32_t)Kernel::get_ms_count();
+	
+	if (level > DALI_FADE_MAX)
+		level = DALI_FADE_MAX;
+	for (uint8_t a = 0; a < DALI_ADDRESSES; a++) {
+		if (!(addrs & DALI_ADDR(a)))
+			continue;
+		ramp_t &r = _ramps[a];
+		uint8_t from;
+		if (_known & DALI_ADDR(a))
+			from = r.sent;
+		else if (!_bus->shadow.get(a, DALI_SHADOW_LEVEL, &from))
+			from = level;
+		r.start = now;
+		r.ms    = ms;
+		r.from  = from;
+		r.to    = level;
+	}
+	_active |= addrs;
+	
+	if (!f_tick_posted) {
+		f_tick_posted = 1;
+		last_ms = now;
+		_queue->call(this, &DaliFade::tick);
+	}
+}
+
+
+void DaliFade::stop(uint64_t addrs) {
+	_active &= ~addrs;
+}
+
+
+bool DaliFade::level(uint8_t addr, uint8_t *level) {
+	if (addr >= DALI_ADDRESSES || !(_known & DALI_ADDR(addr)))
+		return false;
+	*level = _ramps[addr].sent;
+	return true;
+}
+
+
+/* Where the ramp should be at now, rounded to the nearest level. */
+uint8_t DaliFade::want(const ramp_t &r, uint32_t now) {
+	uint32_t t = now - r.start;
+	if (t >= r.ms)
+		return r.to;
+	int32_t span = (int32_t)r.to - r.from;
+	int32_t half = (span < 0) ? -(int32_t)r.ms / 2 : (int32_t)r.ms / 2;
+	return r.from + (span * (int32_t)t + half) / (int32_t)r.ms;
+}
+
+
+/* Short addresses a frame from groups.plan() reaches. */
+uint64_t DaliFade::reaches(uint16_t frame) {
+	uint8_t a = frame >> 8;
+	if (a >= 0xFE)
+		return _bus->groups.present;
+	if (a & 0x80)
+		return _bus->groups.members[(a >> 1) & 0xF];
+	return DALI_ADDR(a >> 1);
+}
+
+
+/* The ms the furthest behind of addrs is, as this tick found them. */
+uint32_t DaliFade::furthest(uint64_t addrs) {
+	uint32_t most = 0;
+	for (uint8_t a = 0; addrs; a++) {
+		if (addrs & DALI_ADDR(a)) {
+			if (_behind[a] > most)
+				most = _behind[a];
+			addrs &= ~DALI_ADDR(a);
+		}
+	}
+	return most;
+}
+
+
+/*
+	Function    : tick()
+	Description : one step of every ramp.  The fixtures not yet at the
+	              level they should be at are sorted into one DAPC command
+	              per level, and the commands go out furthest behind first
+	              while the budget lasts.  A command the budget only partly
+	              covers sends the frames reaching the furthest behind, and
+	              the rest waits.  Behind is measured in ms, not levels, so
+	              a steep ramp does not always beat a shallow one.
+*/
+void DaliFade::tick(void) {
+	uint32_t now = (uint32_t)Kernel::get_ms_count();
+	uint32_t frame_us, queued;
+	uint16_t planned[DALI_ADDRESSES + 1];
+	uint8_t n = 0;
+	
+	f_tick_posted = 0;
+	if (!_active)
+		return;
+	steps++;
+	
+	/* The budget, in frames */
+	if (!_bus->stat(DALI_STAT_FRAME_RATE, 1, &frame_us) || !frame_us)
+		frame_us = DALI_FRAME_US;
+	credit += (int32_t)((uint64_t)(now - last_ms) * 1000 * 256 * share / 100 / frame_us);
+	if (credit > DALI_FADE_BURST * 256)
+		credit = DALI_FADE_BURST * 256;
+	last_ms = now;
+	
+	/* One command per level wanted */
+	for (uint8_t a = 0; a < DALI_ADDRESSES; a++) {
+		if (!(_active & DALI_ADDR(a)))
+			continue;
+		ramp_t &r = _ramps[a];
+		uint8_t w = want(r, now);
+		uint32_t behind = 0xFFFFFFFF;   // never sent
+		if (_known & DALI_ADDR(a)) {
+			if (w == r.sent) {
+				if (w == r.to && now - r.start >= r.ms)
+					_active &= ~DALI_ADDR(a);
+				continue;
+			}
+			/* ms since the ramp passed the level sent, none if the level
+				sent is still ahead of the clock */
+			int32_t done = (r.to > r.from) ? r.sent - r.from : r.from - r.sent;
+			int32_t span = (r.to > r.from) ? r.to - r.from : r.from - r.to;
+			uint32_t at  = (done > 0) ? (uint32_t)done * r.ms / span : 0;
+			behind = (now - r.start > at) ? now - r.start - at : 0;
+		}
+		_behind[a] = behind;
+		uint8_t i;
+		for (i = 0; i < n && _steps[i].level != w; i++)
+			;
+		if (i == n) {
+			_steps[n].addrs = 0;
+			_steps[n].level = w;
+			_steps[n].behind = 0;
+			n++;
+		}
+		_steps[i].addrs |= DALI_ADDR(a);
+		if (behind > _steps[i].behind)
+			_steps[i].behind = behind;
+	}
+	
+	_bus->stat(DALI_STAT_TX_QUEUE, 0, &queued);
+	while (n) {
+		uint8_t best = 0;
+		for (uint8_t i = 1; i < n; i++) {
+			if (_steps[i].behind > _steps[best].behind)
+				best = i;
+		}
+		step_t s = _steps[best];
+		_steps[best] = _steps[--n];
+		
+		if (queued >= DALI_FADE_BACKLOG || credit < 256) {
+			deferred += popcount64(s.addrs);
+			continue;
+		}
+		
+		uint32_t count = _bus->groups.plan(s.addrs, s.level, planned, DALI_ADDRESSES + 1);
+		commands++;
+		while (count) {
+			if (credit < 256 || queued >= DALI_FADE_BACKLOG) {
+				deferred += popcount64(s.addrs);
+				break;
+			}
+			uint32_t j = 0, most = 0;
+			for (uint32_t k = 0; k < count; k++) {
+				uint32_t b = furthest(reaches(planned[k]) & s.addrs);
+				if (b >= most) {
+					most = b;
+					j = k;
+				}
+			}
+			uint16_t frame = planned[j];
+			planned[j] = planned[--count];
+			uint8_t cls = _bus->set_class(DALI_CLASS_SCHEDULED);
+			_bus->send(frame);
+			_bus->set_class(cls);
+			credit -= 256;
+			queued++;
+			frames++;
+			
+			uint64_t reached = reaches(frame) & s.addrs;
+			s.addrs &= ~reached;
+			_known  |= reached;
+			for (uint8_t a = 0; reached; a++) {
+				if (reached & DALI_ADDR(a)) {
+					_ramps[a].sent = s.level;
+					reached &= ~DALI_ADDR(a);
+				}
+			}
+		}
+	}
+	
+	if (_active) {
+		f_tick_posted = 1;
+		_queue->call_in(DALI_FADE_TICK, this, &DaliFade::tick);
+	} else if (done) {
+		done();
+	}
+}
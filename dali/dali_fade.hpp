@@ -0,0 +1,92 @@
+#ifndef MBED_DALI_FADE_H
+#define MBED_DALI_FADE_H
+
+#include "dali.hpp"
+
+/*
+	Level ramps for any number of fixtures on one bus at once, driven by
+	DAPC frames from the master.
+
+	Every DALI_FADE_TICK ms each fixture being ramped has a level it should
+	be at by now.  Fixtures that should be at the same level share one DAPC
+	command, which groups.plan() sends to as few groups or broadcasts as
+	reach exactly them, so fixtures ramped together cost one frame a step
+	between them.  Fixtures that drift apart cost more.
+
+	Ramps only take share percent of the bus.  The budget is worked out in
+	frames from the bus's measured time per frame (DALI_STAT_FRAME_RATE,
+	index 1).  A step that does not fit goes to the fixtures furthest
+	behind first, the rest catch up on a later step at a level further on,
+	so a slow bus gives coarser steps, not a longer ramp.  No step is
+	queued while DALI_FADE_BACKLOG frames are still waiting for the bus,
+	so a command given meanwhile waits for a frame or two, never for the
+	ramps.
+*/
+
+#define DALI_FADE_TICK     40     // ms between steps
+#define DALI_FADE_SHARE    50     // percent of the bus ramps take by default
+#define DALI_FADE_BACKLOG  2      // frames waiting for the bus that hold a step back
+#define DALI_FADE_BURST    4      // frames of budget saved up at most
+#define DALI_FADE_MAX      254    // highest DAPC level, 255 is MASK
+
+
+class DaliFade {
+
+public:
+	DaliFade(Dali *bus, EventQueue *queue);
+	
+	/* Ramps each short address in addrs from where it is to level over
+	   ms, replacing any ramp it is in.  Where it is is the level last sent
+	   by the ramps or the bus's shadow, with neither it goes straight to
+	   level. */
+	void ramp(uint64_t addrs, uint8_t level, uint32_t ms);
+	
+	/* Leaves the addresses at the level last sent. */
+	void stop(uint64_t addrs);
+	
+	uint64_t active(void) { return _active; }
+	
+	/* The level last sent to a short address, false if none was. */
+	bool level(uint8_t addr, uint8_t *level);
+	
+	uint8_t share;              // percent of the bus, 1..100
+	Callback<void()> done;      // the last ramp has ended
+	
+	uint32_t steps;             // ticks that had ramps to run
+	uint32_t commands;          // DAPC levels given to groups.plan()
+	uint32_t frames;            // frames sent
+	uint32_t deferred;          // fixtures a step left for later
+	
+private:
+	typedef struct {
+		uint32_t start;         // Kernel ms
+		uint32_t ms;
+		uint8_t  from;
+		uint8_t  to;
+		uint8_t  sent;          // level last sent
+	} ramp_t;
+	
+	typedef struct {
+		uint64_t addrs;
+		uint32_t behind;        // ms the furthest behind of addrs is
+		uint8_t  level;
+	} step_t;
+	
+	Dali *_bus;
+	EventQueue *_queue;
+	ramp_t _ramps[DALI_ADDRESSES];
+	step_t _steps[DALI_ADDRESSES];
+	uint32_t _behind[DALI_ADDRESSES];	// ms, this tick
+	uint64_t _active;
+	uint64_t _known;            // sent holds a level
+	int32_t  credit;            // frames of budget, 1/256ths
+	uint32_t last_ms;
+	uint8_t  f_tick_posted;
+	
+	void tick(void);
+	uint8_t want(const ramp_t &r, uint32_t now);
+	uint64_t reaches(uint16_t frame);
+	uint32_t furthest(uint64_t addrs);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "mbed.h"
+#include "dali_groups.hpp"
+#include "dali_cmd.hpp"
+
+
+static uint32_t popcount64(uint64_t x) {
+	uint32_t n = 0;
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+
+
+void DaliGroups::clear(void) {
+	present = 0;
+	known   = 0;
+	for (int g = 0; g < DALI_GROUPS; g++)
+		members[g] = 0;
+}
+
+
+void DaliGroups::set_present(uint64_t addrs) {
+	present = addrs;
+	known   = 1;
+	for (int g = 0; g < DALI_GROUPS; g++)
+		members[g] &= addrs;
+}
+
+
+void DaliGroups::set_groups(uint8_t addr, uint16_t groups) {
+	for (int g = 0; g < DALI_GROUPS; g++) {
+		if (groups & (1 << g))
+			members[g] |= DALI_ADDR(addr);
+		else
+			members[g] &= ~DALI_ADDR(addr);
+	}
+}
+
+
+/* The short addresses a frame's address byte reaches, as far as is known. */
+uint64_t DaliGroups::target(uint8_t a) {
+	if ((a & 0x80) == 0)
+		return DALI_ADDR((a >> 1) & 0x3F);
+	if ((a & 0xE0) == 0x80)
+		return members[(a >> 1) & 0xF];
+	if ((a & 0xFE) == 0xFE)
+		return present;
+	return 0;
+}
+
+
+/*
+	Function    : observe()
+	Description : keeps the group table in step with configuration the
+	              master sends: ADD TO GROUP, REMOVE FROM GROUP and RESET.
+	              Special commands (dali_is_special() address bytes) are not
+	              addressed to gear and are ignored.  Until a census the
+	              table is not kept, gear may be in groups the master never
+	              heard of.
+*/
+void DaliGroups::observe(uint16_t frame) {
+	uint8_t a   = frame >> 8;
+	uint8_t cmd = frame & 0xFF;
+
+	if (!known || !(a & 1) || dali_is_special(a))
+		return;                 // DAPC or special command
+
+	uint64_t t = target(a);
+	if (cmd >= DALI_ADD_TO_GROUP && cmd < DALI_REMOVE_FROM_GROUP) {
+		members[cmd & 0xF] |= t;
+	} else if (cmd >= DALI_REMOVE_FROM_GROUP && cmd < DALI_SET_SHORT_ADDRESS) {
+		members[cmd & 0xF] &= ~t;
+	} else if (cmd == DALI_RESET) {
+		for (int g = 0; g < DALI_GROUPS; g++)
+			members[g] &= ~t;
+	}
+	for (int g = 0; g < DALI_GROUPS; g++)
+		members[g] &= present;
+}
+
+
+/*
+	Function    : plan()
+	Description : once a census is known, covers addrs with a broadcast if
+	              it holds every present device, otherwise with groups that
+	              lie wholly inside what is still to be covered, largest
+	              first.  Short addresses cover the rest.  The groups chosen never overlap, so a
+	              command that is not idempotent (UP, STEP UP...) still
+	              reaches each device once.
+*/
+uint32_t DaliGroups::plan(uint64_t addrs, uint16_t op, uint16_t *frames, uint32_t max) {
+	uint32_t n = 0;
+	uint8_t s = (op >> 8) & 1;
+
+	if (known && present && (addrs & present) == present) {
+		addrs &= ~present;
+		if (n < max)
+			frames[n++] = (0xFE | s) << 8 | (op & 0xFF);
+	}
+
+	uint64_t left = addrs;
+	while (known && left && n < max) {
+		int best = -1;
+		uint32_t best_count = 1;    // a group of one saves nothing
+		for (int g = 0; g < DALI_GROUPS; g++) {
+			uint64_t m = members[g];
+			if (m && (m & left) == m) {
+				uint32_t c = popcount64(m);
+				if (c > best_count) {
+					best = g;
+					best_count = c;
+				}
+			}
+		}
+		if (best < 0)
+			break;
+		frames[n++] = (0x80 | (best << 1) | s) << 8 | (op & 0xFF);
+		left &= ~members[best];
+	}
+
+	for (uint8_t a = 0; left && n < max; a++) {
+		if (left & DALI_ADDR(a)) {
+			frames[n++] = ((a << 1) | s) << 8 | (op & 0xFF);
+			left &= ~DALI_ADDR(a);
+		}
+	}
+	return n;
+}
@@ -0,0 +1,53 @@
+#ifndef MBED_DALI_GROUPS_H
+#define MBED_DALI_GROUPS_H
+
+/*
+	What the master knows of the gear on one bus: which short addresses
+	answer and which of the 16 groups each belongs to.  plan() uses it to
+	send one command to a set of short addresses in as few frames as
+	possible, without reaching any gear outside the set.
+
+	Nothing is assumed until it is known.  Groups and broadcast are only
+	used once a census has accounted for every short address and its
+	groups.  From then on the ADD TO GROUP / REMOVE FROM GROUP frames the
+	master sends itself keep the table up to date.
+*/
+
+#define DALI_GROUPS      16
+#define DALI_ADDRESSES   64
+
+#define DALI_ADDR(a)     ((uint64_t)1 << (a))
+
+
+class DaliGroups {
+
+public:
+	DaliGroups() { clear(); }
+
+	/* Forget everything. */
+	void clear(void);
+
+	/* A census: addrs is every short address in use.  Until then, or after
+	   clear(), the planner never broadcasts. */
+	void set_present(uint64_t addrs);
+
+	/* QUERY GROUPS 0-7 and 8-15 of a present device. */
+	void set_groups(uint8_t addr, uint16_t groups);
+
+	/* Track a forward frame the master sent. */
+	void observe(uint16_t frame);
+
+	/* Frames that deliver op, the low 9 bits of a forward frame (selector
+	   bit and data), to exactly the short addresses in addrs.  Returns how
+	   many were written to frames, at most max. */
+	uint32_t plan(uint64_t addrs, uint16_t op, uint16_t *frames, uint32_t max);
+
+	uint64_t present;                 // short addresses known to be in use
+	uint64_t members[DALI_GROUPS];    // short addresses in each group
+	uint8_t  known;                   // present and members cover every device
+
+private:
+	uint64_t target(uint8_t addr_byte);
+};
+
+#endif
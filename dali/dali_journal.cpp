@@ -0,0 +1,124 @@
+#include "mbed.h"
+#include "dali_journal.hpp"
+#include "EventQueue.h"
+
+
+DaliJournal::DaliJournal(EventQueue *queue, Callback<void(const uint8_t *data, uint32_t len)> write) {
+	_queue       = queue;
+	_write       = write;
+	fill_len     = 0;
+	fill         = 0;
+	f_writing    = 0;
+	f_write_ok   = 0;
+	f_flush      = 0;
+	missed       = 0;
+	gen          = 0;
+	records      = 0;
+	lost         = 0;
+	writes       = 0;
+	write_errors = 0;
+}
+
+
+void DaliJournal::start(void) {
+	dali_log_t r = { us_ticker_read(), DALI_LOG_MAGIC, DALI_LOG_START, DALI_LOG_VERSION, 0, 0 };
+	add(r);
+}
+
+
+/* Everything the master sent and got back, and frames heard that did not
+   decode; frames heard intact are other controllers' business. */
+void DaliJournal::frame(const dali_mon_t &f) {
+	uint8_t kind   = f.info & 3;
+	uint8_t status = f.info >> 4;
+	
+	if (kind == DALI_MON_DROPPED || (kind == DALI_MON_HEARD && status == DALI_RX_OK))
+		return;
+	
+	dali_log_t r = { f.time, f.data, kind, f.bits, status, (uint8_t)((f.info >> 2) & 3) };
+	add(r);
+}
+
+
+/*
+	Function    : add()
+	Description : appends a record, after the buffer's time anchor and any
+	              loss still to report.  A full buffer goes to the store if
+	              the store is free, else the record is lost.
+*/
+void DaliJournal::add(const dali_log_t &r) {
+	uint32_t need = (1 + (missed ? 1 : 0) + (fill_len ? 0 : 1)) * DALI_LOG_RECORD;
+	
+	if (fill_len + need > DALI_LOG_BUF) {
+		if (f_writing) {
+			missed++;
+			lost++;
+			return;
+		}
+		submit();
+	}
+	
+	if (!fill_len) {
+		dali_log_t t = { us_ticker_read(), (uint32_t)time(NULL), DALI_LOG_TIME, 0, 0, 0 };
+		put(t);
+		_queue->call_in(DALI_LOG_FLUSH * 1000, this, &DaliJournal::flush_due, gen);
+	}
+	if (missed) {
+		dali_log_t l = { us_ticker_read(), missed, DALI_LOG_LOST, 0, 0, 0 };
+		put(l);
+		missed = 0;
+	}
+	put(r);
+	records++;
+}
+
+
+/* Both ends are little endian, records go in as they are. */
+void DaliJournal::put(const dali_log_t &r) {
+	memcpy((uint8_t *)buf[fill] + fill_len, &r, DALI_LOG_RECORD);
+	fill_len += DALI_LOG_RECORD;
+}
+
+
+void DaliJournal::flush(void) {
+	if (!fill_len)
+		return;
+	if (f_writing)
+		f_flush = 1;
+	else
+		submit();
+}
+
+
+void DaliJournal::flush_due(uint32_t g) {
+	if (g == gen)
+		flush();
+}
+
+
+void DaliJournal::submit(void) {
+	f_writing = 1;
+	f_flush   = 0;
+	writes++;
+	gen++;
+	_write((const uint8_t *)buf[fill], fill_len);
+	fill ^= 1;
+	fill_len = 0;
+}
+
+
+void DaliJournal::written(bool ok) {
+	f_write_ok = ok;
+	_queue->call(this, &DaliJournal::write_done);
+}
+
+
+/* The store has the buffer back.  One that filled meanwhile, or whose
+   time was up, goes next. */
+void DaliJournal::write_done(void) {
+	f_writing = 0;
+	if (!f_write_ok)
+		write_errors++;
+	if (f_flush || missed)
+		flush();
+}
@@ -0,0 +1,73 @@
+#ifndef MBED_DALI_JOURNAL_H
+#define MBED_DALI_JOURNAL_H
+
+#include "dali.hpp"
+#include "dali_log.hpp"
+
+/*
+	Append only journal of the frames the master sent, the answers it got
+	and the frames that failed to decode, as dali_log_t records.
+
+	Records go into one of two RAM buffers while the other is being
+	written, and the store only sees whole buffers, DALI_LOG_BUF bytes at a
+	time, or a part filled one once it has waited DALI_LOG_FLUSH seconds.
+	The store writes on its own low priority thread and calls written()
+	when done, so the file system's cost per write never holds up the
+	event queue.  Should both buffers be full the records that follow are
+	counted and reported in a DALI_LOG_LOST record.
+
+	Frames come from DaliMonitor's tap.
+*/
+
+#define DALI_LOG_BUF      (170 * DALI_LOG_RECORD)  // 2040 bytes per store write
+#define DALI_LOG_FLUSH    60                       // seconds a part filled buffer waits at most
+
+
+class DaliJournal {
+	
+public:
+	/* write() starts appending and returns, the store calls written()
+	   once the buffer may be reused. */
+	DaliJournal(EventQueue *queue, Callback<void(const uint8_t *data, uint32_t len)> write);
+	
+	/* Marks a boot in the journal, once the clock is set. */
+	void start(void);
+	
+	/* A monitor record, thread context. */
+	void frame(const dali_mon_t &f);
+	
+	/* Hands the part filled buffer to the store now. */
+	void flush(void);
+	
+	/* From the store, in any context: the last write has finished. */
+	void written(bool ok);
+	
+	/* Records not yet stored */
+	bool pending(void) { return f_writing || fill_len; }
+	
+	uint32_t records;           // logged
+	uint32_t lost;              // lost to full buffers
+	uint32_t writes;            // store writes
+	uint32_t write_errors;
+	
+private:
+	EventQueue *_queue;
+	Callback<void(const uint8_t *data, uint32_t len)> _write;
+	
+	uint32_t buf[2][DALI_LOG_BUF / 4];	// word aligned
+	uint32_t fill_len;			// bytes in buf[fill]
+	uint8_t  fill;
+	volatile uint8_t f_writing;	// the other buffer is with the store
+	uint8_t  f_write_ok;
+	uint8_t  f_flush;			// flush once the store is done
+	uint32_t missed;			// lost since the last DALI_LOG_LOST record
+	uint32_t gen;				// flush timers armed before the last write are stale
+	
+	void add(const dali_log_t &r);
+	void put(const dali_log_t &r);
+	void submit(void);
+	void flush_due(uint32_t g);
+	void write_done(void);
+};
+
+#endif
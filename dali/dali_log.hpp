@@ -0,0 +1,46 @@
+#ifndef MBED_DALI_LOG_H
+#define MBED_DALI_LOG_H
+
+#include <stdint.h>
+
+/*
+	Journal record, as DaliJournal appends them to its file and
+	tools/dali_journal reads them back: DALI_LOG_RECORD bytes, little
+	endian, no header.
+
+	Each store write opens with a DALI_LOG_TIME record holding the RTC
+	seconds and the us_ticker together.  The records after it carry the
+	us_ticker only, their time is the anchor's seconds plus the ticks since
+	it: to the second absolutely, to the microsecond against each other.
+	A write covers at most DALI_LOG_FLUSH seconds, well inside the
+	ticker's 71 minute wrap.
+
+	Kept free of mbed headers for the reader.
+*/
+
+#define DALI_LOG_RECORD   12
+#define DALI_LOG_MAGIC    0x4C4E4A44    // "DJNL", data of DALI_LOG_START
+#define DALI_LOG_VERSION  1
+
+enum {
+	DALI_LOG_SENT = 0,      // forward frame the master sent, or gave up with DALI_RX_COLLISION
+	DALI_LOG_ANSWER,        // what came back in its answer window, decoded or not
+	DALI_LOG_HEARD,         // a frame another device sent that did not decode
+	DALI_LOG_LOST,          // data: records lost to a store that fell behind
+	DALI_LOG_TIME,          // data: RTC seconds when usec was read
+	DALI_LOG_START,         // data: DALI_LOG_MAGIC, bits: DALI_LOG_VERSION, at each boot
+	DALI_LOG_KINDS
+};
+
+typedef struct {
+	uint32_t usec;          // us_ticker at the start bit, or when written
+	uint32_t data;          // frame or answer, 0 if it did not decode
+	uint8_t  kind;          // DALI_LOG_*
+	uint8_t  bits;
+	uint8_t  status;        // DALI_RX_*
+	uint8_t  bus;
+} dali_log_t;
+
+static_assert(sizeof(dali_log_t) == DALI_LOG_RECORD, "dali_log_t is the file format");
+
+#endif
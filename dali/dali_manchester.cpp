@@ -0,0 +1,11 @@
+#include "mbed.h"
+#include "dali_manchester.hpp"
+
+#define DALI_M1(n)  dali_manchester_byte(n)
+#define DALI_M4(n)  DALI_M1(n), DALI_M1((n)+1), DALI_M1((n)+2), DALI_M1((n)+3)
+#define DALI_M16(n) DALI_M4(n), DALI_M4((n)+4), DALI_M4((n)+8), DALI_M4((n)+12)
+#define DALI_M64(n) DALI_M16(n), DALI_M16((n)+16), DALI_M16((n)+32), DALI_M16((n)+48)
+
+constexpr uint16_t dali_manchester_lut[256] = {
+	DALI_M64(0), DALI_M64(64), DALI_M64(128), DALI_M64(192)
+};
@@ -0,0 +1,58 @@
+#ifndef MBED_DALI_MANCHESTER_H
+#define MBED_DALI_MANCHESTER_H
+
+/*
+	Manchester expansion of forward frames.
+
+	A frame is expanded once, before it is sent, into a bitmap of half bit
+	levels in transmission order: bit 0 is the first half of the start bit,
+	bit 1 the second half, then two bits for each data bit, MSB first.  All
+	bits after the frame are 1 so the stop bits and the settling time that
+	follow drive the bus idle.
+
+	Per DALI a "1" is low then high, a "0" is high then low, so in the
+	bitmap a data bit b becomes (!b, b).
+
+	Forward frames are 16 bits for control gear, 24 bits for control
+	devices and their events, and 25 bits.  The start bit, the data and
+	the stop bits of a 25 bit frame take 56 half bits, so any of them fits
+	the 64 bit map.
+*/
+
+/* Expand one byte, MSB first, into 16 half bits (LSB is sent first). */
+constexpr uint16_t dali_manchester_byte(uint8_t b, int i = 0) {
+	return (i == 8) ? 0 :
+		((((b >> (7 - i)) & 1) ? 2u : 1u) << (2*i)) | dali_manchester_byte(b, i + 1);
+}
+
+static_assert(dali_manchester_byte(0x00) == 0x5555, "all zero bits are high-low");
+static_assert(dali_manchester_byte(0xFF) == 0xAAAA, "all one bits are low-high");
+static_assert(dali_manchester_byte(0x80) == 0x5556, "MSB is sent first");
+
+/* dali_manchester_byte() for every byte value, built at compile time */
+extern const uint16_t dali_manchester_lut[256];
+
+/* Half bit bitmap for a 16 bit forward frame. */
+inline uint64_t dali_manchester_frame(uint16_t frame) {
+	return 2                                                       // start bit
+		| ((uint64_t)dali_manchester_lut[frame >> 8] << 2)
+		| ((uint64_t)dali_manchester_lut[frame & 0xFF] << 18)
+		| (~(uint64_t)0 << 34);                                    // stop and idle
+}
+
+/* Half bit bitmap for a frame of any width up to 30 bits.  Bits above
+   the last whole byte go first, from the tail of their byte's expansion. */
+inline uint64_t dali_manchester_frame(uint32_t frame, uint8_t bits) {
+	uint8_t  odd = bits & 7;
+	uint8_t  at  = 2 + 2*odd;
+	uint64_t map = 2                                               // start bit
+		| ((uint64_t)(dali_manchester_lut[(frame >> (bits - odd)) & 0xFF] >> (16 - 2*odd)) << 2);
+
+	for (int8_t shift = bits - odd - 8; shift >= 0; shift -= 8) {
+		map |= (uint64_t)dali_manchester_lut[(frame >> shift) & 0xFF] << at;
+		at  += 16;
+	}
+	return map | (~(uint64_t)0 << at);                             // stop and idle
+}
+
+#endif
@@ -0,0 +1,194 @@
+#include "mbed.h"
+#include "dali_monitor.hpp"
+#include "EventQueue.h"
+
+
+DaliMonitor::DaliMonitor() {
+	client          = 0;
+	queue           = 0;
+	_buses          = 0;
+	_server         = 0;
+	f_server_posted = 0;
+	f_client_posted = 0;
+	lost            = 0;
+	tx_len          = 0;
+	frames          = 0;
+	dropped         = 0;
+}
+
+
+/*
+	Function    : add()
+	Description : registers the next bus and sets it monitoring.  Set queue
+	              first: a bus without an event queue of its own is given the
+	              monitor's.  The bus may be a DaliRouter's as well.
+*/
+int DaliMonitor::add(Dali *bus) {
+	if (_buses == DALI_MON_BUSES)
+		return -1;
+	
+	port_t &port = _ports[_buses];
+	port.monitor = this;
+	port.bus     = _buses;
+	
+	if (!bus->queue)
+		bus->queue = queue;
+	bus->monitor(callback(&port, &port_t::frame));
+	return _buses++;
+}
+
+
+void DaliMonitor::attach_server(TCPSocket *server) {
+	_server = server;
+	_server->set_blocking(false);
+	_server->sigio(callback(this, &DaliMonitor::server_event));
+	server_event();         // a connection may already be waiting
+}
+
+
+void DaliMonitor::server_event(void) {
+	if (queue && !f_server_posted) {
+		f_server_posted = 1;
+		queue->call(this, &DaliMonitor::server_sigio, _server);
+	}
+}
+
+
+void DaliMonitor::client_event(void) {
+	if (queue && !f_client_posted) {
+		f_client_posted = 1;
+		queue->call(this, &DaliMonitor::client_sigio, client);
+	}
+}
+
+
+/*
+	Function    : server_sigio()
+	Description : accepts a client and queues the stream header.  One client
+	              is served at a time, a new connection replaces the old one
+	              and starts from the frames that follow.
+*/
+void DaliMonitor::server_sigio(TCPSocket *socket) {
+	nsapi_error_t err;
+	
+	if (socket == _server)
+		f_server_posted = 0;
+	
+	TCPSocket *sock = socket->accept(&err);
+	if (err != NSAPI_ERROR_OK)
+		return;
+	
+	if (client)
+		close();
+	
+	client = sock;
+	client->set_blocking(false);
+	
+	static const uint8_t magic[4] = { 'D', 'M', 'O', 'N' };
+	memcpy(tx, magic, sizeof(magic));
+	tx[4]  = DALI_MON_VERSION;
+	tx[5]  = DALI_MON_RECORD;
+	tx[6]  = _buses;
+	tx[7]  = 0;
+	tx_len = DALI_MON_HEADER;
+	
+	if (_server) {
+		client->sigio(callback(this, &DaliMonitor::client_event));
+		f_client_posted = 0;
+	}
+	flush();
+}
+
+
+/*
+	Function    : client_sigio()
+	Description : the socket has room, or the client closed.  Anything the
+	              client sends is read and ignored.
+*/
+void DaliMonitor::client_sigio(TCPSocket *socket) {
+	uint8_t discard[16];
+	nsapi_size_or_error_t szerr;
+	
+	f_client_posted = 0;
+	if (!socket || socket != client)
+		return;             // posted for a connection that has since closed
+	
+	while ((szerr = socket->recv(discard, sizeof(discard))) > 0)
+		;
+	if (szerr != NSAPI_ERROR_WOULD_BLOCK) {
+		close();            // 0 when the client closed, else an error
+		return;
+	}
+	flush();
+}
+
+
+/* A frame from one of the buses, from its process(). */
+void DaliMonitor::record(uint8_t bus, const dali_mon_t &f) {
+	dali_mon_t m = f;
+	m.info = (m.info & ~0x0C) | (bus << 2);
+	if (tap)
+		tap(m);
+	if (!client)
+		return;
+	
+	report_lost();
+	if (lost || ring.full()) {
+		lost++;
+		dropped++;
+		return;
+	}
+	
+	ring.push(m);
+	frames++;
+	flush();
+}
+
+
+/* Records lost go ahead of the next one as soon as there is room. */
+void DaliMonitor::report_lost(void) {
+	if (!lost || ring.full())
+		return;
+	
+	dali_mon_t d = { us_ticker_read(), lost, 0, 0, DALI_MON_INFO(DALI_MON_DROPPED, 0, DALI_RX_OK) };
+	ring.push(d);
+	lost = 0;
+}
+
+
+/* Moves records from the ring to tx and sends as much as the socket will
+   take.  Both ends are little endian, records go out as they are. */
+void DaliMonitor::flush(void) {
+	while (client) {
+		dali_mon_t m;
+		while (tx_len + DALI_MON_RECORD <= sizeof(tx) && ring.pop(m)) {
+			memcpy(tx + tx_len, &m, DALI_MON_RECORD);
+			tx_len += DALI_MON_RECORD;
+		}
+		report_lost();
+		if (!tx_len)
+			return;
+		
+		nsapi_size_or_error_t szerr = client->send(tx, tx_len);
+		if (szerr > 0) {
+			tx_len -= szerr;
+			memmove(tx, tx + szerr, tx_len);
+		} else if (szerr == NSAPI_ERROR_WOULD_BLOCK) {
+			return;         // sigio when there is room
+		} else {
+			close();
+		}
+	}
+}
+
+
+void DaliMonitor::close(void) {
+	client->close();
+	client = 0;
+	tx_len = 0;
+	lost   = 0;
+	
+	dali_mon_t m;
+	while (ring.pop(m))
+		;
+}
@@ -0,0 +1,83 @@
+#ifndef MBED_DALI_MONITOR_H
+#define MBED_DALI_MONITOR_H
+
+#include "dali.hpp"
+
+/*
+	Bus monitor.
+
+	Every frame on the buses added, forward and backward, whoever sent it,
+	is streamed to one client on a TCP socket as it is decoded.  The stream
+	opens with a DALI_MON_HEADER byte header:
+
+		"DMON", version, DALI_MON_RECORD, buses, 0
+
+	then carries dali_mon_t records, DALI_MON_RECORD bytes each, little
+	endian, with the bus number in info.  Records wait in a fixed ring for
+	the socket; when the client falls behind the ring fills and the frames
+	that do not fit are counted, then reported in one DALI_MON_DROPPED
+	record, timed when it was written, as soon as there is room again.
+	Nothing is allocated or formatted per frame, and nothing is kept while
+	no client is connected.
+*/
+
+#define DALI_MON_RING     256   // records waiting for the socket, a power of two
+#define DALI_MON_TX       32    // records handed to the socket at once
+#define DALI_MON_HEADER   8
+#define DALI_MON_VERSION  1
+#define DALI_MON_BUSES    4     // bus numbers that fit info
+
+
+class DaliMonitor {
+	
+public:
+	DaliMonitor();
+	
+	/* Monitors the bus and returns its number, or -1 if all are taken.
+	   The bus's process() must run from queue. */
+	int add(Dali *bus);
+	
+	/* Takes a listening socket and hooks its sigio, and that of the
+	   connection it accepts, to queue, as DaliRouter does. */
+	void attach_server(TCPSocket *server);
+	void server_sigio(TCPSocket *socket);
+	void client_sigio(TCPSocket *socket);
+	
+	TCPSocket *client;
+	EventQueue *queue;
+	
+	/* Every record as it is taken, with its bus, client or not */
+	Callback<void(const dali_mon_t &frame)> tap;
+	
+	uint32_t frames;            // records taken for a client
+	uint32_t dropped;           // lost to a full ring
+	
+private:
+	typedef struct port_t {
+		DaliMonitor *monitor;
+		uint8_t bus;
+	
+		void frame(const dali_mon_t &f) { monitor->record(bus, f); }
+	} port_t;
+	
+	port_t _ports[DALI_MON_BUSES];
+	uint8_t _buses;
+	
+	TCPSocket *_server;
+	volatile uint8_t f_server_posted;	// server_sigio() already queued
+	volatile uint8_t f_client_posted;	// client_sigio() already queued
+	
+	DaliRing<dali_mon_t, DALI_MON_RING> ring;
+	uint32_t lost;						// dropped since the last DROPPED record
+	uint8_t  tx[DALI_MON_TX * DALI_MON_RECORD];	// bytes not yet sent
+	uint32_t tx_len;
+	
+	void record(uint8_t bus, const dali_mon_t &f);
+	void report_lost(void);
+	void server_event(void);
+	void client_event(void);
+	void flush(void);
+	void close(void);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef MBED_DALI_RING_H
+#define MBED_DALI_RING_H
+
+/*
+	Single producer, single consumer ring buffer.
+
+	One side may run in an interrupt handler and the other in thread context
+	without any locking: the producer only ever writes _head and the consumer
+	only ever writes _tail.  The memory barrier makes sure an element is in
+	the buffer before the index that publishes it.
+
+	N must be a power of two.  The indices run freely and are masked on
+	access, so all N slots are usable.
+*/
+template <typename T, uint32_t N>
+class DaliRing {
+
+	static_assert(N && !(N & (N - 1)), "DaliRing size must be a power of two");
+
+public:
+	DaliRing() : _head(0), _tail(0) {}
+
+	/* Producer side: returns false if the ring is full. */
+	bool push(const T &item) {
+		uint32_t head = _head;
+		if (head - _tail == N)
+			return false;
+		_buf[head & (N - 1)] = item;
+		__DMB();
+		_head = head + 1;
+		return true;
+	}
+
+	/* Consumer side: returns false if the ring is empty. */
+	bool pop(T &item) {
+		uint32_t tail = _tail;
+		if (_head == tail)
+			return false;
+		item = _buf[tail & (N - 1)];
+		__DMB();
+		_tail = tail + 1;
+		return true;
+	}
+
+	/* Consumer side: the oldest item, left in the ring. */
+	bool peek(T &item) const {
+		if (_head == _tail)
+			return false;
+		item = _buf[_tail & (N - 1)];
+		return true;
+	}
+
+	/* Producer side: item i counting from the oldest, false past the
+	   newest.  The consumer may take it meanwhile, but only the producer
+	   ever overwrites it, so what is read is whole. */
+	bool at(uint32_t i, T &item) const {
+		uint32_t tail = _tail;
+		if (i >= _head - tail)
+			return false;
+		item = _buf[(tail + i) & (N - 1)];
+		return true;
+	}
+
+	bool empty() const { return _head == _tail; }
+	bool full() const { return (_head - _tail) == N; }
+	uint32_t count() const { return _head - _tail; }
+	uint32_t size() const { return N; }
+
+private:
+	T _buf[N];
+	volatile uint32_t _head;
+	volatile uint32_t _tail;
+};
+
+#endif
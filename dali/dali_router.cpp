@@ -0,0 +1,377 @@
+#include "mbed.h"
+#include "dali_router.hpp"
+#include "EventQueue.h"
+
+
+DaliRouter::DaliRouter() {
+	client          = 0;
+	queue           = 0;
+	_buses          = 0;
+	_server         = 0;
+	f_server_posted = 0;
+	f_client_posted = 0;
+	net_rx_len      = 0;
+	net_tx_len      = 0;
+	net_owed        = 0;
+	events_sent     = 0;
+	events_dropped  = 0;
+}
+
+
+/*
+	Function    : add()
+	Description : registers the next bus.  Set queue first: a bus without
+	              an event queue of its own is given the router's, and its
+	              tx_ready is taken over to resume records held back for
+	              lack of room.  The bus is set listening for events.
+*/
+int DaliRouter::add(Dali *bus) {
+	if (_buses == DALI_MAX_BUSES)
+		return -1;
+	
+	port_t &port = _ports[_buses];
+	port.router  = this;
+	port.dali    = bus;
+	port.drop    = 0;
+	port.pushed  = 0;
+	for (int i = 0; i < DALI_QUERY_SLOTS; i++)
+		port.tickets[i].port = &port;
+	
+	if (!bus->queue)
+		bus->queue = queue;
+	bus->tx_ready = callback(this, &DaliRouter::tx_ready);
+	bus->listen(callback(&port, &port_t::event));
+	return _buses++;
+}
+
+
+Dali *DaliRouter::bus(uint8_t n) {
+	return (n < _buses) ? _ports[n].dali : 0;
+}
+
+
+void DaliRouter::turn_on(uint8_t bus, uint8_t addr) {
+	if (bus < _buses)
+		_ports[bus].dali->turn_on(addr);
+}
+
+void DaliRouter::turn_off(uint8_t bus, uint8_t addr) {
+	if (bus < _buses)
+		_ports[bus].dali->turn_off(addr);
+}
+
+int DaliRouter::query(uint8_t bus, uint16_t frame, dali_answer_cb_t cb) {
+	if (bus >= _buses)
+		return -1;
+	return _ports[bus].dali->query(frame, cb);
+}
+
+void DaliRouter::broadcast(uint8_t command) {
+	for (uint8_t i = 0; i < _buses; i++)
+		_ports[i].dali->broadcast(command);
+}
+
+bool DaliRouter::is_busy(void) {
+	for (uint8_t i = 0; i < _buses; i++) {
+		if (_ports[i].dali->is_busy())
+			return true;
+	}
+	return false;
+}
+
+
+/*
+	Function    : attach_server()
+	Description : makes the listening socket non-blocking and has its sigio
+	              post server_sigio() to queue, which must be set first.
+
+	              sigio runs in the network stack's context, so the handlers
+	              only ever post to the queue and the socket work happens in
+	              the thread dispatching it.  A handler still queued is not
+	              posted again, a burst of signals costs one event.
+*/
+void DaliRouter::attach_server(TCPSocket *server) {
+	_server = server;
+	_server->set_blocking(false);
+	_server->sigio(callback(this, &DaliRouter::server_event));
+	server_event();         // a connection may already be waiting
+}
+
+
+void DaliRouter::server_event(void) {
+	if (queue && !f_server_posted) {
+		f_server_posted = 1;
+		queue->call(this, &DaliRouter::server_sigio, _server);
+	}
+}
+
+
+void DaliRouter::client_event(void) {
+	if (queue && !f_client_posted) {
+		f_client_posted = 1;
+		queue->call(this, &DaliRouter::client_sigio, client);
+	}
+}
+
+
+/* A bus finished a transfer, records held back may fit now. */
+void DaliRouter::tx_ready(void) {
+	if (client && net_rx_len >= DALI_NET_RECORD)
+		client_sigio(client);
+}
+
+
+/*
+	Function    : server_sigio()
+	Description : accepts the building controller's connection on the
+	              listening socket.  One controller is served at a time, a
+	              new connection replaces the old one.  The connection stays
+	              open for any number of records.
+*/
+void DaliRouter::server_sigio(TCPSocket *socket) {
+	nsapi_error_t err;
+	
+	if (socket == _server)
+		f_server_posted = 0;
+	
+	TCPSocket *sock = socket->accept(&err);
+	if (err != NSAPI_ERROR_OK)
+		return;             // nothing waiting, or a failed handshake
+	
+	if (client)
+		net_close();
+	
+	client = sock;
+	client->set_blocking(false);
+	eventFlags.set(FLAG_CLIENT_CONNECT);
+	if (_server) {
+		client->sigio(callback(this, &DaliRouter::client_event));
+		f_client_posted = 0;  // one queued for the old connection does not count
+		client_event();       // records may have arrived with the handshake
+	}
+}
+
+
+/*
+	Function    : client_sigio()
+	Description : sends any responses waiting, then reads dali_payload_t
+	              records and queues as many as the buses can take.
+
+	              Records need not arrive whole, the tail of a read is kept
+	              for the next one.  Records are queued in order, so one for
+	              a full bus holds back the rest: they stay in net_rx and
+	              nothing more is read, and TCP flow control holds the
+	              controller back.  tx_ready() calls back in here as the bus
+	              frees up.
+*/
+void DaliRouter::client_sigio(TCPSocket *socket) {
+	nsapi_size_or_error_t szerr;
+	
+	f_client_posted = 0;
+	if (!socket || socket != client)
+		return;             // posted for a connection that has since closed
+	
+	net_flush();
+	
+	while (client) {
+		if (net_rx_len < DALI_NET_RX_BUF) {
+			szerr = socket->recv(net_rx + net_rx_len, DALI_NET_RX_BUF - net_rx_len);
+			if (szerr > 0) {
+				net_rx_len += szerr;
+			} else if (szerr != NSAPI_ERROR_WOULD_BLOCK) {
+				net_close();    // 0 when the controller closed, else an error
+				return;
+			}
+		}
+	
+		uint32_t used = 0;
+		while (net_rx_len - used >= DALI_NET_RECORD) {
+			dali_payload_t cmd;
+			memcpy(&cmd, net_rx + used, DALI_NET_RECORD);
+			if (!put(cmd))
+				break;
+			used += DALI_NET_RECORD;
+		}
+		if (used == 0)
+			break;              // waiting for data, or for room on the bus
+	
+		net_rx_len -= used;
+		memmove(net_rx, net_rx + used, net_rx_len);
+	}
+}
+
+
+/*
+	Function    : put()
+	Description : hands the record to the bus it names.  With response_req
+	              the answer comes back through that bus's port, which also
+	              needs room for the response.  A query the bus's shadow can
+	              answer never goes on the bus, nor does a counter read,
+	              net_local() answers them.  A record for a bus that does
+	              not exist is answered DALI_ANSWER_ERROR at once if it
+	              asks for a response, and dropped otherwise.
+*/
+bool DaliRouter::put(dali_payload_t dali_cmd, uint8_t cls) {
+	if (dali_cmd.control.bus >= _buses) {
+		if (!dali_cmd.control.response_req)
+			return true;
+		if (net_tx_len/DALI_NET_RECORD + net_owed >= DALI_NET_TX_BUF)
+			return false;       // no room for the response yet
+		net_owed++;
+		net_respond(NULL, dali_cmd, DALI_ANSWER_ERROR, 0);
+		net_flush();
+		return true;
+	}
+	
+	port_t &port = _ports[dali_cmd.control.bus];
+	uint8_t was  = port.dali->set_class(cls);
+	bool ok      = put_bus(port, dali_cmd);
+	port.dali->set_class(was);
+	return ok;
+}
+
+
+bool DaliRouter::put_bus(port_t &port, dali_payload_t dali_cmd) {
+	if (!dali_cmd.control.response_req)
+		return port.dali->put(dali_cmd, dali_answer_cb_t());
+	
+	if (port.pending.full())
+		return false;
+	if (net_tx_len/DALI_NET_RECORD + net_owed >= DALI_NET_TX_BUF)
+		return false;       // no room for the response yet
+	
+	/* A counter read, answered here */
+	if (!dali_cmd.control.is_req) {
+		uint32_t value = 0;
+		uint8_t index = dali_cmd.command & 0x7F;
+		int status = port.dali->stat(dali_cmd.address, index, &value) ? DALI_ANSWER : DALI_ANSWER_ERROR;
+		if (dali_cmd.command & 0x80)
+			value >>= 24;
+		dali_cmd.address = value >> 16;
+		dali_cmd.command = value >> 8;
+		net_local(&port, dali_cmd, status, value);
+		return true;
+	}
+	
+	uint8_t ans;
+	uint16_t frame = (dali_cmd.address << 8) | dali_cmd.command;
+	bool frame_16 = dali_cmd.control.status != DALI_NET_FRAME_24;
+	if (frame_16 && !dali_cmd.control.repeat && port.dali->shadow.lookup(frame, &ans)) {
+		net_local(&port, dali_cmd, DALI_ANSWER, ans);
+		return true;
+	}
+	
+	ticket_t &t = port.tickets[port.pushed & (DALI_QUERY_SLOTS - 1)];
+	t.done = 0;
+	if (!port.dali->put(dali_cmd, callback(&t, &ticket_t::answered)))
+		return false;
+	port.pending.push(dali_cmd);
+	port.pushed++;
+	net_owed++;
+	return true;
+}
+
+
+/* A response the bus is not needed for: it goes out at once, or, if answers
+   from the bus are still owed on that port, waits behind them. */
+void DaliRouter::net_local(port_t *port, dali_payload_t rsp, int status, uint8_t ans) {
+	net_owed++;
+	if (port->pending.empty()) {
+		net_respond(port, rsp, status, ans);
+		net_flush();
+	} else {
+		rsp.control.is_rsp = 1;     // answered, waiting its turn
+		rsp.control.status = status;
+		rsp.response       = ans;
+		port->pending.push(rsp);
+		port->pushed++;
+	}
+}
+
+
+/* Runs when one of a port's tickets is answered.  Responses go back in
+   the order the requests came, so everything answered at the head of
+   pending goes out, locally answered or by the bus. */
+void DaliRouter::net_answer(port_t *port) {
+	dali_payload_t rsp;
+	
+	while (port->pending.peek(rsp)) {
+		ticket_t &t = port->tickets[(port->pushed - port->pending.count()) & (DALI_QUERY_SLOTS - 1)];
+		if (rsp.control.is_rsp) {
+			net_respond(port, rsp, rsp.control.status, rsp.response);
+		} else if (t.done) {
+			net_respond(port, rsp, t.status, t.answer);
+			t.done = 0;
+		} else {
+			break;
+		}
+		port->pending.pop(rsp);
+	}
+	net_flush();
+}
+
+
+/* An event message heard on a bus goes straight to the controller.  Room
+   owed to responses is kept for them, an event without room is dropped. */
+void DaliRouter::net_event(port_t *port, uint32_t event) {
+	dali_payload_t rec;
+	
+	if (!client || net_tx_len/DALI_NET_RECORD + net_owed >= DALI_NET_TX_BUF) {
+		events_dropped++;
+		return;
+	}
+	
+	memset(&rec, 0, sizeof(rec));
+	rec.control.bus = port - _ports;
+	rec.address     = event >> 16;
+	rec.command     = event >> 8;
+	rec.response    = event;
+	memcpy(net_tx + net_tx_len, &rec, DALI_NET_RECORD);
+	net_tx_len += DALI_NET_RECORD;
+	events_sent++;
+	net_flush();
+}
+
+
+/* Queues the response record to a request, unless its connection has gone. */
+void DaliRouter::net_respond(port_t *port, dali_payload_t rsp, int status, uint8_t ans) {
+	net_owed--;
+	if (port && port->drop) {
+		port->drop--;
+		return;
+	}
+	
+	rsp.control.is_req   = 0;
+	rsp.control.is_rsp   = 1;
+	rsp.control.status   = status;
+	rsp.response         = (status == DALI_ANSWER) ? ans : 0;
+	memcpy(net_tx + net_tx_len, &rsp, DALI_NET_RECORD);
+	net_tx_len += DALI_NET_RECORD;
+}
+
+
+/* Sends as much of net_tx as the socket will take. */
+void DaliRouter::net_flush(void) {
+	if (!client || !net_tx_len)
+		return;
+	
+	nsapi_size_or_error_t szerr = client->send(net_tx, net_tx_len);
+	if (szerr > 0) {
+		net_tx_len -= szerr;
+		memmove(net_tx, net_tx + szerr, net_tx_len);
+	} else if (szerr != NSAPI_ERROR_WOULD_BLOCK) {
+		net_close();
+	}
+}
+
+
+/* Answers still owed to the connection are dropped as they arrive. */
+void DaliRouter::net_close(void) {
+	client->close();
+	client = 0;
+	eventFlags.clear(FLAG_CLIENT_CONNECT);
+	net_rx_len = 0;
+	net_tx_len = 0;
+	for (uint8_t i = 0; i < _buses; i++)
+		_ports[i].drop = _ports[i].pending.count();
+}
@@ -0,0 +1,125 @@
+#ifndef MBED_DALI_ROUTER_H
+#define MBED_DALI_ROUTER_H
+
+#include "dali.hpp"
+
+/*
+	Several Dali buses behind one controller.
+
+	Each bus is its own Dali instance with its own timer, so frames go out
+	on all of them at once.  Devices are addressed as (bus, short address)
+	and the command socket picks the bus from the record's control byte.
+	Every bus listens while idle, and the event messages input devices send
+	go to the controller as they are heard.
+*/
+
+#define DALI_MAX_BUSES    4   // bus numbers that fit dali_ctrl_t
+#define DALI_NET_RX_BUF   64  // bytes read from the client in one go, a multiple of DALI_NET_RECORD
+#define DALI_NET_TX_BUF   64  // responses waiting to go back, records
+
+#define FLAG_SOCKET_ACCEPT  (1<<0)
+#define FLAG_SOCKET_CLOSED  (1<<1)
+#define FLAG_CLIENT_CONNECT (1<<2)
+
+
+class DaliRouter {
+	
+public:
+	DaliRouter();
+	
+	/* Adds a bus and returns its number, or -1 if all are taken.  The
+	   router's queue is shared with the bus. */
+	int add(Dali *bus);
+	Dali *bus(uint8_t n);
+	uint8_t buses(void) { return _buses; }
+	
+	/* (bus, short address) commands */
+	void turn_on(uint8_t bus, uint8_t addr);
+	void turn_off(uint8_t bus, uint8_t addr);
+	int query(uint8_t bus, uint16_t frame, dali_answer_cb_t cb);
+	
+	/* Every bus at once */
+	void broadcast(uint8_t command);
+	bool is_busy(void);
+	
+	/* Command socket.  attach_server() takes a listening socket and hooks
+	   its sigio, and that of the connection it accepts, to queue: nothing
+	   is polled, server_sigio() accepts the controller's connection and
+	   client_sigio() streams records in and responses out when the network
+	   stack signals.  Both are safe to call when nothing is pending. */
+	void attach_server(TCPSocket *server);
+	void server_sigio(TCPSocket *socket);
+	void client_sigio(TCPSocket *socket);
+	
+	/* Queue one request record on the bus it names, in traffic class cls,
+	   see Dali::set_class().  Returns false, without sending anything, if
+	   that bus has no room for it yet.  A bus that does not exist answers
+	   DALI_ANSWER_ERROR. */
+	bool put(dali_payload_t dali_cmd, uint8_t cls = DALI_CLASS_INTERACTIVE);
+	
+	TCPSocket *client;
+	EventQueue *queue;
+	
+	uint32_t events_sent;       // event messages passed to the controller
+	uint32_t events_dropped;    // heard with no controller, or no room for them
+	
+private:
+	
+	/* Per bus: requests waiting for an answer, in the order they came.
+	   Those answered without the bus are marked is_rsp and hold their
+	   status and response.  The bus's answers land in the ticket in step
+	   with each request, a frame queued behind one of a later traffic
+	   class may be answered after requests that came later. */
+	struct port_t;
+	typedef struct ticket_t {
+		port_t *port;
+		uint8_t done;
+		uint8_t status;
+		uint8_t answer;
+	
+		void answered(int s, uint8_t ans) {
+			status = s;
+			answer = ans;
+			done   = 1;
+			port->router->net_answer(port);
+		}
+	} ticket_t;
+	
+	typedef struct port_t {
+		DaliRouter *router;
+		Dali *dali;
+		DaliRing<dali_payload_t, DALI_QUERY_SLOTS> pending;
+		ticket_t tickets[DALI_QUERY_SLOTS];
+		uint32_t pushed;            // requests ever put in pending
+		uint32_t drop;              // answers owed to a connection that has gone
+	
+		void event(uint32_t e) { router->net_event(this, e); }
+	} port_t;
+	
+	port_t _ports[DALI_MAX_BUSES];
+	uint8_t _buses;
+	
+	EventFlags eventFlags;
+	TCPSocket *_server;
+	volatile uint8_t f_server_posted;	// server_sigio() already queued
+	volatile uint8_t f_client_posted;	// client_sigio() already queued
+	
+	uint8_t  net_rx[DALI_NET_RX_BUF];	// bytes from the client, not yet queued
+	uint32_t net_rx_len;
+	uint8_t  net_tx[DALI_NET_TX_BUF * DALI_NET_RECORD];	// responses not yet sent
+	uint32_t net_tx_len;
+	uint32_t net_owed;					// responses still to come, all buses
+	
+	void server_event(void);
+	void client_event(void);
+	void tx_ready(void);
+	bool put_bus(port_t &port, dali_payload_t dali_cmd);
+	void net_answer(port_t *port);
+	void net_event(port_t *port, uint32_t event);
+	void net_local(port_t *port, dali_payload_t rsp, int status, uint8_t answer);
+	void net_respond(port_t *port, dali_payload_t rsp, int status, uint8_t answer);
+	void net_flush(void);
+	void net_close(void);
+};
+
+#endif
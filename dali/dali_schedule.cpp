@@ -0,0 +1,197 @@
+#include "mbed.h"
+#include "dali_schedule.hpp"
+#include "EventQueue.h"
+
+
+DaliSchedule::DaliSchedule(DaliRouter *router, EventQueue *queue) {
+	_router    = router;
+	_queue     = queue;
+	utc_offset = 0;
+	running    = 0;
+	gen        = 0;
+	ticks      = 0;
+	fired      = 0;
+	examined   = 0;
+	retries    = 0;
+	skipped    = 0;
+	partial    = 0;
+	clear();
+}
+
+
+void DaliSchedule::clear(void) {
+	for (uint32_t i = 0; i < DALI_SCHED_BUCKETS; i++)
+		buckets[i] = DALI_SCHED_NONE;
+	for (uint32_t i = 0; i < DALI_SCHED_EVENTS; i++) {
+		events[i].used = 0;
+		events[i].next = (i + 1 < DALI_SCHED_EVENTS) ? i + 1 : DALI_SCHED_NONE;
+	}
+	free_list = 0;
+	_count    = 0;
+	cursor    = DALI_SCHED_NONE;
+}
+
+
+/* Events of one minute fire in the order they were added.  Adding walks
+   the bucket to its end, ticks never pay for it. */
+int DaliSchedule::add(uint8_t hour, uint8_t minute, uint8_t days, uint8_t bus,
+                      uint8_t target, uint8_t action, uint8_t level) {
+	if (hour > 23 || minute > 59 || !(days & DALI_EVERY_DAY) || action > DALI_SCHED_OFF)
+		return -1;
+	if (target >= DALI_TARGET_GROUP(16) && target != DALI_TARGET_BROADCAST)
+		return -1;
+	if (free_list == DALI_SCHED_NONE)
+		return -1;
+	
+	uint16_t id = free_list;
+	dali_sched_t &e = events[id];
+	free_list = e.next;
+	
+	uint16_t slot = hour * 60 + minute;
+	e.minute = slot;
+	e.action = action;
+	e.used   = 1;
+	e.days   = days & DALI_EVERY_DAY;
+	e.bus    = bus;
+	e.target = target;
+	e.level  = level;
+	e.next   = DALI_SCHED_NONE;
+	
+	uint16_t *link = &buckets[slot % DALI_SCHED_BUCKETS];
+	while (*link != DALI_SCHED_NONE)
+		link = &events[*link].next;
+	*link = id;
+	_count++;
+	return id;
+}
+
+
+bool DaliSchedule::remove(int id) {
+	if (id < 0 || id >= DALI_SCHED_EVENTS || !events[id].used)
+		return false;
+	
+	dali_sched_t &e = events[id];
+	uint16_t *link = &buckets[e.minute % DALI_SCHED_BUCKETS];
+	while (*link != id)
+		link = &events[*link].next;
+	*link = e.next;
+	
+	if (cursor == id)
+		cursor = e.next;    // it was about to fire, NONE if it was the last
+	
+	e.used    = 0;
+	e.next    = free_list;
+	free_list = id;
+	_count--;
+	return true;
+}
+
+
+/* Minute of the week now, Sunday 00:00 is 0, and the second within it. */
+uint32_t DaliSchedule::now_minute(uint32_t *second) {
+	uint32_t t = (uint32_t)time(NULL) + utc_offset;
+	uint32_t day = t / 86400;
+	
+	*second = t % 60;
+	return ((day + 4) % 7) * DALI_SCHED_DAY + (t % 86400) / 60;    // 1 Jan 1970 was a Thursday
+}
+
+
+void DaliSchedule::start(void) {
+	uint32_t second;
+	
+	done    = now_minute(&second);
+	cursor  = DALI_SCHED_NONE;
+	partial = 0;
+	running = 1;
+	gen++;
+	_queue->call_in((60 - second) * 1000, this, &DaliSchedule::tick, gen);
+}
+
+
+void DaliSchedule::stop(void) {
+	running = 0;
+	gen++;
+}
+
+
+/*
+	Function    : tick()
+	Description : fires every minute since the last one handled, then posts
+	              itself for the start of the next.  A bus without room
+	              leaves the rest of the minute for a retry shortly after.
+*/
+void DaliSchedule::tick(uint8_t tick_gen) {
+	uint32_t second;
+	
+	if (!running || tick_gen != gen)
+		return;
+	
+	uint32_t now = now_minute(&second);
+	while (done != now) {
+		uint32_t gap = (now + DALI_SCHED_WEEK - done) % DALI_SCHED_WEEK;
+		if (gap > DALI_SCHED_CATCHUP && !partial) {
+			skipped += gap;
+			done = now;
+			break;
+		}
+	
+		uint16_t minute = (done + 1) % DALI_SCHED_WEEK;
+		if (!fire(minute)) {
+			retries++;
+			_queue->call_in(DALI_SCHED_RETRY_MS, this, &DaliSchedule::tick, gen);
+			return;
+		}
+		done = minute;
+		ticks++;
+	}
+	
+	_queue->call_in((60 - second) * 1000, this, &DaliSchedule::tick, gen);
+}
+
+
+/* Sends the events of one minute of the week that apply on its day,
+   from cursor if an earlier try ran out of room.  False if it did again.
+   The bucket also holds other minutes of the day, those are passed over. */
+bool DaliSchedule::fire(uint16_t minute) {
+	uint8_t day = DALI_DAY(minute / DALI_SCHED_DAY);
+	uint16_t of_day = minute % DALI_SCHED_DAY;
+	uint16_t i = partial ? cursor : buckets[of_day % DALI_SCHED_BUCKETS];
+	
+	for (; i != DALI_SCHED_NONE; i = events[i].next) {
+		examined++;
+		if (events[i].minute != of_day || !(events[i].days & day))
+			continue;
+		if (!send(events[i])) {
+			cursor  = i;
+			partial = 1;
+			return false;
+		}
+		fired++;
+	}
+	cursor  = DALI_SCHED_NONE;
+	partial = 0;
+	return true;
+}
+
+
+bool DaliSchedule::send(const dali_sched_t &e) {
+	dali_payload_t rec;
+	
+	memset(&rec, 0, sizeof(rec));
+	rec.control.is_req = 1;
+	rec.control.bus    = e.bus;
+	
+	dali_addr_t addr = (e.target == DALI_TARGET_BROADCAST) ? dali_addr_t(DALI_BROADCAST)
+		: (e.target >= DALI_TARGET_GROUP(0)) ? dali_addr_t(dali_group(e.target - DALI_TARGET_GROUP(0)))
+		: dali_addr_t(dali_short(e.target));
+	
+	dali_cmd_t cmd;
+	if (e.action == DALI_SCHED_LEVEL)
+		cmd = dali_dapc(addr, e.level);
+	else
+		cmd = dali_command(addr, (e.action == DALI_SCHED_ON) ? DALI_RECALL_MAX : DALI_OFF);
+	rec.address = cmd.frame >> 8;
+	rec.command = cmd.frame & 0xFF;
+	return _router->put(rec, DALI_CLASS_SCHEDULED);
+}
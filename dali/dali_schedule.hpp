@@ -0,0 +1,126 @@
+#ifndef MBED_DALI_SCHEDULE_H
+#define MBED_DALI_SCHEDULE_H
+
+#include "dali_router.hpp"
+
+/*
+	Weekly switching schedule for any number of fixtures.
+
+	Each event is a minute of the day, the days of the week it applies on,
+	a (bus, target) and what to do: switch on (RECALL MAX LEVEL), switch
+	off, or go to a level (DAPC).  The target is a short address, a group
+	or the whole bus.
+
+	Events sit in a hashed timing wheel of DALI_SCHED_BUCKETS buckets keyed
+	by the minute of the day, so a tick only walks the events that share
+	its bucket, never the whole schedule, and skips those of other
+	minutes.  Ticks land in the first second of each minute, timed from
+	the RTC and re-aligned every tick.  The commands go to the buses
+	through DaliRouter::put(), so per address commands for the same minute
+	are coalesced into group frames.  When a bus is full the rest of the
+	minute waits for room rather than block the event queue.
+
+	Minutes missed while the clock jumped or the queue was held up are
+	caught up if there are at most DALI_SCHED_CATCHUP of them, a longer
+	gap, setting the clock say, is skipped.
+
+	The tables are static.  On the LPC1768 they belong in AHB SRAM, put
+	the object there with DALI_SCHED_SECTION and the 32 KB main bank keeps
+	the ring buffers, router ports and network stack.
+*/
+
+#ifndef DALI_SCHED_EVENTS
+#define DALI_SCHED_EVENTS    1024   // events held, 8 bytes each, at most 65535
+#endif
+#ifndef DALI_SCHED_RAM
+#define DALI_SCHED_RAM       12288  // bytes of events and buckets together, of AHBSRAM0's 16 KB
+#endif
+#define DALI_SCHED_BUCKETS   256    // a power of two, minute of the day modulo it
+#define DALI_SCHED_DAY       1440   // minutes
+#define DALI_SCHED_WEEK      (7 * DALI_SCHED_DAY)
+#define DALI_SCHED_CATCHUP   15     // minutes
+#define DALI_SCHED_RETRY_MS  25     // bus full, try again after about a frame
+#define DALI_SCHED_NONE      0xFFFF
+
+#if defined(TARGET_LPC1768)
+#define DALI_SCHED_SECTION   __attribute__((section("AHBSRAM0")))
+#else
+#define DALI_SCHED_SECTION
+#endif
+
+#define DALI_DAY(d)          (1 << (d))   // 0 is Sunday, as tm_wday
+#define DALI_EVERY_DAY       0x7F
+
+#define DALI_TARGET_GROUP(g)   (64 + (g))
+#define DALI_TARGET_BROADCAST  0xFF
+
+/* What an event does */
+enum {
+	DALI_SCHED_LEVEL = 0,   // DAPC level
+	DALI_SCHED_ON,          // RECALL MAX LEVEL
+	DALI_SCHED_OFF          // OFF
+};
+
+typedef struct {
+	uint16_t next;          // in its bucket, or the free list
+	uint16_t minute : 11;   // of the day
+	uint16_t action : 2;
+	uint16_t used   : 1;
+	uint8_t  days;          // DALI_DAY() bits
+	uint8_t  bus;
+	uint8_t  target;        // short address, DALI_TARGET_GROUP() or DALI_TARGET_BROADCAST
+	uint8_t  level;         // for DALI_SCHED_LEVEL
+} dali_sched_t;
+
+/* Raise DALI_SCHED_RAM with DALI_SCHED_EVENTS only where there is room. */
+static_assert(DALI_SCHED_EVENTS * sizeof(dali_sched_t) + DALI_SCHED_BUCKETS * sizeof(uint16_t) <= DALI_SCHED_RAM,
+              "schedule tables over DALI_SCHED_RAM");
+static_assert(!(DALI_SCHED_BUCKETS & (DALI_SCHED_BUCKETS - 1)), "DALI_SCHED_BUCKETS is a power of two");
+
+
+class DaliSchedule {
+
+public:
+	DaliSchedule(DaliRouter *router, EventQueue *queue);
+
+	/* Adds an event and returns its id, or -1 if the schedule is full or
+	   the event makes no sense. */
+	int add(uint8_t hour, uint8_t minute, uint8_t days, uint8_t bus,
+	        uint8_t target, uint8_t action, uint8_t level = 0);
+	bool remove(int id);
+	void clear(void);
+	uint32_t count(void) { return _count; }
+
+	/* Ticks from the next minute on, set the RTC first. */
+	void start(void);
+	void stop(void);
+
+	int32_t utc_offset;     // seconds added to the RTC for local time
+
+	uint32_t ticks;         // minutes handled
+	uint32_t fired;         // commands given to the buses
+	uint32_t examined;      // events looked at, the cost of the ticks
+	uint32_t retries;       // times a bus was full
+	uint32_t skipped;       // minutes lost to clock jumps
+
+private:
+	DaliRouter *_router;
+	EventQueue *_queue;
+	dali_sched_t events[DALI_SCHED_EVENTS];
+	uint16_t buckets[DALI_SCHED_BUCKETS];   // first event of each
+	uint16_t free_list;
+	uint16_t _count;
+
+	uint8_t  running;
+	uint8_t  gen;           // ticks posted before stop() are ignored
+	uint16_t done;          // minute of the week last fired in full
+	uint16_t cursor;        // next event of the minute being fired, or DALI_SCHED_NONE
+	uint8_t  partial;       // a minute stopped part-way, resume it from cursor
+
+	uint32_t now_minute(uint32_t *second);
+	void tick(uint8_t tick_gen);
+	bool fire(uint16_t minute);
+	bool send(const dali_sched_t &e);
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_shadow.hpp"
+
+#define FIELD(f)     (1 << (f))
+#define ALL_FIELDS   (FIELD(DALI_SHADOW_FIELDS) - 1)
+#define ANY_ADDRESS  (~(uint64_t)0)
+
+
+/* The field a query for one short address reads, or -1 if it is not kept. */
+static int query_field(uint8_t cmd) {
+	switch (cmd) {
+		case DALI_QUERY_STATUS:       return DALI_SHADOW_STATUS;
+		case DALI_QUERY_DEVICE_TYPE:  return DALI_SHADOW_TYPE;
+		case DALI_QUERY_ACTUAL_LEVEL: return DALI_SHADOW_LEVEL;
+		case DALI_QUERY_MAX_LEVEL:    return DALI_SHADOW_MAX;
+		case DALI_QUERY_MIN_LEVEL:    return DALI_SHADOW_MIN;
+		case DALI_QUERY_GROUPS_0_7:   return DALI_SHADOW_GROUPS_LO;
+		case DALI_QUERY_GROUPS_8_15:  return DALI_SHADOW_GROUPS_HI;
+		default:                      return -1;
+	}
+}
+
+
+DaliShadow::DaliShadow() {
+	max_age[DALI_SHADOW_LEVEL]     = 30000;
+	max_age[DALI_SHADOW_STATUS]    = 5000;
+	max_age[DALI_SHADOW_TYPE]      = DALI_SHADOW_FOREVER;
+	max_age[DALI_SHADOW_GROUPS_LO] = DALI_SHADOW_FOREVER;
+	max_age[DALI_SHADOW_GROUPS_HI] = DALI_SHADOW_FOREVER;
+	max_age[DALI_SHADOW_MAX]       = DALI_SHADOW_FOREVER;
+	max_age[DALI_SHADOW_MIN]       = DALI_SHADOW_FOREVER;
+	hits   = 0;
+	misses = 0;
+	clear();
+}
+
+
+void DaliShadow::clear(void) {
+	for (int a = 0; a < DALI_ADDRESSES; a++)
+		dev[a].valid = 0;
+}
+
+
+void DaliShadow::set(uint8_t addr, uint8_t field, uint8_t value) {
+	dev[addr].value[field] = value;
+	dev[addr].at[field]    = (uint32_t)Kernel::get_ms_count();
+	dev[addr].valid       |= FIELD(field);
+}
+
+
+void DaliShadow::forget(uint64_t addrs, uint8_t fields) {
+	for (int a = 0; a < DALI_ADDRESSES; a++) {
+		if (addrs & DALI_ADDR(a))
+			dev[a].valid &= ~fields;
+	}
+}
+
+
+bool DaliShadow::fresh(uint8_t addr, uint8_t field) {
+	if (!(dev[addr].valid & FIELD(field)))
+		return false;
+	if (max_age[field] == DALI_SHADOW_FOREVER)
+		return true;
+	return (uint32_t)Kernel::get_ms_count() - dev[addr].at[field] < max_age[field];
+}
+
+
+bool DaliShadow::get(uint8_t addr, uint8_t field, uint8_t *value) {
+	if (addr >= DALI_ADDRESSES || field >= DALI_SHADOW_FIELDS || !fresh(addr, field))
+		return false;
+	*value = dev[addr].value[field];
+	return true;
+}
+
+
+/* The short addresses an address byte reaches for sure, and those it may
+   reach because their groups are not known. */
+void DaliShadow::targets(uint8_t a, uint64_t *sure, uint64_t *maybe) {
+	*sure  = 0;
+	*maybe = 0;
+
+	if ((a & 0x80) == 0) {
+		*sure = DALI_ADDR((a >> 1) & 0x3F);
+	} else if ((a & 0xFE) == 0xFE) {
+		*sure = ANY_ADDRESS;
+	} else if ((a & 0xE0) == 0x80) {
+		uint8_t g = (a >> 1) & 0xF;
+		uint8_t field = (g < 8) ? DALI_SHADOW_GROUPS_LO : DALI_SHADOW_GROUPS_HI;
+		for (int i = 0; i < DALI_ADDRESSES; i++) {
+			if (!fresh(i, field))
+				*maybe |= DALI_ADDR(i);
+			else if ((dev[i].value[field] >> (g & 7)) & 1)
+				*sure |= DALI_ADDR(i);
+		}
+	}
+}
+
+
+/*
+	Function    : command()
+	Description : works out what a forward frame does to the fields.  Arc
+	              power commands act on every frame, configuration commands
+	              only on the second of a pair, as the gear do.  Programming
+	              short addresses moves devices around, everything is
+	              forgotten.
+*/
+void DaliShadow::command(uint16_t frame, bool twice) {
+	uint8_t a   = frame >> 8;
+	uint8_t cmd = frame & 0xFF;
+	uint64_t sure, maybe;
+
+	if (dali_is_special(a)) {
+		if (a == DALI_PROGRAM_SHORT_ADDRESS)
+			clear();
+		return;
+	}
+
+	targets(a, &sure, &maybe);
+
+	/* DAPC and arc power commands: the new level, if it can be known */
+	if (!(a & 1) || cmd < DALI_RESET) {
+		forget(sure | maybe, FIELD(DALI_SHADOW_STATUS));
+		forget(maybe, FIELD(DALI_SHADOW_LEVEL));
+
+		for (int i = 0; i < DALI_ADDRESSES; i++) {
+			if (!(sure & DALI_ADDR(i)))
+				continue;
+
+			bool limits = fresh(i, DALI_SHADOW_MAX) && fresh(i, DALI_SHADOW_MIN);
+			uint8_t max = dev[i].value[DALI_SHADOW_MAX];
+			uint8_t min = dev[i].value[DALI_SHADOW_MIN];
+			int level = -1;
+
+			if (!(a & 1)) {
+				if (cmd == 0)
+					level = 0;
+				else if (cmd != 0xFF && limits)
+					level = (cmd < min) ? min : (cmd > max) ? max : cmd;
+			} else if (cmd == DALI_OFF) {
+				level = 0;
+			} else if (cmd == DALI_RECALL_MAX && fresh(i, DALI_SHADOW_MAX)) {
+				level = max;
+			} else if (cmd == DALI_RECALL_MIN && fresh(i, DALI_SHADOW_MIN)) {
+				level = min;
+			}
+
+			if (level >= 0)
+				set(i, DALI_SHADOW_LEVEL, level);
+			else
+				forget(DALI_ADDR(i), FIELD(DALI_SHADOW_LEVEL));
+		}
+		return;
+	}
+
+	if (cmd < DALI_RESET || cmd > DALI_SET_SHORT_ADDRESS || !twice)
+		return;                 // queries, or the first of a pair
+
+	forget(sure | maybe, FIELD(DALI_SHADOW_STATUS));
+
+	if (cmd == DALI_RESET) {
+		forget(maybe, ALL_FIELDS & ~FIELD(DALI_SHADOW_TYPE));
+		forget(sure, FIELD(DALI_SHADOW_MIN));
+		for (int i = 0; i < DALI_ADDRESSES; i++) {
+			if (sure & DALI_ADDR(i)) {
+				set(i, DALI_SHADOW_LEVEL, 254);
+				set(i, DALI_SHADOW_MAX, 254);
+				set(i, DALI_SHADOW_GROUPS_LO, 0);
+				set(i, DALI_SHADOW_GROUPS_HI, 0);
+			}
+		}
+	} else if (cmd == DALI_SET_MAX_LEVEL || cmd == DALI_SET_MIN_LEVEL) {
+		uint8_t limit = (cmd == DALI_SET_MAX_LEVEL) ? DALI_SHADOW_MAX : DALI_SHADOW_MIN;
+		forget(sure | maybe, FIELD(limit) | FIELD(DALI_SHADOW_LEVEL));
+	} else if (cmd >= DALI_ADD_TO_GROUP && cmd < DALI_SET_SHORT_ADDRESS) {
+		uint8_t g = cmd & 0xF;
+		uint8_t field = (g < 8) ? DALI_SHADOW_GROUPS_LO : DALI_SHADOW_GROUPS_HI;
+		uint8_t bit = 1 << (g & 7);
+		forget(maybe, FIELD(field));
+		for (int i = 0; i < DALI_ADDRESSES; i++) {
+			if ((sure & DALI_ADDR(i)) && fresh(i, field)) {
+				uint8_t v = dev[i].value[field];
+				set(i, field, (cmd < DALI_REMOVE_FROM_GROUP) ? (v | bit) : (v & ~bit));
+			}
+		}
+	} else if (cmd == DALI_SET_SHORT_ADDRESS) {
+		clear();
+	}
+}
+
+
+/* A frame given to command() never reached the gear: whatever it would
+   have changed is not known now. */
+void DaliShadow::lost(uint16_t frame) {
+	uint8_t a   = frame >> 8;
+	uint8_t cmd = frame & 0xFF;
+	uint64_t sure, maybe;
+
+	if (dali_is_special(a))
+		return;                 // PROGRAM SHORT ADDRESS cleared everything already
+
+	targets(a, &sure, &maybe);
+	if (!(a & 1) || cmd < DALI_RESET)
+		forget(sure | maybe, FIELD(DALI_SHADOW_LEVEL) | FIELD(DALI_SHADOW_STATUS));
+	else if (cmd <= DALI_SET_SHORT_ADDRESS)
+		forget(sure | maybe, ALL_FIELDS & ~FIELD(DALI_SHADOW_TYPE));
+}
+
+
+/* An answer is what the device holds now.  No answer at all means nothing
+   is at that address. */
+void DaliShadow::answered(uint16_t frame, int status, uint8_t ans) {
+	uint8_t a = frame >> 8;
+	int field = query_field(frame & 0xFF);
+
+	if ((a & 0x81) != 0x01 || field < 0)
+		return;
+
+	uint8_t addr = (a >> 1) & 0x3F;
+	if (status == DALI_ANSWER)
+		set(addr, field, ans);
+	else if (status == DALI_NO_ANSWER)
+		forget(DALI_ADDR(addr), ALL_FIELDS);
+}
+
+
+bool DaliShadow::lookup(uint16_t frame, uint8_t *ans) {
+	uint8_t a = frame >> 8;
+	int field = query_field(frame & 0xFF);
+
+	if ((a & 0x81) != 0x01 || field < 0)
+		return false;
+
+	if (!get((a >> 1) & 0x3F, field, ans)) {
+		misses++;
+		return false;
+	}
+	hits++;
+	return true;
+}
@@ -0,0 +1,82 @@
+#ifndef MBED_DALI_SHADOW_H
+#define MBED_DALI_SHADOW_H
+
+#include "dali_groups.hpp"
+
+/*
+	What the master believes each short address on one bus would answer to
+	the common queries, so that they can be answered without the bus.
+
+	Fields are learnt from the answers to queries the master sends and from
+	the commands it sends: DAPC 100 means QUERY ACTUAL LEVEL answers 100.
+	A command whose effect cannot be worked out, UP or GO TO SCENE say,
+	makes the field unknown instead.  So does a group command to a device
+	whose groups are not known.  The level cached after a command is the
+	level the gear is fading to.
+
+	Staleness: each field is trusted for max_age ms after it was learnt,
+	to cover what the master cannot see: another master, a power cycle, a
+	lamp failing.  Device type and groups only change when told to, the
+	defaults keep them for ever.  A max_age of 0 turns the cache off for
+	that field.
+*/
+
+#define DALI_SHADOW_FOREVER  0xFFFFFFFF
+
+/* Fields, and the query that reads each */
+enum {
+	DALI_SHADOW_LEVEL = 0,  // 0xA0 QUERY ACTUAL LEVEL
+	DALI_SHADOW_STATUS,     // 0x90 QUERY STATUS
+	DALI_SHADOW_TYPE,       // 0x99 QUERY DEVICE TYPE
+	DALI_SHADOW_GROUPS_LO,  // 0xC0 QUERY GROUPS 0-7
+	DALI_SHADOW_GROUPS_HI,  // 0xC1 QUERY GROUPS 8-15
+	DALI_SHADOW_MAX,        // 0xA1 QUERY MAX LEVEL
+	DALI_SHADOW_MIN,        // 0xA2 QUERY MIN LEVEL
+	DALI_SHADOW_FIELDS
+};
+
+typedef struct {
+	uint8_t  value[DALI_SHADOW_FIELDS];
+	uint8_t  valid;                     // a bit per field
+	uint32_t at[DALI_SHADOW_FIELDS];    // Kernel ms count when learnt
+} dali_shadow_t;
+
+
+class DaliShadow {
+
+public:
+	DaliShadow();
+
+	/* Forget everything, e.g. once short addresses have moved. */
+	void clear(void);
+
+	/* A forward frame went out, twice when it is the second of a pair.
+	   Dali calls it as the frame is queued, and lost() if the frame is
+	   given up after collisions. */
+	void command(uint16_t frame, bool twice);
+	void lost(uint16_t frame);
+
+	/* A query finished, as passed to its callback. */
+	void answered(uint16_t frame, int status, uint8_t answer);
+
+	/* The answer a query for one short address would get, if it is known
+	   and fresh.  Counts hits and misses. */
+	bool lookup(uint16_t frame, uint8_t *answer);
+
+	/* One field of one short address, if it is known and fresh. */
+	bool get(uint8_t addr, uint8_t field, uint8_t *value);
+
+	uint32_t max_age[DALI_SHADOW_FIELDS];   // ms, the staleness policy
+	uint32_t hits;
+	uint32_t misses;
+
+private:
+	dali_shadow_t dev[DALI_ADDRESSES];
+
+	void set(uint8_t addr, uint8_t field, uint8_t value);
+	void forget(uint64_t addrs, uint8_t fields);
+	bool fresh(uint8_t addr, uint8_t field);
+	void targets(uint8_t a, uint64_t *sure, uint64_t *maybe);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef MBED_DALI_STATS_H
+#define MBED_DALI_STATS_H
+
+#include "dali_decoder.hpp"
+
+/*
+	Counters kept by each bus, always on, to show bus saturation and timing
+	drift in the field.
+
+	The ISR fields are written by the bus's timer ISR, its GPIO edge
+	handlers which run at the same priority, and dali_start(), which the
+	thread only calls inside a critical section, so no two writes to them
+	ever interleave.  The thread fields are written only by the thread
+	running process().  Every field is a 32 bit word, so a reader sees each
+	one whole without taking a lock, and counters simply wrap.
+
+	Items, as asked for over the command socket (see DaliRouter::put()),
+	with the index they take:
+
+		DALI_STAT_ISR_COUNT    DALI_ISR_MATCH or DALI_ISR_EDGE: entries
+		DALI_STAT_ISR_WORST    the same: longest entry, CPU cycles
+		DALI_STAT_FRAMES       0: forward frames sent
+		DALI_STAT_FRAME_RATE   0: frames per second, over the last second or more,
+		                       1: usec a forward frame takes the bus when they
+		                       are sent back to back, averaged
+		DALI_STAT_LATENCY      bucket: answers whose start bit began that many
+		                       TE after the forward frame's last bit, the last
+		                       bucket holds everything later
+		DALI_STAT_RX_STATUS    DALI_RX_*: answer windows that decoded so,
+		                       DALI_RX_EMPTY for those nothing answered in
+		DALI_STAT_TX_QUEUE     0: frames waiting now, every class together,
+		                       1: most ever waiting, 2: commands refused as
+		                       built from a value out of range
+		DALI_STAT_RX_EDGES     0: most edges waiting for process(), 1: answer
+		                       windows lost to a full ring
+		DALI_STAT_HEARD        0: event messages heard while idle, 1: other
+		                       frames heard then, of other widths or garbled
+		DALI_STAT_COLLISIONS   0: forward frames that collided with another
+		                       transmitter, 1: starts held back because the
+		                       bus went busy first, 2: frames given up after
+		                       DALI_TX_RETRIES
+		DALI_STAT_CLASS        DALI_CLASS_*: frames of that class sent,
+		                       DALI_CLASSES + DALI_CLASS_*: longest one of
+		                       them waited to start, usec
+*/
+
+#define DALI_LAT_BUCKETS  24    // one TE each, 22 TE is the longest wait allowed
+
+enum {
+	DALI_ISR_MATCH = 0,     // MR1: transmit, answer window, end of transfer
+	DALI_ISR_EDGE,          // Rx edge, capture or GPIO
+	DALI_ISR_KINDS
+};
+
+enum {
+	DALI_STAT_ISR_COUNT = 0,
+	DALI_STAT_ISR_WORST,
+	DALI_STAT_FRAMES,
+	DALI_STAT_FRAME_RATE,
+	DALI_STAT_LATENCY,
+	DALI_STAT_RX_STATUS,
+	DALI_STAT_TX_QUEUE,
+	DALI_STAT_RX_EDGES,
+	DALI_STAT_HEARD,
+	DALI_STAT_COLLISIONS,
+	DALI_STAT_CLASS,
+	DALI_STAT_ITEMS
+};
+
+/* Traffic classes, first to last, see Dali::set_class() */
+enum {
+	DALI_CLASS_INTERACTIVE = 0,     // someone is waiting for it: a switch, an override
+	DALI_CLASS_SCHEDULED,           // timed changes, fades
+	DALI_CLASS_BACKGROUND,          // polling, learning, commissioning
+	DALI_CLASSES
+};
+
+typedef struct {
+	/* ISR */
+	volatile uint32_t isr_count[DALI_ISR_KINDS];
+	volatile uint32_t isr_worst[DALI_ISR_KINDS];   // DWT cycles
+	volatile uint32_t frames;
+	volatile uint32_t latency[DALI_LAT_BUCKETS];
+	volatile uint32_t rx_edges_max;
+	volatile uint32_t collisions[3];   // collided, held back, given up
+	volatile uint32_t frame_us;        // bus time per frame, back to back
+	volatile uint32_t class_frames[DALI_CLASSES];
+	volatile uint32_t class_wait[DALI_CLASSES];    // usec, queued to started
+	
+	/* Thread */
+	uint32_t rx_status[DALI_RX_STATUS_COUNT];
+	uint32_t tx_queue_max;
+	uint32_t tx_refused;            // DALI_FLAG_BAD
+	uint32_t heard[2];              // events, other frames
+	uint32_t frame_rate;
+	uint32_t rate_ms;               // when frame_rate was last worked out
+	uint32_t rate_frames;           // frames then
+} dali_stats_t;
+
+#endif
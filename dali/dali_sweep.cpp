@@ -0,0 +1,172 @@
+#include "mbed.h"
+#include "dali_sweep.hpp"
+#include "EventQueue.h"
+
+
+DaliSweep::DaliSweep(Dali *bus) {
+	_bus     = bus;
+	_status  = 0;
+	_level   = 0;
+	_what    = 0;
+	_out     = 0;
+	_running = 0;
+	_started = 0;
+	f_retry_posted = 0;
+	f_filling = 0;
+	f_refill  = 0;
+	window   = DALI_SWEEP_WINDOW;
+	sweeps   = 0;
+	skipped  = 0;
+	memset(&_snap, 0, sizeof(_snap));
+	memset(&_last, 0, sizeof(_last));
+	memset(_last.level, 0xFF, sizeof(_last.level));
+	for (int i = 0; i < DALI_SWEEP_WINDOW; i++) {
+		_asks[i].sweep = this;
+		_asks[i].what  = 0;
+	}
+}
+
+
+bool DaliSweep::start(Callback<void(const dali_snapshot_t &snap)> done, uint8_t what) {
+	uint64_t ask = ~(uint64_t)0;
+	
+	if (_running || !(what & (DALI_SWEEP_STATUS | DALI_SWEEP_LEVEL)))
+		return false;
+	
+	/* Every address now and then, else only where something may be */
+	if (sweeps % DALI_SWEEP_REPROBE) {
+		if (_bus->groups.known)
+			ask = _bus->groups.present;
+		else
+			ask = _last.present | _last.garbled;
+	}
+	for (uint8_t a = 0; a < DALI_ADDRESSES; a++) {
+		if (!(ask & DALI_ADDR(a)))
+			skipped++;
+	}
+	
+	memset(&_snap, 0, sizeof(_snap));
+	memset(_snap.level, 0xFF, sizeof(_snap.level));
+	_done    = done;
+	_what    = what;
+	_status  = ask;
+	_level   = 0;
+	_running = 1;
+	_started = us_ticker_read();
+	
+	/* Only levels: an answer is as good as a status for presence */
+	if (!(what & DALI_SWEEP_STATUS)) {
+		_status = 0;
+		_level  = ask;
+	}
+	fill();
+	return true;
+}
+
+
+/*
+	Function    : fill()
+	Description : queues queries until window are out or none are left,
+	              levels first so each address is done before the next
+	              starts.  With every query slot taken it tries again in
+	              DALI_SWEEP_RETRY_MS.  Queueing a query may wait for room
+	              in process(), which runs answered() and so fill() again:
+	              that call only marks f_refill and the running one goes
+	              round once more.
+*/
+void DaliSweep::fill(void) {
+	uint8_t limit = window;
+	
+	if (f_filling) {
+		f_refill = 1;
+		return;
+	}
+	f_retry_posted = 0;
+	if (!_running)
+		return;
+	if (limit < 1 || limit > DALI_SWEEP_WINDOW)
+		limit = DALI_SWEEP_WINDOW;
+	
+	f_filling = 1;
+	uint8_t cls = _bus->set_class(DALI_CLASS_BACKGROUND);
+	do {
+		f_refill = 0;
+		while (_out < limit && (_status | _level)) {
+			ask_t *ask = NULL;
+			for (int i = 0; i < DALI_SWEEP_WINDOW && !ask; i++) {
+				if (!_asks[i].what)
+					ask = &_asks[i];
+			}
+			if (!ask)
+				break;
+		
+			uint8_t op;
+			uint64_t &from = _level ? _level : _status;
+			ask->what = _level ? DALI_SWEEP_LEVEL : DALI_SWEEP_STATUS;
+			op        = _level ? DALI_QUERY_ACTUAL_LEVEL : DALI_QUERY_STATUS;
+			for (ask->addr = 0; !(from & DALI_ADDR(ask->addr)); ask->addr++)
+				;
+			if (_bus->query(dali_command(dali_short(ask->addr), op), callback(ask, &ask_t::answered)) < 0) {
+				ask->what = 0;
+				if (!_out && !f_retry_posted && _bus->queue) {
+					f_retry_posted = 1;
+					_bus->queue->call_in(DALI_SWEEP_RETRY_MS, this, &DaliSweep::fill);
+				}
+				break;
+			}
+			from &= ~DALI_ADDR(ask->addr);
+			_out++;
+			_snap.queries++;
+		}
+	} while (f_refill && !f_retry_posted);
+	_bus->set_class(cls);
+	f_filling = 0;
+	
+	if (!_out && !(_status | _level) && !f_retry_posted)
+		finish();
+}
+
+
+/*
+	Function    : answered()
+	Description : one query's outcome, from process().  A status answer
+	              makes the address present and, if levels are wanted,
+	              queues its level next.  A garbled answer means something
+	              is there, it is asked again next sweep.
+*/
+void DaliSweep::answered(ask_t *ask, int status, uint8_t answer) {
+	uint8_t a = ask->addr;
+	
+	if (ask->what == DALI_SWEEP_STATUS) {
+		if (status == DALI_ANSWER) {
+			_snap.present  |= DALI_ADDR(a);
+			_snap.status[a] = answer;
+			if (answer & 0x02)
+				_snap.lamp_failure |= DALI_ADDR(a);
+			if (_what & DALI_SWEEP_LEVEL)
+				_level |= DALI_ADDR(a);
+		} else if (status == DALI_ANSWER_ERROR) {
+			_snap.garbled |= DALI_ADDR(a);
+		}
+	} else {
+		if (status == DALI_ANSWER) {
+			_snap.level[a] = answer;
+			_snap.present |= DALI_ADDR(a);
+		} else if (status == DALI_ANSWER_ERROR) {
+			_snap.garbled |= DALI_ADDR(a);
+		}
+	}
+	ask->what = 0;
+	_out--;
+	fill();
+}
+
+
+void DaliSweep::finish(void) {
+	_snap.took_us = us_ticker_read() - _started;
+	_last    = _snap;
+	_running = 0;
+	sweeps++;
+	if (_done)
+		_done(_last);
+}
@@ -0,0 +1,89 @@
+#ifndef MBED_DALI_SWEEP_H
+#define MBED_DALI_SWEEP_H
+
+#include "dali.hpp"
+
+/*
+	Status of every gear on one bus in one pass.
+
+	A sweep asks each short address QUERY STATUS and, for those that
+	answer, QUERY ACTUAL LEVEL, and gathers the answers into one
+	dali_snapshot_t.  Lamp failure is bit 1 of the status, no query of its
+	own.  DALI_SWEEP_WINDOW queries are kept queued at once, so the bus
+	goes from one to the next with no gap but its own timing and the
+	thread is never waited for; each answer queues the next query from
+	process().  They go as background traffic, see Dali::set_class(), so
+	anything else on the bus goes first.
+
+	An address is asked only when something may be there: those present
+	in the last sweep, or in the bus's groups once learn_groups() has run,
+	and every address on the first sweep and every DALI_SWEEP_REPROBE
+	sweeps, to find gear added since.  An address that does not answer
+	costs as much bus time as one that does.
+*/
+
+#define DALI_SWEEP_STATUS    0x01    // what start() asks
+#define DALI_SWEEP_LEVEL     0x02
+#define DALI_SWEEP_WINDOW    4       // queries queued at once
+#define DALI_SWEEP_REPROBE   8       // sweeps between asks of every address
+#define DALI_SWEEP_RETRY_MS  20      // wait for a query slot when all are taken
+
+typedef struct {
+	uint64_t present;       // answered QUERY STATUS
+	uint64_t lamp_failure;  // status bit 1
+	uint64_t garbled;       // an answer did not decode, several gear on one address say
+	uint8_t  status[DALI_ADDRESSES];
+	uint8_t  level[DALI_ADDRESSES];    // 255 where not read
+	uint32_t queries;       // sent for this sweep
+	uint32_t took_us;       // from start() to the last answer
+} dali_snapshot_t;
+
+
+class DaliSweep {
+
+public:
+	DaliSweep(Dali *bus);
+	
+	/* Starts a sweep, done gets the snapshot as the last answer is in.
+	   Needs the bus's queue.  Returns false if a sweep is running. */
+	bool start(Callback<void(const dali_snapshot_t &snap)> done,
+	           uint8_t what = DALI_SWEEP_STATUS | DALI_SWEEP_LEVEL);
+	bool active(void) { return _running; }
+	
+	/* The last complete sweep */
+	const dali_snapshot_t &snapshot(void) { return _last; }
+	
+	uint8_t  window;            // queries queued at once, 1..DALI_SWEEP_WINDOW
+	uint32_t sweeps;            // complete sweeps
+	uint32_t skipped;           // addresses left out as absent, all sweeps
+	
+private:
+	typedef struct ask_t {
+		DaliSweep *sweep;
+		uint8_t addr;
+		uint8_t what;           // DALI_SWEEP_STATUS or _LEVEL, 0 when free
+	
+		void answered(int status, uint8_t answer) { sweep->answered(this, status, answer); }
+	} ask_t;
+	
+	Dali *_bus;
+	Callback<void(const dali_snapshot_t &snap)> _done;
+	ask_t _asks[DALI_SWEEP_WINDOW];
+	dali_snapshot_t _snap;      // being filled
+	dali_snapshot_t _last;
+	uint64_t _status;           // addresses still to ask their status
+	uint64_t _level;            // and their level
+	uint8_t  _what;
+	uint8_t  _out;              // queries queued
+	uint8_t  _running;
+	uint8_t  f_retry_posted;
+	uint8_t  f_filling;         // fill() is running
+	uint8_t  f_refill;          // and was called again meanwhile
+	uint32_t _started;          // us_ticker
+	
+	void fill(void);
+	void answered(ask_t *ask, int status, uint8_t answer);
+	void finish(void);
+};
+
+#endif
@@ -8,18 +8,24 @@
 
 #include "mbed.h"
 #include "Dali.hpp"
+#include "dali_router.hpp"
+#include "dali_monitor.hpp"
+#include "dali_journal.hpp"
+#include "dali_schedule.hpp"
 #include "EthernetInterface.h"
 #include "TCPSocket.h"
 #include "SocketAddress.h"
 #include <string.h>
 #include "NTPClient.h"
 #include "LocalFileSystem.h"
+#include "firmware_update.hpp"
+#include "local_store.hpp"
 
-#define SECONDS 300.0
 #define ADDR 0x7
-#define BUFSZ 256
 #define ONTIME 14
 #define OFFTIME 00
+#define BUSES 1      // Dali buses fitted, up to 3
+#define RESET_MS 500 // after an update, for the stack to send the reply
 
 class Lights {
 public:
@@ -27,13 +33,12 @@ public:
 	void set_address(uint8_t addr);
 	void set_on_time(uint32_t hour);
 	void set_off_time(uint32_t hour);
-	void callback(void);
 	time_t toggle(void);
 	void turn_off(void);
 	void turn_on(void);
-	volatile bool check_time = false;
 	
 private:
+	bool is_on(void);
 	enum {OFF,ON} state = OFF;
 	uint32_t on_hour, off_hour;
 	Dali* _dali;
@@ -49,6 +54,15 @@ Lights::Lights(Dali *dali, PinName pin) : _led(pin) {
 	_led = 0;
 }
 
+/* The bus's shadow knows the level if anything does, another controller
+	may have switched the lights.  Otherwise go by what we last did. */
+bool Lights::is_on() {
+	uint8_t level;
+	if (_dali->shadow.get(_addr, DALI_SHADOW_LEVEL, &level))
+		return level != 0;
+	return _led.read() == 1;
+}
+
 time_t Lights::toggle() {
 	/* Read the current time */
 	timestamp = time(NULL);
@@ -63,7 +77,7 @@ time_t Lights::toggle() {
 	if( ((hour >= on_hour) && (hour > off_hour)) || ((hour < on_hour) && (hour < off_hour)) ) {
 		// Lights should be on
 		if (_override) {
-			if (_led.read() == 1) {
+			if (is_on()) {
 				// Reset the override flag
 				_override = false;
 			} else {
@@ -71,7 +85,7 @@ time_t Lights::toggle() {
 				goto EARLY;
 			}
 		}
-		if (_led.read() == 0) {
+		if (!is_on()) {
 			printf("Turning on\n\r");
 			_dali->turn_on(_addr);
 			_led = 1;
@@ -79,13 +93,13 @@ time_t Lights::toggle() {
 	} else {
 		// Lights should be off
 		if (_override) {
-			if (_led.read() == 0) {
+			if (!is_on()) {
 				_override = false;
 			} else {
 				goto EARLY;
 			}
 		}
-		if (_led.read() == 1) {
+		if (is_on()) {
 			printf("Turning off\n\r");
 			_dali->turn_off(_addr);
 			_led = 0;			
@@ -93,26 +107,27 @@ time_t Lights::toggle() {
 	}
 	
 EARLY:
-	check_time = false;
 	return timestamp;
 }
 
+/* Overrides are someone at a switch, they go ahead of the schedule and
+   of background traffic */
 void Lights::turn_on() {
+	uint8_t cls = _dali->set_class(DALI_CLASS_INTERACTIVE);
 	_dali->turn_on(_addr);
+	_dali->set_class(cls);
 	_led = 1;
 	_override = true;
 }
 
 void Lights::turn_off() {
+	uint8_t cls = _dali->set_class(DALI_CLASS_INTERACTIVE);
 	_dali->turn_off(_addr);
+	_dali->set_class(cls);
 	_led = 0;
 	_override = true;
 }
 
-void Lights::callback() {
-	check_time = true;
-}
-
 void Lights::set_on_time(uint32_t hour) {
 	on_hour = hour;
 }
@@ -126,37 +141,64 @@ void Lights::set_address(uint8_t addr) {
 }
 
 
-Dali *Dali::handler = {0};
+/* Bus 0 is the NXP I/OH board on TIMER2, Rx on the CAP2.0 pin.  The
+	others have no capture pin on their timer and timestamp Rx edges with
+	GPIO interrupts.  TIMER3 belongs to the us_ticker. */
 Dali DaliMaster(p30,p29);
+#if BUSES > 1
+Dali DaliBus1(p8,p7,0);
+#endif
+#if BUSES > 2
+Dali DaliBus2(p6,p5,1);
+#endif
+DaliRouter router;
+DaliMonitor monitor;
 Serial Uart(USBTX,USBRX);
 EthernetInterface eth;	
-Ticker timecheck;
+EventQueue events;
+DALI_SCHED_SECTION DaliSchedule schedule(&router, &events);   // 8 KB of tables, in AHB SRAM
 Ticker heartbeat;
 DigitalOut led2(LED2);
 DigitalOut led1(LED1);
 LocalFileSystem local("local");
+TCPSocket server;
+TCPSocket updater;
+TCPSocket sniffer;
+LocalStore firmware("/local/firm.bin");
+FirmwareUpdate upload(&events, firmware.store());
+LocalStore journal_file("/local/journal.bin", osPriorityLow);
+DaliJournal journal(&events, callback(&journal_file, &LocalStore::append));
 
 void hbeat() {
 	led1 = !led1;
 }
 
 void disable_timers() {
-	timecheck.detach();
+	schedule.stop();
 	heartbeat.detach();
 }
 
+void firmware_reset() {
+	server.close();
+	eth.disconnect();
+	system_reset();
+}
+
+/* A good image is closed on the local file system, the mbed interface
+	flashes it at the reset.  The reply to the uploader is with the stack,
+	the reset waits RESET_MS for it to go out. */
+void firmware_done(bool ok) {
+	printf("Firmware update %s: %lu bytes, %lu writes in %lu ms.\n\r",
+		ok ? "successful" : "failed", (unsigned long)upload.bytes,
+		(unsigned long)upload.writes, (unsigned long)(upload.elapsed_us / 1000));
+	if (!ok)
+		return;
+	disable_timers();
+	events.call_in(RESET_MS, firmware_reset);
+}
+
 int main() 
 {
-
-	time_t time;
-    TCPSocket server;
-	TCPSocket updater;
-	TCPSocket *sock;
-    int remaining;
-    int rcount;
-    char *p;
-    char *buffer = new char[BUFSZ];
-	char *c_time_string;
     nsapi_size_or_error_t result;
 	nsapi_error_t err;
 	
@@ -181,6 +223,35 @@ int main()
 	}
 	set_time(ts);
 
+	/* Decoding, socket handling and the time check all run from the
+		event queue, dispatched by this thread.  Records on the command
+		socket name their bus, the router hands them on. */
+	router.queue = &events;
+	router.add(&DaliMaster);
+#if BUSES > 1
+	router.add(&DaliBus1);
+#endif
+#if BUSES > 2
+	router.add(&DaliBus2);
+#endif
+	
+	/* Every frame on every bus goes to the monitor port as well */
+	monitor.queue = &events;
+	for (uint8_t i = 0; i < router.buses(); i++)
+		monitor.add(router.bus(i));
+	
+	/* And what was sent, answered or garbled to the journal, written a
+		buffer at a time behind everything else.  tools/dali_journal reads
+		it back. */
+	journal_file.written = callback(&journal, &DaliJournal::written);
+	monitor.tap = callback(&journal, &DaliJournal::frame);
+	journal.start();
+	
+	/* Find the gear and their groups so that runs of per address commands
+		can go out as group and broadcast frames */
+	for (uint8_t i = 0; i < router.buses(); i++)
+		router.bus(i)->learn_groups(Callback<void()>());
+
 	/* Set up the lighting control */
 	Lights lighting(&DaliMaster, LED2);
 	lighting.set_on_time(ONTIME);
@@ -188,8 +259,10 @@ int main()
 	lighting.set_address(ADDR);
 	lighting.toggle();
 	
-	/* Check the time every 5 mins */
-	timecheck.attach(callback(&lighting, &Lights::callback), SECONDS);
+	/* From now on the schedule switches them, on the minute */
+	schedule.add(ONTIME, 0, DALI_EVERY_DAY, 0, ADDR, DALI_SCHED_ON);
+	schedule.add(OFFTIME, 0, DALI_EVERY_DAY, 0, ADDR, DALI_SCHED_OFF);
+	schedule.start();
 	
 	/* Attach a heartbeat ticket */
 	heartbeat.attach(&hbeat, 1);
@@ -222,112 +295,37 @@ int main()
 		printf("Error! updater.listen() returned: %d\n\r", err);
 	}
 	
-	/* Set a timeout on the server so that we can handle multiple tasks */
-	server.set_timeout(1); // timeout in ms
-	updater.set_timeout(1);
+	/* Setup a socket for the bus monitor */
+    result = sniffer.open(&eth);
+    if (result != 0) {
+        printf("Error! sniffer.open() returned: %d\n\r", result);
+    }
+	err = sniffer.bind(8083);
+	if (err != 0) {
+		printf("Error! sniffer.bind() returned: %d\n\r", err);
+	}
+	err = sniffer.listen();
+	if (err != 0) {
+		printf("Error! sniffer.listen() returned: %d\n\r", err);
+	}
 	
-	/* Accept incoming connections to turn on/off the lights */
-	while(1) {
-		/* Check if we need to check the time */
-		if (lighting.check_time) {
-			time = lighting.toggle();
-			c_time_string = ctime(&time);
-			// REVISIT: testing only
-			//lighting.turn_on();
-			//Uart.printf("Current time is %s\n\r", c_time_string);
-		}
-		
-		/* Check if we have a new firmware image to download */
-		sock = updater.accept(&err);
-		if (err != 0) {
-			if (err == NSAPI_ERROR_WOULD_BLOCK) {
-				// timeout so ignore
-			} else {
-				printf("Error! updater.accept() returned: %d\n\r", err);
-			}
-		} else {
-			// Turn off the timer interrupts
-			disable_timers();
-			printf("Got socket connection on port 8082. Updating firmware.\n\r");
-			
-			// Open the file handle
-			FILE *fp = fopen("/local/firm.bin", "w");
-			printf("Opened file /local/firm.bin for writing.\n\r");
-			
-			while(1) {
-				// Read 256 bytes at a time and write to the file
-				remaining = BUFSZ;
-				rcount = 0;
-				p = buffer;
-				while(remaining > 0 && 0 < (result = sock->recv(p, remaining))) {
-			        p += result;
-			        rcount += result;
-			        remaining -= result;
-				}
-				if (result < 0) {
-		        	printf("FW Update Error! sock.recv() returned: %d\n\r", result);
-					fclose(fp);
-					sock->close();
-			        goto DISCONNECT;
-				}
-				printf("Writing %d bytes.\n\r", rcount);
-				fwrite(p, rcount, 1, fp);
-			}
-			
-			// Finish up and reset
-			fclose(fp);
-			sock->close();
-			printf("Firmware update successful.\n\r");
-			goto RESET;
-		}
-		
-		/* Wait for a socket connection or timeout and loop again */
-		sock = server.accept(&err);
-		if (err != 0) {
-			if (err == NSAPI_ERROR_WOULD_BLOCK) {
-				// timeout so ignore
-			} else {
-				printf("Error! server.accept() returned: %d\n\r", err);
-			}
-		} else {
-		    remaining = BUFSZ;
-		    rcount = 0;
-		    p = buffer;
-		    while (remaining > 0 && 0 < (result = sock->recv(p, remaining))) {
-		        p += result;
-		        rcount += result;
-		        remaining -= result;
-		    }
-		    if (result < 0) {
-		        printf("Error! sock.recv() returned: %d\n\r", result);
-				sock->close();
-		        goto DISCONNECT;
-		    }
-			sock->close();
+	/* Sockets are serviced when they signal, nothing is polled.  The
+		command connection carries any number of dali_payload_t records,
+		the responses go back on it as the answers come in, and so do the
+		event messages input devices send. */
+	router.attach_server(&server);
 	
-			/* Modify the light state. */
-			if (buffer[1] == 'n') {
-				lighting.turn_on();
-			} else {
-				lighting.turn_off();
-			}
-		}
-	}
+	/* Firmware images arrive on port 8082 behind a length and CRC header,
+		see firmware_update.hpp.  They are written while the rest is still
+		arriving and everything else keeps running meanwhile. */
+	firmware.written = callback(&upload, &FirmwareUpdate::written);
+	upload.done = callback(&firmware_done);
+	upload.attach(&updater);
 	
-RESET:
-	server.close();
-	eth.disconnect();
-	system_reset();
-	while(1) {
-		Uart.printf("bye\n\r");
-		wait(2);
-	};
+	/* Port 8083 streams every frame decoded, with its time, see
+		dali_monitor.hpp */
+	monitor.attach_server(&sniffer);
 	
-DISCONNECT:
-	delete[] buffer;	
-    // Close the socket to return its memory and bring down the network interface
-    server.close();
-    // Bring down the ethernet interface
-    eth.disconnect();
-    printf("Done\n\r");
+	/* Sleeps until an interrupt posts work */
+	events.dispatch_forever();
 }
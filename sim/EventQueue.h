@@ -0,0 +1,7 @@
+#ifndef DALI_SIM_EVENTQUEUE_H
+#define DALI_SIM_EVENTQUEUE_H
+
+/* mbed-os provides EventQueue in its own header, the shim keeps it in mbed.h */
+#include "mbed.h"
+
+#endif
@@ -0,0 +1,387 @@
+/*
+	Receive decoder benchmark and edge trace replay.
+
+	Feeds edge trains through DaliDecoder::decode(), the path process()
+	runs every answer window and heard frame through, with the adaptive
+	windows and with the fixed ones.  The trains are made up, -n of each
+	kind, or read from a trace file (-r):
+
+		clean      8, 16 and 24 bit frames at the nominal half bit
+		jittered   each frame 8% fast or slow at most, every edge up to
+		           -j usec early or late, rising edges up to -k usec late
+		truncated  a clean frame cut short after a random edge, as when
+		           the capture ring overflows or the window closes
+		collided   two frames on the wired-AND bus, the second starting up
+		           to 4 TE after the first
+
+	Reported per kind and each way: how the frames were classified, right,
+	short (the first bits sent, well formed), wrong (any other frame) or
+	rejected with each DALI_RX_* status; and for all of them together
+	frames decoded per second and the cost per edge.
+	Clean and jittered frames must all come out right with the adaptive
+	windows, clean ones with the fixed windows too.
+
+	A trace file holds one frame per block, a header line then an edge per
+	line, time in usec and the level after it, 0 low or 1 high:
+
+		trace <kind> <sent hex> <sent bits> <status> <data hex> <bits>
+		<time> <level>
+		...
+
+	status, data and bits are what the adaptive decoder made of it when
+	the file was written (-w), and replaying a file every frame must come
+	out the same, so a change to the decoder that changes any outcome is
+	caught.  Recorded captures can be added by hand, with their expected
+	outcome.
+
+	usage: dali_bench_rx [-n frames] [-p passes] [-j usec] [-k usec] [-r file] [-w file]
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_decoder.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cycles() { return __rdtsc(); }
+#define CYCLE_UNIT "TSC cycles"
+#else
+static inline uint64_t cycles() {
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#define CYCLE_UNIT "clock ticks"
+#endif
+
+#define HALF        417     // usec, nominal half bit
+#define MAX_EDGES   128
+
+enum { CLEAN = 0, JITTERED, TRUNCATED, COLLIDED, KINDS };
+static const char *kind_name[KINDS] = { "clean", "jittered", "truncated", "collided" };
+
+static const char *status_name[DALI_RX_STATUS_COUNT] = {
+	"OK", "EMPTY", "SHORT_LOW", "SHORT_HIGH", "MID_LOW", "MID_HIGH", "LONG_LOW", "LONG_HIGH",
+	"BAD_START", "BAD_BIT", "TOO_LONG", "OVERRUN", "COLLISION"
+};
+
+typedef struct {
+	uint8_t kind;
+	uint32_t sent;
+	uint8_t sent_bits;
+	uint8_t status;         // expected, from the trace file
+	uint32_t data;
+	uint8_t bits;
+	std::vector<dali_edge_t> edges;
+} trace_t;
+
+/* Outcomes of one kind */
+enum { RIGHT = 0, SHORT, WRONG, OUTCOMES };
+
+typedef struct {
+	uint32_t frames;
+	uint32_t outcome[OUTCOMES];
+	uint32_t rejected[DALI_RX_STATUS_COUNT];
+} tally_t;
+
+
+/* Half bit levels of a frame: the start bit, the data MSB first, then the
+   bus idles high. */
+static int halves(uint32_t data, uint8_t bits, uint8_t *level) {
+	int n = 0;
+	level[n++] = 0;
+	level[n++] = 1;
+	for (int b = bits - 1; b >= 0; b--) {
+		uint8_t one = (data >> b) & 1;
+		level[n++] = !one;
+		level[n++] = one;
+	}
+	return n;
+}
+
+
+/* The edges of a bus whose level at each half bit boundary is given,
+   starting at t0 with half bits of te usec.  Rising edges come skew late,
+   every edge up to jitter early or late. */
+static void edges_of(const uint8_t *level, int n, uint32_t t0, uint32_t te, uint32_t jitter,
+                     uint32_t skew, std::mt19937 &rng, std::vector<dali_edge_t> &out) {
+	uint8_t bus = 1;
+	for (int i = 0; i <= n; i++) {
+		uint8_t l = i < n ? level[i] : 1;
+		if (l == bus)
+			continue;
+		int32_t t = t0 + i * te + (l ? skew : 0);
+		if (jitter)
+			t += (int32_t)(rng() % (2 * jitter + 1)) - (int32_t)jitter;
+		out.push_back({ (uint32_t)t, l, 0 });
+		bus = l;
+	}
+}
+
+
+static void make(int per_kind, uint32_t jitter, uint32_t skew, std::vector<trace_t> &traces) {
+	static const uint8_t widths[] = { 8, 16, 24 };
+	std::mt19937 rng(25);
+
+	for (int k = 0; k < KINDS; k++) {
+		for (int i = 0; i < per_kind; i++) {
+			trace_t t;
+			t.kind      = k;
+			t.sent_bits = widths[i % 3];
+			t.sent      = rng() & ((1u << t.sent_bits) - 1);
+			uint8_t level[2 * 34];
+			int n = halves(t.sent, t.sent_bits, level);
+			uint32_t t0 = 1000 + rng() % 1000;
+
+			if (k == CLEAN || k == TRUNCATED) {
+				edges_of(level, n, t0, HALF, 0, 0, rng, t.edges);
+				if (k == TRUNCATED)
+					t.edges.resize(1 + rng() % (t.edges.size() - 1));
+			} else if (k == JITTERED) {
+				uint32_t te = HALF * (92 + rng() % 17) / 100;
+				edges_of(level, n, t0, te, jitter, rng() % (skew + 1), rng, t.edges);
+			} else {
+				/* The AND of two frames, on a common grid of usec */
+				uint8_t other[2 * 34];
+				uint8_t bits2 = widths[rng() % 3];
+				int n2 = halves(rng() & ((1u << bits2) - 1), bits2, other);
+				uint32_t offset = rng() % (4 * 2 * HALF);
+				uint32_t end = std::max<uint32_t>(n * HALF, offset + n2 * HALF);
+				uint8_t bus = 1;
+				for (uint32_t us = 0; us <= end; us++) {
+					uint8_t a = us / HALF < (uint32_t)n ? level[us / HALF] : 1;
+					uint8_t b = us >= offset && (us - offset) / HALF < (uint32_t)n2 ? other[(us - offset) / HALF] : 1;
+					if ((a & b) != bus) {
+						bus = a & b;
+						t.edges.push_back({ t0 + us, bus, 0 });
+					}
+				}
+			}
+			uint32_t data = 0;
+			uint8_t bits = 0;
+			t.status = DaliDecoder::decode(t.edges.data(), t.edges.size(), &data, &bits);
+			t.data   = data;
+			t.bits   = bits;
+			traces.push_back(t);
+		}
+	}
+}
+
+
+static bool load(const char *path, std::vector<trace_t> &traces) {
+	FILE *f = fopen(path, "r");
+	char line[128], kind[32], status[32];
+	unsigned sent, sent_bits, data, bits, time, level;
+
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "trace %31s %x %u %31s %x %u", kind, &sent, &sent_bits, status, &data, &bits) == 6) {
+			trace_t t;
+			t.kind = KINDS;
+			for (int k = 0; k < KINDS; k++) {
+				if (!strcmp(kind, kind_name[k]))
+					t.kind = k;
+			}
+			t.status = DALI_RX_STATUS_COUNT;
+			for (int s = 0; s < DALI_RX_STATUS_COUNT; s++) {
+				if (!strcmp(status, status_name[s]))
+					t.status = s;
+			}
+			if (t.kind == KINDS || t.status == DALI_RX_STATUS_COUNT) {
+				fprintf(stderr, "%s: unknown kind or status: %s", path, line);
+				fclose(f);
+				return false;
+			}
+			t.sent      = sent;
+			t.sent_bits = sent_bits;
+			t.data      = data;
+			t.bits      = bits;
+			traces.push_back(t);
+		} else if (sscanf(line, "%u %u", &time, &level) == 2 && !traces.empty()
+				&& traces.back().edges.size() < MAX_EDGES) {
+			traces.back().edges.push_back({ time, (uint8_t)(level ? DALI_EDGE_RISE : DALI_EDGE_FALL), 0 });
+		} else {
+			fprintf(stderr, "%s: cannot read: %s", path, line);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+
+static bool save(const char *path, const std::vector<trace_t> &traces) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	fprintf(f, "# dali_bench_rx traces: trace <kind> <sent hex> <sent bits> <status> <data hex> <bits>,\n");
+	fprintf(f, "# then <time usec> <level after the edge> per edge\n");
+	for (size_t i = 0; i < traces.size(); i++) {
+		const trace_t &t = traces[i];
+		fprintf(f, "trace %s %x %u %s %x %u\n", kind_name[t.kind], t.sent, t.sent_bits,
+			status_name[t.status], t.data, t.bits);
+		for (size_t e = 0; e < t.edges.size(); e++)
+			fprintf(f, "%u %u\n", t.edges[e].time, t.edges[e].level);
+	}
+	fclose(f);
+	return true;
+}
+
+
+static void classify(const std::vector<trace_t> &traces, bool adaptive, tally_t *tally) {
+	memset(tally, 0, sizeof(tally_t) * KINDS);
+	for (size_t i = 0; i < traces.size(); i++) {
+		const trace_t &t = traces[i];
+		tally_t &k = tally[t.kind];
+		uint32_t data = 0;
+		uint8_t bits = 0;
+		uint8_t status = DaliDecoder::decode(t.edges.data(), t.edges.size(), &data, &bits, adaptive);
+		k.frames++;
+		if (status != DALI_RX_OK)
+			k.rejected[status]++;
+		else if (bits == t.sent_bits && data == t.sent)
+			k.outcome[RIGHT]++;
+		else if (bits < t.sent_bits && data == t.sent >> (t.sent_bits - bits))
+			k.outcome[SHORT]++;
+		else
+			k.outcome[WRONG]++;
+	}
+}
+
+
+/* Decodes every trace passes times, returns cycles per edge. */
+__attribute__((noinline))
+static double run(const std::vector<trace_t> &traces, int passes, bool adaptive, double *ns, double *fps) {
+	volatile uint32_t sink = 0;
+	uint64_t edges = 0;
+
+	for (size_t i = 0; i < traces.size(); i++)
+		edges += traces[i].edges.size();
+
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t c0 = cycles();
+	for (int p = 0; p < passes; p++) {
+		for (size_t i = 0; i < traces.size(); i++) {
+			uint32_t data = 0;
+			uint8_t bits = 0;
+			sink += DaliDecoder::decode(traces[i].edges.data(), traces[i].edges.size(), &data, &bits, adaptive);
+			sink += data;
+		}
+	}
+	uint64_t c1 = cycles();
+	auto t1 = std::chrono::steady_clock::now();
+	(void)sink;
+
+	double s = std::chrono::duration<double>(t1 - t0).count();
+	double n = (double)edges * passes;
+	*ns  = s * 1e9 / n;
+	*fps = traces.size() * passes / s;
+	return (c1 - c0) / n;
+}
+
+
+static void report(const char *name, const tally_t *tally) {
+	printf("%s\n", name);
+	for (int k = 0; k < KINDS; k++) {
+		const tally_t &t = tally[k];
+		if (!t.frames)
+			continue;
+		printf("  %-10s %5u frames: %5u right, %4u short, %4u wrong", kind_name[k], t.frames,
+			t.outcome[RIGHT], t.outcome[SHORT], t.outcome[WRONG]);
+		for (int s = 1; s < DALI_RX_STATUS_COUNT; s++) {
+			if (t.rejected[s])
+				printf(", %u %s", t.rejected[s], status_name[s]);
+		}
+		printf("\n");
+	}
+}
+
+
+int main(int argc, char **argv) {
+	int per_kind = 3000;
+	int passes = 200;
+	int jitter = 10;
+	int skew = 60;
+	const char *in = NULL, *out = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:j:k:r:w:")) != -1) {
+		switch (opt) {
+			case 'n': per_kind = atoi(optarg); break;
+			case 'p': passes = atoi(optarg); break;
+			case 'j': jitter = atoi(optarg); break;
+			case 'k': skew = atoi(optarg); break;
+			case 'r': in = optarg; break;
+			case 'w': out = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-n frames] [-p passes] [-j usec] [-k usec] [-r file] [-w file]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (per_kind < 1 || passes < 1 || jitter < 0 || jitter > 100 || skew < 0 || skew > 200) {
+		fprintf(stderr, "one frame of each kind and one pass at least, jitter 0..100 and skew 0..200 usec\n");
+		return 1;
+	}
+
+	std::vector<trace_t> traces;
+	if (in) {
+		if (!load(in, traces))
+			return 1;
+	} else {
+		make(per_kind, jitter, skew, traces);
+	}
+	if (out && !save(out, traces))
+		return 1;
+
+	/* Every outcome as recorded */
+	uint32_t changed = 0;
+	for (size_t i = 0; i < traces.size(); i++) {
+		const trace_t &t = traces[i];
+		uint32_t data = 0;
+		uint8_t bits = 0;
+		uint8_t status = DaliDecoder::decode(t.edges.data(), t.edges.size(), &data, &bits);
+		if (status != t.status || (status == DALI_RX_OK && (data != t.data || bits != t.bits))) {
+			if (changed++ < 10)
+				fprintf(stderr, "trace %u (%s, sent %x): %s %x/%u, was %s %x/%u\n", (unsigned)i,
+					kind_name[t.kind], t.sent, status_name[status], data, bits,
+					status_name[t.status], t.data, t.bits);
+		}
+	}
+
+	tally_t adaptive[KINDS], fixed[KINDS];
+	classify(traces, true, adaptive);
+	classify(traces, false, fixed);
+
+	double a_ns, a_fps, f_ns, f_fps;
+	run(traces, passes, true, &a_ns, &a_fps);         // warm up
+	double a_c = run(traces, passes, true, &a_ns, &a_fps);
+	double f_c = run(traces, passes, false, &f_ns, &f_fps);
+
+	printf("%u frames%s%s, decoded %d times each\n", (unsigned)traces.size(), in ? " from " : "", in ? in : "", passes);
+	report("adaptive:", adaptive);
+	report("fixed:", fixed);
+	printf("  adaptive: %6.2f %s  %6.2f ns per edge  %.2fM frames/s\n", a_c, CYCLE_UNIT, a_ns, a_fps / 1e6);
+	printf("  fixed:    %6.2f %s  %6.2f ns per edge  %.2fM frames/s\n", f_c, CYCLE_UNIT, f_ns, f_fps / 1e6);
+
+	bool ok = !changed;
+	for (int k = CLEAN; k <= JITTERED; k++) {
+		ok = ok && adaptive[k].outcome[RIGHT] == adaptive[k].frames;
+	}
+	ok = ok && fixed[CLEAN].outcome[RIGHT] == fixed[CLEAN].frames;
+	if (changed)
+		printf("  %u frames decoded otherwise than recorded\n", changed);
+	printf("  result:   %s\n", !ok ? "FAILED" : in ? "every frame decoded as recorded" : "every clean and jittered frame right");
+	return ok ? 0 : 1;
+}
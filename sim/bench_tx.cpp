@@ -0,0 +1,139 @@
+/*
+	Transmit half bit benchmark.
+
+	Compares the per-interrupt work of the MR1 branch of timer_isr() before
+	and after the Manchester bitmap: the old code shifted the forward frame by
+	a variable amount, divided by two and conditionally inverted on every
+	interrupt, the new code shifts out one precomputed bit.  Both versions
+	are checked to produce the same waveform before timing.
+
+	usage: dali_bench_tx [-f frames]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali_manchester.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t cycles() { return __rdtsc(); }
+#define CYCLE_UNIT "TSC cycles"
+#else
+static inline uint64_t cycles() {
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+#define CYCLE_UNIT "clock ticks"
+#endif
+
+#define TE_STOP     33
+#define INTERRUPTS  (TE_STOP + 13)   // half bits, stop, settling and end of transfer
+
+
+/* The MR1 branch as it was: output the level computed last time, then work
+   out the next one from the frame. */
+__attribute__((noinline))
+static uint32_t old_frame(uint16_t forward_frame, uint8_t *wave) {
+	uint8_t frame_bit_pol = 0;
+	uint32_t sum = 0;
+
+	for (uint8_t frame_bit_idx = 0; frame_bit_idx < INTERRUPTS; frame_bit_idx++) {
+		wave[frame_bit_idx] = frame_bit_pol;
+		sum += frame_bit_pol;
+
+		if (frame_bit_idx == 0) {
+			frame_bit_pol = 1;
+		} else if (frame_bit_idx < TE_STOP) {
+			frame_bit_pol = (forward_frame >> (((TE_STOP-1) - frame_bit_idx)/2)) & 1;
+			if (frame_bit_idx & 1)
+				frame_bit_pol = !frame_bit_pol;
+		} else if (frame_bit_idx == TE_STOP) {
+			frame_bit_pol = 1;
+		}
+		__asm__ volatile("" ::: "memory");   // one interrupt per iteration
+	}
+	return sum;
+}
+
+/* The MR1 branch now: expand once, shift out a bit per interrupt. */
+__attribute__((noinline))
+static uint32_t new_frame(uint16_t forward_frame, uint8_t *wave) {
+	uint64_t tx_halves = dali_manchester_frame(forward_frame);
+	uint32_t sum = 0;
+
+	for (uint8_t frame_bit_idx = 0; frame_bit_idx < INTERRUPTS; frame_bit_idx++) {
+		uint8_t level = (uint32_t)tx_halves & 1;
+		tx_halves = (tx_halves >> 1) | ((uint64_t)1 << 63);
+		wave[frame_bit_idx] = level;
+		sum += level;
+		__asm__ volatile("" ::: "memory");
+	}
+	return sum;
+}
+
+
+typedef uint32_t (*frame_fn)(uint16_t, uint8_t *);
+
+static double run(frame_fn fn, const std::vector<uint16_t> &frames, double *ns) {
+	uint8_t wave[INTERRUPTS];
+	volatile uint32_t sink = 0;
+
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t c0 = cycles();
+	for (size_t i = 0; i < frames.size(); i++)
+		sink += fn(frames[i], wave);
+	uint64_t c1 = cycles();
+	auto t1 = std::chrono::steady_clock::now();
+	(void)sink;
+
+	double n = (double)frames.size() * INTERRUPTS;
+	*ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+	return (c1 - c0) / n;
+}
+
+
+int main(int argc, char **argv) {
+	int nframes = 2000000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+			case 'f': nframes = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-f frames]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	/* Every 16 bit frame must give the same waveform both ways. */
+	for (uint32_t f = 0; f <= 0xFFFF; f++) {
+		uint8_t a[INTERRUPTS], b[INTERRUPTS];
+		old_frame(f, a);
+		new_frame(f, b);
+		if (memcmp(a, b, sizeof(a))) {
+			fprintf(stderr, "waveform mismatch for frame 0x%04x\n", f);
+			return 1;
+		}
+	}
+
+	std::mt19937 rng(1);
+	std::vector<uint16_t> frames(nframes);
+	for (int i = 0; i < nframes; i++)
+		frames[i] = rng();
+
+	double old_ns, new_ns;
+	run(old_frame, frames, &old_ns);                 // warm up
+	double old_c = run(old_frame, frames, &old_ns);
+	double new_c = run(new_frame, frames, &new_ns);
+
+	printf("waveforms identical for all 65536 frames\n");
+	printf("%d frames, %d interrupts each\n", nframes, INTERRUPTS);
+	printf("  before: %6.2f %s  %6.2f ns per interrupt\n", old_c, CYCLE_UNIT, old_ns);
+	printf("  after:  %6.2f %s  %6.2f ns per interrupt (expansion included)\n",
+		new_c, CYCLE_UNIT, new_ns);
+	printf("  ratio:  %.2fx\n", old_c / new_c);
+	return 0;
+}
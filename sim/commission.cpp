@@ -0,0 +1,159 @@
+/*
+	Commissions a bus of unaddressed gear with DaliCommission and reports
+	how long it took and what went over the bus.
+
+	The gear start without short addresses and pick random addresses from
+	-s seeded generators.  With -b the buses are commissioned in parallel,
+	one engine each.  At the end every gear must hold a distinct short
+	address.
+
+	With -c the first two gear of each bus draw the same random address
+	the first time, and the second answers a little later so that their
+	replies garble.  The engine must see the shared address and RANDOMISE
+	them apart rather than give both the same short address.
+
+	usage: dali_commission [-c] [-n devices] [-b buses] [-j jitter_us] [-s seed]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <set>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_commission.hpp"
+#include "sim_bus.hpp"
+
+#define MAX_BUSES 3
+
+/* Same pins and timers as dali_session */
+static const struct {
+	PinName rx;
+	PinName tx;
+	uint8_t timer;
+} bus_pins[MAX_BUSES] = {
+	{ p30, p29, 2 },
+	{ p8,  p7,  0 },
+	{ p6,  p5,  1 },
+};
+
+/* A plain search: 24 COMPAREs and all three SEARCHADDR bytes before each,
+   then PROGRAM SHORT ADDRESS and WITHDRAW. */
+#define TEXTBOOK_FRAMES (24 * 4 + 2)
+
+#define CLASH_RANDOM 0x5A5A5A   // what the clashing gear draw first
+
+
+int main(int argc, char **argv) {
+	int devices = 64;
+	int buses = 1;
+	int jitter = 0;
+	int seed = 1;
+	bool clash = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cn:b:j:s:")) != -1) {
+		switch (opt) {
+			case 'c': clash = true; break;
+			case 'n': devices = atoi(optarg); break;
+			case 'b': buses = atoi(optarg); break;
+			case 'j': jitter = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-c] [-n devices] [-b buses] [-j jitter_us] [-s seed]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (devices < (clash ? 2 : 1) || devices > 64 || buses < 1 || buses > MAX_BUSES) {
+		fprintf(stderr, "devices must be %d..64, buses 1..%d\n", clash ? 2 : 1, MAX_BUSES);
+		return 1;
+	}
+
+	sim::reset();
+	EventQueue events;
+	std::vector<SimBus *> bus;
+	std::vector<std::vector<SimGear *> > gear(buses);
+	std::vector<Dali *> dali;
+	std::vector<DaliCommission *> engine;
+	for (int b = 0; b < buses; b++) {
+		bus.push_back(new SimBus(bus_pins[b].tx, bus_pins[b].rx));
+		for (int i = 0; i < devices; i++) {
+			SimGear::config_t cfg = SimGear::default_config(i);
+			cfg.short_addr = SIM_MASK;
+			cfg.seed = seed * 1000003u + b * 64 + i;
+			cfg.jitter = jitter;
+			if (clash && i < 2) {
+				cfg.first_random = CLASH_RANDOM;
+				cfg.reply_te += i;
+			}
+			gear[b].push_back(new SimGear(cfg));
+			bus[b]->attach(gear[b].back());
+		}
+		dali.push_back(new Dali(bus_pins[b].rx, bus_pins[b].tx, bus_pins[b].timer));
+		dali[b]->queue = &events;
+		engine.push_back(new DaliCommission(dali[b]));
+	}
+
+	auto wall0 = std::chrono::steady_clock::now();
+	std::vector<int> found(buses, -1);
+	std::vector<sim::vtime_t> took(buses, 0);
+	int running = 0;
+	for (int b = 0; b < buses; b++) {
+		running++;
+		engine[b]->start([&, b](int n) {
+			found[b] = n;
+			took[b] = sim::now();
+			running--;
+		});
+	}
+	while (running) {
+		__WFI();
+		events.dispatch(0);
+	}
+	sim::run_for(10000);
+	events.dispatch(0);
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall0).count();
+
+	printf("buses %d, devices %d per bus, jitter +/-%d us, seed %d\n", buses, devices, jitter, seed);
+	int ok = 1;
+	for (int b = 0; b < buses; b++) {
+		std::set<uint8_t> addrs;
+		int unaddressed = 0;
+		for (int i = 0; i < devices; i++) {
+			uint8_t a = gear[b][i]->state().short_addr;
+			if (a == SIM_MASK)
+				unaddressed++;
+			else
+				addrs.insert(a);
+		}
+		uint32_t fwd = 0;
+		for (size_t i = 0; i < bus[b]->frames().size(); i++) {
+			const sim_frame_t &f = bus[b]->frames()[i];
+			if (f.valid && f.bits == 16)
+				fwd++;
+		}
+		int duplicates = devices - unaddressed - (int)addrs.size();
+		if (unaddressed || duplicates || found[b] != devices || (clash && !engine[b]->shared))
+			ok = 0;
+
+		printf("bus %d:   %d found, %d unaddressed, %d sharing an address, %u failed, %.3f s\n",
+			b, found[b], unaddressed, duplicates, engine[b]->failed, took[b] / 1e6);
+		if (clash)
+			printf("clash:   two gear drew %06X, %u shared random address%s seen and RANDOMISEd apart\n",
+				CLASH_RANDOM, engine[b]->shared, engine[b]->shared == 1 ? "" : "es");
+		printf("         %u forward frames, %u COMPARE, %u SEARCHADDR, %.1f frames per device "
+			"(a plain search takes %d)\n",
+			fwd, engine[b]->compares, engine[b]->searches,
+			(double)fwd / devices, TEXTBOOK_FRAMES);
+	}
+	sim::vtime_t slowest = 0;
+	for (int b = 0; b < buses; b++)
+		if (took[b] > slowest)
+			slowest = took[b];
+	printf("time:    %.3f s virtual to commission %d devices, %.3f s wall\n",
+		slowest / 1e6, devices * buses, wall);
+	printf("result:  %s\n", ok ? "every device has its own short address" : "FAILED");
+
+	return ok ? 0 : 1;
+}
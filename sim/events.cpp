@@ -0,0 +1,231 @@
+/*
+	Runs input devices that send 24 bit event messages on a bus the master
+	is also driving, and checks that the controller gets every event.
+
+	-i input devices each raise events at random, -e a minute on average,
+	for -t seconds of virtual time.  Every second the master switches and
+	queries some of 16 gear and sends 24 bit commands to the input devices
+	through the command socket, one of which needs sending twice.  The
+	events reach the controller as records on the same connection.
+
+	Reported: events raised, heard and passed on intact, how long each
+	waited for the bus and then took to reach the controller, the 24 bit
+	frames seen on the bus against those asked for, and the gear answers.
+
+	usage: dali_events [-i inputs] [-e events_per_minute] [-t seconds] [-s seed]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <map>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_router.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES      16
+#define TYPE_BUTTON  1      // instance types, IEC 62386-301 and 303
+#define TYPE_SENSOR  3
+
+typedef struct {
+	sim::vtime_t raised;
+	sim::vtime_t started;
+	bool heard;
+} raised_t;
+
+static std::map<uint32_t, raised_t> raised;
+
+
+/* Event message from a short addressed input device: address, 0 for an
+   event, then the instance type and 10 bits of event information. */
+static uint32_t event_word(int input, int type, uint32_t info) {
+	return ((uint32_t)input << 17) | ((uint32_t)type << 10) | (info & 0x3FF);
+}
+
+
+int main(int argc, char **argv) {
+	int inputs = 8;
+	int per_minute = 30;
+	int seconds = 60;
+	int seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:e:t:s:")) != -1) {
+		switch (opt) {
+			case 'i': inputs = atoi(optarg); break;
+			case 'e': per_minute = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-i inputs] [-e events_per_minute] [-t seconds] [-s seed]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (inputs < 1 || inputs > 64 || per_minute < 1 || seconds < 1) {
+		fprintf(stderr, "inputs must be 1..64, events and seconds at least 1\n");
+		return 1;
+	}
+
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		gear.push_back(new SimGear(SimGear::default_config(i)));
+		bus.attach(gear.back());
+	}
+	std::vector<int> input;
+	for (int i = 0; i < inputs; i++)
+		input.push_back(bus.add_input());
+
+	EventQueue events;
+	DaliRouter router;
+	router.queue = &events;
+	Dali *master = new Dali(p30, p29);
+	master->coalesce = false;
+	router.add(master);
+
+	TCPSocket server, conn;
+	router.attach_server(&server);
+	server.sim_connect(&conn);
+
+	/* Each input's events at random, 1024 at most so the words stay unique */
+	std::mt19937 rng(seed);
+	std::exponential_distribution<double> gap(per_minute / 60e6);
+	sim::vtime_t end = (sim::vtime_t)seconds * 1000000;
+	uint32_t count = 0;
+	for (int i = 0; i < inputs; i++) {
+		sim::vtime_t t = 0;
+		for (uint32_t n = 0; n < 1024; n++) {
+			t += (sim::vtime_t)gap(rng) + 1;
+			if (t >= end)
+				break;
+			uint32_t word = event_word(i, (i & 1) ? TYPE_SENSOR : TYPE_BUTTON, n);
+			raised[word].raised = t;
+			raised[word].heard  = false;
+			int driver = input[i];
+			sim::schedule(t, [&bus, driver, word]() {
+				bus.send_event(driver, word, [word](sim::vtime_t at) { raised[word].started = at; });
+				sim::wake();
+			});
+			count++;
+		}
+	}
+
+	/* The master's second: 4 switched, 4 asked their device type, and to
+	   one input device IDENTIFY DEVICE, sent twice, and QUERY DEVICE STATUS */
+	uint32_t expected_24 = 0, correct = 0, wrong = 0, heard = 0, garbled = 0;
+	std::vector<uint32_t> sent_24;
+	double wait_sum = 0, deliver_sum = 0, wait_max = 0, deliver_max = 0;
+	size_t seen = 0;
+	int second = 0;
+
+	for (int k = 1; k <= seconds + 1; k++)
+		sim::schedule((sim::vtime_t)k * 1000000, sim::wake);
+	while (sim::now() < end + 1000000) {
+		if (sim::now() >= (sim::vtime_t)second * 1000000 && second < seconds) {
+			for (int k = 0; k < 4; k++) {
+				int a = (second * 4 + k) % DEVICES;
+				if (second & 1)
+					router.turn_off(0, a);
+				else
+					router.turn_on(0, a);
+				uint8_t expect = gear[a]->state().device_type;
+				router.query(0, (a << 9) | 0x199, [&correct, &wrong, expect](int status, uint8_t ans) {
+					if (status == DALI_ANSWER && ans == expect)
+						correct++;
+					else
+						wrong++;
+				});
+			}
+			uint8_t target = second % inputs;
+			static const uint8_t opcodes[] = { 0x00, 0x30 };
+			for (int k = 0; k < 2; k++) {
+				dali_payload_t rec;
+				memset(&rec, 0, sizeof(rec));
+				rec.control.is_req = 1;
+				rec.control.status = DALI_NET_FRAME_24;
+				rec.address  = (target << 1) | 1;
+				rec.command  = 0xFE;        // the device, not an instance
+				rec.response = opcodes[k];
+				conn.sim_inject(&rec, sizeof(rec));
+				uint32_t frame = (rec.address << 16) | (rec.command << 8) | rec.response;
+				sent_24.push_back(frame);
+				if (opcodes[k] == 0x00)
+					sent_24.push_back(frame);
+			}
+			second++;
+		}
+
+		__WFI();
+		events.dispatch(0);
+
+		std::deque<uint8_t> &out = conn.sim_sent();
+		while (out.size() >= (seen + 1) * DALI_NET_RECORD) {
+			dali_payload_t rec;
+			for (int b = 0; b < DALI_NET_RECORD; b++)
+				((uint8_t *)&rec)[b] = out[seen * DALI_NET_RECORD + b];
+			seen++;
+			if (rec.control.is_rsp || rec.control.is_req || rec.control.response_req)
+				continue;
+			uint32_t word = (rec.address << 16) | (rec.command << 8) | rec.response;
+			std::map<uint32_t, raised_t>::iterator it = raised.find(word);
+			if (it == raised.end() || it->second.heard) {
+				garbled++;
+				continue;
+			}
+			it->second.heard = true;
+			heard++;
+			double wait = (it->second.started - it->second.raised) / 1e3;
+			double deliver = (sim::now() - it->second.started) / 1e3;
+			wait_sum += wait;
+			deliver_sum += deliver;
+			if (wait > wait_max)
+				wait_max = wait;
+			if (deliver > deliver_max)
+				deliver_max = deliver;
+		}
+	}
+	expected_24 = sent_24.size();
+
+	/* The 24 bit frames on the bus, in order, master's first */
+	uint32_t frames_24 = 0, intact_24 = 0, events_on_bus = 0, malformed = 0;
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (!f.valid) {
+			malformed++;
+			continue;
+		}
+		if (f.bits != 24)
+			continue;
+		if (f.data & 0x10000) {
+			if (frames_24 < sent_24.size() && f.data == sent_24[frames_24])
+				intact_24++;
+			frames_24++;
+		} else {
+			events_on_bus++;
+		}
+	}
+
+	uint32_t stat_events = 0, stat_other = 0;
+	master->stat(DALI_STAT_HEARD, 0, &stat_events);
+	master->stat(DALI_STAT_HEARD, 1, &stat_other);
+
+	printf("inputs %d, %d events a minute each, %d s, 16 gear, seed %d\n", inputs, per_minute, seconds, seed);
+	printf("events:  %u raised, %u on the bus, %u heard by the master, %u passed on intact, "
+		"%u garbled, %u dropped\n", count, events_on_bus, stat_events, heard, garbled, router.events_dropped);
+	printf("timing:  waited for the bus %.1f ms on average, %.1f ms at worst\n",
+		heard ? wait_sum / heard : 0, wait_max);
+	printf("         start bit to controller %.1f ms on average, %.1f ms at worst\n",
+		heard ? deliver_sum / heard : 0, deliver_max);
+	printf("frames:  %u 24 bit commands asked for, %u on the bus, %u intact, %u malformed frames, "
+		"%u other frames heard while idle\n", expected_24, frames_24, intact_24, malformed, stat_other);
+	printf("gear:    %u answers correct, %u wrong\n", correct, wrong);
+
+	bool ok = heard == count && !garbled && intact_24 == expected_24 && frames_24 == expected_24
+		&& !malformed && !wrong && correct == (uint32_t)seconds * 4;
+	printf("result:  %s\n", ok ? "every event reached the controller" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,279 @@
+/*
+	Ramps 64 gear at once through DaliFade and checks how closely they
+	follow, what the ramps cost the bus and how long the commands given
+	meanwhile wait, next to sending each fixture its own DAPC every step.
+
+	The gear are in groups of eight, 0-7, and halves, 8 and 9.  Half a
+	second in, gear 0-31 ramp from 1 to 254 over -d ms and gear 32-47 to
+	128 over two thirds of that, while gear 48-63 each ramp alone to a
+	level and over a time of their own; four seconds in everything ramps
+	back down to 1 together.
+	Every -q ms something else asks one gear its actual level.
+
+	Reported, both ways: frames on the bus for the ramps, how far the
+	gear were from where their ramp should have had them, sampled every
+	10 ms, how late the last gear reached its level, and how long the
+	queries took to be answered.  The ramps are meant to be more than the
+	bus can carry: with -p at 50 the fade has half of it.
+
+	usage: dali_fade [-d ramp_ms] [-q query_ms] [-p share_percent]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_fade.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES   64
+#define SAMPLE    10000     // usec between samples of the gear levels
+#define START     500000    // usec, the ramps up
+#define DOWN      4000000   // usec, everything down
+
+typedef struct {
+	sim::vtime_t start;
+	uint32_t ms;
+	uint8_t from, to;
+} plan_t;
+
+typedef struct {
+	uint32_t frames;        // DAPC frames on the bus
+	uint32_t queries, answered;
+	double lag_sum, lag_max;   // ms from query() to its answer
+	double err_sum, err_max;   // levels the gear were off
+	uint32_t samples;
+	double late;            // ms the last gear reached its level after its ramp ended
+	uint32_t missed;        // gear that had not by the time they were ramped down
+	uint32_t deferred;
+	uint32_t frame_us;      // the bus's measure of a frame
+} run_t;
+
+
+/* Where a ramp should have a gear at t. */
+static double ideal(const plan_t &p, sim::vtime_t t) {
+	if (t <= p.start)
+		return p.from;
+	double f = (double)(t - p.start) / (p.ms * 1000.0);
+	if (f >= 1)
+		return p.to;
+	return p.from + (p.to - p.from) * f;
+}
+
+
+static void run(bool naive, int ramp_ms, int query_ms, int share, run_t &out) {
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		SimGear::config_t cfg = SimGear::default_config(i);
+		cfg.groups = (1 << (i / 8)) | (1 << (8 + i / 32));
+		gear.push_back(new SimGear(cfg));
+		bus.attach(gear.back());
+	}
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+	master->coalesce = false;
+
+	int learning = 1;
+	master->learn_groups([&]() { learning = 0; });
+	while (learning) {
+		__WFI();
+		events.dispatch(0);
+	}
+	master->send((uint16_t)0xFE01);     // everything at 1 to start from
+	while (master->is_busy()) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	DaliFade fade(master, &events);
+	fade.share = share;
+	fade.ramp(~(uint64_t)0, 1, 0);      // where the gear are, so far as the ramps know
+	events.dispatch(0);
+	while (fade.active() || master->is_busy()) {
+		__WFI();
+		events.dispatch(0);
+	}
+	bus.clear_frames();
+	sim::vtime_t t0 = sim::now();
+
+	/* The ramps, up then down */
+	std::vector<plan_t> up(DEVICES), down(DEVICES);
+	for (int i = 0; i < DEVICES; i++) {
+		plan_t &p = up[i];
+		p.start = t0 + START;
+		p.from  = 1;
+		if (i < 32) {
+			p.to = 254;
+			p.ms = ramp_ms;
+		} else if (i < 48) {
+			p.to = 128;
+			p.ms = ramp_ms * 2 / 3;
+		} else {
+			p.to = 20 + (i - 48) * 13;
+			p.ms = ramp_ms / 2 + (i - 48) * ramp_ms / 30;
+		}
+		down[i].start = t0 + DOWN;
+		down[i].from  = p.to;
+		down[i].to    = 1;
+		down[i].ms    = ramp_ms * 2 / 3;
+	}
+	sim::vtime_t end = t0 + DOWN + (sim::vtime_t)down[0].ms * 1000;
+
+	/* Either way the ramps start on the event queue */
+	std::vector<uint8_t> sent(DEVICES, 1);
+	std::function<void()> naive_step = [&]() {
+		sim::vtime_t t = sim::now();
+		bool more = false;
+		for (int i = 0; i < DEVICES; i++) {
+			const plan_t &p = (t >= t0 + DOWN) ? down[i] : up[i];
+			uint8_t w = (uint8_t)lround(ideal(p, t));
+			if (w != sent[i]) {
+				master->send((uint16_t)((i << 9) | w));
+				sent[i] = w;
+			}
+			if (t < p.start + (sim::vtime_t)p.ms * 1000)
+				more = true;
+		}
+		if (more || t < t0 + DOWN)
+			events.call_in(DALI_FADE_TICK, naive_step);
+	};
+	sim::schedule(t0 + START, [&]() {
+		if (naive) {
+			events.call(naive_step);
+		} else {
+			fade.ramp(0xFFFFFFFFull, 254, up[0].ms);
+			fade.ramp(0xFFFFull << 32, 128, up[32].ms);
+			for (int i = 48; i < DEVICES; i++)
+				fade.ramp(DALI_ADDR(i), up[i].to, up[i].ms);
+		}
+		sim::wake();
+	});
+	sim::schedule(t0 + DOWN, [&]() {
+		if (!naive)
+			events.call([&]() { fade.ramp(~(uint64_t)0, 1, down[0].ms); });
+		sim::wake();
+	});
+
+	/* Levels against the ramps, and when each gear got there */
+	out = run_t();
+	std::vector<sim::vtime_t> reached(DEVICES, 0);
+	std::function<void()> sample = [&]() {
+		sim::vtime_t t = sim::now();
+		if (t >= t0 + START) {
+			for (int i = 0; i < DEVICES; i++) {
+				const plan_t &p = (t >= t0 + DOWN) ? down[i] : up[i];
+				double err = fabs(gear[i]->state().level - ideal(p, t));
+				out.err_sum += err;
+				if (err > out.err_max)
+					out.err_max = err;
+				out.samples++;
+				if (t < t0 + DOWN && gear[i]->state().level == up[i].to && !reached[i])
+					reached[i] = t;
+			}
+		}
+		if (t + SAMPLE <= end)
+			sim::schedule(t + SAMPLE, sample);
+	};
+	sim::schedule(t0, sample);
+
+	/* The interactive queries */
+	std::function<void()> ask = [&]() {
+		sim::vtime_t asked = sim::now();
+		int a = (out.queries * 7) % DEVICES;
+		out.queries++;
+		events.call([&, asked, a]() {
+			master->query((a << 9) | 0x1A0, [&out, asked](int status, uint8_t) {
+				double lag = (sim::now() - asked) / 1e3;
+				if (status == DALI_ANSWER)
+					out.answered++;
+				out.lag_sum += lag;
+				if (lag > out.lag_max)
+					out.lag_max = lag;
+			});
+		});
+		sim::wake();
+		if (sim::now() + (sim::vtime_t)query_ms * 1000 < end)
+			sim::schedule(sim::now() + (sim::vtime_t)query_ms * 1000, ask);
+	};
+	sim::schedule(t0 + query_ms * 1000, ask);
+
+	sim::schedule(end + 1000000, sim::wake);
+	while (sim::now() < end + 1000000 || master->is_busy() || fade.active()) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	for (int i = 0; i < DEVICES; i++) {
+		sim::vtime_t due = up[i].start + (sim::vtime_t)up[i].ms * 1000;
+		if (!reached[i]) {
+			out.missed++;
+			continue;
+		}
+		double late = reached[i] > due ? (reached[i] - due) / 1e3 : 0;
+		if (late > out.late)
+			out.late = late;
+	}
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (f.valid && f.bits == 16 && !(f.data & 0x100))
+			out.frames++;
+	}
+	out.deferred = fade.deferred;
+	master->stat(DALI_STAT_FRAME_RATE, 1, &out.frame_us);
+	delete master;
+}
+
+
+static void report(const char *name, const run_t &r) {
+	printf("%-8s %u DAPC frames, gear %.2f levels off on average, %.0f at worst\n",
+		name, r.frames, r.samples ? r.err_sum / r.samples : 0, r.err_max);
+	printf("         %u of %d gear up before coming down, the last %.0f ms after its ramp ended\n",
+		DEVICES - r.missed, DEVICES, r.late);
+	printf("         %u queries, %u answered, %.1f ms on average, %.1f ms at worst\n",
+		r.queries, r.answered, r.queries ? r.lag_sum / r.queries : 0, r.lag_max);
+}
+
+
+int main(int argc, char **argv) {
+	int ramp_ms = 3000;
+	int query_ms = 200;
+	int share = DALI_FADE_SHARE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:q:p:")) != -1) {
+		switch (opt) {
+			case 'd': ramp_ms = atoi(optarg); break;
+			case 'q': query_ms = atoi(optarg); break;
+			case 'p': share = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-d ramp_ms] [-q query_ms] [-p share_percent]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (ramp_ms < 300 || ramp_ms > 3000 || query_ms < 20 || share < 1 || share > 100) {
+		fprintf(stderr, "ramps must take 300..3000 ms, queries 20 ms apart at least, share 1..100\n");
+		return 1;
+	}
+
+	run_t each, faded;
+	run(true, ramp_ms, query_ms, share, each);
+	run(false, ramp_ms, query_ms, share, faded);
+
+	printf("64 gear in groups of 8, ramps over %d ms, a query every %d ms, ramps take %d%% of the bus\n",
+		ramp_ms, query_ms, share);
+	report("each:", each);
+	report("fade:", faded);
+	printf("         %u fixtures' steps left for a later tick, frames measured at %u us\n",
+		faded.deferred, faded.frame_us);
+
+	bool ok = faded.answered == faded.queries && !faded.missed && faded.frames < each.frames
+		&& faded.lag_max < each.lag_max && faded.err_sum / faded.samples <= each.err_sum / each.samples;
+	printf("result:  %s\n", ok ? "ramps followed on fewer frames, queries answered sooner" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,304 @@
+/*
+	Journals a busy shared bus through DaliJournal and checks the file
+	against the frames the bus carried, next to writing each record to
+	the file as it comes, on the event queue, as a plain fwrite() would.
+
+	The master switches gear 0-7 with -m DAPC commands a second and asks
+	-q device types a second, one in four of an address with no gear; a
+	second controller and input devices share the bus as in dali_shared,
+	so some frames collide.  The store is the LocalFileSystem: every write
+	costs -o usec of semihosting overhead plus the bytes at -r KB/s, on
+	the writer thread for the journal and on the event queue for the old
+	way.
+
+	Reported: records and store writes, the journal against the bus, and
+	how late the event queue ran, from a probe posted every 10 ms, both
+	ways.  -f writes the journal to a file for tools/dali_journal.
+
+	usage: dali_journal [-m master/s] [-q queries/s] [-r store_KB/s] [-o write_overhead_us]
+	                    [-t seconds] [-s seed] [-f file]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_monitor.hpp"
+#include "dali_journal.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES      16
+#define ABSENT       40     // short address with no gear
+#define SETTLE_P2    14900  // usec, the second controller's settling time, priority 2
+#define LATENCY      200    // usec, the other transmitters'
+#define T0           1790000000     // RTC at the start of the run
+#define PROBE        10000  // usec between event queue probes
+
+static struct {
+	uint32_t store_rate;    // bytes per second
+	uint32_t overhead;      // us per write
+} model;
+
+typedef struct {
+	uint32_t frames;        // intact frames the master sent
+	uint32_t answers;       // intact answers
+	uint32_t queries;
+	uint32_t records;
+	uint32_t writes;
+	uint32_t lost;
+	double lag_sum, lag_max;
+	uint32_t probes;
+	std::vector<uint8_t> file;
+} run_t;
+
+
+static sim::vtime_t write_cost(uint32_t len) {
+	return model.overhead + (sim::vtime_t)len * 1000000 / model.store_rate;
+}
+
+
+/* ---- The store, with the writer thread modelled as scheduled events ---- */
+
+static DaliJournal *journal;
+static std::vector<uint8_t> *stored;
+
+static void store_append(const uint8_t *data, uint32_t len) {
+	stored->insert(stored->end(), data, data + len);
+	sim::schedule(sim::now() + write_cost(len), []() {
+		journal->written(true);
+		sim::wake();
+	});
+}
+
+
+static void run(bool old_way, int master_rate, int query_rate, int seconds, int seed, run_t &out) {
+	sim::reset();
+	set_time(T0);
+	SimBus bus(p29, p30);
+	for (int i = 0; i < DEVICES; i++)
+		bus.attach(new SimGear(SimGear::default_config(i)));
+	int ctrl = bus.add_input(SETTLE_P2, LATENCY);
+	std::vector<int> input;
+	for (int i = 0; i < 4; i++)
+		input.push_back(bus.add_input(SIM_SETTLE, LATENCY));
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+	master->coalesce = false;
+	master->listen([](uint32_t) {});
+
+	DaliMonitor monitor;
+	monitor.queue = &events;
+	monitor.add(master);
+
+	out = run_t();
+	stored = &out.file;
+	DaliJournal dj(&events, callback(store_append));
+	journal = &dj;
+	if (old_way) {
+		/* Each record written as it comes, the queue waits for it */
+		monitor.tap = [&out](const dali_mon_t &f) {
+			uint8_t kind = f.info & 3;
+			if (kind == DALI_MON_HEARD && !(f.info >> 4))
+				return;
+			uint8_t rec[DALI_LOG_RECORD] = { 0 };
+			memcpy(rec, &f.time, 4);
+			out.file.insert(out.file.end(), rec, rec + DALI_LOG_RECORD);
+			out.records++;
+			out.writes++;
+			sim::run_for(write_cost(DALI_LOG_RECORD));
+		};
+	} else {
+		monitor.tap = callback(&dj, &DaliJournal::frame);
+		dj.start();
+	}
+
+	std::mt19937 rng(seed);
+	sim::vtime_t end = (sim::vtime_t)seconds * 1000000;
+	std::exponential_distribution<double> gap(5 / 1e6);
+	sim::vtime_t t = 0;
+	for (uint32_t n = 0; (t += (sim::vtime_t)gap(rng) + 1) < end; n++) {
+		uint32_t frame = ((8 + n % 8) << 9) | (1 + n % 254);
+		sim::schedule(t, [&bus, ctrl, frame]() { bus.send(ctrl, frame, 16); });
+	}
+	std::exponential_distribution<double> event_gap(30 / 60e6);
+	for (int i = 0; i < 4; i++) {
+		sim::vtime_t t = 0;
+		for (uint32_t n = 0; n < 1024; n++) {
+			t += (sim::vtime_t)event_gap(rng) + 1;
+			if (t >= end)
+				break;
+			uint32_t word = ((uint32_t)i << 17) | (1 << 10) | n;
+			int in = input[i];
+			sim::schedule(t, [&bus, in, word]() { bus.send_event(in, word); });
+		}
+	}
+
+	/* The probe: how long a posted event waits for the queue */
+	std::function<void()> probe = [&]() {
+		sim::vtime_t posted = sim::now();
+		events.call([&out, posted]() {
+			double lag = (sim::now() - posted) / 1e3;
+			out.lag_sum += lag;
+			if (lag > out.lag_max)
+				out.lag_max = lag;
+			out.probes++;
+		});
+		sim::wake();
+		if (sim::now() + PROBE < end)
+			sim::schedule(sim::now() + PROBE, probe);
+	};
+	sim::schedule(PROBE, probe);
+
+	uint32_t count = 0, asked = 0;
+	sim::vtime_t step = 1000000 / master_rate, q_step = 1000000 / query_rate;
+	for (sim::vtime_t t = step; t <= end + 1000000; t += step)
+		sim::schedule(t, sim::wake);
+	while (sim::now() < end + 1000000 || master->is_busy() || bus.inputs_waiting()) {
+		while (count < (uint32_t)seconds * master_rate && sim::now() >= (count + 1) * step) {
+			master->send((uint16_t)(((count % 8) << 9) | (1 + count % 254)));
+			count++;
+		}
+		while (asked < (uint32_t)seconds * query_rate && sim::now() >= (asked + 1) * q_step) {
+			int a = (asked % 4 == 3) ? ABSENT : asked % 8;
+			master->query((a << 9) | 0x199, [](int, uint8_t) {});
+			asked++;
+		}
+		__WFI();
+		events.dispatch(0);
+	}
+	out.queries = asked;
+
+	/* What is left goes out */
+	if (!old_way) {
+		while (dj.pending()) {
+			dj.flush();
+			sim::run_for(1000);
+			events.dispatch(0);
+		}
+		out.records = dj.records;
+		out.writes  = dj.writes;
+		out.lost    = dj.lost;
+	}
+
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		uint8_t addr = (f.data >> 9) & 0x3F;
+		if (f.valid && f.bits == 16 && (addr < 8 || addr == ABSENT))
+			out.frames++;
+		else if (f.valid && f.bits == 8)
+			out.answers++;
+	}
+	delete master;
+}
+
+
+int main(int argc, char **argv) {
+	int master_rate = 10;
+	int query_rate = 4;
+	int seconds = 60;
+	int seed = 1;
+	const char *path = 0;
+	int opt;
+
+	model.store_rate = 64 * 1024;
+	model.overhead   = 3000;
+
+	while ((opt = getopt(argc, argv, "m:q:r:o:t:s:f:")) != -1) {
+		switch (opt) {
+			case 'm': master_rate = atoi(optarg); break;
+			case 'q': query_rate = atoi(optarg); break;
+			case 'r': model.store_rate = atoi(optarg) * 1024; break;
+			case 'o': model.overhead = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'f': path = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-m master/s] [-q queries/s] [-r store_KB/s] "
+					"[-o write_overhead_us] [-t seconds] [-s seed] [-f file]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (master_rate < 1 || query_rate < 1 || !model.store_rate || seconds < 1) {
+		fprintf(stderr, "rates and seconds must be at least 1\n");
+		return 1;
+	}
+
+	run_t old_run, run_j;
+	run(true, master_rate, query_rate, seconds, seed, old_run);
+	run(false, master_rate, query_rate, seconds, seed, run_j);
+
+	/* The journal read back */
+	uint32_t kinds[DALI_LOG_KINDS] = { 0 }, sent_ok = 0, empty = 0, answered = 0, garbled = 0;
+	uint32_t anchors = 0, bad = 0, time_err = 0, lost = 0;
+	uint32_t anchor_usec = 0, anchor_sec = 0;
+	for (size_t at = 0; at + DALI_LOG_RECORD <= run_j.file.size(); at += DALI_LOG_RECORD) {
+		dali_log_t r;
+		memcpy(&r, &run_j.file[at], DALI_LOG_RECORD);
+		if (r.kind >= DALI_LOG_KINDS) {
+			bad++;
+			continue;
+		}
+		kinds[r.kind]++;
+		if (r.kind == DALI_LOG_TIME) {
+			anchors++;
+			anchor_usec = r.usec;
+			anchor_sec  = r.data;
+			uint32_t truth = T0 + r.usec / 1000000;
+			if (r.data != truth)
+				time_err++;
+		} else if (r.kind == DALI_LOG_SENT && r.status == DALI_RX_OK) {
+			sent_ok++;
+			/* The anchor's seconds and the ticks since give the record's second */
+			int64_t us = (int64_t)anchor_sec * 1000000 + anchor_usec % 1000000 + (int32_t)(r.usec - anchor_usec);
+			if (us / 1000000 != T0 + r.usec / 1000000)
+				time_err++;
+		} else if (r.kind == DALI_LOG_ANSWER) {
+			if (r.status == DALI_RX_EMPTY)
+				empty++;
+			else if (r.status == DALI_RX_OK)
+				answered++;
+		} else if (r.kind == DALI_LOG_HEARD) {
+			garbled++;
+		} else if (r.kind == DALI_LOG_LOST) {
+			lost += r.data;
+		}
+	}
+
+	if (path) {
+		FILE *fp = fopen(path, "wb");
+		if (!fp || fwrite(&run_j.file[0], 1, run_j.file.size(), fp) != run_j.file.size()) {
+			perror(path);
+			return 1;
+		}
+		fclose(fp);
+	}
+
+	printf("master %d/s, %d queries/s, %d s; store %u KB/s, %u us a write\n", master_rate, query_rate,
+		seconds, model.store_rate / 1024, model.overhead);
+	printf("old way:  %u records, %u writes, event queue %.2f ms late on average, %.2f ms at worst\n",
+		old_run.records, old_run.writes, old_run.lag_sum / old_run.probes, old_run.lag_max);
+	printf("journal:  %u records, %u writes, %zu bytes, %u lost, event queue %.2f ms late on average, "
+		"%.2f ms at worst\n", run_j.records, run_j.writes, run_j.file.size(), run_j.lost,
+		run_j.lag_sum / run_j.probes, run_j.lag_max);
+	printf("file:     %u sent, %u answer windows: %u answered, %u empty; %u garbled heard, %u anchors, "
+		"%u start, %u reported lost\n", kinds[DALI_LOG_SENT], kinds[DALI_LOG_ANSWER], answered, empty,
+		garbled, anchors, kinds[DALI_LOG_START], lost);
+	printf("bus:      %u intact frames from the master, %u answers, %u queries; %u records with the "
+		"wrong second, %u unreadable\n", run_j.frames, run_j.answers, run_j.queries, time_err, bad);
+
+	/* Records the store could not keep up with are counted, the rest must
+	   all be there */
+	bool whole = run_j.lost ? sent_ok <= run_j.frames && answered <= run_j.answers
+		: sent_ok == run_j.frames && answered == run_j.answers && kinds[DALI_LOG_ANSWER] == run_j.queries;
+	bool ok = whole && !bad && !time_err && lost == run_j.lost && kinds[DALI_LOG_START] == 1
+		&& anchors == run_j.writes
+		&& run_j.file.size() == (run_j.records + anchors + kinds[DALI_LOG_LOST]) * DALI_LOG_RECORD;
+	printf("result:   %s\n", !ok ? "FAILED" : run_j.lost ? "every record journaled or reported lost"
+		: "every frame and answer journaled");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#include <chrono>
+#include "mbed.h"
+
+LPC_TIM_TypeDef sim_tim[4] = { LPC_TIM_TypeDef(0), LPC_TIM_TypeDef(1),
+                               LPC_TIM_TypeDef(2), LPC_TIM_TypeDef(3) };
+LPC_SC_TypeDef sim_sc;
+DWT_Type sim_dwt;
+CoreDebug_Type sim_coredebug;
+time_t sim_rtc_base;
+
+SimCycleCount::operator uint32_t() const {
+#if defined(__x86_64__) || defined(__i386__)
+	return (uint32_t)__builtin_ia32_rdtsc();
+#else
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	return (uint32_t)ns;
+#endif
+}
@@ -0,0 +1,374 @@
+#ifndef DALI_SIM_MBED_H
+#define DALI_SIM_MBED_H
+
+/*
+	Minimal stand-in for mbed.h so that dali/ builds on a Linux host.
+
+	Only the parts of the mbed-os and CMSIS API that the Dali core touches are
+	provided.  Peripheral accesses are forwarded to the model in sim.hpp, the
+	networking classes model a single in-memory connection.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include "sim.hpp"
+
+
+/* ---- Pins (LPC1768 mbed DIP40 names) ---- */
+typedef enum {
+	p5 = 5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15, p16, p17, p18,
+	p19, p20, p21, p22, p23, p24, p25, p26, p27, p28, p29, p30,
+	LED1 = 100, LED2, LED3, LED4,
+	USBTX = 110, USBRX,
+	NC = -1
+} PinName;
+
+
+/* ---- CMSIS ---- */
+typedef enum {
+	TIMER0_IRQn = 1,
+	TIMER1_IRQn = 2,
+	TIMER2_IRQn = 3,
+	TIMER3_IRQn = 4,
+	EINT3_IRQn  = 21       // GPIO interrupts share it
+} IRQn_Type;
+
+inline void NVIC_SetVector(IRQn_Type irq, uintptr_t vector) {
+	sim::nvic_set_vector(irq, (void (*)(void))vector);
+}
+inline void NVIC_SetPriority(IRQn_Type, uint32_t) {}
+inline void NVIC_EnableIRQ(IRQn_Type irq)  { sim::nvic_enable(irq, true); }
+inline void NVIC_DisableIRQ(IRQn_Type irq) { sim::nvic_enable(irq, false); }
+
+/* Handlers only run between events, so nothing can preempt the caller. */
+inline void __disable_irq(void) {}
+inline void __enable_irq(void) {}
+inline void __WFI(void) { sim::wait_for_interrupt(); }
+inline void __DMB(void) { std::atomic_signal_fence(std::memory_order_seq_cst); }
+inline void core_util_critical_section_enter(void) {}
+inline void core_util_critical_section_exit(void) {}
+/* The DWT cycle counter counts host cycles, the time stamp counter where
+   there is one, else nanoseconds.  ISR times are host times, as with
+   sim::isr_stats(). */
+class SimCycleCount {
+public:
+	operator uint32_t() const;
+};
+
+typedef struct {
+	uint32_t CTRL;
+	SimCycleCount CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type sim_dwt;
+extern CoreDebug_Type sim_coredebug;
+
+#define DWT        (&sim_dwt)
+#define CoreDebug  (&sim_coredebug)
+#define DWT_CTRL_CYCCNTENA_Msk      (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk  (1UL << 24)
+
+#define MBED_ASSERT(expr) do { if (!(expr)) { \
+	fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #expr); abort(); } } while (0)
+
+
+/* A timer register: reads and writes go through the peripheral model. */
+class SimTimerReg {
+public:
+	SimTimerReg(int timer, int reg) : _timer(timer), _reg(reg) {}
+	operator uint32_t() const { return sim::timer_read(_timer, _reg); }
+	SimTimerReg &operator=(uint32_t v) { sim::timer_write(_timer, _reg, v); return *this; }
+	SimTimerReg &operator=(const SimTimerReg &r) { return *this = (uint32_t)r; }
+	SimTimerReg &operator|=(uint32_t v) { return *this = (uint32_t)*this | v; }
+	SimTimerReg &operator&=(uint32_t v) { return *this = (uint32_t)*this & v; }
+	SimTimerReg &operator+=(uint32_t v) { return *this = (uint32_t)*this + v; }
+private:
+	int _timer;
+	int _reg;
+};
+
+typedef struct LPC_TIM_TypeDef {
+	LPC_TIM_TypeDef(int n) :
+		IR(n, sim::TREG_IR), TCR(n, sim::TREG_TCR), TC(n, sim::TREG_TC),
+		PR(n, sim::TREG_PR), PC(n, sim::TREG_PC), MCR(n, sim::TREG_MCR),
+		MR0(n, sim::TREG_MR0), MR1(n, sim::TREG_MR1), MR2(n, sim::TREG_MR2),
+		MR3(n, sim::TREG_MR3), CCR(n, sim::TREG_CCR), CR0(n, sim::TREG_CR0),
+		CR1(n, sim::TREG_CR1), EMR(n, sim::TREG_EMR), CTCR(n, sim::TREG_CTCR) {}
+	SimTimerReg IR, TCR, TC, PR, PC, MCR, MR0, MR1, MR2, MR3, CCR, CR0, CR1, EMR, CTCR;
+} LPC_TIM_TypeDef;
+
+typedef struct {
+	uint32_t PCLKSEL0;
+	uint32_t PCLKSEL1;
+	uint32_t PCONP;
+} LPC_SC_TypeDef;
+
+extern LPC_TIM_TypeDef sim_tim[4];
+extern LPC_SC_TypeDef sim_sc;
+
+#define LPC_TIM0 (&sim_tim[0])
+#define LPC_TIM1 (&sim_tim[1])
+#define LPC_TIM2 (&sim_tim[2])
+#define LPC_TIM3 (&sim_tim[3])
+#define LPC_SC   (&sim_sc)
+
+
+/* ---- Callbacks and events ---- */
+template <typename F> class Callback;
+
+template <typename R, typename... A>
+class Callback<R(A...)> : public std::function<R(A...)> {
+public:
+	Callback() {}
+	template <typename F> Callback(F f) : std::function<R(A...)>(f) {}
+	template <typename T> Callback(T *obj, R (T::*method)(A...)) :
+		std::function<R(A...)>([obj, method](A... a) { return (obj->*method)(a...); }) {}
+};
+
+template <typename T, typename R, typename... A>
+Callback<R(A...)> callback(T *obj, R (T::*method)(A...)) {
+	return Callback<R(A...)>(obj, method);
+}
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*fn)(A...)) {
+	return Callback<R(A...)>(fn);
+}
+
+/* ---- Drivers ---- */
+class DigitalOut {
+public:
+	DigitalOut(PinName pin) : _pin(pin) {}
+	DigitalOut(PinName pin, int value) : _pin(pin) { write(value); }
+	void write(int value) { sim::pin_write(_pin, value); }
+	int read() { return sim::pin_read(_pin); }
+	DigitalOut &operator=(int value) { write(value); return *this; }
+	operator int() { return read(); }
+private:
+	PinName _pin;
+};
+
+/* Pin function select, as PINSEL.  Function 3 of these pins is a timer
+   capture input (CAPn.ch) on the LPC1768 DIP, anything else leaves the pin
+   as GPIO. */
+inline void pin_function(PinName pin, int function) {
+	int timer = -1, channel = 0;
+	if (function == 3) {
+		switch (pin) {
+			case p30: timer = 2; channel = 0; break;   // P0.4 CAP2.0
+			case p29: timer = 2; channel = 1; break;   // P0.5 CAP2.1
+			case p15: timer = 3; channel = 0; break;   // P0.23 CAP3.0
+			case p16: timer = 3; channel = 1; break;   // P0.24 CAP3.1
+			default: break;
+		}
+	}
+	sim::pin_route_capture(pin, timer, channel);
+}
+
+/* Edge interrupts are pended with sim::raise_irq(), so the handler runs in
+   interrupt context after whatever caused the edge. */
+class InterruptIn {
+public:
+	InterruptIn(PinName pin) : _pin(pin) {
+		pin_function(pin, 0);
+		sim::pin_set_listener(pin, [this](int, int level) {
+			Callback<void()> &cb = level ? _rise : _fall;
+			if (cb)
+				sim::raise_irq(cb);
+		});
+	}
+	int read() { return sim::pin_read(_pin); }
+	operator int() { return read(); }
+	void rise(Callback<void()> cb) { _rise = cb; }
+	void fall(Callback<void()> cb) { _fall = cb; }
+private:
+	PinName _pin;
+	Callback<void()> _rise;
+	Callback<void()> _fall;
+};
+
+class Serial {
+public:
+	Serial(PinName, PinName, int baud = 9600) { (void)baud; }
+	int printf(const char *fmt, ...) {
+		va_list ap;
+		va_start(ap, fmt);
+		int n = vprintf(fmt, ap);
+		va_end(ap);
+		return n;
+	}
+};
+
+inline uint32_t us_ticker_read(void) { return (uint32_t)sim::now(); }
+
+namespace Kernel {
+	inline uint64_t get_ms_count(void) { return sim::now() / 1000; }
+}
+/* The RTC counts virtual seconds on from what set_time() gave it. */
+extern time_t sim_rtc_base;
+inline void set_time(time_t t) { sim_rtc_base = t - (time_t)(sim::now() / 1000000); }
+inline time_t sim_rtc_read(time_t *t) {
+	time_t now = sim_rtc_base + (time_t)(sim::now() / 1000000);
+	if (t) *t = now;
+	return now;
+}
+#define time(t) sim_rtc_read(t)
+
+inline void wait_us(int us) { sim::run_for(us); }
+inline void wait(float s) { sim::run_for((sim::vtime_t)(s * 1e6f)); }
+
+
+/* Posted events are run by dispatch(), which the host driver calls. */
+class EventQueue {
+public:
+	EventQueue(unsigned size = 0) { (void)size; }
+
+	template <typename F, typename... A>
+	int call(F f, A... a) {
+		_events.push_back([=]() { f(a...); });
+		return (int)_events.size();
+	}
+
+	template <typename T, typename R, typename... A, typename... B>
+	int call(T *obj, R (T::*method)(A...), B... b) {
+		_events.push_back([=]() { (obj->*method)(b...); });
+		return (int)_events.size();
+	}
+
+	/* Posted once ms of virtual time have passed, the timer that fires it
+	   wakes __WFI() like the RTOS tick would. */
+	template <typename T, typename R, typename... A, typename... B>
+	int call_in(int ms, T *obj, R (T::*method)(A...), B... b) {
+		std::function<void()> fn = [=]() { (obj->*method)(b...); };
+		sim::schedule(sim::now() + (sim::vtime_t)ms * 1000, [this, fn]() {
+			_events.push_back(fn);
+			sim::wake();
+		});
+		return 1;
+	}
+
+	template <typename F, typename... A>
+	int call_in(int ms, F f, A... a) {
+		std::function<void()> fn = [=]() { f(a...); };
+		sim::schedule(sim::now() + (sim::vtime_t)ms * 1000, [this, fn]() {
+			_events.push_back(fn);
+			sim::wake();
+		});
+		return 1;
+	}
+
+	void dispatch(int ms = -1) {
+		(void)ms;
+		while (!_events.empty()) {
+			std::function<void()> fn = _events.front();
+			_events.pop_front();
+			fn();
+		}
+	}
+
+	unsigned pending() const { return (unsigned)_events.size(); }
+
+private:
+	std::deque<std::function<void()> > _events;
+};
+
+class EventFlags {
+public:
+	EventFlags() : _flags(0) {}
+	uint32_t set(uint32_t f) { return _flags |= f; }
+	uint32_t clear(uint32_t f) { uint32_t o = _flags; _flags &= ~f; return o; }
+	uint32_t get() const { return _flags; }
+private:
+	uint32_t _flags;
+};
+
+
+/* ---- Networking: an in-memory TCP connection ----
+
+	A listening socket hands out the connection queued with sim_connect().
+	The host side feeds bytes with sim_inject(), which raises sigio like data
+	arriving from the network, and collects whatever the firmware sent from
+	sim_sent().  sim_hangup() makes recv() report the peer's close.  Each of
+	these counts as an Ethernet interrupt and wakes __WFI(). */
+typedef int nsapi_error_t;
+typedef int nsapi_size_or_error_t;
+
+enum {
+	NSAPI_ERROR_OK          = 0,
+	NSAPI_ERROR_WOULD_BLOCK = -3001,
+	NSAPI_ERROR_NO_SOCKET   = -3005
+};
+
+class TCPSocket {
+public:
+	TCPSocket() : _pending(0), _hangup(false), _closed(false), _window(0) {}
+
+	TCPSocket *accept(nsapi_error_t *err) {
+		TCPSocket *s = _pending;
+		_pending = 0;
+		if (err) *err = s ? NSAPI_ERROR_OK : NSAPI_ERROR_WOULD_BLOCK;
+		return s;
+	}
+	nsapi_size_or_error_t recv(void *buf, unsigned size) {
+		if (_closed) return NSAPI_ERROR_NO_SOCKET;
+		if (_rx.empty()) return _hangup ? 0 : NSAPI_ERROR_WOULD_BLOCK;
+		unsigned n = 0;
+		for (; n < size && !_rx.empty(); n++) {
+			((uint8_t *)buf)[n] = _rx.front();
+			_rx.pop_front();
+		}
+		return (nsapi_size_or_error_t)n;
+	}
+	nsapi_size_or_error_t send(const void *buf, unsigned size) {
+		if (_closed) return NSAPI_ERROR_NO_SOCKET;
+		if (_window) {
+			if (_tx.size() >= _window) return NSAPI_ERROR_WOULD_BLOCK;
+			if (size > _window - _tx.size()) size = _window - (unsigned)_tx.size();
+		}
+		_tx.insert(_tx.end(), (const uint8_t *)buf, (const uint8_t *)buf + size);
+		return (nsapi_size_or_error_t)size;
+	}
+	void set_blocking(bool) {}
+	void set_timeout(int) {}
+	void sigio(Callback<void()> cb) { _sigio = cb; }
+	nsapi_error_t close() { _closed = true; return NSAPI_ERROR_OK; }
+
+	/* Host side */
+	void sim_connect(TCPSocket *s) { _pending = s; raise(); }
+	void sim_inject(const void *buf, unsigned size) {
+		_rx.insert(_rx.end(), (const uint8_t *)buf, (const uint8_t *)buf + size);
+		raise();
+	}
+	void sim_hangup() { _hangup = true; raise(); }
+	std::deque<uint8_t> &sim_sent() { return _tx; }
+	/* At most bytes sent and not yet taken from sim_sent(), 0 for no limit;
+	   sim_drained() after taking some signals the room. */
+	void sim_window(unsigned bytes) { _window = bytes; }
+	void sim_drained() { raise(); }
+	unsigned sim_unread() const { return (unsigned)_rx.size(); }
+	bool sim_closed() const { return _closed; }
+
+private:
+	TCPSocket *_pending;
+	bool _hangup;
+	bool _closed;
+	unsigned _window;
+	std::deque<uint8_t> _rx, _tx;
+	Callback<void()> _sigio;
+
+	void raise() { sim::wake(); if (_sigio) _sigio(); }
+};
+
+#endif
@@ -0,0 +1,271 @@
+/*
+	Streams a shared bus from the monitor port and checks it against the
+	frames the bus carried.
+
+	The master switches gear 0-7 with -m DAPC commands a second and asks
+	one its device type every second, a second controller switches gear
+	8-15 with -c a second and -i input devices raise events, -e a minute
+	on average, as in dali_shared.  A client reads the monitor port at -r bytes a second,
+	0 for as fast as it comes, through a -w byte socket window.
+
+	Every intact frame on the bus should be in the stream once, as SENT if
+	the master sent it, ANSWER if it answers the master, else HEARD, with
+	the time of its start bit and its length to the last edge.  Frames
+	lost to a slow client should add up to the DROPPED records.
+
+	Reported: frames on the bus and in the stream by kind, those matched,
+	missing and unexpected, the worst time and length error, records
+	dropped, and bus occupancy measured from the stream against the bus.
+
+	usage: dali_monitor [-m master/s] [-c controller/s] [-i inputs] [-e events_per_minute]
+	                    [-r bytes_per_second] [-w window] [-t seconds] [-s seed]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <map>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_monitor.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES      16
+#define SETTLE_P2    14900  // usec, the second controller's settling time, priority 2
+#define LATENCY      200    // usec, the other transmitters'
+#define TIME_SLACK   4      // usec a timestamp may be off
+#define LENGTH_SLACK 4      // usec a length may be off
+
+static const char *kinds[] = { "sent", "answer", "heard", "dropped" };
+
+
+int main(int argc, char **argv) {
+	int master_rate = 10;
+	int ctrl_rate = 5;
+	int inputs = 4;
+	int per_minute = 30;
+	int rate = 0;
+	int window = 2048;
+	int seconds = 60;
+	int seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:c:i:e:r:w:t:s:")) != -1) {
+		switch (opt) {
+			case 'm': master_rate = atoi(optarg); break;
+			case 'c': ctrl_rate = atoi(optarg); break;
+			case 'i': inputs = atoi(optarg); break;
+			case 'e': per_minute = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-m master/s] [-c controller/s] [-i inputs] [-e events_per_minute] "
+					"[-r bytes_per_second] [-w window] [-t seconds] [-s seed]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (master_rate < 1 || ctrl_rate < 0 || inputs < 0 || inputs > 32 || per_minute < 1
+		|| rate < 0 || window < DALI_MON_RECORD || seconds < 1) {
+		fprintf(stderr, "rates must be positive, inputs 0..32, the window at least a record, "
+			"seconds at least 1\n");
+		return 1;
+	}
+
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		gear.push_back(new SimGear(SimGear::default_config(i)));
+		bus.attach(gear.back());
+	}
+	int ctrl = bus.add_input(SETTLE_P2, LATENCY);
+	std::vector<int> input;
+	for (int i = 0; i < inputs; i++)
+		input.push_back(bus.add_input(SIM_SETTLE, LATENCY));
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+	master->coalesce = false;
+	master->listen([](uint32_t) {});
+
+	DaliMonitor monitor;
+	monitor.queue = &events;
+	monitor.add(master);
+	TCPSocket server, conn;
+	monitor.attach_server(&server);
+	conn.sim_window(window);
+	server.sim_connect(&conn);
+
+	std::mt19937 rng(seed);
+	sim::vtime_t end = (sim::vtime_t)seconds * 1000000;
+
+	/* The second controller's commands and the events, as in dali_shared */
+	if (ctrl_rate) {
+		std::exponential_distribution<double> gap(ctrl_rate / 1e6);
+		sim::vtime_t t = 0;
+		uint32_t n = 0;
+		while ((t += (sim::vtime_t)gap(rng) + 1) < end) {
+			uint32_t frame = ((8 + n % 8) << 9) | (1 + n % 254);
+			sim::schedule(t, [&bus, ctrl, frame]() { bus.send(ctrl, frame, 16); });
+			n++;
+		}
+	}
+	std::exponential_distribution<double> event_gap(per_minute / 60e6);
+	for (int i = 0; i < inputs; i++) {
+		sim::vtime_t t = 0;
+		for (uint32_t n = 0; n < 1024; n++) {
+			t += (sim::vtime_t)event_gap(rng) + 1;
+			if (t >= end)
+				break;
+			uint32_t word = ((uint32_t)i << 17) | (1 << 10) | n;
+			int in = input[i];
+			sim::schedule(t, [&bus, in, word]() { bus.send_event(in, word); });
+		}
+	}
+
+	/* The client's reads, every 10 ms */
+	for (sim::vtime_t t = 10000; t <= end + 2000000; t += 10000)
+		sim::schedule(t, sim::wake);
+
+	std::vector<uint8_t> stream;
+	double credit = 0;
+	sim::vtime_t last_read = 0;
+	uint32_t master_count = 0;
+	sim::vtime_t step = 1000000 / master_rate;
+
+	while (sim::now() < end + 1000000 || master->is_busy() || bus.inputs_waiting()) {
+		while (master_count < (uint32_t)seconds * master_rate && sim::now() >= (master_count + 1) * step) {
+			master->send((uint16_t)(((master_count % 8) << 9) | (1 + master_count % 254)));
+			if (master_count % master_rate == 0) {
+				int a = (master_count / master_rate) % 8;
+				master->query((a << 9) | 0x199, [](int, uint8_t) {});
+			}
+			master_count++;
+		}
+		__WFI();
+		events.dispatch(0);
+
+		std::deque<uint8_t> &out = conn.sim_sent();
+		credit += rate ? (sim::now() - last_read) * rate / 1e6 : out.size();
+		last_read = sim::now();
+		size_t n = out.size() < credit ? out.size() : (size_t)credit;
+		if (n) {
+			stream.insert(stream.end(), out.begin(), out.begin() + n);
+			out.erase(out.begin(), out.begin() + n);
+			credit -= n;
+			conn.sim_drained();
+			events.dispatch(0);
+		}
+		if (!rate)
+			credit = 0;
+	}
+
+	/* What is left, read at once */
+	conn.sim_window(0);
+	conn.sim_drained();
+	events.dispatch(0);
+	std::deque<uint8_t> &out = conn.sim_sent();
+	stream.insert(stream.end(), out.begin(), out.end());
+	out.clear();
+
+	/* The stream */
+	bool header_ok = stream.size() >= DALI_MON_HEADER && !memcmp(&stream[0], "DMON", 4)
+		&& stream[4] == DALI_MON_VERSION && stream[5] == DALI_MON_RECORD && stream[6] == 1;
+	std::vector<dali_mon_t> rec;
+	uint32_t kind_count[4] = { 0 }, dropped = 0;
+	for (size_t at = DALI_MON_HEADER; at + DALI_MON_RECORD <= stream.size(); at += DALI_MON_RECORD) {
+		const uint8_t *b = &stream[at];
+		dali_mon_t m;
+		m.time   = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+		m.data   = b[4] | (b[5] << 8) | (b[6] << 16) | ((uint32_t)b[7] << 24);
+		m.length = b[8] | (b[9] << 8);
+		m.bits   = b[10];
+		m.info   = b[11];
+		kind_count[m.info & 3]++;
+		if ((m.info & 3) == DALI_MON_DROPPED)
+			dropped += m.data;
+		else
+			rec.push_back(m);
+	}
+
+	/* Each intact frame on the bus against the stream, by start time */
+	std::multimap<uint32_t, size_t> by_time;
+	for (size_t i = 0; i < rec.size(); i++)
+		by_time.insert(std::make_pair(rec[i].time, i));
+	std::vector<bool> used(rec.size(), false);
+	uint32_t good = 0, garbled = 0, matched = 0, missing = 0, wrong_kind = 0, errors = 0;
+	uint32_t time_err = 0, length_err = 0;
+	double bus_busy = 0, stream_busy = 0;
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (!f.valid) {
+			garbled++;
+			continue;
+		}
+		good++;
+		uint32_t length = (uint32_t)(f.end - f.start) - ((f.data & 1) ? SIM_TE : 0);
+		bus_busy += length;
+
+		int expect = (f.bits == 8) ? DALI_MON_ANSWER
+			: (f.bits == 16 && !(f.data & 0x1000)) ? DALI_MON_SENT : DALI_MON_HEARD;
+		std::multimap<uint32_t, size_t>::iterator it = by_time.lower_bound((uint32_t)f.start - TIME_SLACK);
+		for (; it != by_time.end() && it->first <= (uint32_t)f.start + TIME_SLACK; it++) {
+			const dali_mon_t &m = rec[it->second];
+			if (used[it->second] || m.bits != f.bits || m.data != f.data)
+				continue;
+			used[it->second] = true;
+			break;
+		}
+		if (it == by_time.end() || it->first > (uint32_t)f.start + TIME_SLACK) {
+			missing++;
+			continue;
+		}
+		const dali_mon_t &m = rec[it->second];
+		matched++;
+		if ((m.info & 3) != expect)
+			wrong_kind++;
+		uint32_t dt = (m.time > f.start) ? m.time - (uint32_t)f.start : (uint32_t)f.start - m.time;
+		uint32_t dl = (m.length > length) ? m.length - length : length - m.length;
+		if (dt > time_err)
+			time_err = dt;
+		if (dl > length_err)
+			length_err = dl;
+	}
+	uint32_t unexpected = 0;
+	for (size_t i = 0; i < rec.size(); i++) {
+		stream_busy += rec[i].length;
+		if (rec[i].info >> 4)
+			errors++;
+		else if (!used[i])
+			unexpected++;
+	}
+
+	printf("master %d/s, controller %d/s, %d inputs %d events a minute, %d s; client %s, %d byte window\n",
+		master_rate, ctrl_rate, inputs, per_minute, seconds, rate ? "limited" : "unlimited", window);
+	if (rate)
+		printf("client:  reads %d bytes a second\n", rate);
+	printf("stream:  header %s, %zu bytes, %zu frames:", header_ok ? "ok" : "BAD", stream.size(), rec.size());
+	for (int k = 0; k < 4; k++)
+		printf(" %u %s", kind_count[k], kinds[k]);
+	printf("\n");
+	printf("bus:     %u intact frames, %u garbled; %u in the stream, %u missing, %u of the wrong kind\n",
+		good, garbled, matched, missing, wrong_kind);
+	printf("         %u frames reported with a decode error, %u not on the bus\n", errors, unexpected);
+	printf("timing:  start bit time within %u us, length within %u us\n", time_err, length_err);
+	printf("busy:    %.3f%% from the stream, %.3f%% on the bus\n",
+		100 * stream_busy / sim::now(), 100 * bus_busy / sim::now());
+	printf("monitor: %u records taken, %u dropped, %u reported dropped\n",
+		monitor.frames, monitor.dropped, dropped);
+
+	bool ok = header_ok && !wrong_kind && !unexpected && time_err <= TIME_SLACK
+		&& length_err <= LENGTH_SLACK && dropped == monitor.dropped
+		&& rec.size() == monitor.frames && missing <= dropped && (rate || !dropped);
+	printf("result:  %s\n", ok ? (dropped ? "every frame in the stream or counted dropped"
+		: "every frame on the bus in the stream") : "FAILED");
+	return ok ? 0 : 1;
+}
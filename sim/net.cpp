@@ -0,0 +1,455 @@
+/*
+	Streams dali_payload_t records to the command socket over one persistent
+	connection, the way the building controller does, and checks the
+	responses that come back.
+
+	Each round switches every gear on, asks its device type, switches it
+	off again and ends with a repeated (send twice) broadcast.  The whole
+	session is written to the socket in chunks of -c bytes, regardless of
+	record boundaries, and the firmware is left to pace it onto the bus.
+
+	Then single commands are sent at random moments on an idle bus, -l of
+	them, to time command-to-bus latency (socket write to the first edge of
+	the forward frame) and count how often the main thread wakes.  This runs
+	twice: with the socket handlers hooked to sigio and the EventQueue, as
+	main.cpp does now, and with the old loop that polled each socket with a
+	1 ms accept() timeout.
+
+	The session's counters are then read back over the same connection, as
+	a monitoring tool would, and the frame count checked against the bus.
+
+	Last, a controller polls one device's level and status, -q queries, and
+	the time from socket write to response is measured with the shadow
+	cache answering and with it turned off.
+
+	usage: dali_net [-n devices] [-r rounds] [-c chunk_bytes] [-l commands]
+	                [-q queries]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_router.hpp"
+#include "sim_bus.hpp"
+
+#define POLL_TIMEOUT 1000     // us, set_timeout(1) on each listening socket
+
+
+static dali_payload_t request(uint8_t addr, uint8_t cmd, bool rsp, bool repeat) {
+	dali_payload_t p;
+	memset(&p, 0, sizeof(p));
+	p.control.is_req       = 1;
+	p.control.response_req = rsp;
+	p.control.repeat       = repeat;
+	p.address              = addr;
+	p.command              = cmd;
+	return p;
+}
+
+
+/* Reads one counter over the command socket, both halves of it. */
+static bool read_stat(TCPSocket &conn, EventQueue &events, uint8_t item, uint8_t index, uint32_t *value) {
+	dali_payload_t req[2];
+	for (int i = 0; i < 2; i++) {
+		memset(&req[i], 0, sizeof(req[i]));
+		req[i].control.response_req = 1;
+		req[i].address = item;
+		req[i].command = index | (i ? 0x80 : 0);
+	}
+	conn.sim_inject(req, sizeof(req));
+	events.dispatch(0);
+
+	std::deque<uint8_t> &out = conn.sim_sent();
+	if (out.size() < sizeof(req))
+		return false;
+	dali_payload_t rsp[2];
+	for (int i = 0; i < 2; i++) {
+		uint8_t rec[DALI_NET_RECORD];
+		for (int j = 0; j < DALI_NET_RECORD; j++) {
+			rec[j] = out.front();
+			out.pop_front();
+		}
+		memcpy(&rsp[i], rec, sizeof(rsp[i]));
+		if (!rsp[i].control.is_rsp || rsp[i].control.status != DALI_ANSWER)
+			return false;
+	}
+	*value = ((uint32_t)rsp[1].response << 24) | (rsp[0].address << 16)
+		| (rsp[0].command << 8) | rsp[0].response;
+	return true;
+}
+
+static uint32_t stat(TCPSocket &conn, EventQueue &events, uint8_t item, uint8_t index) {
+	uint32_t v = 0;
+	if (!read_stat(conn, events, item, index, &v))
+		printf("stats:   item %u index %u unreadable\n", item, index);
+	return v;
+}
+
+
+typedef struct {
+	double mean_us;
+	double max_us;
+	double wakeups;         // main thread wakeups per second, ISRs not counted
+	uint32_t lost;
+} latency_t;
+
+
+/* Sends commands one at a time on an idle bus and times each to its first
+   edge on the bus. */
+static latency_t latency(int commands, bool poll) {
+	sim::reset();
+	SimBus bus(p29, p30);
+	bus.attach(new SimGear(SimGear::default_config(0)));
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	DaliRouter router;
+	router.queue = &events;
+	router.add(master);
+
+	TCPSocket server, conn;
+	if (poll) {
+		server.sim_connect(&conn);
+		router.server_sigio(&server);
+	} else {
+		router.attach_server(&server);
+		server.sim_connect(&conn);
+		events.dispatch(0);
+	}
+
+	/* A command every 100-200 ms, well apart from the previous frame */
+	static dali_payload_t cmd = request(1, 0x05, false, false);
+	std::mt19937 rng(7);
+	std::vector<sim::vtime_t> sent;
+	sim::vtime_t t = sim::now();
+	for (int i = 0; i < commands; i++) {
+		t += 100000 + rng() % 100000;
+		sent.push_back(t);
+		sim::schedule(t, [&conn]() { conn.sim_inject(&cmd, sizeof(cmd)); });
+	}
+	sim::vtime_t end = t + 100000;
+	sim::schedule(end, []() { sim::wake(); });
+	size_t frames0 = bus.frames().size();
+	sim::vtime_t t0 = sim::now();
+
+	uint64_t wakeups = 0;
+	while (sim::now() < end) {
+		if (poll) {
+			/* main() before: updater.accept(), server.accept() and the
+				client, each accept() sleeping out its timeout */
+			sim::run_for(POLL_TIMEOUT);
+			sim::run_for(POLL_TIMEOUT);
+			router.server_sigio(&server);
+			router.client_sigio(router.client);
+			master->process();
+			events.dispatch(0);     // commands held for coalescing
+			wakeups += 2;
+		} else {
+			/* the ISRs wake the core in either case, the thread only
+				runs when something was posted */
+			__WFI();
+			if (events.pending())
+				wakeups++;
+			events.dispatch(0);
+		}
+	}
+	sim::run_for(10000);
+	delete master;
+
+	latency_t r = { 0, 0, 0, 0 };
+	size_t n = 0;
+	for (size_t i = frames0; i < bus.frames().size() && n < sent.size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (!f.valid || f.bits != 16)
+			continue;
+		double us = (double)(f.start - sent[n++]);
+		r.mean_us += us;
+		if (us > r.max_us)
+			r.max_us = us;
+	}
+	r.mean_us = n ? r.mean_us / n : 0;
+	r.lost = (uint32_t)(sent.size() - n);
+	r.wakeups = wakeups / ((end - t0) / 1e6);
+	return r;
+}
+
+
+typedef struct {
+	double mean_us;
+	double max_us;
+	uint32_t answered;
+	uint32_t frames;        // forward frames on the bus
+	uint32_t hits;
+} poll_t;
+
+
+/* Polls QUERY ACTUAL LEVEL and QUERY STATUS of one device in turn, a query
+   every 100-200 ms, and times each from socket write to response. */
+static poll_t poll_latency(int queries, bool cache) {
+	sim::reset();
+	SimBus bus(p29, p30);
+	bus.attach(new SimGear(SimGear::default_config(0)));
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	DaliRouter router;
+	router.queue = &events;
+	router.add(master);
+	if (!cache)
+		for (int f = 0; f < DALI_SHADOW_FIELDS; f++)
+			master->shadow.max_age[f] = 0;
+
+	TCPSocket server, conn;
+	router.attach_server(&server);
+	server.sim_connect(&conn);
+	events.dispatch(0);
+
+	static dali_payload_t level = request(1, 0xA0, true, false);
+	static dali_payload_t status = request(1, 0x90, true, false);
+	std::mt19937 rng(11);
+	std::vector<sim::vtime_t> sent;
+	sim::vtime_t t = sim::now();
+	for (int i = 0; i < queries; i++) {
+		t += 100000 + rng() % 100000;
+		sent.push_back(t);
+		dali_payload_t *q = (i & 1) ? &status : &level;
+		sim::schedule(t, [&conn, q]() { conn.sim_inject(q, sizeof(*q)); });
+	}
+	sim::vtime_t end = t + 100000;
+	sim::schedule(end, []() { sim::wake(); });
+
+	poll_t r = { 0, 0, 0, 0, 0 };
+	while (sim::now() < end) {
+		__WFI();
+		events.dispatch(0);
+		while (conn.sim_sent().size() >= (r.answered + 1) * DALI_NET_RECORD && r.answered < sent.size()) {
+			double us = (double)(sim::now() - sent[r.answered++]);
+			r.mean_us += us;
+			if (us > r.max_us)
+				r.max_us = us;
+		}
+	}
+	r.mean_us = r.answered ? r.mean_us / r.answered : 0;
+	for (size_t i = 0; i < bus.frames().size(); i++)
+		if (bus.frames()[i].valid && bus.frames()[i].bits == 16)
+			r.frames++;
+	r.hits = master->shadow.hits;
+	delete master;
+	return r;
+}
+
+
+int main(int argc, char **argv) {
+	int devices = 16;
+	int rounds = 10;
+	int chunk = 1460;       // one full TCP segment
+	int commands = 200;
+	int queries = 200;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:c:l:q:")) != -1) {
+		switch (opt) {
+			case 'n': devices = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'c': chunk = atoi(optarg); break;
+			case 'l': commands = atoi(optarg); break;
+			case 'q': queries = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n devices] [-r rounds] [-c chunk_bytes] [-l commands] "
+					"[-q queries]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (devices < 1 || devices > 64 || chunk < 1) {
+		fprintf(stderr, "devices must be 1..64, chunk at least 1\n");
+		return 1;
+	}
+
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < devices; i++) {
+		SimGear::config_t cfg = SimGear::default_config(i);
+		cfg.device_type = (i % 3 == 0) ? 6 : 0;
+		gear.push_back(new SimGear(cfg));
+		bus.attach(gear.back());
+	}
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	DaliRouter router;
+	router.queue = &events;
+	router.add(master);
+
+	/* The session, and the responses it should produce in order */
+	std::vector<dali_payload_t> session;
+	std::vector<int> expected;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < devices; i++)
+			session.push_back(request((i << 1) | 1, 0x05, false, false));
+		for (int i = 0; i < devices; i++) {
+			session.push_back(request((i << 1) | 1, 0x99, true, false));
+			expected.push_back(gear[i]->state().device_type);
+		}
+		for (int i = 0; i < devices; i++)
+			session.push_back(request((i << 1) | 1, 0x00, false, false));
+		session.push_back(request(0xFF, 0x21, false, true));   // STORE ACTUAL LEVEL IN DTR, twice
+		session.push_back(request(0xFF, DALI_RECALL_MAX, false, false));
+	}
+	const uint8_t *bytes = (const uint8_t *)&session[0];
+	size_t total = session.size() * DALI_NET_RECORD;
+
+	TCPSocket server, conn;
+	router.attach_server(&server);
+	server.sim_connect(&conn);
+
+	auto wall0 = std::chrono::steady_clock::now();
+	sim::vtime_t t0 = sim::now();
+
+	size_t sent = 0;
+	while (sent < total || master->is_busy() || events.pending()) {
+		if (sent < total) {
+			size_t n = total - sent < (size_t)chunk ? total - sent : (size_t)chunk;
+			conn.sim_inject(bytes + sent, (unsigned)n);
+			sent += n;
+		}
+		if (master->is_busy())
+			__WFI();
+		events.dispatch(0);
+	}
+	sim::run_for(10000);
+	events.dispatch(0);
+
+	sim::vtime_t elapsed = sim::now() - t0;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall0).count();
+
+	/* Responses */
+	std::deque<uint8_t> &out = conn.sim_sent();
+	uint32_t rsp = 0, correct = 0, wrong = 0, missing = 0, bad = 0;
+	while (out.size() >= DALI_NET_RECORD) {
+		uint8_t rec[DALI_NET_RECORD];
+		for (int i = 0; i < DALI_NET_RECORD; i++) {
+			rec[i] = out.front();
+			out.pop_front();
+		}
+		dali_payload_t p;
+		memcpy(&p, rec, sizeof(p));
+		if (!p.control.is_rsp || p.control.is_req || rsp >= expected.size()) {
+			bad++;
+			continue;
+		}
+		int dev = rsp % devices;
+		if (p.address != ((dev << 1) | 1) || p.command != 0x99)
+			bad++;
+		else if (p.control.status == DALI_NO_ANSWER)
+			missing++;
+		else if (p.control.status == DALI_ANSWER && p.response == expected[rsp])
+			correct++;
+		else
+			wrong++;
+		rsp++;
+	}
+
+	uint32_t fwd = 0;
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (f.valid && f.bits == 16)
+			fwd++;
+	}
+	uint32_t lit = 0;
+	for (int i = 0; i < devices; i++)
+		lit += gear[i]->state().level != 0;
+
+	printf("devices %d, rounds %d, %u byte writes on one connection\n", devices, rounds, chunk);
+	printf("records: %u sent, %u forward frames on the bus, %u queries answered from the shadow\n",
+		(unsigned)session.size(), fwd, master->shadow.hits);
+	printf("time:    %.3f s virtual, %.3f s wall, %.1f records/s\n",
+		elapsed / 1e6, wall, session.size() / (elapsed / 1e6));
+	printf("rsp:     %u of %u, %u correct, %u wrong, %u missing, %u out of order%s\n",
+		rsp, (unsigned)expected.size(), correct, wrong, missing, bad,
+		conn.sim_closed() ? ", connection closed" : "");
+	printf("gear:    %u of %d lit after final broadcast\n", lit, devices);
+
+	bool ok = rsp == expected.size() && correct == rsp && !bad;
+
+	/* The counters, read as a monitoring tool would */
+	static const char *rx_names[DALI_RX_STATUS_COUNT] = {
+		"ok", "no answer", "short low", "short high", "mid low", "mid high",
+		"long low", "long high", "bad start", "bad bit", "too long", "overrun", "collision"
+	};
+	uint32_t frames = stat(conn, events, DALI_STAT_FRAMES, 0);
+	printf("stats:   isr match %u, worst %u cycles; isr edge %u, worst %u cycles\n",
+		stat(conn, events, DALI_STAT_ISR_COUNT, DALI_ISR_MATCH),
+		stat(conn, events, DALI_STAT_ISR_WORST, DALI_ISR_MATCH),
+		stat(conn, events, DALI_STAT_ISR_COUNT, DALI_ISR_EDGE),
+		stat(conn, events, DALI_STAT_ISR_WORST, DALI_ISR_EDGE));
+	printf("         %u frames, %u frames/s, tx queue %u now %u most, rx edges %u most %u windows lost\n",
+		frames, stat(conn, events, DALI_STAT_FRAME_RATE, 0),
+		stat(conn, events, DALI_STAT_TX_QUEUE, 0), stat(conn, events, DALI_STAT_TX_QUEUE, 1),
+		stat(conn, events, DALI_STAT_RX_EDGES, 0), stat(conn, events, DALI_STAT_RX_EDGES, 1));
+	printf("         answer windows:");
+	for (int i = 0; i < DALI_RX_STATUS_COUNT; i++) {
+		uint32_t n = stat(conn, events, DALI_STAT_RX_STATUS, i);
+		if (n)
+			printf(" %s %u", rx_names[i], n);
+	}
+	printf("\n         answer delay, TE after the last bit:");
+	for (int i = 0; i < DALI_LAT_BUCKETS; i++) {
+		uint32_t n = stat(conn, events, DALI_STAT_LATENCY, i);
+		if (n)
+			printf(" %d%s:%u", i, i == DALI_LAT_BUCKETS - 1 ? "+" : "", n);
+	}
+	printf("\n");
+	uint32_t none;
+	if (frames != fwd || read_stat(conn, events, DALI_STAT_ITEMS, 0, &none))
+		ok = false;
+
+	/* A query for a bus that is not fitted is answered, with an error */
+	dali_payload_t nobus = request(0x01, 0x90, true, false);
+	nobus.control.bus = DALI_MAX_BUSES - 1;
+	conn.sim_sent().clear();
+	conn.sim_inject(&nobus, sizeof(nobus));
+	events.dispatch(0);
+	dali_payload_t back;
+	std::deque<uint8_t> &reply = conn.sim_sent();
+	bool answered = reply.size() == sizeof(back);
+	for (size_t i = 0; answered && i < sizeof(back); i++) {
+		((uint8_t *)&back)[i] = reply.front();
+		reply.pop_front();
+	}
+	answered = answered && back.control.is_rsp && back.control.status == DALI_ANSWER_ERROR;
+	printf("         a query for bus %d, not fitted: %s\n", DALI_MAX_BUSES - 1,
+		answered ? "answered with an error" : "NOT ANSWERED");
+	if (!answered)
+		ok = false;
+	delete master;
+
+	if (commands > 0) {
+		latency_t ev = latency(commands, false);
+		latency_t pl = latency(commands, true);
+		printf("latency: %d commands, socket write to first edge on the bus\n", commands);
+		printf("  accept() polling  mean %6.0f us  max %6.0f us  %5.0f thread wakeups/s  %u lost\n",
+			pl.mean_us, pl.max_us, pl.wakeups, pl.lost);
+		printf("  sigio+EventQueue  mean %6.0f us  max %6.0f us  %5.0f thread wakeups/s  %u lost\n",
+			ev.mean_us, ev.max_us, ev.wakeups, ev.lost);
+		printf("  (the first half bit goes out %d us after the frame is started)\n", TE);
+	}
+
+	if (queries > 0) {
+		poll_t on = poll_latency(queries, true);
+		poll_t off = poll_latency(queries, false);
+		printf("queries: %d level and status polls, socket write to response\n", queries);
+		printf("  shadow off        mean %6.0f us  max %6.0f us  %4u frames on the bus  %u answered\n",
+			off.mean_us, off.max_us, off.frames, off.answered);
+		printf("  shadow on         mean %6.0f us  max %6.0f us  %4u frames on the bus  %u answered, %u from the shadow\n",
+			on.mean_us, on.max_us, on.frames, on.answered, on.hits);
+		if (on.answered != (uint32_t)queries || off.answered != (uint32_t)queries)
+			ok = false;
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+#ifndef DALI_SIM_PINMAP_H
+#define DALI_SIM_PINMAP_H
+
+/* pin_function() lives in the mbed.h shim */
+#include "mbed.h"
+
+#endif
@@ -0,0 +1,237 @@
+/*
+	Wall switch presses, scheduled changes and a status sweep of 64 gear on
+	one bus at once, with the traffic classes and with everything in one
+	queue, as it all used to be.
+
+	The sweep asks every gear QUERY STATUS in turn, -s queries out at once,
+	for the whole run.  Every second a scheduled
+	change sets one group of eight to a level, and every 300 to 1100 ms
+	someone at a switch turns one gear on or off.
+
+	Reported, both ways: how long from each press to its frame's start bit
+	on the bus, at worst and on average, against the bus's own measure of a
+	frame, and how many forward frames went first that had not already
+	been taken for the bus; the same for the scheduled changes; and how
+	many status answers the sweep got.  The gear must end where both runs
+	leave them, the classes only change when frames go, not what each gear
+	sees.
+
+	usage: dali_priority [-t seconds] [-s sweep_slots]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES   64
+#define START     200000    // usec, the first press and change
+#define TAKEN     1000      // usec, a frame starting this soon after was already on its way
+
+typedef struct {
+	sim::vtime_t given;
+	uint16_t frame;
+} given_t;
+
+typedef struct {
+	double sum, max;        // ms from given to the start bit
+	uint32_t count, missing;
+	uint32_t ahead;         // most frames that started in between
+} lag_t;
+
+typedef struct {
+	lag_t press, change;
+	uint32_t swept;         // status answers
+	uint32_t frame_us;
+	uint32_t class_wait[DALI_CLASSES];
+	std::vector<int> levels;
+} run_t;
+
+
+/* Each given frame against the first frame like it on the bus after it. */
+static void match(const std::vector<sim_frame_t> &frames, const std::vector<given_t> &given, lag_t &out) {
+	std::vector<uint8_t> used(frames.size(), 0);
+	out = lag_t();
+	for (size_t i = 0; i < given.size(); i++) {
+		size_t j = 0;
+		while (j < frames.size() && (used[j] || !frames[j].valid || frames[j].bits != 16
+				|| frames[j].data != given[i].frame || frames[j].start < given[i].given))
+			j++;
+		if (j == frames.size()) {
+			out.missing++;
+			continue;
+		}
+		used[j] = 1;
+		uint32_t ahead = 0;
+		for (size_t k = 0; k < j; k++) {
+			if (frames[k].start > given[i].given + TAKEN && frames[k].bits != 8)
+				ahead++;
+		}
+		if (ahead > out.ahead)
+			out.ahead = ahead;
+		double lag = (frames[j].start - given[i].given) / 1e3;
+		out.sum += lag;
+		if (lag > out.max)
+			out.max = lag;
+		out.count++;
+	}
+}
+
+
+static void run(bool classes, int seconds, int slots, run_t &out) {
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		SimGear::config_t cfg = SimGear::default_config(i);
+		cfg.groups = 1 << (i / 8);
+		gear.push_back(new SimGear(cfg));
+		bus.attach(gear.back());
+	}
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+
+	int learning = 1;
+	master->learn_groups([&]() { learning = 0; });
+	while (learning) {
+		__WFI();
+		events.dispatch(0);
+	}
+	bus.clear_frames();
+	sim::vtime_t t0  = sim::now();
+	sim::vtime_t end = t0 + (sim::vtime_t)seconds * 1000000;
+
+	/* One queue: the class every frame would have been in before */
+	auto as = [&](uint8_t cls) { return master->set_class(classes ? cls : (uint8_t)DALI_CLASS_SCHEDULED); };
+
+	/* The sweep, slots queries out at a time for as long as the run lasts */
+	out = run_t();
+	int next = 0;
+	std::function<void()> sweep;
+	std::function<void(int, uint8_t)> swept = [&](int status, uint8_t) {
+		if (status == DALI_ANSWER)
+			out.swept++;
+		if (sim::now() < end)
+			sweep();
+	};
+	sweep = [&]() {
+		uint8_t cls = as(DALI_CLASS_BACKGROUND);
+		master->query(dali_command(dali_short(next), DALI_QUERY_STATUS), swept);
+		master->set_class(cls);
+		next = (next + 1) % DEVICES;
+	};
+	sim::schedule(t0, [&]() {
+		events.call([&]() {
+			for (int i = 0; i < slots; i++)
+				sweep();
+		});
+		sim::wake();
+	});
+
+	/* Someone at a switch */
+	std::vector<given_t> presses, changes;
+	uint32_t rnd = 12345;
+	std::function<void()> press = [&]() {
+		int a = (presses.size() * 13) % DEVICES;
+		bool on = (presses.size() / DEVICES) % 2 == 0;
+		presses.push_back({ sim::now(), (uint16_t)((a << 9) | (on ? 0x100 | DALI_RECALL_MAX : 0x100 | DALI_OFF)) });
+		events.call([&, a, on]() {
+			uint8_t cls = as(DALI_CLASS_INTERACTIVE);
+			if (on)
+				master->turn_on(a);
+			else
+				master->turn_off(a);
+			master->set_class(cls);
+		});
+		sim::wake();
+		rnd = rnd * 1103515245 + 12345;
+		sim::vtime_t gap = 300000 + (rnd >> 8) % 800000;
+		if (sim::now() + gap < end)
+			sim::schedule(sim::now() + gap, press);
+	};
+	sim::schedule(t0 + START, press);
+
+	/* And the schedule */
+	std::function<void()> change = [&]() {
+		uint8_t g = changes.size() % 8;
+		uint8_t level = 40 + (changes.size() * 37) % 200;
+		changes.push_back({ sim::now(), dali_dapc(dali_group(g), level).frame });
+		events.call([&, g, level]() {
+			uint8_t cls = as(DALI_CLASS_SCHEDULED);
+			master->send(dali_dapc(dali_group(g), level));
+			master->set_class(cls);
+		});
+		sim::wake();
+		if (sim::now() + 1000000 < end)
+			sim::schedule(sim::now() + 1000000, change);
+	};
+	sim::schedule(t0 + START + 100000, change);
+
+	sim::schedule(end, sim::wake);
+	while (sim::now() < end || master->is_busy()) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	match(bus.frames(), presses, out.press);
+	match(bus.frames(), changes, out.change);
+	for (int i = 0; i < DEVICES; i++)
+		out.levels.push_back(gear[i]->state().level);
+	master->stat(DALI_STAT_FRAME_RATE, 1, &out.frame_us);
+	for (int c = 0; c < DALI_CLASSES; c++)
+		master->stat(DALI_STAT_CLASS, DALI_CLASSES + c, &out.class_wait[c]);
+	delete master;
+	for (size_t i = 0; i < gear.size(); i++)
+		delete gear[i];
+}
+
+
+static void report(const char *name, const run_t &r) {
+	printf("%-8s presses on the bus after %.1f ms on average, %.1f ms at worst, %u frames ahead, %u missing\n",
+		name, r.press.count ? r.press.sum / r.press.count : 0, r.press.max, r.press.ahead, r.press.missing);
+	printf("         scheduled changes after %.1f ms on average, %.1f ms at worst, %u frames ahead, %u missing\n",
+		r.change.count ? r.change.sum / r.change.count : 0, r.change.max, r.change.ahead, r.change.missing);
+	printf("         %u status answers, frames measured at %u us\n", r.swept, r.frame_us);
+}
+
+
+int main(int argc, char **argv) {
+	int seconds = 30;
+	int slots = 12;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+		switch (opt) {
+			case 't': seconds = atoi(optarg); break;
+			case 's': slots = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-t seconds] [-s sweep_slots]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (seconds < 2 || slots < 1 || slots > DALI_QUERY_SLOTS - 2) {
+		fprintf(stderr, "the run takes 2 s at least, the sweep 1..%d query slots\n", DALI_QUERY_SLOTS - 2);
+		return 1;
+	}
+
+	run_t flat, classes;
+	run(false, seconds, slots, flat);
+	run(true, seconds, slots, classes);
+
+	printf("64 gear swept with %d queries out, a switch pressed every 0.3-1.1 s, a group changed every second, %d s\n",
+		slots, seconds);
+	report("one:", flat);
+	report("classes:", classes);
+	printf("         longest waits by class %.1f, %.1f and %.1f ms\n", classes.class_wait[DALI_CLASS_INTERACTIVE] / 1e3,
+		classes.class_wait[DALI_CLASS_SCHEDULED] / 1e3, classes.class_wait[DALI_CLASS_BACKGROUND] / 1e3);
+
+	bool ok = !classes.press.missing && !classes.change.missing && classes.levels == flat.levels
+		&& !classes.press.ahead && classes.press.max < flat.press.max
+		&& classes.swept * 10 >= flat.swept * 9;
+	printf("result:  %s\n", ok ? "every press the next frame on the bus, the gear left as before" : "FAILED");
+	return ok ? 0 : 1;
+}
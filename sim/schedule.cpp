@@ -0,0 +1,261 @@
+/*
+	Runs a weekly schedule of -e events against a bus of 64 gear for -d days
+	of virtual time and checks that every event fired in the right minute,
+	and that the gear end up where the schedule left them.
+
+	Events cluster on the quarter hours, as real schedules do, with random
+	days of the week, targets (short addresses mostly, some groups and
+	broadcasts) and actions.  The gear are in groups of four so that per
+	address commands of the same minute can be coalesced.
+
+	Reported: how long after the start of its minute each frame went out,
+	and what each tick cost in events looked at, against the whole schedule
+	that scanning every event every minute would look at.
+
+	Then a minute with more events than the bus takes at once, whose
+	pending events are removed while its retry waits: the minute must end
+	there, none of the events already sent may go again.
+
+	The simulator builds with DALI_SCHED_EVENTS raised to 16384 so that
+	large schedules can be tried, the firmware keeps 1024.
+
+	usage: dali_schedule [-e events] [-d days] [-s seed]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_router.hpp"
+#include "dali_schedule.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES  64
+#define CROWD    48             // events of the minute removed from
+#define MONDAY   1791763200     // 2026-10-12 00:00:00 UTC
+
+typedef struct {
+	uint16_t minute;
+	uint8_t  days;
+	uint8_t  target;
+	uint8_t  action;
+	uint8_t  level;
+} event_t;
+
+
+/* What one event does to the model of the gear. */
+static void apply(const event_t &e, std::vector<int> &level) {
+	for (int i = 0; i < DEVICES; i++) {
+		bool hit = e.target == DALI_TARGET_BROADCAST || e.target == i
+			|| e.target == DALI_TARGET_GROUP(i / 4);
+		if (!hit)
+			continue;
+		if (e.action == DALI_SCHED_ON)
+			level[i] = 254;
+		else if (e.action == DALI_SCHED_OFF || e.level == 0)
+			level[i] = 0;
+		else if (e.level != 0xFF)
+			level[i] = e.level;
+	}
+}
+
+
+/* Removes what is left of a minute while it waits for room on the bus.
+   True if only the events sent before went out, once each. */
+static bool remove_pending(DaliRouter &router, EventQueue &events, SimBus &bus,
+                           std::vector<SimGear *> &gear, uint32_t *sent) {
+	DaliSchedule *crowd = new DaliSchedule(&router, &events);
+	for (int n = 0; n < CROWD; n++)
+		crowd->add(12, 0, DALI_EVERY_DAY, 0, n, DALI_SCHED_LEVEL, 10 + n);
+
+	set_time(MONDAY + 12 * 3600 - 30);
+	sim::vtime_t end = sim::now() + 150 * 1000000;
+	sim::schedule(end, sim::wake);
+	bus.clear_frames();
+	crowd->start();
+	while (!crowd->retries && sim::now() < end) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	/* Ids are given in order, the first not sent is where the retry starts */
+	uint32_t k = crowd->fired;
+	for (int n = CROWD - 1; n >= (int)k; n--)
+		crowd->remove(n);
+	while (sim::now() < end) {
+		__WFI();
+		events.dispatch(0);
+	}
+	crowd->stop();
+	while (router.is_busy()) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	uint32_t frames = 0;
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		if (bus.frames()[i].valid && bus.frames()[i].bits == 16)
+			frames++;
+	}
+	bool right = true;
+	for (int n = 0; n < CROWD; n++) {
+		if (n < (int)k && gear[n]->state().level != 10 + n)
+			right = false;
+	}
+	*sent = k;
+	return k > 0 && k < CROWD && crowd->fired == k && frames == k && right;
+}
+
+
+int main(int argc, char **argv) {
+	int count = 1000;
+	int days = 7;
+	int seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:d:s:")) != -1) {
+		switch (opt) {
+			case 'e': count = atoi(optarg); break;
+			case 'd': days = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-e events] [-d days] [-s seed]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (count < 1 || count > DALI_SCHED_EVENTS || days < 1) {
+		fprintf(stderr, "events must be 1..%d, days at least 1\n", DALI_SCHED_EVENTS);
+		return 1;
+	}
+
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		SimGear::config_t cfg = SimGear::default_config(i);
+		cfg.groups = 1 << (i / 4);
+		gear.push_back(new SimGear(cfg));
+		bus.attach(gear.back());
+	}
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	DaliRouter router;
+	router.queue = &events;
+	router.add(master);
+
+	int learning = 1;
+	master->learn_groups([&]() { learning = 0; });
+	while (learning) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	/* The schedule */
+	std::mt19937 rng(seed);
+	static const uint8_t day_sets[] = { DALI_EVERY_DAY, 0x3E, 0x41, 0x3E, DALI_EVERY_DAY };
+	DaliSchedule *schedule = new DaliSchedule(&router, &events);
+	std::vector<event_t> list;
+	for (int n = 0; n < count; n++) {
+		event_t e;
+		e.minute = (rng() % 24) * 60 + ((rng() % 10 < 7) ? (rng() % 4) * 15 : rng() % 60);
+		e.days   = (rng() % 4) ? day_sets[rng() % sizeof(day_sets)] : (rng() % 127) + 1;
+		uint32_t t = rng() % 100;
+		e.target = (t < 85) ? rng() % DEVICES : (t < 95) ? DALI_TARGET_GROUP(rng() % 16)
+			: DALI_TARGET_BROADCAST;
+		e.action = rng() % 3;
+		e.level  = (e.action == DALI_SCHED_LEVEL) ? 1 + rng() % 254 : 0;
+		if (schedule->add(e.minute / 60, e.minute % 60, e.days, 0, e.target, e.action, e.level) < 0) {
+			fprintf(stderr, "add failed\n");
+			return 1;
+		}
+		list.push_back(e);
+	}
+
+	/* Start half a minute before Monday, every event at its minute of the
+	   week in the order added */
+	set_time(MONDAY - 30);
+	sim::vtime_t t0 = sim::now();
+	bus.clear_frames();
+	schedule->start();
+
+	std::vector<int> level(DEVICES);
+	for (int i = 0; i < DEVICES; i++)
+		level[i] = gear[i]->state().level;
+	uint32_t expected = 0;
+	uint64_t scanned = 0;
+	uint32_t minutes = days * 1440;
+	for (uint32_t m = 0; m < minutes; m++) {
+		uint32_t week_minute = DALI_SCHED_DAY + m;     // Monday on
+		uint8_t day = DALI_DAY((week_minute / DALI_SCHED_DAY) % 7);
+		for (size_t i = 0; i < list.size(); i++) {
+			scanned++;
+			if (list[i].minute == week_minute % DALI_SCHED_DAY && (list[i].days & day)) {
+				expected++;
+				apply(list[i], level);
+			}
+		}
+	}
+
+	auto wall0 = std::chrono::steady_clock::now();
+	sim::vtime_t end = t0 + (30 + (sim::vtime_t)minutes * 60 - 1) * 1000000;
+	sim::schedule(end, sim::wake);  // stop before the next tick
+	while (sim::now() < end) {
+		__WFI();
+		events.dispatch(0);
+	}
+	schedule->stop();
+	while (router.is_busy()) {
+		__WFI();
+		events.dispatch(0);
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall0).count();
+
+	/* When in its minute each frame started */
+	double sum = 0, worst = 0;
+	uint32_t frames = 0, late = 0;
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (!f.valid || f.bits != 16)
+			continue;
+		double into = (double)((f.start - t0 + 30000000) % 60000000) / 1e6;
+		sum += into;
+		if (into > worst)
+			worst = into;
+		if (into >= 1.0)
+			late++;
+		frames++;
+	}
+
+	uint32_t wrong = 0;
+	for (int i = 0; i < DEVICES; i++)
+		if (gear[i]->state().level != level[i])
+			wrong++;
+
+	uint32_t coalesced, sent;
+	master->coalesce_stats(&coalesced, &sent);
+	printf("events %d on 64 gear, %d days from Monday 00:00, seed %d\n", count, days, seed);
+	printf("fired:   %u commands of %u expected in %u ticks, %u frames on the bus, %u retries, %u minutes skipped\n",
+		schedule->fired, expected, schedule->ticks, frames, schedule->retries, schedule->skipped);
+	printf("         %u per address commands coalesced into %u frames\n", coalesced, sent);
+	printf("timing:  frames start %.3f s into their minute on average, %.3f s at worst, %u after the first second\n",
+		frames ? sum / frames : 0, worst, late);
+	printf("cost:    %.2f events looked at per tick, scanning the schedule looks at %u\n",
+		(double)schedule->examined / schedule->ticks, (unsigned)list.size());
+	printf("         %llu against %llu over the run, %.3f s wall\n",
+		(unsigned long long)schedule->examined, (unsigned long long)scanned, wall);
+	printf("gear:    %u of %d at the level the schedule left them\n", DEVICES - wrong, DEVICES);
+
+	bool ok = schedule->fired == expected && schedule->ticks == minutes && !wrong && !schedule->skipped;
+
+	uint32_t before;
+	bool removed = remove_pending(router, events, bus, gear, &before);
+	printf("remove:  %u of %d events sent before the retry, the rest removed, %s\n", before, CROWD,
+		removed ? "none sent again" : "WRONG");
+	ok = ok && removed;
+	printf("result:  %s\n", ok ? "every event fired in its minute" : "FAILED");
+	return ok ? 0 : 1;
+}
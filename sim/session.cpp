@@ -0,0 +1,285 @@
+/*
+	Replays a lighting session against the virtual buses and reports
+	throughput, ISR cost and backward frame decode results.
+
+	With -b the session runs on every bus at once through DaliRouter.  Bus 0
+	is the NXP board's p30/p29 on TIMER2 with hardware capture, the others
+	use TIMER0 and TIMER1 with Rx edges timestamped by GPIO interrupts.
+
+	The gear are put in groups of -g consecutive short addresses and the
+	master learns them before the session, so the per address turn_on() and
+	turn_off() runs go out as group and broadcast frames.  -c sends every
+	command as given for comparison.
+
+	Cheap gear on a long bus answer off the nominal half bit time: -d
+	spreads the half bit time of the gear's answers evenly over +/- that
+	many percent, -k delays every rising edge they send by that many usec
+	and -j jitters each edge.  Answers are decoded with adaptive windows
+	unless -f asks for the fixed ones.  -i inverts the Tx pin as well as
+	the Rx pin.
+
+	usage: dali_session [-n devices] [-r rounds] [-j jitter_us] [-b buses]
+	                    [-g group_size] [-c] [-d drift_%] [-k skew_us] [-f] [-i]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_router.hpp"
+#include "sim_bus.hpp"
+
+#define MAX_BUSES 3
+
+/* Rx, Tx and timer of each bus */
+static const struct {
+	PinName rx;
+	PinName tx;
+	uint8_t timer;
+} bus_pins[MAX_BUSES] = {
+	{ p30, p29, 2 },
+	{ p8,  p7,  0 },
+	{ p6,  p5,  1 },
+};
+
+static DaliRouter router;
+
+typedef struct {
+	uint32_t queries;
+	uint32_t expected;      // queries a gear should have answered
+	uint32_t correct;
+	uint32_t wrong;
+	uint32_t missing;
+	uint32_t spurious;      // answers decoded where none was sent
+} decode_stats_t;
+
+static decode_stats_t dstats;
+
+
+static EventQueue events;
+
+
+/* Sleep until the bus is idle, running the decoder as the ISR posts it. */
+static void wait_idle(void) {
+	while (router.is_busy()) {
+		events.dispatch(0);     // commands held for coalescing go out from here
+		if (router.is_busy())
+			__WFI();
+	}
+	events.dispatch(0);
+}
+
+
+/* Check an answer against what the gear sent. */
+static void check_answer(int expected, int status, uint8_t ans) {
+	if (expected < 0) {
+		if (status != DALI_NO_ANSWER)
+			dstats.spurious++;
+		return;
+	}
+	if (status == DALI_NO_ANSWER)
+		dstats.missing++;
+	else if (status == DALI_ANSWER && ans == expected)
+		dstats.correct++;
+	else
+		dstats.wrong++;
+}
+
+
+/* Queue a query without waiting for it, only sleeping if every query slot
+   is already in flight. */
+static void query_async(uint8_t bus, uint16_t frame, int expected) {
+	dstats.queries++;
+	if (expected >= 0)
+		dstats.expected++;
+
+	dali_answer_cb_t cb = [expected](int status, uint8_t ans) {
+		check_answer(expected, status, ans);
+	};
+	while (router.query(bus, frame, cb) < 0) {
+		__WFI();
+		events.dispatch(0);
+	}
+}
+
+
+static void print_isr(const char *name, const sim::isr_stat_t &s) {
+	printf("  %-8s %10llu calls  mean %6.0f ns  max %7llu ns\n", name,
+		(unsigned long long)s.count,
+		s.count ? (double)s.total_ns / s.count : 0.0,
+		(unsigned long long)s.max_ns);
+}
+
+
+int main(int argc, char **argv) {
+	int devices = 16;
+	int rounds = 10;
+	int jitter = 0;
+	int buses = 1;
+	int group_size = 4;
+	bool coalesce = true;
+	int drift = 0;
+	int skew = 0;
+	bool adaptive = true;
+	bool tx_inverted = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:j:b:g:cd:k:fi")) != -1) {
+		switch (opt) {
+			case 'n': devices = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'j': jitter = atoi(optarg); break;
+			case 'b': buses = atoi(optarg); break;
+			case 'g': group_size = atoi(optarg); break;
+			case 'c': coalesce = false; break;
+			case 'd': drift = atoi(optarg); break;
+			case 'k': skew = atoi(optarg); break;
+			case 'f': adaptive = false; break;
+			case 'i': tx_inverted = true; break;
+			default:
+				fprintf(stderr, "usage: %s [-n devices] [-r rounds] [-j jitter_us] [-b buses] "
+					"[-g group_size] [-c] [-d drift_%%] [-k skew_us] [-f] [-i]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (devices < 1 || devices > 64 || buses < 1 || buses > MAX_BUSES || group_size < 1
+		|| drift < 0 || drift > 50 || skew < 0) {
+		fprintf(stderr, "devices must be 1..64, buses 1..%d, group size at least 1, "
+			"drift 0..50%%\n", MAX_BUSES);
+		return 1;
+	}
+
+	sim::reset();
+	router.queue = &events;
+	std::vector<SimBus *> bus;
+	std::vector<std::vector<SimGear *> > gear(buses);
+	for (int b = 0; b < buses; b++) {
+		bus.push_back(new SimBus(bus_pins[b].tx, bus_pins[b].rx));
+		for (int i = 0; i < devices; i++) {
+			SimGear::config_t cfg = SimGear::default_config(i);
+			cfg.device_type = ((i + b) % 3 == 0) ? 6 : 0;
+			cfg.jitter = jitter;
+			cfg.skew = skew;
+			if (devices > 1) {
+				cfg.te = SIM_TE * (100 * (devices - 1) + drift * (2 * i - (devices - 1)))
+					/ (100 * (devices - 1));
+				cfg.reply_te = (12 * SIM_TE + cfg.te / 2) / cfg.te;     // settling is in ms, not TE
+			}
+			if (i / group_size < 16)
+				cfg.groups = 1 << (i / group_size);
+			gear[b].push_back(new SimGear(cfg));
+			bus[b]->attach(gear[b].back());
+		}
+		Dali *master = new Dali(bus_pins[b].rx, bus_pins[b].tx, bus_pins[b].timer);
+		bus[b]->set_polarity(true, tx_inverted);
+		master->set_polarity(true, tx_inverted);
+		master->set_adaptive(adaptive);
+		router.add(master);
+	}
+
+	/* Census of every bus, not counted in the session's time */
+	int learning = 0;
+	for (int b = 0; b < buses; b++) {
+		router.bus(b)->coalesce = coalesce;
+		if (coalesce) {
+			learning++;
+			router.bus(b)->learn_groups([&learning]() { learning--; });
+		}
+	}
+	while (learning) {
+		__WFI();
+		events.dispatch(0);
+	}
+	wait_idle();
+	sim::vtime_t learn_time = sim::now();
+	std::vector<size_t> learn_frames;
+	for (int b = 0; b < buses; b++)
+		learn_frames.push_back(bus[b]->frames().size());
+
+	int absent = devices < 64 ? devices : -1;     // a short address nobody has
+
+	auto wall0 = std::chrono::steady_clock::now();
+	sim::vtime_t t0 = sim::now();
+
+	sim::vtime_t blocked = 0;     // virtual time callers spent inside a send
+
+	for (int r = 0; r < rounds; r++) {
+		sim::vtime_t t = sim::now();
+		for (int i = 0; i < devices; i++)
+			for (int b = 0; b < buses; b++)
+				router.turn_on(b, i);
+		blocked += sim::now() - t;
+
+		for (int i = 0; i < devices; i++)
+			for (int b = 0; b < buses; b++)
+				query_async(b, (i << 9) | 0x199, gear[b][i]->state().device_type);
+		if (absent >= 0)
+			for (int b = 0; b < buses; b++)
+				query_async(b, (absent << 9) | 0x199, -1);
+
+		t = sim::now();
+		for (int i = 0; i < devices / 2; i++)
+			for (int b = 0; b < buses; b++)
+				router.turn_off(b, i);
+		router.broadcast(DALI_RECALL_MAX);
+		blocked += sim::now() - t;
+	}
+	wait_idle();
+	sim::run_for(10000);
+	events.dispatch(0);
+
+	sim::vtime_t elapsed = sim::now() - t0;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall0).count();
+
+	uint32_t fwd = 0, bwd = 0, bad = 0, lit = 0;
+	uint32_t staged = 0, coalesced = 0;
+	for (int b = 0; b < buses; b++) {
+		uint32_t commands, frames;
+		router.bus(b)->coalesce_stats(&commands, &frames);
+		staged += commands;
+		coalesced += frames;
+		for (size_t i = learn_frames[b]; i < bus[b]->frames().size(); i++) {
+			const sim_frame_t &f = bus[b]->frames()[i];
+			if (!f.valid) bad++;
+			else if (f.bits == 16) fwd++;
+			else if (f.bits == 8) bwd++;
+		}
+		for (int i = 0; i < devices; i++)
+			lit += gear[b][i]->state().level != 0;
+	}
+
+	printf("buses %d, devices %d per bus, rounds %d, jitter +/-%d us\n", buses, devices, rounds, jitter);
+	printf("answers: TE %d +/-%d%%, rising edges %d us late, %s windows, Tx %s\n", SIM_TE, drift, skew,
+		adaptive ? "adaptive" : "fixed", tx_inverted ? "inverted" : "not inverted");
+	printf("bus:     %u forward, %u backward, %u malformed frames\n", fwd, bwd, bad);
+	printf("time:    %.3f s virtual, %.3f s wall (x%.0f)\n",
+		elapsed / 1e6, wall, wall > 0 ? (elapsed / 1e6) / wall : 0.0);
+	if (coalesce)
+		printf("groups:  learnt in %.3f s, %u per address commands sent as %u frames\n",
+			learn_time / 1e6, staged, coalesced);
+	else
+		printf("groups:  coalescing off, %d per address commands sent as is\n",
+			rounds * (devices + devices / 2) * buses);
+	printf("rate:    %.1f forward frames/s, callers blocked %.3f s issuing commands\n",
+		fwd / (elapsed / 1e6), blocked / 1e6);
+	printf("isr:\n");
+	for (int b = 0; b < buses; b++) {
+		char name[16];
+		snprintf(name, sizeof(name), "TIMER%d", bus_pins[b].timer);
+		printf("  %s\n", name);
+		print_isr("match", sim::isr_stats(bus_pins[b].timer).match);
+		print_isr("capture", sim::isr_stats(bus_pins[b].timer).capture);
+	}
+	if (buses > 1)
+		print_isr("gpio", sim::raised_irq_stats());
+	printf("decode:  %u queries, %u expected answers, %u correct, %u wrong, "
+		"%u missing, %u spurious (error rate %.2f%%)\n",
+		dstats.queries, dstats.expected, dstats.correct, dstats.wrong,
+		dstats.missing, dstats.spurious,
+		dstats.expected ? 100.0 * (dstats.wrong + dstats.missing) / dstats.expected : 0.0);
+	printf("gear:    %u of %d lit after final broadcast\n", lit, devices * buses);
+
+	return 0;
+}
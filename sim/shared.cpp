@@ -0,0 +1,236 @@
+/*
+	Shares a bus between the master, a second controller and input
+	devices, and counts the commands that get through.
+
+	The master switches gear 0-7 with -m DAPC commands a second and asks
+	one its device type every second; the second controller, at priority
+	2 like the master, switches gear 8-15 with -c a second.  -i input
+	devices each raise events at random, -e a minute on average.  Every
+	other transmitter starts -l usec after it last saw the bus idle, the
+	time its receiver and firmware take, so now and then it starts on top
+	of someone else.  -n turns the master's arbitration off: it then sends
+	regardless and never sees a collision, as before.
+
+	The run goes on past -t until everything given has been sent.
+	Reported: commands each side gave and those that reached the bus
+	intact, the collisions each side saw, events heard, the good frames a
+	second the bus carried and the answers.
+
+	Last, with the master's arbitration on, a DAPC to gear 3 is jammed
+	until the master gives it up: the master's cached level for gear 3
+	must not be the one the gear never got.
+
+	usage: dali_shared [-m master/s] [-c controller/s] [-i inputs] [-e events_per_minute]
+	                   [-l latency_us] [-p priority] [-n] [-t seconds] [-s seed]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <map>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES      16
+#define SETTLE_P2    14900  // usec, the second controller's settling time, priority 2
+
+
+/* Takes one of each frame given from the count of frames wanted, true if
+   it was wanted. */
+static bool take(std::map<uint32_t, uint32_t> &wanted, uint32_t frame) {
+	std::map<uint32_t, uint32_t>::iterator it = wanted.find(frame);
+	if (it == wanted.end() || !it->second)
+		return false;
+	it->second--;
+	return true;
+}
+
+
+int main(int argc, char **argv) {
+	int master_rate = 10;
+	int ctrl_rate = 5;
+	int inputs = 4;
+	int per_minute = 30;
+	int latency = 200;
+	int prio = DALI_PRIORITY;
+	bool arbitrate = true;
+	int seconds = 60;
+	int seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:c:i:e:l:p:nt:s:")) != -1) {
+		switch (opt) {
+			case 'm': master_rate = atoi(optarg); break;
+			case 'c': ctrl_rate = atoi(optarg); break;
+			case 'i': inputs = atoi(optarg); break;
+			case 'e': per_minute = atoi(optarg); break;
+			case 'l': latency = atoi(optarg); break;
+			case 'p': prio = atoi(optarg); break;
+			case 'n': arbitrate = false; break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-m master/s] [-c controller/s] [-i inputs] "
+					"[-e events_per_minute] [-l latency_us] [-p priority] [-n] [-t seconds] [-s seed]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (master_rate < 1 || ctrl_rate < 0 || inputs < 0 || inputs > 32 || per_minute < 1
+		|| latency < 0 || prio < 1 || prio > 5 || seconds < 1) {
+		fprintf(stderr, "rates must be positive, inputs 0..32, priority 1..5, seconds at least 1\n");
+		return 1;
+	}
+
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		gear.push_back(new SimGear(SimGear::default_config(i)));
+		bus.attach(gear.back());
+	}
+	int ctrl = bus.add_input(SETTLE_P2, latency);
+	std::vector<int> input;
+	for (int i = 0; i < inputs; i++)
+		input.push_back(bus.add_input(SIM_SETTLE, latency));
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+	master->coalesce = false;
+	master->set_arbitration(arbitrate, prio);
+	uint32_t heard = 0;
+	master->listen([&heard](uint32_t) { heard++; });
+
+	std::mt19937 rng(seed);
+	sim::vtime_t end = (sim::vtime_t)seconds * 1000000;
+
+	/* The second controller's commands, spread at random over the run */
+	std::map<uint32_t, uint32_t> ctrl_wanted;
+	uint32_t ctrl_count = 0;
+	if (ctrl_rate) {
+		std::exponential_distribution<double> gap(ctrl_rate / 1e6);
+		sim::vtime_t t = 0;
+		while ((t += (sim::vtime_t)gap(rng) + 1) < end) {
+			uint32_t frame = ((8 + ctrl_count % 8) << 9) | (1 + ctrl_count % 254);
+			ctrl_wanted[frame]++;
+			ctrl_count++;
+			sim::schedule(t, [&bus, ctrl, frame]() { bus.send(ctrl, frame, 16); });
+		}
+	}
+
+	/* Events, each word unique */
+	std::exponential_distribution<double> event_gap(per_minute / 60e6);
+	uint32_t raised = 0;
+	for (int i = 0; i < inputs; i++) {
+		sim::vtime_t t = 0;
+		for (uint32_t n = 0; n < 1024; n++) {
+			t += (sim::vtime_t)event_gap(rng) + 1;
+			if (t >= end)
+				break;
+			uint32_t word = ((uint32_t)i << 17) | (1 << 10) | n;
+			int in = input[i];
+			sim::schedule(t, [&bus, in, word]() { bus.send_event(in, word); });
+			raised++;
+		}
+	}
+
+	/* The master's commands, evenly spread, with a query each second */
+	std::map<uint32_t, uint32_t> master_wanted;
+	uint32_t master_count = 0, correct = 0, wrong = 0;
+	sim::vtime_t step = 1000000 / master_rate;
+	for (sim::vtime_t t = step; t <= end + 1000000; t += step)
+		sim::schedule(t, sim::wake);
+
+	while (sim::now() < end + 1000000 || master->is_busy() || bus.inputs_waiting()) {
+		while (master_count < (uint32_t)seconds * master_rate && sim::now() >= (master_count + 1) * step) {
+			uint32_t frame = ((master_count % 8) << 9) | (1 + master_count % 254);
+			master_wanted[frame]++;
+			master->send((uint16_t)frame);
+			if (master_count % master_rate == 0) {
+				int a = (master_count / master_rate) % 8;
+				uint8_t expect = gear[a]->state().device_type;
+				master->query((a << 9) | 0x199, [&correct, &wrong, expect](int status, uint8_t ans) {
+					if (status == DALI_ANSWER && ans == expect)
+						correct++;
+					else
+						wrong++;
+				});
+			}
+			master_count++;
+		}
+		__WFI();
+		events.dispatch(0);
+	}
+
+	/* What the bus carried */
+	uint32_t master_ok = 0, ctrl_ok = 0, good = 0, malformed = 0, events_ok = 0;
+	for (size_t i = 0; i < bus.frames().size(); i++) {
+		const sim_frame_t &f = bus.frames()[i];
+		if (!f.valid) {
+			malformed++;
+			continue;
+		}
+		good++;
+		if (f.bits == 24)
+			events_ok++;
+		else if (f.bits == 16 && take(master_wanted, f.data))
+			master_ok++;
+		else if (f.bits == 16 && take(ctrl_wanted, f.data))
+			ctrl_ok++;
+	}
+
+	uint32_t collided, held, given_up, ctrl_coll = bus.input_collisions(ctrl), input_coll = 0;
+	master->stat(DALI_STAT_COLLISIONS, 0, &collided);
+	master->stat(DALI_STAT_COLLISIONS, 1, &held);
+	master->stat(DALI_STAT_COLLISIONS, 2, &given_up);
+	for (int i = 0; i < inputs; i++)
+		input_coll += bus.input_collisions(input[i]);
+
+	printf("arbitration %s, priority %d, latency %d us, %d s: master %d/s, controller %d/s, "
+		"%d inputs %d events a minute\n", arbitrate ? "on" : "off", prio, latency, seconds,
+		master_rate, ctrl_rate, inputs, per_minute);
+	printf("master:      %u commands, %u intact on the bus, %u lost; %u collided, %u held back, %u given up\n",
+		master_count, master_ok, master_count - master_ok, collided, held, given_up);
+	printf("controller:  %u commands, %u intact on the bus, %u lost; %u collided\n",
+		ctrl_count, ctrl_ok, ctrl_count - ctrl_ok, ctrl_coll);
+	printf("events:      %u raised, %u intact on the bus, %u heard; %u collided\n",
+		raised, events_ok, heard, input_coll);
+	printf("bus:         %u good frames in %.1f s, %.1f a second, %u malformed\n",
+		good, sim::now() / 1e6, good / (sim::now() / 1e6), malformed);
+	printf("answers:     %u correct, %u wrong\n", correct, wrong);
+
+	bool ok = master_ok == master_count && ctrl_ok == ctrl_count && heard == raised
+		&& events_ok == raised && correct == (uint32_t)seconds && !wrong;
+
+	/* A frame given up: its level is learnt first, so the cache would hold
+	   the new one if it followed the frame as queued */
+	if (arbitrate) {
+		int pending = 2;
+		auto learnt = [&pending](int, uint8_t) { pending--; };
+		master->query(dali_command(dali_short(3), DALI_QUERY_MAX_LEVEL), learnt);
+		master->query(dali_command(dali_short(3), DALI_QUERY_MIN_LEVEL), learnt);
+		while (pending || master->is_busy()) {
+			__WFI();
+			events.dispatch(0);
+		}
+		uint8_t level = gear[3]->state().level == 77 ? 78 : 77;
+		bus.jam(DALI_TX_RETRIES + 1);
+		master->send(dali_dapc(dali_short(3), level));
+		while (master->is_busy()) {
+			__WFI();
+			events.dispatch(0);
+		}
+		uint32_t now_given_up;
+		uint8_t cached;
+		master->stat(DALI_STAT_COLLISIONS, 2, &now_given_up);
+		bool believed = master->shadow.get(3, DALI_SHADOW_LEVEL, &cached) && cached == level;
+		printf("given up:    DAPC %u to gear 3 jammed %d times, %u given up, gear at %u, cache %s\n",
+			level, DALI_TX_RETRIES + 1, now_given_up - given_up, gear[3]->state().level,
+			believed ? "WRONG" : "does not claim it");
+		ok = ok && now_given_up == given_up + 1 && gear[3]->state().level != level && !believed;
+	}
+	printf("result:      %s\n", ok ? "every command and event got through" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <queue>
+#include <vector>
+#include "sim.hpp"
+
+namespace sim {
+
+static const vtime_t NEVER = ~(vtime_t)0;
+static const int NUM_TIMERS = 4;
+static const int NUM_IRQS = 64;
+
+/* The LPC17xx TIMERn_IRQn numbers are 1..4, see the shim in mbed.h */
+static int timer_irq(int timer) { return timer + 1; }
+
+
+typedef struct {
+	vtime_t t;
+	uint64_t seq;
+	std::function<void()> fn;
+} event_t;
+
+struct event_later {
+	bool operator()(const event_t &a, const event_t &b) const {
+		return (a.t != b.t) ? (a.t > b.t) : (a.seq > b.seq);
+	}
+};
+
+typedef struct {
+	uint32_t reg[TREG_COUNT];
+	vtime_t  base_time;    // virtual time at which TC was base_tc
+	uint32_t base_tc;
+	vtime_t  matched_at;   // a match is taken once per instant
+} timer_t;
+
+typedef struct {
+	int level;
+	pin_listener_t listener;
+	int cap_timer;         // -1 when not routed to a capture input
+	int cap_channel;
+} pin_t;
+
+
+static vtime_t g_now;
+static uint64_t g_seq;
+static std::priority_queue<event_t, std::vector<event_t>, event_later> g_events;
+static timer_t g_timers[NUM_TIMERS];
+static std::map<int, pin_t> g_pins;
+static void (*g_vectors[NUM_IRQS])(void);
+static bool g_enabled[NUM_IRQS];
+static bool g_in_isr;
+static uint64_t g_serviced;
+static isr_stats_t g_isr_stats[NUM_TIMERS];
+static std::deque<std::function<void()> > g_raised;
+static isr_stat_t g_raised_stats;
+
+
+vtime_t now() {
+	return g_now;
+}
+
+
+void schedule(vtime_t t, std::function<void()> fn) {
+	if (t < g_now)
+		t = g_now;
+	g_events.push(event_t{t, g_seq++, fn});
+}
+
+
+/* ---- Timer model ---- */
+
+static bool timer_running(const timer_t &tm) {
+	return (tm.reg[TREG_TCR] & 3) == 1;
+}
+
+static uint32_t timer_tc(const timer_t &tm) {
+	if (timer_running(tm))
+		return tm.base_tc + (uint32_t)(g_now - tm.base_time);
+	return tm.base_tc;
+}
+
+static void timer_set_tc(timer_t &tm, uint32_t tc) {
+	tm.base_tc = tc;
+	tm.base_time = g_now;
+}
+
+static vtime_t timer_next_match(const timer_t &tm) {
+	if (!timer_running(tm))
+		return NEVER;
+
+	vtime_t next = NEVER;
+	uint32_t tc = timer_tc(tm);
+	for (int ch = 0; ch < 4; ch++) {
+		uint32_t mcr = (tm.reg[TREG_MCR] >> (3*ch)) & 7;
+		uint32_t mr  = tm.reg[TREG_MR0 + ch];
+		if (mcr && mr > tc) {
+			vtime_t t = g_now + (mr - tc);
+			if (t < next)
+				next = t;
+		}
+	}
+	return next;
+}
+
+static void timer_fire_matches(timer_t &tm) {
+	uint32_t tc = timer_tc(tm);
+	bool reset = false, stop = false;
+
+	for (int ch = 0; ch < 4; ch++) {
+		uint32_t mcr = (tm.reg[TREG_MCR] >> (3*ch)) & 7;
+		if (!mcr || tm.reg[TREG_MR0 + ch] != tc)
+			continue;
+		if (mcr & 1) tm.reg[TREG_IR] |= 1 << ch;
+		if (mcr & 2) reset = true;
+		if (mcr & 4) stop = true;
+	}
+	if (reset)
+		timer_set_tc(tm, 0);
+	if (stop) {
+		timer_set_tc(tm, timer_tc(tm));
+		tm.reg[TREG_TCR] &= ~1u;
+	}
+}
+
+static void timer_capture(timer_t &tm, int ch, bool rising) {
+	uint32_t ccr = (tm.reg[TREG_CCR] >> (3*ch)) & 7;
+	if ((rising && (ccr & 1)) || (!rising && (ccr & 2))) {
+		tm.reg[TREG_CR0 + ch] = timer_tc(tm);
+		if (ccr & 4)
+			tm.reg[TREG_IR] |= 1 << (4 + ch);
+	}
+}
+
+uint32_t timer_read(int timer, int reg) {
+	timer_t &tm = g_timers[timer];
+	if (reg == TREG_TC)
+		return timer_tc(tm);
+	return tm.reg[reg];
+}
+
+void timer_write(int timer, int reg, uint32_t val) {
+	timer_t &tm = g_timers[timer];
+	switch (reg) {
+		case TREG_IR:
+			tm.reg[TREG_IR] &= ~val;   // write one to clear
+			break;
+		case TREG_TC:
+			timer_set_tc(tm, val);
+			break;
+		case TREG_TCR: {
+			uint32_t tc = timer_tc(tm);
+			tm.reg[TREG_TCR] = val;
+			timer_set_tc(tm, (val & 2) ? 0 : tc);
+			break;
+		}
+		case TREG_CR0:
+		case TREG_CR1:
+			break;                     // read only
+		default:
+			tm.reg[reg] = val;
+			break;
+	}
+}
+
+
+/* ---- NVIC ---- */
+
+void nvic_set_vector(int irq, void (*fn)(void)) {
+	g_vectors[irq] = fn;
+}
+
+void nvic_enable(int irq, bool en) {
+	g_enabled[irq] = en;
+}
+
+static void account(isr_stat_t &s, uint64_t ns) {
+	s.count++;
+	s.total_ns += ns;
+	if (ns > s.max_ns)
+		s.max_ns = ns;
+}
+
+/* Run handlers while any enabled timer has a flag pending.  Handlers that
+   cause further edges (the Tx pin loops back to Rx) only mark the IRQ
+   pending, it is taken once the current handler returns. */
+static void service_irqs() {
+	if (g_in_isr)
+		return;
+
+	for (int guard = 0; ; guard++) {
+		int timer = -1;
+		for (int i = 0; i < NUM_TIMERS; i++) {
+			int irq = timer_irq(i);
+			if (g_timers[i].reg[TREG_IR] && g_enabled[irq] && g_vectors[irq]) {
+				timer = i;
+				break;
+			}
+		}
+		if (timer < 0) {
+			if (g_raised.empty())
+				return;
+			std::function<void()> fn = g_raised.front();
+			g_raised.pop_front();
+
+			g_in_isr = true;
+			auto t0 = std::chrono::steady_clock::now();
+			fn();
+			auto t1 = std::chrono::steady_clock::now();
+			g_in_isr = false;
+			g_serviced++;
+			account(g_raised_stats,
+				std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+			continue;
+		}
+
+		if (guard > 1000) {
+			fprintf(stderr, "sim: TIMER%d IRQ storm at t=%llu, IR=0x%x\n",
+				timer, (unsigned long long)g_now, g_timers[timer].reg[TREG_IR]);
+			abort();
+		}
+
+		bool match = (g_timers[timer].reg[TREG_IR] & 0xF) != 0;
+
+		g_in_isr = true;
+		auto t0 = std::chrono::steady_clock::now();
+		g_vectors[timer_irq(timer)]();
+		auto t1 = std::chrono::steady_clock::now();
+		g_in_isr = false;
+		g_serviced++;
+
+		uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+		account(match ? g_isr_stats[timer].match : g_isr_stats[timer].capture, ns);
+	}
+}
+
+const isr_stats_t &isr_stats(int timer) {
+	return g_isr_stats[timer];
+}
+
+void raise_irq(std::function<void()> fn) {
+	g_raised.push_back(fn);
+	service_irqs();
+}
+
+const isr_stat_t &raised_irq_stats() {
+	return g_raised_stats;
+}
+
+
+/* ---- GPIO ---- */
+
+static pin_t &pin(int p) {
+	std::map<int, pin_t>::iterator it = g_pins.find(p);
+	if (it == g_pins.end())
+		it = g_pins.insert(std::make_pair(p, pin_t{0, pin_listener_t(), -1, 0})).first;
+	return it->second;
+}
+
+void pin_write(int p, int level) {
+	pin_t &pn = pin(p);
+	level = level ? 1 : 0;
+	if (pn.level == level)
+		return;
+	pn.level = level;
+
+	if (pn.cap_timer >= 0)
+		timer_capture(g_timers[pn.cap_timer], pn.cap_channel, level);
+	if (pn.listener)
+		pn.listener(p, level);
+
+	service_irqs();
+}
+
+int pin_read(int p) {
+	return pin(p).level;
+}
+
+void pin_set_listener(int p, pin_listener_t fn) {
+	pin(p).listener = fn;
+}
+
+void pin_route_capture(int p, int timer, int channel) {
+	pin(p).cap_timer = timer;
+	pin(p).cap_channel = channel;
+}
+
+
+/* ---- Event loop ---- */
+
+static vtime_t next_time() {
+	vtime_t next = g_events.empty() ? NEVER : g_events.top().t;
+	for (int i = 0; i < NUM_TIMERS; i++) {
+		vtime_t t = timer_next_match(g_timers[i]);
+		if (t < next)
+			next = t;
+	}
+	return next;
+}
+
+/* Advance to the next event if it is no later than limit. */
+static bool step(vtime_t limit) {
+	vtime_t t = next_time();
+	if (t == NEVER || t > limit)
+		return false;
+
+	g_now = t;
+
+	while (!g_events.empty() && g_events.top().t == t) {
+		std::function<void()> fn = g_events.top().fn;
+		g_events.pop();
+		fn();
+		service_irqs();
+	}
+
+	/* a match at exactly this instant has TC == MR, timer_next_match() only
+	   looks forward so check the registers directly */
+	for (int i = 0; i < NUM_TIMERS; i++) {
+		timer_t &tm = g_timers[i];
+		if (!timer_running(tm) || tm.matched_at == g_now)
+			continue;
+		uint32_t tc = timer_tc(tm);
+		for (int ch = 0; ch < 4; ch++) {
+			if (((tm.reg[TREG_MCR] >> (3*ch)) & 7) && tm.reg[TREG_MR0 + ch] == tc) {
+				timer_fire_matches(tm);
+				tm.matched_at = g_now;
+				break;
+			}
+		}
+	}
+
+	service_irqs();
+	return true;
+}
+
+void run_until(vtime_t t) {
+	while (step(t))
+		;
+	if (t > g_now)
+		g_now = t;
+}
+
+void run_for(vtime_t us) {
+	run_until(g_now + us);
+}
+
+bool run_until_idle(vtime_t max_us) {
+	vtime_t limit = g_now + max_us;
+	while (step(limit))
+		;
+	if (next_time() == NEVER)
+		return true;
+	g_now = limit;
+	return false;
+}
+
+void wait_for_interrupt() {
+	uint64_t start = g_serviced;
+	while (g_serviced == start) {
+		if (!step(NEVER - 1)) {
+			fprintf(stderr, "sim: __WFI() with nothing pending at t=%llu\n",
+				(unsigned long long)g_now);
+			abort();
+		}
+	}
+}
+
+void wake() {
+	g_serviced++;
+}
+
+uint64_t interrupts() {
+	return g_serviced;
+}
+
+void reset() {
+	g_now = 0;
+	g_seq = 0;
+	g_events = std::priority_queue<event_t, std::vector<event_t>, event_later>();
+	for (int i = 0; i < NUM_TIMERS; i++) {
+		g_timers[i] = timer_t();
+		g_timers[i].matched_at = NEVER;
+	}
+	g_pins.clear();
+	for (int i = 0; i < NUM_IRQS; i++) {
+		g_vectors[i] = 0;
+		g_enabled[i] = false;
+	}
+	g_in_isr = false;
+	g_serviced = 0;
+	for (int i = 0; i < NUM_TIMERS; i++)
+		g_isr_stats[i] = isr_stats_t();
+	g_raised.clear();
+	g_raised_stats = isr_stat_t();
+}
+
+} // namespace sim
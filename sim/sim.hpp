@@ -0,0 +1,110 @@
+#ifndef DALI_SIM_H
+#define DALI_SIM_H
+
+/*
+	Host-side model of the LPC1768 peripherals used by the Dali class.
+
+	Time is virtual and counted in microseconds.  Nothing advances unless the
+	driver calls run_for()/run_until() or the firmware executes __WFI(), so a
+	session runs as fast as the host can process events.
+
+	The model covers:
+		- TIMER0..3: TC/MR0-3/MCR/CCR/CR0-1/IR with match interrupt, reset and
+		  stop, and capture on either edge.  The prescaler is not modelled,
+		  one TC tick is one microsecond.
+		- NVIC: a vector table and enable bits.  Pending timer IRQs are serviced
+		  between events, never nested, which is how a single-priority Cortex-M3
+		  handler behaves.
+		- GPIO: pin levels with a single listener per pin, used by the bus,
+		  and edge interrupts raised through raise_irq().
+*/
+
+#include <stdint.h>
+#include <functional>
+
+namespace sim {
+
+typedef uint64_t vtime_t;
+
+/* Current virtual time in microseconds. */
+vtime_t now();
+
+/* Schedule fn to run at absolute virtual time t. */
+void schedule(vtime_t t, std::function<void()> fn);
+
+/* Advance virtual time, processing every event up to and including t. */
+void run_until(vtime_t t);
+void run_for(vtime_t us);
+
+/* Process events until the timer hardware goes quiet (no pending events).
+   Returns false if max_us elapsed first. */
+bool run_until_idle(vtime_t max_us);
+
+/* Process events until at least one interrupt has been serviced.  This is
+   what __WFI() maps to on the host. */
+void wait_for_interrupt();
+
+/* Count an interrupt from a peripheral outside the model, such as the
+   Ethernet controller, so that a pending __WFI() returns. */
+void wake();
+
+/* Pend an interrupt whose handler is fn, as a GPIO edge does.  It is taken
+   like the timer IRQs: after the current handler, never nested. */
+void raise_irq(std::function<void()> fn);
+
+/* Interrupts serviced since reset, modelled and woken. */
+uint64_t interrupts();
+
+/* Reset time, events, timers, pins and statistics. */
+void reset();
+
+
+/* ---- GPIO ---- */
+typedef std::function<void(int pin, int level)> pin_listener_t;
+
+void pin_write(int pin, int level);
+int  pin_read(int pin);
+void pin_set_listener(int pin, pin_listener_t fn);
+
+/* Route a pin to a timer capture input (CAPn.ch).  Any level change on the
+   pin is then presented to the timer as a rising or falling edge. */
+void pin_route_capture(int pin, int timer, int channel);
+
+
+/* ---- NVIC ---- */
+void nvic_set_vector(int irq, void (*fn)(void));
+void nvic_enable(int irq, bool en);
+
+
+/* ---- Timer register access, used by the LPC_TIM_TypeDef shim ---- */
+enum timer_reg_t {
+	TREG_IR, TREG_TCR, TREG_TC, TREG_PR, TREG_PC, TREG_MCR,
+	TREG_MR0, TREG_MR1, TREG_MR2, TREG_MR3,
+	TREG_CCR, TREG_CR0, TREG_CR1, TREG_EMR, TREG_CTCR,
+	TREG_COUNT
+};
+
+uint32_t timer_read(int timer, int reg);
+void     timer_write(int timer, int reg, uint32_t val);
+
+
+/* ---- ISR statistics ---- */
+typedef struct {
+	uint64_t count;        // number of handler invocations
+	uint64_t total_ns;     // host time spent in the handler
+	uint64_t max_ns;       // worst single invocation
+} isr_stat_t;
+
+typedef struct {
+	isr_stat_t match;      // entered with a match flag pending
+	isr_stat_t capture;    // entered with only capture flags pending
+} isr_stats_t;
+
+const isr_stats_t &isr_stats(int timer);
+
+/* Handlers pended with raise_irq() */
+const isr_stat_t &raised_irq_stats();
+
+} // namespace sim
+
+#endif
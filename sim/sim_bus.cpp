@@ -0,0 +1,283 @@
+#include "sim_bus.hpp"
+
+#define STOP_HALVES 4       // stop condition is 2 bits of idle
+#define MAX_HALVES  80      // longest frame the receiver will sample
+
+
+SimBus::SimBus(int tx_pin, int rx_pin) :
+	backward_collisions(0), _tx_pin(tx_pin), _rx_pin(rx_pin), _rx_invert(1), _tx_invert(0),
+	_level(1), _last_change(0), _rng(12345), _jam(0), _jam_driver(-1), _rx_active(false), _rx_start(0) {
+
+	_drive.push_back(1);
+	sim::pin_write(_rx_pin, _level ^ _rx_invert);
+	sim::pin_set_listener(_tx_pin, [this](int, int level) { master(level ^ _tx_invert); });
+}
+
+
+/* The master's Tx pin.  A start from an idle bus may be jammed. */
+void SimBus::master(int level) {
+	if (!level && _level && !_rx_active && _jam) {
+		_jam--;
+		sim::vtime_t t = sim::now() + SIM_TE + SIM_TE / 2;     // over the end of the start bit
+		sim::schedule(t, [this]() { drive(_jam_driver, 0); });
+		sim::schedule(t + SIM_TE * 3 / 4, [this]() { drive(_jam_driver, 1); });
+	}
+	drive(0, level);
+}
+
+
+void SimBus::jam(uint32_t starts) {
+	if (_jam_driver < 0) {
+		_jam_driver = (int)_drive.size();
+		_drive.push_back(1);
+	}
+	_jam = starts;
+}
+
+
+void SimBus::set_polarity(bool rx_inverted, bool tx_inverted) {
+	_rx_invert = rx_inverted;
+	_tx_invert = tx_inverted;
+	sim::pin_write(_rx_pin, _level ^ _rx_invert);
+}
+
+
+void SimBus::attach(SimGear *gear) {
+	gear->_bus = this;
+	gear->_driver = (int)_drive.size();
+	gear->_transmitting = false;
+	_drive.push_back(1);
+	_gear.push_back(gear);
+}
+
+
+void SimBus::drive(int driver, int level) {
+	_drive[driver] = level ? 1 : 0;
+	update();
+}
+
+
+/* The bus is low while any driver pulls it low. */
+void SimBus::update() {
+	int level = 1;
+	for (size_t i = 0; i < _drive.size(); i++)
+		level &= _drive[i];
+
+	if (level == _level)
+		return;
+	_level = level;
+	_last_change = sim::now();
+	sim::pin_write(_rx_pin, level ^ _rx_invert);
+
+	if (!level && !_rx_active) {
+		_rx_active = true;
+		_rx_start = sim::now();
+		_samples.clear();
+		sim::schedule(_rx_start + SIM_TE/2, [this]() { sample(); });
+	}
+}
+
+
+/* Sample in the middle of each half bit until the bus has been idle for the
+   length of the stop condition. */
+void SimBus::sample() {
+	_samples.push_back((uint8_t)_level);
+
+	size_t n = _samples.size();
+	bool stop = n >= STOP_HALVES;
+	for (size_t i = 0; stop && i < STOP_HALVES; i++)
+		stop = _samples[n - 1 - i] != 0;
+
+	if (stop || n >= MAX_HALVES)
+		frame_done();
+	else
+		sim::schedule(sim::now() + SIM_TE, [this]() { sample(); });
+}
+
+
+void SimBus::frame_done() {
+	/* The idle run starts either on the second half of a final "1" bit or
+	   straight after the final "0" bit. */
+	size_t run = _samples.size() - STOP_HALVES;
+	size_t halves = (run + 1) & ~(size_t)1;
+
+	sim_frame_t f;
+	f.start = _rx_start;
+	f.end   = _rx_start + halves * SIM_TE;
+	f.bits  = halves >= 2 ? (uint8_t)(halves/2 - 1) : 0;
+	f.data  = 0;
+	f.valid = halves >= 2 && _samples[0] == 0 && _samples[1] == 1;
+
+	for (size_t i = 2; f.valid && i < halves; i += 2) {
+		if (_samples[i] == 0 && _samples[i+1] == 1)
+			f.data = (f.data << 1) | 1;
+		else if (_samples[i] == 1 && _samples[i+1] == 0)
+			f.data = f.data << 1;
+		else
+			f.valid = false;
+	}
+
+	_rx_active = false;
+	_frames.push_back(f);
+
+	if (!f.valid || f.bits != 16)
+		return;
+
+	int answered = 0;
+	for (size_t i = 0; i < _gear.size(); i++) {
+		SimGear *g = _gear[i];
+		if (g->_transmitting)
+			continue;
+		int answer = g->receive((uint16_t)f.data, f.end);
+		if (answer >= 0) {
+			send_backward(g, (uint8_t)answer, f.end + g->_s.reply_te * g->_s.te);
+			answered++;
+		}
+	}
+	if (answered > 1)
+		backward_collisions++;
+}
+
+
+void SimBus::send_backward(SimGear *gear, uint8_t data, sim::vtime_t t) {
+	gear->_transmitting = true;
+	gear->answers_sent++;
+
+	drive_frame(gear->_driver, data, 8, t, gear->_s.te, gear->_s.jitter, gear->_s.skew,
+		[gear]() { gear->_transmitting = false; });
+}
+
+
+/* Drives a frame of any width onto the bus from t, the start bit first. */
+void SimBus::drive_frame(int driver, uint32_t data, uint8_t bits, sim::vtime_t t, uint32_t te,
+                         uint32_t jitter, uint32_t skew, std::function<void()> done) {
+	std::vector<uint8_t> halves(2 + 2 * bits);
+	halves[0] = 0;
+	halves[1] = 1;
+	for (int i = 0; i < bits; i++) {
+		int bit = (data >> (bits - 1 - i)) & 1;
+		halves[2 + 2*i] = !bit;
+		halves[3 + 2*i] = bit;
+	}
+
+	int32_t j = (int32_t)jitter;
+	std::uniform_int_distribution<int32_t> dist(-j, j);
+	size_t n = halves.size();
+
+	for (size_t i = 0; i < n; i++) {
+		uint8_t level = halves[i];
+		sim::vtime_t when = t + i * te + (i ? dist(_rng) : 0);
+		if (level && !halves[i - 1])
+			when += skew;
+		sim::schedule(when, [this, driver, level]() { drive(driver, level); });
+	}
+	sim::schedule(t + n * te + (halves[n - 1] ? 0 : skew), [this, driver, done]() {
+		drive(driver, 1);
+		if (done)
+			done();
+	});
+}
+
+
+int SimBus::add_input(sim::vtime_t settle, sim::vtime_t latency) {
+	input_t in;
+	in.driver     = (int)_drive.size();
+	in.settle     = settle;
+	in.latency    = latency;
+	in.wait       = settle;
+	in.half       = -1;
+	in.posted     = false;
+	in.collisions = 0;
+	_drive.push_back(1);
+	_inputs.push_back(in);
+	return (int)_inputs.size() - 1;
+}
+
+
+void SimBus::send(int input, uint32_t frame, uint8_t bits, std::function<void(sim::vtime_t)> sent) {
+	tx_t tx = { frame, bits, sent };
+	_inputs[input].queue.push_back(tx);
+	input_post(input, sim::now());
+}
+
+
+void SimBus::send_event(int input, uint32_t event, std::function<void(sim::vtime_t)> sent) {
+	send(input, event, 24, sent);
+}
+
+
+bool SimBus::inputs_waiting() const {
+	for (size_t i = 0; i < _inputs.size(); i++) {
+		if (!_inputs[i].queue.empty())
+			return true;
+	}
+	return false;
+}
+
+
+void SimBus::input_post(int input, sim::vtime_t t) {
+	input_t &in = _inputs[input];
+	if (in.posted || in.half >= 0 || in.queue.empty())
+		return;
+	in.posted = true;
+	sim::schedule(t, [this, input]() { input_try(input); });
+}
+
+
+/* Starts the oldest waiting frame if the bus has been idle long enough,
+   else looks again when it might have been. */
+void SimBus::input_try(int input) {
+	input_t &in = _inputs[input];
+	in.posted = false;
+
+	sim::vtime_t now = sim::now();
+	sim::vtime_t free = _last_change + in.wait;
+	if (_level && !_rx_active && now >= free) {
+		const tx_t &tx = in.queue.front();
+		in.halves.assign(2 + 2 * tx.bits + STOP_HALVES, 1);
+		in.halves[0] = 0;
+		for (int i = 0; i < tx.bits; i++) {
+			int bit = (tx.frame >> (tx.bits - 1 - i)) & 1;
+			in.halves[2 + 2*i] = !bit;
+			in.halves[3 + 2*i] = bit;
+		}
+		in.half = 0;
+		sim::schedule(now + in.latency, [this, input]() { input_step(input); });
+		return;
+	}
+	input_post(input, free > now ? free : now + SIM_TE);
+}
+
+
+/* One half bit of the frame, stop bits included, after checking the last
+   one it left high really was.  The last step releases the bus. */
+void SimBus::input_step(int input) {
+	input_t &in = _inputs[input];
+	size_t n = in.halves.size();
+	std::uniform_int_distribution<sim::vtime_t> spread(0, SIM_SETTLE_SPREAD - 1);
+
+	if (in.half > 0 && in.halves[in.half - 1] && !_level) {
+		in.collisions++;
+		drive(in.driver, 0);
+		sim::schedule(sim::now() + SIM_BREAK, [this, input]() {
+			input_t &in = _inputs[input];
+			drive(in.driver, 1);
+			in.half = -1;
+			input_post(input, sim::now());
+		});
+		in.wait = in.settle + spread(_rng);
+		return;
+	}
+	if (in.half == 0 && in.queue.front().sent)
+		in.queue.front().sent(sim::now());
+	if ((size_t)in.half == n) {
+		drive(in.driver, 1);
+		in.queue.pop_front();
+		in.half = -1;
+		in.wait = in.settle + spread(_rng);
+		input_post(input, sim::now());
+		return;
+	}
+	drive(in.driver, in.halves[in.half++]);
+	sim::schedule(sim::now() + SIM_TE, [this, input]() { input_step(input); });
+}
@@ -0,0 +1,206 @@
+#ifndef DALI_SIM_BUS_H
+#define DALI_SIM_BUS_H
+
+/*
+	Virtual DALI bus.
+
+	The bus is a wired-AND of every driver: the master's Tx pin and each
+	simulated control gear.  The master's Rx pin follows the inverse of the bus
+	level, as it does through the optocoupler on the NXP I/OH board, unless
+	set_polarity() says otherwise.
+
+	A sampling receiver on the bus decodes every frame (forward or backward)
+	and hands forward frames to the attached gear, which may answer with a
+	backward frame after their configured settling time.
+
+	Input devices send 24 bit event messages, and other controllers forward
+	frames, as IEC 62386-101 multi-master transmitters: one only starts
+	once the bus has been idle for its settling time, longer than any
+	answer takes to start, plus a random part.  It starts latency usec
+	after it last saw the bus idle, so two can start together.  Each half
+	bit it releases the bus it checks the bus is high: if not it has
+	collided, holds the bus low for SIM_BREAK and waits to try again.
+*/
+
+#include <stdint.h>
+#include <deque>
+#include <random>
+#include <vector>
+#include "sim.hpp"
+
+#define SIM_TE      417     // nominal half bit time in usec
+#define SIM_YES     0xFF    // backward frame for YES
+#define SIM_MASK    0xFF    // short address / level value meaning "none"
+#define SIM_SETTLE  17900   // usec of idle bus before an event, priority 4 settling time
+#define SIM_SETTLE_SPREAD 1200  // usec, random part of every settling time
+#define SIM_BREAK   1300    // usec the bus is held low after a collision
+
+class SimBus;
+
+
+typedef struct {
+	sim::vtime_t start;     // first falling edge
+	sim::vtime_t end;       // end of the last half bit
+	uint8_t  bits;          // data bits, excluding the start bit
+	uint32_t data;
+	bool     valid;         // Manchester pairs were all well formed
+} sim_frame_t;
+
+
+/*
+	IEC 62386-102 control gear, modelling the parts of the command set that a
+	master needs for switching, queries, grouping and commissioning.
+*/
+class SimGear {
+public:
+	typedef struct {
+		uint8_t  short_addr;    // 0..63, or SIM_MASK when unaddressed
+		uint32_t random_addr;   // 24 bits
+		uint8_t  device_type;
+		uint16_t groups;
+		uint8_t  level;         // actual arc power level
+		uint8_t  min_level;
+		uint8_t  max_level;
+		bool     lamp_failure;
+		uint32_t seed;          // drives RANDOMISE
+		int32_t  first_random;  // taken by the first RANDOMISE instead of drawing, -1 to draw
+		uint32_t te;            // this gear's half bit time when answering
+		uint32_t jitter;        // +/- usec applied to each answered half bit
+		uint32_t reply_te;      // settling time before answering, in TE
+		uint32_t skew;          // usec each rising edge lags, a slow rise on a long bus
+	} config_t;
+
+	static config_t default_config(uint8_t short_addr);
+
+	SimGear(const config_t &cfg);
+
+	/* Handle a 16 bit forward frame, returning the answer or -1 for none. */
+	int receive(uint16_t frame, sim::vtime_t t);
+
+	const config_t &state() const { return _s; }
+
+	uint32_t frames_seen;
+	uint32_t answers_sent;
+
+private:
+	friend class SimBus;
+
+	config_t _s;
+	std::mt19937 _rng;
+
+	uint8_t  _dtr, _dtr1, _dtr2;
+	uint8_t  _scene[16];
+	uint8_t  _power_on_level;
+	uint8_t  _fail_level;
+	uint8_t  _fade;
+	bool     _reset_state;
+	bool     _initialised;
+	bool     _withdrawn;
+	uint32_t _search;
+
+	uint16_t     _last_frame;     // for the send-twice rule
+	sim::vtime_t _last_time;
+	bool         _armed;          // _last_frame may be the first of a pair
+	bool         _repeat;         // current frame completes a pair
+
+	bool addressed(uint8_t addr_byte) const;
+	int  command(uint8_t cmd);
+	int  special(uint8_t addr_byte, uint8_t data);
+	void set_level(uint8_t level);
+	uint8_t status() const;
+
+	/* bus side */
+	SimBus *_bus;
+	int     _driver;
+	bool    _transmitting;
+};
+
+
+class SimBus {
+public:
+	/* tx_pin/rx_pin are the master's pins, as passed to Dali(). */
+	SimBus(int tx_pin, int rx_pin);
+
+	void attach(SimGear *gear);
+
+	/* Pin polarity against the bus, to match Dali::set_polarity().  Call
+	   it first, the bus then sees no glitch when the master's Tx changes. */
+	void set_polarity(bool rx_inverted, bool tx_inverted);
+
+	/* Every frame seen on the bus, in order. */
+	const std::vector<sim_frame_t> &frames() const { return _frames; }
+	void clear_frames() { _frames.clear(); }
+
+	/* Transmit a backward frame from a gear starting at time t. */
+	void send_backward(SimGear *gear, uint8_t data, sim::vtime_t t);
+
+	/* Input devices and other controllers: add_input() returns one with
+	   the settling time and latency given, send() has it send a frame as
+	   soon as the bus lets it, send_event() a 24 bit event message.  sent()
+	   runs as the start bit of each try goes out. */
+	int add_input(sim::vtime_t settle = SIM_SETTLE, sim::vtime_t latency = 0);
+	void send(int input, uint32_t frame, uint8_t bits, std::function<void(sim::vtime_t)> sent = nullptr);
+	void send_event(int input, uint32_t event, std::function<void(sim::vtime_t)> sent = nullptr);
+	uint32_t input_collisions(int input) const { return _inputs[input].collisions; }
+	bool inputs_waiting() const;
+
+	/* The next starts frames the master starts from an idle bus collide:
+	   something pulls the bus low over the end of the start bit. */
+	void jam(uint32_t starts);
+
+	int level() const { return _level; }
+
+	/* Forward frames that more than one gear answered at once */
+	uint32_t backward_collisions;
+
+private:
+	int _tx_pin;
+	int _rx_pin;
+	int _rx_invert;
+	int _tx_invert;
+	int _level;
+	sim::vtime_t _last_change;
+	std::vector<SimGear *> _gear;
+	std::vector<int> _drive;           // 0 = master, then one per gear or input device
+	std::vector<sim_frame_t> _frames;
+	std::mt19937 _rng;
+	uint32_t _jam;                     // starts left to collide
+	int _jam_driver;
+
+	/* sampling receiver */
+	bool         _rx_active;
+	sim::vtime_t _rx_start;
+	std::vector<uint8_t> _samples;
+
+	typedef struct {
+		uint32_t frame;
+		uint8_t  bits;
+		std::function<void(sim::vtime_t)> sent;
+	} tx_t;
+
+	typedef struct {
+		int driver;
+		sim::vtime_t settle;
+		sim::vtime_t latency;
+		sim::vtime_t wait;              // settling time of this try
+		std::deque<tx_t> queue;         // waiting for the bus, oldest first
+		std::vector<uint8_t> halves;    // the frame going out
+		int  half;                      // next half bit to drive, -1 while waiting
+		bool posted;
+		uint32_t collisions;
+	} input_t;
+	std::vector<input_t> _inputs;
+
+	void drive(int driver, int level);
+	void master(int level);
+	void drive_frame(int driver, uint32_t data, uint8_t bits, sim::vtime_t t, uint32_t te,
+	                 uint32_t jitter, uint32_t skew, std::function<void()> done);
+	void input_post(int input, sim::vtime_t t);
+	void input_try(int input);
+	void input_step(int input);
+	void update();
+	void sample();
+	void frame_done();
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include "sim_bus.hpp"
+
+#define TWICE_WINDOW 100000   // send-twice commands must repeat within 100 ms
+
+
+SimGear::config_t SimGear::default_config(uint8_t short_addr) {
+	config_t c;
+	c.short_addr   = short_addr;
+	c.random_addr  = (short_addr * 0x9E3779u) & 0xFFFFFF;
+	c.device_type  = 6;        // LED module
+	c.groups       = 0;
+	c.level        = 0;
+	c.min_level    = 1;
+	c.max_level    = 254;
+	c.lamp_failure = false;
+	c.seed         = 1 + short_addr;
+	c.first_random = -1;
+	c.te           = SIM_TE;
+	c.jitter       = 0;
+	c.reply_te     = 12;       // 4TE of stop bits plus 8TE settling
+	c.skew         = 0;
+	return c;
+}
+
+
+SimGear::SimGear(const config_t &cfg) :
+	frames_seen(0), answers_sent(0), _s(cfg), _rng(cfg.seed),
+	_dtr(0), _dtr1(0), _dtr2(0), _power_on_level(254), _fail_level(254),
+	_fade(0x07), _reset_state(true), _initialised(false), _withdrawn(false),
+	_search(0xFFFFFF), _last_frame(0), _last_time(0), _armed(false),
+	_repeat(false), _bus(0), _driver(-1), _transmitting(false) {
+
+	for (int i = 0; i < 16; i++)
+		_scene[i] = SIM_MASK;
+}
+
+
+bool SimGear::addressed(uint8_t a) const {
+	if ((a & 0x80) == 0)
+		return ((a >> 1) & 0x3F) == _s.short_addr;
+	if ((a & 0xE0) == 0x80)
+		return (_s.groups >> ((a >> 1) & 0xF)) & 1;
+	if ((a & 0xFE) == 0xFE)
+		return true;
+	if ((a & 0xFE) == 0xFC)
+		return _s.short_addr == SIM_MASK;   // broadcast unaddressed
+	return false;
+}
+
+
+void SimGear::set_level(uint8_t level) {
+	if (level == SIM_MASK)
+		return;                            // MASK stops a fade, nothing to do
+	if (level == 0)
+		_s.level = 0;
+	else if (level < _s.min_level)
+		_s.level = _s.min_level;
+	else if (level > _s.max_level)
+		_s.level = _s.max_level;
+	else
+		_s.level = level;
+	_reset_state = false;
+}
+
+
+uint8_t SimGear::status() const {
+	uint8_t s = 0;
+	if (_s.lamp_failure)          s |= 1 << 1;
+	if (_s.level)                 s |= 1 << 2;
+	if (_reset_state)             s |= 1 << 5;
+	if (_s.short_addr == SIM_MASK) s |= 1 << 6;
+	return s;
+}
+
+
+int SimGear::receive(uint16_t frame, sim::vtime_t t) {
+	uint8_t a = frame >> 8;
+	uint8_t data = frame & 0xFF;
+
+	frames_seen++;
+
+	/* A command is only the repeat of a send-twice pair if it is identical
+	   to the frame straight before it and arrives inside the window. */
+	_repeat = _armed && frame == _last_frame && (t - _last_time) <= TWICE_WINDOW;
+	_armed = !_repeat;
+	_last_frame = frame;
+	_last_time = t;
+
+	if (a >= 0xA0 && a <= 0xDF)
+		return (a & 1) ? special(a, data) : -1;
+
+	if (!addressed(a))
+		return -1;
+
+	if (!(a & 1)) {
+		set_level(data);                   // direct arc power control
+		return -1;
+	}
+	return command(data);
+}
+
+
+int SimGear::command(uint8_t cmd) {
+	/* configuration commands only act on the second of a pair */
+	if (cmd >= 0x20 && cmd <= 0x80 && !_repeat)
+		return -1;
+
+	switch (cmd) {
+		case 0x00: _s.level = 0; return -1;                          // OFF
+		case 0x01:                                                   // UP
+		case 0x03: if (_s.level && _s.level < _s.max_level) _s.level++; return -1;
+		case 0x02:                                                   // DOWN
+		case 0x04: if (_s.level > _s.min_level) _s.level--; return -1;
+		case 0x05: set_level(_s.max_level); return -1;               // RECALL MAX
+		case 0x06: set_level(_s.min_level); return -1;               // RECALL MIN
+		case 0x07: _s.level = (_s.level <= _s.min_level) ? 0 : _s.level - 1; return -1;
+		case 0x08: set_level(_s.level ? _s.level + 1 : _s.min_level); return -1;
+
+		case 0x20:                                                   // RESET
+			_s.level = 254; _s.groups = 0; _s.min_level = 1; _s.max_level = 254;
+			_power_on_level = 254; _fail_level = 254; _fade = 0x07;
+			for (int i = 0; i < 16; i++) _scene[i] = SIM_MASK;
+			_reset_state = true;
+			return -1;
+		case 0x21: _dtr = _s.level; return -1;
+		case 0x2A: _s.max_level = _dtr; return -1;
+		case 0x2B: _s.min_level = _dtr; return -1;
+		case 0x2C: _fail_level = _dtr; return -1;
+		case 0x2D: _power_on_level = _dtr; return -1;
+		case 0x2E: _fade = (_fade & 0x0F) | (_dtr << 4); return -1;
+		case 0x2F: _fade = (_fade & 0xF0) | (_dtr & 0x0F); return -1;
+		case 0x80: _s.short_addr = (_dtr == 0xFF) ? SIM_MASK : (_dtr >> 1) & 0x3F; return -1;
+
+		case 0x90: return status();
+		case 0x91: return SIM_YES;                                   // CONTROL GEAR
+		case 0x92: return _s.lamp_failure ? SIM_YES : -1;
+		case 0x93: return _s.level ? SIM_YES : -1;
+		case 0x94: return -1;                                        // LIMIT ERROR
+		case 0x95: return _reset_state ? SIM_YES : -1;
+		case 0x96: return (_s.short_addr == SIM_MASK) ? SIM_YES : -1;
+		case 0x97: return 1;                                         // VERSION
+		case 0x98: return _dtr;
+		case 0x99: return _s.device_type;
+		case 0x9A: return _s.min_level;                              // PHYS MIN
+		case 0x9B: return -1;                                        // POWER FAILURE
+		case 0x9C: return _dtr1;
+		case 0x9D: return _dtr2;
+		case 0xA0: return _s.level;
+		case 0xA1: return _s.max_level;
+		case 0xA2: return _s.min_level;
+		case 0xA3: return _power_on_level;
+		case 0xA4: return _fail_level;
+		case 0xA5: return _fade;
+		case 0xC0: return _s.groups & 0xFF;
+		case 0xC1: return _s.groups >> 8;
+		case 0xC2: return (_s.random_addr >> 16) & 0xFF;
+		case 0xC3: return (_s.random_addr >> 8) & 0xFF;
+		case 0xC4: return _s.random_addr & 0xFF;
+		default: break;
+	}
+
+	if (cmd >= 0x10 && cmd <= 0x1F) {                                // GO TO SCENE
+		set_level(_scene[cmd & 0xF]);
+	} else if (cmd >= 0x40 && cmd <= 0x4F) {                         // STORE SCENE
+		_scene[cmd & 0xF] = _dtr;
+	} else if (cmd >= 0x50 && cmd <= 0x5F) {                         // REMOVE SCENE
+		_scene[cmd & 0xF] = SIM_MASK;
+	} else if (cmd >= 0x60 && cmd <= 0x6F) {                         // ADD TO GROUP
+		_s.groups |= 1 << (cmd & 0xF);
+	} else if (cmd >= 0x70 && cmd <= 0x7F) {                         // REMOVE GROUP
+		_s.groups &= ~(1 << (cmd & 0xF));
+	} else if (cmd >= 0xB0 && cmd <= 0xBF) {                         // SCENE LEVEL
+		return _scene[cmd & 0xF];
+	}
+	return -1;
+}
+
+
+int SimGear::special(uint8_t a, uint8_t data) {
+	bool selected = _initialised && !_withdrawn;
+
+	switch (a) {
+		case 0xA1: _initialised = false; return -1;                  // TERMINATE
+		case 0xA3: _dtr = data; return -1;
+		case 0xA5:                                                   // INITIALISE
+			if (!_repeat)
+				return -1;
+			if (data == 0x00 || (data == 0xFF && _s.short_addr == SIM_MASK) ||
+					((data & 1) && ((data >> 1) & 0x3F) == _s.short_addr)) {
+				_initialised = true;
+				_withdrawn = false;
+			}
+			return -1;
+		case 0xA7:                                                   // RANDOMISE
+			if (!_repeat || !_initialised)
+				return -1;
+			if (_s.first_random >= 0) {
+				_s.random_addr = _s.first_random;
+				_s.first_random = -1;
+			} else {
+				_s.random_addr = _rng() & 0xFFFFFF;
+			}
+			return -1;
+		case 0xA9:                                                   // COMPARE
+			return (selected && _s.random_addr <= _search) ? SIM_YES : -1;
+		case 0xAB:                                                   // WITHDRAW
+			if (_initialised && _s.random_addr == _search)
+				_withdrawn = true;
+			return -1;
+		case 0xB1: _search = (_search & 0x00FFFF) | (data << 16); return -1;
+		case 0xB3: _search = (_search & 0xFF00FF) | (data << 8); return -1;
+		case 0xB5: _search = (_search & 0xFFFF00) | data; return -1;
+		case 0xB7:                                                   // PROGRAM SHORT
+			if (_initialised && _s.random_addr == _search)
+				_s.short_addr = (data == 0xFF) ? SIM_MASK : (data >> 1) & 0x3F;
+			return -1;
+		case 0xB9:                                                   // VERIFY SHORT
+			return (_initialised && _s.short_addr == ((data >> 1) & 0x3F)) ? SIM_YES : -1;
+		case 0xBB:                                                   // QUERY SHORT
+			if (!_initialised || _s.random_addr != _search)
+				return -1;
+			return (_s.short_addr == SIM_MASK) ? SIM_MASK : (_s.short_addr << 1) | 1;
+		case 0xC3: _dtr1 = data; return -1;
+		case 0xC5: _dtr2 = data; return -1;
+		default:   return -1;
+	}
+}
@@ -0,0 +1,165 @@
+/*
+	Reads the status and level of every gear on a bus, one query at a time
+	as the application used to, and with DaliSweep.
+
+	48 gear sit on the 64 short addresses, every fourth one missing, at
+	levels of their own and some with a failed lamp.  The old way asks
+	each address in turn QUERY STATUS, QUERY ACTUAL LEVEL and QUERY LAMP
+	FAILURE, each a blocking transaction the thread waits out before the
+	next.  The sweep is run -n times, the first asking every address and
+	the rest only those found.
+
+	Reported: the wall time of each, the queries it sent, and against the
+	bus's own measure of a query with its answer window back to back, the
+	time the same queries would take with nothing in between.  Every
+	snapshot must hold what the gear hold.
+
+	usage: dali_sweep [-n sweeps] [-w window]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "dali_sweep.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES   64
+
+typedef struct {
+	double ms;              // wall time
+	uint32_t queries;
+	bool right;             // what the gear hold
+} pass_t;
+
+
+static bool there(int a) { return a % 4 != 3; }
+
+
+/* The snapshot against the gear */
+static bool check(const dali_snapshot_t &snap, std::vector<SimGear *> &gear) {
+	for (int a = 0; a < DEVICES; a++) {
+		bool present = snap.present & DALI_ADDR(a);
+		if (present != there(a))
+			return false;
+		if (!present)
+			continue;
+		const SimGear::config_t &s = gear[a]->state();
+		bool failed = snap.lamp_failure & DALI_ADDR(a);
+		if (snap.level[a] != s.level || failed != s.lamp_failure)
+			return false;
+	}
+	return !snap.garbled;
+}
+
+
+int main(int argc, char **argv) {
+	int passes = 3;
+	int window = DALI_SWEEP_WINDOW;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+		switch (opt) {
+			case 'n': passes = atoi(optarg); break;
+			case 'w': window = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n sweeps] [-w window]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (passes < 2 || passes > DALI_SWEEP_REPROBE || window < 1 || window > DALI_SWEEP_WINDOW) {
+		fprintf(stderr, "2..%d sweeps, a window of 1..%d\n", DALI_SWEEP_REPROBE, DALI_SWEEP_WINDOW);
+		return 1;
+	}
+
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear(DEVICES, (SimGear *)NULL);
+	for (int a = 0; a < DEVICES; a++) {
+		SimGear::config_t cfg = SimGear::default_config(a);
+		cfg.level        = 20 + 3 * a;
+		cfg.lamp_failure = (a % 7) == 0;
+		gear[a] = new SimGear(cfg);
+		if (there(a))
+			bus.attach(gear[a]);
+	}
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+
+	/* The old way: three blocking queries per address */
+	pass_t old = pass_t();
+	dali_snapshot_t read;
+	memset(&read, 0, sizeof(read));
+	sim::vtime_t t0 = sim::now();
+	for (int a = 0; a < DEVICES; a++) {
+		static const uint8_t ops[] = { DALI_QUERY_STATUS, DALI_QUERY_ACTUAL_LEVEL, DALI_QUERY_LAMP_FAILURE };
+		for (int q = 0; q < 3; q++) {
+			uint8_t answer = 0;
+			int h = master->query(dali_command(dali_short(a), ops[q]).frame);
+			int status;
+			while ((status = master->query_result(h, &answer)) == DALI_PENDING) {
+				__WFI();
+				events.dispatch(0);
+			}
+			old.queries++;
+			if (status != DALI_ANSWER)
+				continue;
+			read.present |= DALI_ADDR(a);
+			if (q == 1)
+				read.level[a] = answer;
+			if (q == 2)
+				read.lamp_failure |= DALI_ADDR(a);
+		}
+	}
+	old.ms = (sim::now() - t0) / 1e3;
+	old.right = check(read, gear);
+
+	/* The sweep */
+	DaliSweep sweep(master);
+	sweep.window = window;
+	std::vector<pass_t> swept;
+	for (int n = 0; n < passes; n++) {
+		bool done = false;
+		pass_t p = pass_t();
+		t0 = sim::now();
+		sweep.start([&](const dali_snapshot_t &snap) {
+			p.ms      = (sim::now() - t0) / 1e3;
+			p.queries = snap.queries;
+			p.right   = check(snap, gear);
+			done = true;
+		});
+		events.dispatch(0);
+		while (!done) {
+			__WFI();
+			events.dispatch(0);
+		}
+		swept.push_back(p);
+	}
+
+	uint32_t frame_us = 0;
+	master->stat(DALI_STAT_FRAME_RATE, 1, &frame_us);
+
+	printf("48 gear on 64 short addresses, status, level and lamp failure of each, queries measured at %u us\n",
+		frame_us);
+	printf("one by one: %7.1f ms, %3u queries, %.1f ms each, %s\n", old.ms, old.queries,
+		old.ms / old.queries, old.right ? "right" : "WRONG");
+	bool ok = old.right;
+	for (size_t n = 0; n < swept.size(); n++) {
+		const pass_t &p = swept[n];
+		double best = p.queries * frame_us / 1e3;
+		printf("sweep %u:    %7.1f ms, %3u queries, %.1f ms each, %.1f ms back to back, %s\n", (unsigned)n + 1,
+			p.ms, p.queries, p.ms / p.queries, best, p.right ? "right" : "WRONG");
+		ok = ok && p.right && p.ms < best * 1.1;
+	}
+	printf("            %u addresses skipped as absent\n", sweep.skipped);
+	ok = ok && swept[1].queries == 2 * 48 && swept[1].ms < old.ms * 0.6;
+	printf("result:     %s\n", ok ? "every sweep within 10% of its queries back to back" : "FAILED");
+
+	delete master;
+	for (int a = 0; a < DEVICES; a++)
+		delete gear[a];
+	return ok ? 0 : 1;
+}
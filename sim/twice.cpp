@@ -0,0 +1,212 @@
+/*
+	Configures 64 gear while the bus is busy, with the second frame of
+	each send-twice command sent by the ISR, and by the application as it
+	gets round to it.
+
+	Each gear in turn gets DTR0, then SET MAX LEVEL and ADD TO GROUP, both
+	of which it only acts on sent twice with nothing in between.
+	Meanwhile a background sweep keeps -s QUERY STATUS out at once and a
+	second controller switches gear -c times a second.  The application
+	moves on to the next command 0 to -d ms after the last, and sending
+	the second frame itself it does so that late after the first.
+
+	Reported, both ways: gear that took their new maximum level and group,
+	pairs the gear saw broken up, and the longest time from the start of
+	a pair's first frame to the start of its second.  Last an OFF to short
+	address 70, out of range, must be refused rather than switch gear 6
+	off.
+
+	usage: dali_twice [-d thread_ms] [-s sweep_slots] [-c controller/s]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <random>
+#include <vector>
+#include "mbed.h"
+#include "dali.hpp"
+#include "sim_bus.hpp"
+
+#define DEVICES      64
+#define SETTLE_P2    14900  // usec, the second controller's settling time, priority 2
+#define LATENCY      200    // usec, its receiver and firmware
+
+typedef struct {
+	uint32_t configured;    // gear with their max level and group
+	uint32_t pairs, broken; // pairs given, those not on the bus back to back
+	double spacing;         // ms, longest from first to second start bit
+	double took;            // s, to configure them all
+	uint32_t refused;       // out of range commands counted
+	bool stray_off;         // OFF to gear 6 on the bus
+} run_t;
+
+
+static void run(bool isr, int thread_ms, int slots, int ctrl_rate, run_t &out) {
+	sim::reset();
+	SimBus bus(p29, p30);
+	std::vector<SimGear *> gear;
+	for (int i = 0; i < DEVICES; i++) {
+		gear.push_back(new SimGear(SimGear::default_config(i)));
+		bus.attach(gear.back());
+	}
+	int ctrl = bus.add_input(SETTLE_P2, LATENCY);
+
+	EventQueue events;
+	Dali *master = new Dali(p30, p29);
+	master->queue = &events;
+	master->coalesce = false;
+	master->set_arbitration(true);
+
+	std::mt19937 rng(7);
+	std::uniform_int_distribution<int> late(0, thread_ms);
+	out = run_t();
+	bool done = false;
+
+	/* The sweep, in the background */
+	int next = 0;
+	std::function<void()> sweep;
+	std::function<void(int, uint8_t)> swept = [&](int, uint8_t) {
+		if (!done)
+			sweep();
+	};
+	sweep = [&]() {
+		uint8_t cls = master->set_class(DALI_CLASS_BACKGROUND);
+		master->query(dali_command(dali_short(next), DALI_QUERY_STATUS), swept);
+		master->set_class(cls);
+		next = (next + 1) % DEVICES;
+	};
+
+	/* The second controller, until the configuration is done */
+	std::exponential_distribution<double> gap(ctrl_rate ? ctrl_rate / 1e6 : 1);
+	std::function<void()> other = [&]() {
+		if (done || !ctrl_rate)
+			return;
+		uint32_t frame = ((rng() % DEVICES) << 9) | (1 + rng() % 254);
+		bus.send(ctrl, frame, 16);
+		sim::schedule(sim::now() + (sim::vtime_t)gap(rng) + 1, other);
+	};
+
+	/* The configuration: per gear DTR0, SET MAX LEVEL, ADD TO GROUP */
+	int step = 0;
+	std::vector<dali_cmd_t> pairs;
+	std::function<void()> configure = [&]() {
+		int i = step / 3;
+		if (i == DEVICES) {
+			int stray = DEVICES + 6;
+			master->send(dali_command(dali_short(stray), DALI_OFF));
+			done = true;
+			return;
+		}
+		dali_cmd_t cmd;
+		switch (step % 3) {
+			case 0:  cmd = dali_special(DALI_DTR0, 100 + i); break;
+			case 1:  cmd = dali_command(dali_short(i), DALI_SET_MAX_LEVEL); break;
+			default: cmd = dali_command(dali_short(i), dali_nth(DALI_ADD_TO_GROUP, i % 16)); break;
+		}
+		step++;
+		int ms = late(rng);
+		if (cmd.flags & DALI_FLAG_TWICE) {
+			pairs.push_back(cmd);
+			if (isr) {
+				master->send(cmd);
+			} else {
+				dali_cmd_t once = { cmd.frame, 0 };
+				master->send(once);
+				events.call_in(ms, [&, once]() { master->send(once); });
+			}
+		} else {
+			master->send(cmd);
+		}
+		events.call_in(ms + 1, configure);
+	};
+
+	sim::vtime_t t0 = sim::now();
+	events.call([&]() {
+		for (int i = 0; i < slots; i++)
+			sweep();
+		configure();
+	});
+	sim::schedule(t0 + 1000, other);
+	events.dispatch(0);
+	while (!done || master->is_busy()) {
+		__WFI();
+		events.dispatch(0);
+	}
+	out.took = (sim::now() - t0) / 1e6;
+
+	/* Each pair against the bus: its two frames next to each other */
+	const std::vector<sim_frame_t> &frames = bus.frames();
+	size_t from = 0;
+	for (size_t p = 0; p < pairs.size(); p++) {
+		out.pairs++;
+		size_t j = from;
+		while (j < frames.size() && !(frames[j].bits == 16 && frames[j].data == pairs[p].frame))
+			j++;
+		if (j + 1 >= frames.size() || frames[j + 1].bits != 16 || frames[j + 1].data != pairs[p].frame) {
+			out.broken++;
+		} else {
+			double ms = (frames[j + 1].start - frames[j].start) / 1e3;
+			if (ms > out.spacing)
+				out.spacing = ms;
+		}
+		if (j < frames.size())
+			from = j + 1;
+	}
+	for (int i = 0; i < DEVICES; i++) {
+		if (gear[i]->state().max_level == 100 + i && (gear[i]->state().groups & (1 << (i % 16))))
+			out.configured++;
+	}
+	master->stat(DALI_STAT_TX_QUEUE, 2, &out.refused);
+	for (size_t j = 0; j < frames.size(); j++) {
+		if (frames[j].bits == 16 && frames[j].data == dali_command(dali_short(6), DALI_OFF).frame)
+			out.stray_off = true;
+	}
+	delete master;
+	for (size_t i = 0; i < gear.size(); i++)
+		delete gear[i];
+}
+
+
+static void report(const char *name, const run_t &r) {
+	printf("%-8s %u of %d gear configured in %.1f s, %u of %u pairs broken up, %.1f ms apart at most\n",
+		name, r.configured, DEVICES, r.took, r.broken, r.pairs, r.spacing);
+}
+
+
+int main(int argc, char **argv) {
+	int thread_ms = 150;
+	int slots = 8;
+	int ctrl_rate = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:s:c:")) != -1) {
+		switch (opt) {
+			case 'd': thread_ms = atoi(optarg); break;
+			case 's': slots = atoi(optarg); break;
+			case 'c': ctrl_rate = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-d thread_ms] [-s sweep_slots] [-c controller/s]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (thread_ms < 0 || slots < 0 || slots > DALI_QUERY_SLOTS - 2 || ctrl_rate < 0) {
+		fprintf(stderr, "the thread may be 0 ms late or more, the sweep 0..%d query slots\n", DALI_QUERY_SLOTS - 2);
+		return 1;
+	}
+
+	run_t thread, isr;
+	run(false, thread_ms, slots, ctrl_rate, thread);
+	run(true, thread_ms, slots, ctrl_rate, isr);
+
+	printf("64 gear configured with %d queries out, a controller at %d/s, the thread up to %d ms late\n",
+		slots, ctrl_rate, thread_ms);
+	report("thread:", thread);
+	report("isr:", isr);
+
+	printf("range:   %u out of range OFF refused, gear 6 %s\n", isr.refused,
+		isr.stray_off ? "sent OFF" : "sent nothing");
+	bool ok = isr.configured == DEVICES && !isr.broken && isr.spacing < 100;
+	ok = ok && isr.refused == 1 && !isr.stray_off;
+	printf("result:  %s\n", ok ? "every pair sent back to back, every gear configured" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+/*
+	Uploads a firmware image to FirmwareUpdate over the simulated socket and
+	reports the rate, next to the old port 8082 loop under the same model.
+
+	The uploader sends MSS sized segments at the link rate while the
+	receive window has room, so TCP flow control holds it back whenever the
+	firmware stops reading.  The store is the LocalFileSystem: every write
+	costs a fixed semihosting overhead plus the bytes at the interface
+	chip's rate, and runs alongside the firmware as the writer thread does.
+	The old loop read 256 bytes and wrote them before reading more.
+
+	With -c one byte of the image is flipped in transit, the upload must be
+	refused and the stored file dropped.
+
+	First an uploader stops half way through the image and never closes:
+	it must get "ERR timeout" after FW_IDLE_MS and the upload after it must
+	not be turned away as busy.
+
+	usage: dali_update [-k image_KB] [-l link_KB/s] [-w window] [-r store_KB/s]
+	                   [-o write_overhead_us] [-c]
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "mbed.h"
+#include "firmware_update.hpp"
+
+#define MSS        1460
+#define LEGACY_BUF 256
+
+static struct {
+	uint32_t link;          // bytes per second
+	uint32_t window;
+	uint32_t store_rate;    // bytes per second
+	uint32_t overhead;      // us per write
+} model;
+
+
+/* ---- The uploader ---- */
+
+static TCPSocket *peer;
+static std::vector<uint8_t> wire;
+static size_t wire_sent;
+
+static void pump(void) {
+	if (wire_sent == wire.size() || peer->sim_closed())
+		return;
+	uint32_t n = MSS;
+	if (peer->sim_unread() + n > model.window)
+		n = model.window - peer->sim_unread();
+	if (n > wire.size() - wire_sent)
+		n = wire.size() - wire_sent;
+	if (n)
+		peer->sim_inject(&wire[wire_sent], n);
+	wire_sent += n;
+	uint32_t seg = n ? n : MSS;     // a full window waits for the next ack
+	sim::schedule(sim::now() + (sim::vtime_t)seg * 1000000 / model.link, pump);
+}
+
+static void upload_start(TCPSocket *server, TCPSocket *conn, const std::vector<uint8_t> &bytes) {
+	peer = conn;
+	wire = bytes;
+	wire_sent = 0;
+	server->sim_connect(conn);
+	sim::schedule(sim::now() + 1, pump);
+}
+
+static sim::vtime_t write_cost(uint32_t len) {
+	return model.overhead + (sim::vtime_t)len * 1000000 / model.store_rate;
+}
+
+
+/* ---- The store, with the writer thread modelled as scheduled events ---- */
+
+static FirmwareUpdate *updater;
+static std::vector<uint8_t> stored;
+static bool store_open, store_kept;
+
+static void store_open_fn(void) {
+	sim::schedule(sim::now() + model.overhead, []() {
+		stored.clear();
+		store_open = true;
+		store_kept = false;
+		updater->written(true);
+		sim::wake();
+	});
+}
+
+static void store_write_fn(const uint8_t *data, uint32_t len) {
+	stored.insert(stored.end(), data, data + len);
+	sim::schedule(sim::now() + write_cost(len), []() {
+		updater->written(true);
+		sim::wake();
+	});
+}
+
+static void store_close_fn(bool keep) {
+	sim::schedule(sim::now() + model.overhead, [keep]() {
+		store_open = false;
+		store_kept = keep;
+		updater->written(true);
+		sim::wake();
+	});
+}
+
+
+static uint32_t crc32(const uint8_t *p, size_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+	while (len--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+static void put_le32(std::vector<uint8_t> &v, uint32_t x) {
+	for (int i = 0; i < 4; i++)
+		v.push_back(x >> (8 * i));
+}
+
+
+/* The old loop: 256 byte reads, each written before the next read. */
+static double legacy(const std::vector<uint8_t> &image) {
+	sim::reset();
+	TCPSocket server, conn;
+	upload_start(&server, &conn, image);
+
+	TCPSocket *sock = server.accept(0);
+	uint8_t buf[LEGACY_BUF];
+	size_t done = 0;
+	while (done < image.size()) {
+		size_t want = image.size() - done;
+		if (want > LEGACY_BUF)
+			want = LEGACY_BUF;
+		while (sock->sim_unread() < want)
+			__WFI();
+		done += sock->recv(buf, want);
+		sim::run_for(write_cost(want));
+	}
+	return (double)image.size() / 1024 / (sim::now() / 1e6);
+}
+
+
+int main(int argc, char **argv) {
+	uint32_t image_kb = 256;
+	bool corrupt = false;
+	int opt;
+
+	model.link       = 1000 * 1024;
+	model.window     = 4 * MSS;
+	model.store_rate = 64 * 1024;
+	model.overhead   = 3000;
+
+	while ((opt = getopt(argc, argv, "k:l:w:r:o:c")) != -1) {
+		switch (opt) {
+			case 'k': image_kb = atoi(optarg); break;
+			case 'l': model.link = atoi(optarg) * 1024; break;
+			case 'w': model.window = atoi(optarg); break;
+			case 'r': model.store_rate = atoi(optarg) * 1024; break;
+			case 'o': model.overhead = atoi(optarg); break;
+			case 'c': corrupt = true; break;
+			default:
+				fprintf(stderr, "usage: %s [-k image_KB] [-l link_KB/s] [-w window] [-r store_KB/s] "
+					"[-o write_overhead_us] [-c]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (image_kb < 1 || image_kb * 1024 > FW_MAX_IMAGE || !model.link || !model.store_rate
+		|| model.window < MSS) {
+		fprintf(stderr, "image must be 1..%d KB, rates above 0, window at least %d\n",
+			FW_MAX_IMAGE / 1024, MSS);
+		return 1;
+	}
+
+	std::vector<uint8_t> image(image_kb * 1024);
+	uint32_t x = 12345;
+	for (size_t i = 0; i < image.size(); i++) {
+		x = x * 1103515245 + 12345;
+		image[i] = x >> 16;
+	}
+
+	std::vector<uint8_t> upload;
+	put_le32(upload, FW_MAGIC);
+	put_le32(upload, image.size());
+	put_le32(upload, crc32(&image[0], image.size()));
+	upload.insert(upload.end(), image.begin(), image.end());
+	if (corrupt)
+		upload[FW_HEADER_SIZE + image.size() / 2] ^= 0x10;
+
+	double old_rate = legacy(image);
+
+	sim::reset();
+	EventQueue events;
+	TCPSocket server, conn;
+	fw_store_t store;
+	store.open  = callback(store_open_fn);
+	store.write = callback(store_write_fn);
+	store.close = callback(store_close_fn);
+	FirmwareUpdate fw(&events, store);
+	updater = &fw;
+
+	fw.attach(&server);
+
+	/* The stalled uploader */
+	TCPSocket stalled;
+	std::vector<uint8_t> half(upload.begin(), upload.begin() + FW_HEADER_SIZE + image.size() / 2);
+	sim::vtime_t t0 = sim::now();
+	upload_start(&server, &stalled, half);
+	while (!stalled.sim_closed()) {
+		__WFI();
+		events.dispatch(0);
+	}
+	std::string stall_reply(stalled.sim_sent().begin(), stalled.sim_sent().end());
+	double stall_s = (sim::now() - t0) / 1e6;
+	bool stall_ok = stall_reply == "ERR timeout\n" && !store_open && !store_kept;
+
+	int result = -1;
+	bool closed = false;            // before the uploader was answered
+	fw.done = [&](bool ok) { result = ok; closed = !store_open; };
+	upload_start(&server, &conn, upload);
+	while (result < 0) {
+		__WFI();
+		events.dispatch(0);
+	}
+
+	std::string reply(conn.sim_sent().begin(), conn.sim_sent().end());
+	while (!reply.empty() && reply[reply.size() - 1] == '\n')
+		reply.erase(reply.size() - 1);
+	double rate = fw.elapsed_us ? (double)image.size() / 1024 / (fw.elapsed_us / 1e6) : 0;
+
+	printf("image %u KB, link %u KB/s, window %u, store %u KB/s + %u us per write%s\n",
+		image_kb, model.link / 1024, model.window, model.store_rate / 1024, model.overhead,
+		corrupt ? ", one byte corrupted" : "");
+	printf("legacy:   %u writes of %d bytes, %.1f KB/s\n",
+		(unsigned)((image.size() + LEGACY_BUF - 1) / LEGACY_BUF), LEGACY_BUF, old_rate);
+	printf("updater:  %u writes of %d bytes, %.1f KB/s, %.3f s\n",
+		fw.writes, FW_BUF, rate, fw.elapsed_us / 1e6);
+	printf("reply:    \"%s\"\n", reply.c_str());
+	printf("stalled:  half the image then nothing, closed after %.1f s with \"%.*s\"\n",
+		stall_s, (int)stall_reply.size() - 1, stall_reply.c_str());
+
+	bool ok;
+	if (corrupt)
+		ok = !result && closed && !store_kept;
+	else
+		ok = result && closed && store_kept && stored == image;
+	ok = ok && stall_ok;
+	printf("result:   %s\n", ok ? (corrupt ? "corrupt image refused" : "image stored intact") : "FAILED");
+	return ok ? 0 : 1;
+}
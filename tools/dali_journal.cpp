@@ -0,0 +1,151 @@
+/*
+	Reads the journal DaliJournal writes to /local/journal.bin and prints
+	it, one record a line, or with -s only the totals.
+
+	Times are the RTC seconds of the last DALI_LOG_TIME record plus the
+	ticks since it, so right to the second and to the microsecond between
+	records.  Records before the first anchor, in a file cut short at the
+	front, show their ticks only.
+
+	usage: dali_journal [-s] [-b bus] journal.bin
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dali_decoder.hpp"
+#include "dali_log.hpp"
+
+static const char *kinds[DALI_LOG_KINDS] = { "sent", "answer", "heard", "lost", "time", "start" };
+
+static const char *statuses[] = {
+	"ok", "empty", "short low", "short high", "mid low", "mid high", "long low", "long high",
+	"bad start", "bad bit", "too long", "overrun", "collision"
+};
+static_assert(sizeof(statuses) / sizeof(statuses[0]) == DALI_RX_STATUS_COUNT, "a name for each DALI_RX_*");
+
+
+static uint32_t le32(const uint8_t *b) {
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+
+int main(int argc, char **argv) {
+	bool summary = false;
+	int only_bus = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sb:")) != -1) {
+		switch (opt) {
+			case 's': summary = true; break;
+			case 'b': only_bus = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-s] [-b bus] journal.bin\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-s] [-b bus] journal.bin\n", argv[0]);
+		return 1;
+	}
+	FILE *fp = fopen(argv[optind], "rb");
+	if (!fp) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	uint32_t count[DALI_LOG_KINDS] = { 0 }, errors[DALI_RX_STATUS_COUNT] = { 0 };
+	uint32_t lost = 0, bad = 0, boots = 0;
+	bool anchored = false;
+	uint32_t anchor_usec = 0;
+	int64_t anchor_sec = 0, first = -1, last = -1;
+	uint8_t b[DALI_LOG_RECORD];
+	size_t n;
+	long offset = 0;
+
+	while ((n = fread(b, 1, DALI_LOG_RECORD, fp)) == DALI_LOG_RECORD) {
+		dali_log_t r;
+		r.usec   = le32(b);
+		r.data   = le32(b + 4);
+		r.kind   = b[8];
+		r.bits   = b[9];
+		r.status = b[10];
+		r.bus    = b[11];
+		offset += DALI_LOG_RECORD;
+
+		if (r.kind >= DALI_LOG_KINDS || r.status >= DALI_RX_STATUS_COUNT
+			|| (r.kind == DALI_LOG_START && r.data != DALI_LOG_MAGIC)) {
+			bad++;
+			continue;
+		}
+		if (r.kind == DALI_LOG_TIME) {
+			anchored    = true;
+			anchor_sec  = r.data;
+			anchor_usec = r.usec;
+		}
+		if (r.kind == DALI_LOG_START)
+			boots++;            // right after its buffer's anchor
+		if (r.kind == DALI_LOG_LOST)
+			lost += r.data;
+		count[r.kind]++;
+		if (r.kind <= DALI_LOG_HEARD && r.status != DALI_RX_OK)
+			errors[r.status]++;
+
+		int64_t us = anchored ? anchor_sec * 1000000 + (int32_t)(r.usec - anchor_usec) : -1;
+		if (us >= 0) {
+			if (first < 0)
+				first = us;
+			last = us;
+		}
+		if (summary || r.kind == DALI_LOG_TIME || (only_bus >= 0 && r.kind <= DALI_LOG_HEARD && r.bus != only_bus))
+			continue;
+
+		char when[32];
+		if (us >= 0) {
+			time_t sec = (time_t)(us / 1000000);
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&sec));
+			printf("%s.%06u", when, (unsigned)(us % 1000000));
+		} else {
+			printf("%19s %10u", "ticks", r.usec);
+		}
+		switch (r.kind) {
+			case DALI_LOG_LOST:
+				printf("  %u records lost\n", r.data);
+				break;
+			case DALI_LOG_START:
+				printf("  boot, journal version %u\n", r.bits);
+				break;
+			default:
+				printf("  bus %u  %-6s", r.bus, kinds[r.kind]);
+				if (r.status == DALI_RX_OK)
+					printf("  %2u bits  0x%0*x\n", r.bits, (r.bits + 3) / 4, r.data);
+				else
+					printf("  %s\n", statuses[r.status]);
+				break;
+		}
+	}
+	if (n)
+		fprintf(stderr, "%s: %u bytes at the end are not a whole record\n", argv[optind], (unsigned)n);
+	fclose(fp);
+
+	if (!summary)
+		return bad ? 1 : 0;
+
+	printf("%ld bytes, %u boots, %u records unreadable\n", offset, boots, bad);
+	if (first >= 0) {
+		char when[32];
+		time_t sec = (time_t)(first / 1000000);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&sec));
+		printf("from %s UTC, %.1f s\n", when, (last - first) / 1e6);
+	}
+	printf("sent %u, answer windows %u, heard garbled %u, records lost %u\n",
+		count[DALI_LOG_SENT], count[DALI_LOG_ANSWER], count[DALI_LOG_HEARD], lost);
+	for (int s = DALI_RX_EMPTY; s < DALI_RX_STATUS_COUNT; s++) {
+		if (errors[s])
+			printf("  %-10s %u\n", statuses[s], errors[s]);
+	}
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,385 @@
+#include "mbed.h"
+#include "firmware_update.hpp"
+#include "EventQueue.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Upload states */
+enum {
+	FW_IDLE = 0,    // no connection
+	FW_HEADER,      // reading the header
+	FW_OPEN,        // waiting for the store to open the image
+	FW_IMAGE,       // reading the image
+	FW_FLUSH,       // all read, or given up, waiting for the last write
+	FW_CLOSE,       // waiting for the store to close the image
+	FW_REPLY        // sending the reply
+};
+
+
+/* CRC-32, reflected polynomial 0xEDB88320, four bits at a time: a 64 byte
+   table in flash against the full table's 1K, and fast enough to keep up
+   with the network. */
+static const uint32_t crc_nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint32_t len) {
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc_nibble[crc & 0xF];
+		crc = (crc >> 4) ^ crc_nibble[crc & 0xF];
+	}
+	return crc;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+FirmwareUpdate::FirmwareUpdate(EventQueue *queue, fw_store_t store) {
+	_queue          = queue;
+	_store          = store;
+	_server         = 0;
+	_client         = 0;
+	f_server_posted = 0;
+	f_client_posted = 0;
+	f_watch_posted  = 0;
+	f_writing       = 0;
+	f_opened        = 0;
+	state           = FW_IDLE;
+	error           = 0;
+	bytes           = 0;
+	elapsed_us      = 0;
+	writes          = 0;
+}
+
+
+/* As DaliRouter::attach_server(): sigio only posts, the work runs from
+   the queue, and a handler already queued is not posted again. */
+void FirmwareUpdate::attach(TCPSocket *server) {
+	_server = server;
+	_server->set_blocking(false);
+	_server->sigio(callback(this, &FirmwareUpdate::server_event));
+	server_event();
+}
+
+
+void FirmwareUpdate::server_event(void) {
+	if (!f_server_posted) {
+		f_server_posted = 1;
+		_queue->call(this, &FirmwareUpdate::server_sigio);
+	}
+}
+
+
+void FirmwareUpdate::client_event(void) {
+	if (!f_client_posted) {
+		f_client_posted = 1;
+		_queue->call(this, &FirmwareUpdate::client_sigio);
+	}
+}
+
+
+void FirmwareUpdate::written(bool ok) {
+	f_write_ok = ok;
+	_queue->call(this, &FirmwareUpdate::write_done);
+}
+
+
+/*
+	Function    : server_sigio()
+	Description : accepts an uploader.  Only one upload runs at a time, a
+	              second connection is told so and closed.
+*/
+void FirmwareUpdate::server_sigio(void) {
+	nsapi_error_t err;
+	
+	f_server_posted = 0;
+	TCPSocket *sock = _server->accept(&err);
+	if (err != NSAPI_ERROR_OK)
+		return;
+	
+	if (state != FW_IDLE) {
+		static const char busy[] = "ERR busy\n";
+		sock->send(busy, sizeof(busy) - 1);
+		sock->close();
+		return;
+	}
+	
+	_client    = sock;
+	state      = FW_HEADER;
+	header_len = 0;
+	error      = 0;
+	start_us   = us_ticker_read();
+	last_us    = start_us;
+	watch();
+	_client->set_blocking(false);
+	_client->sigio(callback(this, &FirmwareUpdate::client_event));
+	f_client_posted = 0;
+	client_event();
+}
+
+
+/*
+	Function    : client_sigio()
+	Description : reads what has arrived into the buffer being filled and
+	              hands a full buffer to the store.  While the store still
+	              has the other one, reading stops and TCP flow control
+	              holds the uploader back until write_done() resumes it.
+*/
+void FirmwareUpdate::client_sigio(void) {
+	nsapi_size_or_error_t szerr;
+	
+	f_client_posted = 0;
+	if (state == FW_REPLY) {
+		send_reply();
+		return;
+	}
+	
+	while (state == FW_HEADER || state == FW_IMAGE) {
+		if (state == FW_IMAGE && (fill_len == FW_BUF || received == length)) {
+			if (f_writing)
+				return;         // both buffers full
+			submit();
+			if (received == length) {
+				state = FW_FLUSH;
+				return;
+			}
+		}
+	
+		if (state == FW_HEADER) {
+			szerr = _client->recv(header + header_len, FW_HEADER_SIZE - header_len);
+		} else {
+			uint32_t room = FW_BUF - fill_len;
+			if (room > length - received)
+				room = length - received;
+			szerr = _client->recv((uint8_t *)buf[fill] + fill_len, room);
+		}
+	
+		if (szerr == NSAPI_ERROR_WOULD_BLOCK)
+			return;
+		if (szerr <= 0) {
+			fail("connection lost");
+			return;
+		}
+		last_us = us_ticker_read();
+	
+		if (state == FW_HEADER) {
+			header_len += szerr;
+			if (header_len == FW_HEADER_SIZE)
+				read_header();
+		} else {
+			crc_run   = crc32_update(crc_run, (uint8_t *)buf[fill] + fill_len, szerr);
+			fill_len += szerr;
+			received += szerr;
+		}
+	}
+}
+
+
+/* Checks the header and has the store open the image, reading waits for
+   opened(). */
+void FirmwareUpdate::read_header(void) {
+	length = get_le32(header + 4);
+	crc    = get_le32(header + 8);
+	
+	if (get_le32(header) != FW_MAGIC) {
+		fail("bad header");
+		return;
+	}
+	if (length == 0 || length > FW_MAX_IMAGE) {
+		fail("bad length");
+		return;
+	}
+	
+	state = FW_OPEN;
+	_store.open();
+}
+
+
+/* The store has opened the image, or could not. */
+void FirmwareUpdate::opened(void) {
+	if (!f_write_ok && !error)
+		error = "cannot open store";
+	f_opened = f_write_ok;
+	if (error) {
+		state = FW_FLUSH;       // closes what was opened
+		finish();
+		return;
+	}
+	
+	state    = FW_IMAGE;
+	crc_run  = 0xFFFFFFFF;
+	received = 0;
+	fill     = 0;
+	fill_len = 0;
+	writes   = 0;
+	start_us = us_ticker_read();
+	client_sigio();
+}
+
+
+/* Gives the filled buffer to the store and starts filling the other. */
+void FirmwareUpdate::submit(void) {
+	const uint8_t *data = (const uint8_t *)buf[fill];
+	uint32_t len = fill_len;
+	
+	f_writing = 1;
+	writes++;
+	fill    ^= 1;
+	fill_len = 0;
+	_store.write(data, len);
+}
+
+
+void FirmwareUpdate::write_done(void) {
+	last_us = us_ticker_read();
+	if (state == FW_OPEN) {
+		opened();
+		return;
+	}
+	
+	f_writing = 0;
+	if (!f_write_ok && !error)
+		error = (state == FW_CLOSE) ? "close failed" : "write failed";
+	
+	if (state == FW_CLOSE)
+		reply();
+	else if (state == FW_FLUSH)
+		finish();
+	else if (error)
+		fail(error);
+	else
+		client_sigio();         // room again
+}
+
+
+/* Gives up on the upload, once the store has finished with the buffer.
+   While the store is opening the image opened() gives up instead. */
+void FirmwareUpdate::fail(const char *why) {
+	if (!error)
+		error = why;
+	if (state == FW_HEADER) {
+		state = FW_FLUSH;       // nothing opened, nothing written
+		finish();
+	} else if (state == FW_IMAGE) {
+		state = FW_FLUSH;
+		if (!f_writing)
+			finish();
+	}
+}
+
+
+/*
+	Function    : finish()
+	Description : checks the image and has the store keep or drop it.  The
+	              uploader is only answered once the store has closed the
+	              file, so an OK means the image is whole on the store.
+	              The rate is the image size over the time from the header
+	              to the last write.
+*/
+void FirmwareUpdate::finish(void) {
+	if (!error && received == length && (crc_run ^ 0xFFFFFFFF) != crc)
+		error = "crc mismatch";
+	
+	elapsed_us = us_ticker_read() - start_us;
+	if (f_opened) {
+		f_opened = 0;
+		state = FW_CLOSE;
+		_store.close(error == 0);   // a bad image is removed
+		return;
+	}
+	reply();
+}
+
+
+/*
+	Function    : reply()
+	Description : tells the uploader and closes the connection.  The line
+	              is sent without blocking, what does not fit goes when
+	              the socket signals room, so done() only runs once it is
+	              with the stack.
+*/
+void FirmwareUpdate::reply(void) {
+	bool ok = (error == 0);
+	bytes = ok ? length : 0;
+	
+	if (ok) {
+		uint32_t us = elapsed_us ? elapsed_us : 1;
+		uint32_t kbs10 = (uint32_t)((uint64_t)length * 10000000 / 1024 / us);
+		snprintf(line, sizeof(line), "OK %lu %lu.%lu KB/s\n",
+			(unsigned long)length, (unsigned long)(kbs10 / 10), (unsigned long)(kbs10 % 10));
+	} else {
+		snprintf(line, sizeof(line), "ERR %s\n", error);
+	}
+	line_len  = strlen(line);
+	line_sent = 0;
+	state     = FW_REPLY;
+	last_us   = us_ticker_read();
+	send_reply();
+}
+
+
+void FirmwareUpdate::send_reply(void) {
+	while (line_sent < line_len) {
+		nsapi_size_or_error_t szerr = _client->send(line + line_sent, line_len - line_sent);
+		if (szerr == NSAPI_ERROR_WOULD_BLOCK)
+			return;             // client_sigio() comes back
+		if (szerr <= 0)
+			break;
+		line_sent += szerr;
+	}
+	end();
+}
+
+
+void FirmwareUpdate::end(void) {
+	_client->close();
+	_client = 0;
+	state = FW_IDLE;
+	
+	if (done)
+		done(error == 0);
+}
+
+
+/* Keeps one idle() queued while an upload runs. */
+void FirmwareUpdate::watch(void) {
+	if (!f_watch_posted) {
+		f_watch_posted = 1;
+		_queue->call_in(FW_IDLE_MS, this, &FirmwareUpdate::idle);
+	}
+}
+
+
+/*
+	Function    : idle()
+	Description : the upload's timeout.  Every chunk received and every
+	              store call finished moves last_us on, and with it the
+	              deadline, so idle() only gives up once neither the
+	              uploader nor the store has done anything for FW_IDLE_MS;
+	              otherwise it is queued again for what is left.
+*/
+void FirmwareUpdate::idle(void) {
+	f_watch_posted = 0;
+	if (state == FW_IDLE)
+		return;
+	
+	uint32_t quiet_ms = (us_ticker_read() - last_us) / 1000;
+	if (quiet_ms < FW_IDLE_MS) {
+		f_watch_posted = 1;
+		_queue->call_in(FW_IDLE_MS - quiet_ms, this, &FirmwareUpdate::idle);
+		return;
+	}
+	
+	if (state == FW_REPLY)
+		end();                  // the uploader does not read, close without it
+	else if (state == FW_HEADER || state == FW_IMAGE)
+		fail("timeout");
+	else
+		watch();                // the store has it, its call comes back
+}
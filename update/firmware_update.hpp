@@ -0,0 +1,114 @@
+#ifndef MBED_FIRMWARE_UPDATE_H
+#define MBED_FIRMWARE_UPDATE_H
+
+/*
+	Firmware update over TCP.
+
+	The uploader sends an FW_HEADER_SIZE byte header, then the image:
+
+		uint32_t magic      FW_MAGIC, "DFW1"
+		uint32_t length     image bytes that follow
+		uint32_t crc        CRC-32 (IEEE 802.3) of the image
+
+	all little endian.  The image is received into one of two buffers while
+	the other is being written, so the network and the file system work at
+	the same time, and it is written FW_BUF bytes at a time.  When the last
+	byte is written the CRC is checked, and once the store has closed the
+	file the uploader gets one line back, "OK <bytes> <KB/s>" or "ERR
+	<reason>", before the connection closes.  A bad image is not kept.
+	An uploader that sends nothing for FW_IDLE_MS, while the store is not
+	holding it back, gets "ERR timeout", and one that does not take its
+	reply for as long is closed without it.
+
+	Nothing blocks the event queue: the socket is read and the reply sent
+	when it signals, and the store opens, writes and closes in its own
+	context, calling written() when done.
+*/
+
+#define FW_MAGIC        0x31574644    // "DFW1"
+#define FW_HEADER_SIZE  12
+#define FW_BUF          4096          // bytes per store write
+#define FW_MAX_IMAGE    (512 * 1024)  // LPC1768 flash
+#define FW_IDLE_MS      10000         // an upload with nothing arriving this long is dropped
+
+
+/* Where the image goes.  Each call starts the work and returns, the store
+   calls FirmwareUpdate::written() once it is done: after open() with false
+   if the file could not be opened, after write() once the buffer may be
+   reused, after close() with false if the file could not be closed. */
+typedef struct {
+	Callback<void(void)> open;
+	Callback<void(const uint8_t *data, uint32_t len)> write;
+	Callback<void(bool keep)> close;
+} fw_store_t;
+
+
+class FirmwareUpdate {
+
+public:
+	FirmwareUpdate(EventQueue *queue, fw_store_t store);
+
+	/* Takes the listening socket, which must be bound and listening, and
+	   serves one upload at a time from its sigio. */
+	void attach(TCPSocket *server);
+
+	/* From the store, in any context: the last open(), write() or close()
+	   has finished. */
+	void written(bool ok);
+
+	/* Runs once an upload ends and the uploader has been answered, ok if
+	   a good image was stored and closed. */
+	Callback<void(bool ok)> done;
+
+	uint32_t bytes;             // image bytes of the last upload
+	uint32_t elapsed_us;        // from the header to the last write
+	uint32_t writes;            // store writes
+
+private:
+	EventQueue *_queue;
+	fw_store_t _store;
+	TCPSocket *_server;
+	TCPSocket *_client;
+	volatile uint8_t f_server_posted;
+	volatile uint8_t f_client_posted;
+	uint8_t  f_watch_posted;    // idle() is queued
+	uint32_t last_us;           // when the upload last moved, idle() counts from it
+
+	uint8_t  state;
+	const char *error;          // why the upload failed, 0 while all is well
+	uint8_t  header[FW_HEADER_SIZE];
+	uint8_t  header_len;
+	uint32_t length;
+	uint32_t crc;               // expected
+	uint32_t crc_run;           // of what has arrived
+	uint32_t received;          // image bytes so far
+	uint32_t start_us;
+	char     line[48];          // the reply
+	uint8_t  line_len;
+	uint8_t  line_sent;
+
+	uint32_t buf[2][FW_BUF / 4];    // word aligned
+	uint32_t fill_len;          // bytes in buf[fill]
+	uint8_t  fill;
+	volatile uint8_t f_writing; // the other buffer is with the store
+	uint8_t  f_write_ok;
+	uint8_t  f_opened;          // the store is open
+
+	void server_event(void);
+	void client_event(void);
+	void server_sigio(void);
+	void client_sigio(void);
+	void watch(void);
+	void idle(void);
+	void write_done(void);
+	void opened(void);
+	void submit(void);
+	void read_header(void);
+	void fail(const char *why);
+	void finish(void);
+	void reply(void);
+	void send_reply(void);
+	void end(void);
+};
+
+#endif
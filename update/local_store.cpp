@@ -0,0 +1,77 @@
+#include "mbed.h"
+#include "local_store.hpp"
+#include "EventQueue.h"
+
+
+LocalStore::LocalStore(const char *path, osPriority priority) : _thread(priority, 2048), _writes(4 * EVENTS_EVENT_SIZE) {
+	_path = path;
+	_fp   = 0;
+	_thread.start(callback(&_writes, &EventQueue::dispatch_forever));
+}
+
+
+fw_store_t LocalStore::store(void) {
+	fw_store_t s;
+	s.open  = callback(this, &LocalStore::open);
+	s.write = callback(this, &LocalStore::write);
+	s.close = callback(this, &LocalStore::close);
+	return s;
+}
+
+
+/* From the updater's queue: the file itself is opened, written and closed
+   on the store's thread. */
+void LocalStore::open(void) {
+	_writes.call(this, &LocalStore::do_open);
+}
+
+
+void LocalStore::write(const uint8_t *data, uint32_t len) {
+	_writes.call(this, &LocalStore::do_write, data, len);
+}
+
+
+void LocalStore::append(const uint8_t *data, uint32_t len) {
+	_writes.call(this, &LocalStore::do_append, data, len);
+}
+
+
+/* Queued behind the last write, so the file is complete when it runs,
+   and reported through written() as the writes are. */
+void LocalStore::close(bool keep) {
+	_writes.call(this, &LocalStore::do_close, keep);
+}
+
+
+void LocalStore::do_open(void) {
+	_fp = fopen(_path, "w");
+	if (written)
+		written(_fp != 0);
+}
+
+
+void LocalStore::do_write(const uint8_t *data, uint32_t len) {
+	bool ok = _fp && fwrite(data, 1, len, _fp) == len;
+	if (written)
+		written(ok);
+}
+
+
+void LocalStore::do_close(bool keep) {
+	bool ok = _fp && fclose(_fp) == 0;
+	_fp = 0;
+	if (!keep || !ok)
+		remove(_path);
+	if (written)
+		written(ok);
+}
+
+
+void LocalStore::do_append(const uint8_t *data, uint32_t len) {
+	FILE *fp = fopen(_path, "a");
+	bool ok = fp && fwrite(data, 1, len, fp) == len;
+	if (fp && fclose(fp) != 0)
+		ok = false;
+	if (written)
+		written(ok);
+}
@@ -0,0 +1,45 @@
+#ifndef MBED_LOCAL_STORE_H
+#define MBED_LOCAL_STORE_H
+
+#include "firmware_update.hpp"
+
+/*
+	Writes a firmware image to the mbed interface's LocalFileSystem for
+	FirmwareUpdate.  Opening, writing and closing are semihosting calls that
+	take milliseconds each, so they run on a thread of their own and the
+	event queue carries on meanwhile.  The image replaces path, a bad one is removed so that the
+	interface does not flash it at the next reset.
+
+	append() serves a journal instead: each call opens path for appending,
+	writes and closes it again, so the file on the interface is whole
+	between writes.
+*/
+
+class LocalStore {
+
+public:
+	LocalStore(const char *path, osPriority priority = osPriorityBelowNormal);
+
+	/* The callbacks for FirmwareUpdate, set written before the first upload. */
+	fw_store_t store(void);
+	Callback<void(bool ok)> written;
+	
+	/* Appends len bytes, calling written() once data may be reused. */
+	void append(const uint8_t *data, uint32_t len);
+
+private:
+	const char *_path;
+	FILE *_fp;
+	Thread _thread;
+	EventQueue _writes;
+
+	void open(void);
+	void write(const uint8_t *data, uint32_t len);
+	void close(bool keep);
+	void do_open(void);
+	void do_write(const uint8_t *data, uint32_t len);
+	void do_close(bool keep);
+	void do_append(const uint8_t *data, uint32_t len);
+};
+
+#endif